@@ -40,6 +40,9 @@
 #include "../include/dsme/dsmesock.h"
 #include <dsme/protocol.h>
 #include "../include/dsme/logging.h"
+#include "../include/dsme/timers.h"
+#include "flightrec.h"
+#include "wakelock.h"
 #include <dsme/messages.h>
 #include "../include/dsme/oom.h"
 
@@ -48,7 +51,9 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <dlfcn.h>
 #include <unistd.h>
 #include <errno.h>
@@ -92,6 +97,34 @@ static void usage(const char *progname)
         "         Signal systemd when initialization is done.\n"
 #endif
 
+        "  --log-buffer=<KiB>\n"
+        "         Size of the buffer for log messages waiting to be\n"
+        "         written (default 64).\n"
+        "  --log-flush-level=<level>\n"
+        "         Write messages at this or higher level to the log\n"
+        "         file immediately, others in batches (default err).\n"
+        "  --log-sync=<ms>\n"
+        "         Max time log file data is left unsynced, or 0 to\n"
+        "         leave it to the kernel (default 5000).\n"
+        "  --log-rotate=<KiB>[,<count>]\n"
+        "         Rotate log file at given size, keeping count old\n"
+        "         files. Zero size disables rotation (default 1024,2).\n"
+        "  --log-limit=<level|all>:<rate>[:<burst>]\n"
+        "         Limit messages from each call site to rate per second\n"
+        "         allowing bursts of given size. Zero rate disables\n"
+        "         limiting (default: no limits).\n"
+        "  --flight-recorder=<KiB>\n"
+        "         Size of log flight recorder kept in " DSME_FLIGHTREC_PATH ",\n"
+        "         or 0 to disable (default 128).\n"
+        "  --wakeup-summary=<seconds>\n"
+        "         Log the sources that woke up the main loop most often\n"
+        "         at given interval, or 0 to disable (default 3600).\n"
+        "  --client-queue-limit=<KiB>\n"
+        "         Disconnect clients that let more than the given\n"
+        "         amount of data queue up for them (default 256).\n"
+        "  --listen-backlog=<count>\n"
+        "         Number of pending client connections the socket\n"
+        "         can hold (default 32).\n"
         "  --valgrind\n"
         "         Enable running with valgrind\n"
         "  -h  --help\n"
@@ -117,6 +150,10 @@ static void signal_handler(int sig)
 
 static int        logging_verbosity = LOG_NOTICE;
 static log_method logging_method    = LOG_METHOD_SYSLOG;
+static int        log_flush_level   = LOG_ERR;
+static unsigned   log_sync_interval = 5000;
+static size_t     flightrec_size    = DSME_FLIGHTREC_SIZE_DEFAULT;
+static unsigned   wakeup_summary    = 3600;
 
 #ifdef DSME_SYSTEMD_ENABLE
 static int signal_systemd = 0;
@@ -189,6 +226,15 @@ static void parse_options(int      argc,           /* in  */
         { "log-include",    1, NULL, 'i' },
         { "log-exclude",    1, NULL, 'e' },
         { "valgrind",       0, NULL, 901  },
+        { "client-queue-limit", 1, NULL, 902 },
+        { "listen-backlog",     1, NULL, 903 },
+        { "log-buffer",         1, NULL, 904 },
+        { "log-flush-level",    1, NULL, 905 },
+        { "log-sync",           1, NULL, 906 },
+        { "log-rotate",         1, NULL, 907 },
+        { "flight-recorder",    1, NULL, 908 },
+        { "log-limit",          1, NULL, 909 },
+        { "wakeup-summary",     1, NULL, 910 },
         { 0, 0, 0, 0 }
     };
 
@@ -204,6 +250,149 @@ static void parse_options(int      argc,           /* in  */
             valgrind_mode_enabled = true;
             break;
 
+        case 902: /* --client-queue-limit */
+            {
+                char          *end = 0;
+                unsigned long  kib = strtoul(optarg, &end, 0);
+
+                if( end == optarg || *end || kib == 0 )
+                    fprintf(stderr,
+                            ME "Ignoring invalid client queue limit %s\n",
+                            optarg);
+                else
+                    dsmesock_set_send_queue_limit(kib * 1024);
+            }
+            break;
+
+        case 903: /* --listen-backlog */
+            {
+                char *end     = 0;
+                long  backlog = strtol(optarg, &end, 0);
+
+                if( end == optarg || *end || backlog < 1 || backlog > INT_MAX )
+                    fprintf(stderr,
+                            ME "Ignoring invalid listen backlog %s\n",
+                            optarg);
+                else
+                    dsmesock_set_listen_backlog((int)backlog);
+            }
+            break;
+
+        case 904: /* --log-buffer */
+            {
+                char          *end = 0;
+                unsigned long  kib = strtoul(optarg, &end, 0);
+
+                if( end == optarg || *end || kib == 0 || kib > 16 * 1024 )
+                    fprintf(stderr,
+                            ME "Ignoring invalid log buffer size %s\n",
+                            optarg);
+                else if( !dsme_log_set_ring_size(kib * 1024) )
+                    fprintf(stderr,
+                            ME "Log buffer size rounded to power of two\n");
+            }
+            break;
+
+        case 905: /* --log-flush-level */
+            log_flush_level = parse_verbosity(optarg);
+            break;
+
+        case 906: /* --log-sync */
+            {
+                char          *end = 0;
+                unsigned long  ms  = strtoul(optarg, &end, 0);
+
+                if( end == optarg || *end || ms > INT_MAX )
+                    fprintf(stderr,
+                            ME "Ignoring invalid log sync interval %s\n",
+                            optarg);
+                else
+                    log_sync_interval = ms;
+            }
+            break;
+
+        case 907: /* --log-rotate */
+            {
+                char          *end   = 0;
+                unsigned long  kib   = strtoul(optarg, &end, 0);
+                unsigned long  count = 2;
+
+                if( end != optarg && *end == ',' ) {
+                    const char *arg = end + 1;
+                    count = strtoul(arg, &end, 0);
+                    if( end == arg )
+                        end = optarg;
+                }
+
+                if( end == optarg || *end || kib > 1024 * 1024 || count > 99 )
+                    fprintf(stderr,
+                            ME "Ignoring invalid log rotation %s\n",
+                            optarg);
+                else
+                    dsme_log_set_file_rotation(kib * 1024, count);
+            }
+            break;
+
+        case 908: /* --flight-recorder */
+            {
+                char          *end = 0;
+                unsigned long  kib = strtoul(optarg, &end, 0);
+
+                if( end == optarg || *end || kib > 4 * 1024 )
+                    fprintf(stderr,
+                            ME "Ignoring invalid flight recorder size %s\n",
+                            optarg);
+                else
+                    flightrec_size = kib * 1024;
+            }
+            break;
+
+        case 909: /* --log-limit */
+            {
+                char          *arg   = strdup(optarg);
+                char          *rate  = arg ? strchr(arg, ':') : 0;
+                char          *end   = 0;
+                unsigned long  burst = 100;
+                unsigned long  rps   = 0;
+
+                if( rate ) {
+                    *rate++ = 0;
+                    rps = strtoul(rate, &end, 0);
+                    if( end != rate && *end == ':' ) {
+                        const char *tmp = end + 1;
+                        burst = strtoul(tmp, &end, 0);
+                        if( end == tmp )
+                            end = rate;
+                    }
+                }
+
+                if( !rate || end == rate || *end || rps > 10000 ||
+                    burst < 1 || burst > 100000 )
+                    fprintf(stderr,
+                            ME "Ignoring invalid log limit %s\n",
+                            optarg);
+                else
+                    dsme_log_set_rate_limit(strcmp(arg, "all") ?
+                                            parse_verbosity(arg) : -1,
+                                            rps, burst);
+                free(arg);
+            }
+            break;
+
+        case 910: /* --wakeup-summary */
+            {
+                char          *end = 0;
+                unsigned long  sec = strtoul(optarg, &end, 0);
+
+                if( end == optarg || *end || sec > 7 * 24 * 3600 )
+                    fprintf(stderr,
+                            ME "Ignoring invalid wakeup summary interval %s\n",
+                            optarg);
+                else
+                    wakeup_summary = sec;
+            }
+            break;
+
         case 'p': /* -p or --startup-module, allow only once */
             if (module_names)
                 *module_names = g_slist_append(*module_names, optarg);
@@ -264,17 +453,55 @@ static void parse_options(int      argc,           /* in  */
     }
 }
 
-static bool receive_and_queue_message(dsmesock_connection_t* conn)
+static void send_server_stats_row_cb(void* aptr, const char* row)
 {
-    bool keep_connection = true;
-    dsmemsg_generic_t *msg = 0;
+    dsmesock_connection_t   *conn = aptr;
+    DSM_MSGTYPE_SERVER_STATS rsp  = DSME_MSG_INIT(DSM_MSGTYPE_SERVER_STATS);
 
-    DSM_MSGTYPE_SET_LOGGING_VERBOSITY *logverb;
+    dsmesock_client_send_with_extra(conn, &rsp, strlen(row) + 1, row);
+}
 
-    if( !(msg = dsmesock_receive(conn)) )
-        goto EXIT;
+static void send_server_stats(dsmesock_connection_t* conn)
+{
+    DSM_MSGTYPE_SERVER_STATS rsp = DSME_MSG_INIT(DSM_MSGTYPE_SERVER_STATS);
+
+    modulebase_report_stats(send_server_stats_row_cb, conn);
+    dsmesock_report_stats(send_server_stats_row_cb, conn);
+    dsme_log_report_stats(send_server_stats_row_cb, conn);
+    dsme_timers_report_stats(send_server_stats_row_cb, conn);
+    dsme_wakelock_report_stats(send_server_stats_row_cb, conn);
+
+    /* Terminate the reply sequence */
+    dsmesock_client_send_with_extra(conn, &rsp, 0, 0);
+}
+
+static void send_client_stats(dsmesock_connection_t* conn)
+{
+    DSM_MSGTYPE_SERVER_STATS rsp = DSME_MSG_INIT(DSM_MSGTYPE_SERVER_STATS);
+
+    dsmesock_report_clients(send_server_stats_row_cb, conn);
+
+    /* Terminate the reply sequence */
+    dsmesock_client_send_with_extra(conn, &rsp, 0, 0);
+}
 
-    modules_broadcast_internally_from_socket(msg, conn);
+static void send_wakeup_stats(dsmesock_connection_t* conn)
+{
+    DSM_MSGTYPE_SERVER_STATS rsp = DSME_MSG_INIT(DSM_MSGTYPE_SERVER_STATS);
+
+    dsme_main_loop_report_wakeups(send_server_stats_row_cb, conn);
+
+    /* Terminate the reply sequence */
+    dsmesock_client_send_with_extra(conn, &rsp, 0, 0);
+}
+
+static bool receive_and_queue_message(dsmesock_connection_t* conn,
+                                      dsmemsg_generic_t*     msg)
+{
+    bool keep_connection = true;
+
+    DSM_MSGTYPE_SET_LOGGING_VERBOSITY *logverb;
+    DSM_MSGTYPE_SET_LOGGING_RATELIMIT *loglimit;
 
     if( DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) ) {
         keep_connection = false;
@@ -294,9 +521,24 @@ static bool receive_and_queue_message(dsmesock_connection_t* conn)
     {
         dsme_log_set_verbosity(logverb->verbosity);
     }
+    else if( (loglimit = DSMEMSG_CAST(DSM_MSGTYPE_SET_LOGGING_RATELIMIT, msg)) )
+    {
+        dsme_log_set_rate_limit(loglimit->level,
+                                loglimit->rate  < 0 ? 0 : loglimit->rate,
+                                loglimit->burst < 0 ? 0 : loglimit->burst);
+    }
+    else if( DSMEMSG_CAST(DSM_MSGTYPE_GET_SERVER_STATS, msg) ) {
+        send_server_stats(conn);
+    }
+    else if( DSMEMSG_CAST(DSM_MSGTYPE_GET_CLIENT_STATS, msg) ) {
+        send_client_stats(conn);
+    }
+    else if( DSMEMSG_CAST(DSM_MSGTYPE_GET_WAKEUP_STATS, msg) ) {
+        send_wakeup_stats(conn);
+    }
 
-EXIT:
-    free(msg);
+    /* Message buffer ownership is transferred to the queue */
+    modulebase_queue_message_from_socket(msg, conn);
 
     return keep_connection;
 }
@@ -350,6 +592,9 @@ int main(int argc, char *argv[])
       fprintf(stderr, ME "Couldn't set dynamic priority: %s\n", strerror(errno));
   }
 
+  dsme_log_set_file_flush(log_flush_level, log_sync_interval);
+  if( !dsme_log_set_flight_recorder(flightrec_size) )
+      fprintf(stderr, ME "Flight recorder size rounded to power of two\n");
   dsme_log_open(logging_method,
                 logging_verbosity,
                 0,
@@ -384,6 +629,8 @@ int main(int argc, char *argv[])
       kill(getppid(), SIGUSR1);
   }
 #endif
+  dsme_main_loop_set_summary_interval(wakeup_summary);
+
   dsme_log(LOG_DEBUG, "Entering main loop");
   dsme_main_loop_run(modulebase_process_message_queue);
 
@@ -394,6 +641,8 @@ int main(int argc, char *argv[])
 
   modulebase_shutdown();
 
+  dsme_wakelock_quit();
+
   exit_code = dsme_main_loop_exit_code();
 
 EXIT:
@@ -35,6 +35,8 @@
 
 #include "dsme-wdd.h"
 #include "dsme-wdd-wd.h"
+#include "flightrec.h"
+#include "wakelock.h"
 #include "../include/dsme/oom.h"
 #include "../include/dsme/logging.h"
 
@@ -49,6 +51,7 @@
 #include <fcntl.h>
 #include <sched.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #ifdef DSME_SYSTEMD_ENABLE
 #include <systemd/sd-daemon.h>
@@ -77,6 +80,9 @@ static volatile bool run = true;
 
 static volatile bool dsme_abnormal_exit = false;
 
+/** Flag for dsme-server exit caught in kill_and_wait() being abnormal */
+static bool dsme_server_failed = false;
+
 /** dsme-wdd version of dsme_log_p_()
  */
 bool dsme_log_p_(int prio, const char *file, const char *func)
@@ -87,29 +93,85 @@ bool dsme_log_p_(int prio, const char *file, const char *func)
     return prio <= LOG_WARNING;
 }
 
-/** dsme-wdd version of dsme_log_queue()
+/** dsme-wdd version of call site logging generation
  *
- * Always logs to stderr.
+ * Never changes, call sites are evaluated once.
+ */
+volatile unsigned dsme_log_generation_ = 1;
+
+/** dsme-wdd version of dsme_log_site_evaluate_()
+ */
+unsigned dsme_log_site_evaluate_(dsme_log_site_t *site, int prio,
+                                 const char *file, const char *func)
+{
+    unsigned state = ((dsme_log_generation_ << 3 | (unsigned)prio) << 1 |
+                      dsme_log_p_(prio, file, func));
+
+    if( prio >= LOG_EMERG && prio <= LOG_DEBUG )
+        site->state = state;
+
+    return state;
+}
+
+/** dsme-wdd version of dsme_log_site_allow_()
  *
- * No debug logging allowed.
+ * dsme-wdd logs very little, no rate limiting is needed.
  */
-void dsme_log_queue(int prio, const char *file, const char *func, const char *fmt, ...)
+bool dsme_log_site_allow_(dsme_log_site_t *site, int prio,
+                          const char *file, const char *func, int line)
 {
-    (void)file;
-    (void)func;
+    (void)site, (void)prio, (void)file, (void)func, (void)line;
+    return true;
+}
 
+/** Log message to stderr
+ *
+ * No debug logging allowed.
+ */
+static void log_to_stderr(int prio, const char *fmt, va_list va)
+{
     if( prio <= LOG_WARNING ) {
         char txt[128];
-        va_list va;
 
-        va_start(va, fmt);
         vsnprintf(txt, sizeof txt, fmt, va);
-        va_end(va);
 
         fprintf(stderr, ME"%s\n", txt);
     }
 }
 
+/** dsme-wdd version of dsme_log_queue()
+ *
+ * Always logs to stderr.
+ */
+void dsme_log_queue(int prio, const char *file, const char *func, const char *fmt, ...)
+{
+    (void)file;
+    (void)func;
+
+    va_list va;
+    va_start(va, fmt);
+    log_to_stderr(prio, fmt, va);
+    va_end(va);
+}
+
+/** dsme-wdd version of dsme_log_site_queue_()
+ *
+ * Always logs to stderr.
+ */
+void dsme_log_site_queue_(dsme_log_site_t *site, int prio,
+                          const char *file, const char *func,
+                          const char *fmt, ...)
+{
+    (void)site;
+    (void)file;
+    (void)func;
+
+    va_list va;
+    va_start(va, fmt);
+    log_to_stderr(prio, fmt, va);
+    va_end(va);
+}
+
 /**
    Usage
 */
@@ -444,10 +506,14 @@ static bool kill_and_wait(pid_t pid, int sig, int max_wait)
     else if( rc == pid ) {
       if( WIFEXITED(status) ) {
         fprintf(stderr, ME "child exit value: %d\n", WEXITSTATUS(status));
+        if( WEXITSTATUS(status) != EXIT_SUCCESS )
+          dsme_server_failed = true;
       }
       if( WIFSIGNALED(status) ) {
         fprintf(stderr, ME "child exit signal: %s\n",
                  strsignal(WTERMSIG(status)));
+        if( WTERMSIG(status) != sig || sig == SIGKILL )
+          dsme_server_failed = true;
       }
       res = true;
       break;
@@ -462,6 +528,123 @@ EXIT:
   return res;
 }
 
+/** Write all of the given data to a file descriptor
+ *
+ * @return true on success, or false on failure
+ */
+static bool write_all(int fd, const char *data, size_t size)
+{
+    while( size > 0 ) {
+        ssize_t rc = write(fd, data, size);
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            return false;
+        }
+        data += rc, size -= rc;
+    }
+    return true;
+}
+
+/** Save log flight recorder content left by dsme-server
+ *
+ * The lines found in the flight recorder ring are written in
+ * chronological order to DSME_FLIGHTREC_SNAPSHOT_PATH. The
+ * previously saved snapshot is kept with ".1" suffix.
+ */
+static void save_flight_recorder(void)
+{
+    static const char output[] = DSME_FLIGHTREC_SNAPSHOT_PATH;
+    static const char backup[] = DSME_FLIGHTREC_SNAPSHOT_PATH ".1";
+    static const char temp[]   = DSME_FLIGHTREC_SNAPSHOT_PATH ".tmp";
+
+    int         fd_in  = -1;
+    int         fd_out = -1;
+    void       *map    = MAP_FAILED;
+    size_t      size   = 0;
+    struct stat st;
+
+    if( (fd_in = open(DSME_FLIGHTREC_PATH, O_RDONLY | O_CLOEXEC)) == -1 ) {
+        if( errno != ENOENT )
+            fprintf(stderr, ME "%s: open failed: %m\n", DSME_FLIGHTREC_PATH);
+        goto EXIT;
+    }
+
+    if( fstat(fd_in, &st) == -1 || st.st_size < (off_t)sizeof(dsme_flightrec_t) )
+        goto INVALID;
+
+    size = st.st_size;
+    if( (map = mmap(0, size, PROT_READ, MAP_SHARED, fd_in, 0)) == MAP_FAILED ) {
+        fprintf(stderr, ME "%s: mmap failed: %m\n", DSME_FLIGHTREC_PATH);
+        goto EXIT;
+    }
+
+    const dsme_flightrec_t *rec  = map;
+    const char             *data = (const char *)(rec + 1);
+    uint32_t                len  = rec->size;
+
+    if( rec->magic != DSME_FLIGHTREC_MAGIC ||
+        rec->version != DSME_FLIGHTREC_VERSION ||
+        len == 0 || (len & (len - 1)) || sizeof *rec + len > size )
+        goto INVALID;
+
+    uint32_t head = rec->head;
+    uint32_t used = (head < len) ? head : len;
+    uint32_t pos  = head - used;
+
+    /* After wrapping, the oldest line is partially overwritten */
+    if( used == len ) {
+        while( used > 0 && data[pos & (len - 1)] != '\n' )
+            ++pos, --used;
+        if( used > 0 )
+            ++pos, --used;
+    }
+
+    fd_out = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if( fd_out == -1 ) {
+        fprintf(stderr, ME "%s: open failed: %m\n", temp);
+        goto EXIT;
+    }
+
+    uint32_t offs  = pos & (len - 1);
+    uint32_t first = (used < len - offs) ? used : len - offs;
+
+    if( !write_all(fd_out, data + offs, first) ||
+        !write_all(fd_out, data, used - first) ||
+        fsync(fd_out) == -1 ) {
+        fprintf(stderr, ME "%s: write failed: %m\n", temp);
+        goto EXIT;
+    }
+
+    close(fd_out), fd_out = -1;
+
+    if( rename(output, backup) == -1 && errno != ENOENT )
+        fprintf(stderr, ME "%s: rename failed: %m\n", output);
+
+    if( rename(temp, output) == -1 ) {
+        fprintf(stderr, ME "%s: rename failed: %m\n", temp);
+        goto EXIT;
+    }
+
+    fprintf(stderr, ME "flight recorder saved to %s\n", output);
+    goto EXIT;
+
+INVALID:
+    fprintf(stderr, ME "%s: invalid content\n", DSME_FLIGHTREC_PATH);
+
+EXIT:
+    if( fd_out != -1 ) {
+        close(fd_out);
+        unlink(temp);
+    }
+
+    if( map != MAP_FAILED )
+        munmap(map, size);
+
+    if( fd_in != -1 )
+        close(fd_in);
+}
+
 /** Wakelock that DSME "leaks" on abnormal exit
  *
  * The purpose of the leak is to block late suspend while
@@ -474,21 +657,6 @@ EXIT:
  */
 #define DSME_RESTART_WAKELOCK "dsme_restart"
 
-/** Sysfs helper for wakelock manipulation
- */
-static void wakelock_write(const char *path, const char *data, size_t size)
-{
-    // NOTE: called from signal handler - must stay async-signal-safe
-
-    int fd = open(path, O_WRONLY);
-    if( fd != -1 ) {
-        if( write(fd, data, size) == -1 ) {
-            /* dontcare, but need to keep the compiler happy */
-        }
-        close(fd);
-    }
-}
-
 /** Get restart wakelock
  *
  * Used for blocking suspend for one minute when dsme restart
@@ -498,9 +666,8 @@ static void obtain_restart_wakelock(void)
 {
     // NOTE: called from signal handler - must stay async-signal-safe
 
-    static const char path[] = "/sys/power/wake_lock";
     static const char text[] = DSME_RESTART_WAKELOCK " 60000000000\n";
-    wakelock_write(path, text, sizeof text - 1);
+    dsme_wakelock_write_lock(text, sizeof text - 1);
 }
 
 /** Clear restart wakelock
@@ -509,9 +676,7 @@ static void obtain_restart_wakelock(void)
  */
 static void release_restart_wakelock(void)
 {
-    static const char path[] = "/sys/power/wake_unlock";
-    static const char text[] = DSME_RESTART_WAKELOCK "\n";
-    wakelock_write(path, text, sizeof text - 1);
+    dsme_wakelock_clear(DSME_RESTART_WAKELOCK);
 }
 
 /** Set wakelock before invoking default signal handler
@@ -578,6 +743,10 @@ int main(int argc, char *argv[])
     }
     dsme_wd_kick();
 
+    /* Open the wakelock control files before the restart wakelock
+     * can be needed from signal handlers */
+    (void)dsme_wakelock_supported();
+
     trap_terminating_signals();
 
     // set up signal handler
@@ -722,6 +891,10 @@ int main(int argc, char *argv[])
         dsme_abnormal_exit = true;
     }
 
+    /* Preserve dsme-server logs for post-mortem analysis */
+    if( dsme_abnormal_exit || dsme_server_failed )
+        save_flight_recorder();
+
     /* Remove the PID file */
     if (remove(DSME_PID_FILE) < 0 && errno != ENOENT) {
         fprintf(stderr, ME "Couldn't remove lockfile: %m\n");
@@ -32,9 +32,11 @@
 #include "../include/dsme/dsmesock.h"
 #include "../include/dsme/logging.h"
 #include "../include/dsme/modulebase.h"
+#include "../include/dsme/mainloop.h"
 #include <dsme/protocol.h>
 
 #include <stdio.h>
+#include <stdint.h>
 #include <glib.h>
 #include <unistd.h>
 #include <string.h>
@@ -43,43 +45,206 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/sockios.h>
 #include <syslog.h>
 #include <errno.h>
+#include <time.h>
+
+/** Chunk of data waiting to be sent to a client */
+typedef struct dsmesock_txbuf_t
+{
+    /** Next chunk in the send queue */
+    struct dsmesock_txbuf_t *next;
+
+    /** Number of bytes in data */
+    size_t                   size;
+
+    /** Data to send */
+    char                     data[];
+} dsmesock_txbuf_t;
+
+/** Server side state for a client connection */
+typedef struct dsmesock_client_t
+{
+    /** libdsme connection object */
+    dsmesock_connection_t *conn;
+
+    /** Header of the message being received */
+    dsmemsg_generic_t      rx_head;
+
+    /** Buffer for the message being received, or NULL while
+     *  the header is still incomplete */
+    dsmemsg_generic_t     *rx_msg;
+
+    /** Number of bytes of the current message received so far */
+    size_t                 rx_done;
+
+    /** iowatch for client input */
+    guint                  watch_id;
+
+    /** iowatch for flushing the send queue, or 0 when not needed */
+    guint                  tx_watch_id;
+
+    /** First chunk in the send queue */
+    dsmesock_txbuf_t      *tx_head;
+
+    /** Link to update when appending to the send queue */
+    dsmesock_txbuf_t     **tx_tail;
+
+    /** Number of bytes of tx_head that have already been sent */
+    size_t                 tx_offset;
+
+    /** Number of unsent bytes in the send queue */
+    size_t                 tx_bytes;
+
+    /** Number of chunks in the send queue */
+    unsigned               tx_count;
+
+    /** Client is being disconnected, further sends are ignored */
+    bool                   tx_failed;
+
+    /** Idle callback for releasing a disconnected client, or 0 */
+    guint                  close_id;
+
+    /** Messages received from the client */
+    uint64_t               messages_in;
+
+    /** Bytes received from the client */
+    uint64_t               bytes_in;
+
+    /** Messages sent to the client */
+    uint64_t               messages_out;
+
+    /** Bytes sent to the client */
+    uint64_t               bytes_out;
+
+    /** Monotonic time of the latest input / output [ms] */
+    int64_t                last_activity;
+} dsmesock_client_t;
 
 static gboolean accept_client(GIOChannel*  source,
                               GIOCondition condition,
                               gpointer     p);
 static gboolean handle_client(GIOChannel*  source,
                               GIOCondition condition,
-                              gpointer     conn);
-static void close_client(dsmesock_connection_t* conn);
-static void add_client(dsmesock_connection_t* conn);
-static void remove_client(dsmesock_connection_t* conn);
+                              gpointer     client);
+static int receive_message(dsmesock_client_t* client,
+                           dsmemsg_generic_t** pmsg);
+static void queue_close_message(dsmesock_client_t* client);
+static void close_client_later(dsmesock_client_t* client);
+static void close_client(dsmesock_client_t* client);
+static void clear_send_queue(dsmesock_client_t* client);
+static void add_client(dsmesock_client_t* client);
+static void remove_client(dsmesock_client_t* client);
+static dsmesock_client_t* lookup_client(const dsmesock_connection_t* conn);
+
+/** Upper limit for acceptable client message size
+ *
+ * Anything larger is assumed to be garbage / framing error.
+ */
+#define DSMESOCK_MESSAGE_SIZE_MAX (64 * 1024)
+
+/** Default listen backlog for the connect socket
+ *
+ * Several clients are started in parallel during bootup, and they
+ * all want to connect to dsme at about the same time.
+ */
+#define DSMESOCK_LISTEN_BACKLOG_DEFAULT 32
+
+/** Default upper limit for data queued for sending to a single client
+ *
+ * A client that lets its send queue grow beyond this is assumed to
+ * be stuck and gets disconnected.
+ */
+#define DSMESOCK_SEND_QUEUE_LIMIT_DEFAULT (256 * 1024)
+
+/** Maximum number of queued chunks to send with a single syscall */
+#define DSMESOCK_SEND_BATCH 16
+
+/** Maximum number of messages to receive per client wakeup
+ *
+ * Once exceeded, the rest is left for the next main loop iteration
+ * so that a single chatty client can't starve the others.
+ */
+#define DSMESOCK_RECEIVE_BUDGET 32
+
+/** Connections made to listening socket, indexed by socket fd */
+static dsmesock_client_t** client_table = 0;
 
-/* List of all connections made to listening socket */
-static GSList* clients = 0;
+/** Number of slots allocated in client_table */
+static size_t client_table_size = 0;
+
+/** Number of connected clients */
+static unsigned client_count = 0;
 
 /* iowatch for connect socket fd */
 static guint listen_id = 0;
 
 static dsmesock_callback* read_and_queue_f =  0;
 
-/** Set iowatch id for connection
- */
-static void
-set_watch_id(dsmesock_connection_t *conn, guint wid)
-{
-    /* FIXME: the structure in libdsme should be changed, but
-     * for now just store the watch id in channel pointer... */
-    conn->channel = GINT_TO_POINTER(wid);
-}
+/** Current listen backlog, see dsmesock_set_listen_backlog() */
+static int listen_backlog = DSMESOCK_LISTEN_BACKLOG_DEFAULT;
+
+/** Connect statistics */
+static struct {
+    /** Number of listening socket wakeups */
+    uint64_t wakeups;
+    /** Number of connections accepted */
+    uint64_t accepted;
+    /** Largest number of connections accepted in one wakeup */
+    unsigned max_per_wakeup;
+    /** Number of failed accept attempts */
+    uint64_t failures;
+} accept_stats;
+
+/** Current send queue limit, see dsmesock_set_send_queue_limit() */
+static size_t send_queue_limit = DSMESOCK_SEND_QUEUE_LIMIT_DEFAULT;
+
+/** Send statistics */
+static struct {
+    /** Number of messages sent directly without queueing */
+    uint64_t direct;
+    /** Number of messages that had to be queued */
+    uint64_t queued;
+    /** Number of send syscalls made while flushing send queues */
+    uint64_t flushes;
+    /** Number of queued chunks completed while flushing */
+    uint64_t flushed;
+    /** Largest send queue seen [bytes] */
+    size_t   peak_bytes;
+    /** Number of clients disconnected due to send queue limit */
+    uint64_t overflows;
+} send_stats;
+
+/** Receive statistics */
+static struct {
+    /** Number of client input wakeups */
+    uint64_t wakeups;
+    /** Number of messages received */
+    uint64_t messages;
+    /** Largest number of messages received in one wakeup */
+    unsigned max_per_wakeup;
+    /** Number of wakeups that ran out of receive budget */
+    uint64_t budget_exhausted;
+    /** Number of wakeups that yielded only a partial message */
+    uint64_t partial;
+} receive_stats;
 
-/** Get iowatch id from connection
+/** Get monotonic time stamp for client activity tracking
+ *
+ * @return milliseconds since unspecified reference point
  */
-static guint
-get_watch_id(const dsmesock_connection_t *conn)
+static int64_t
+dsmesock_clock_ms(void)
 {
-    return GPOINTER_TO_UINT(conn->channel);
+    struct timespec ts;
+
+    if( clock_gettime(CLOCK_MONOTONIC, &ts) == -1 )
+        return 0;
+
+    return ts.tv_sec * INT64_C(1000) + ts.tv_nsec / 1000000;
 }
 
 /*
@@ -123,7 +288,7 @@ int dsmesock_listen(dsmesock_callback* read_and_queue)
 
     chmod(path, 0646);
 
-    if( listen(fd, 1) == -1 )
+    if( listen(fd, listen_backlog) == -1 )
         goto cleanup;
 
     /* Setup io watch for client connects */
@@ -132,9 +297,9 @@ int dsmesock_listen(dsmesock_callback* read_and_queue)
 
     g_io_channel_set_close_on_unref(chn, true), fd = -1;
 
-    listen_id = g_io_add_watch(chn,
-                               G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-                               accept_client, 0);
+    listen_id = dsme_main_loop_add_watch("dsmesock:listen", chn,
+                                         G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                         accept_client, 0);
 
     if( !listen_id )
         goto cleanup;
@@ -151,25 +316,16 @@ cleanup:
     return listen_id ? 0 : -1;
 }
 
-static gboolean
-accept_client(GIOChannel *src, GIOCondition cnd, gpointer aptr)
+/** Set up server side state for accepted client connection
+ *
+ * @param fd  connected socket, ownership is transferred
+ */
+static void
+setup_client(int fd)
 {
-    (void)aptr;
-
-    gboolean               keep_going = TRUE;
-    int                    fd         = -1;
-    dsmesock_connection_t *conn       = 0;
-    GIOChannel            *chn        = 0;
-
-    /* Remove watch on error conditions */
-    if( cnd & (G_IO_ERR | G_IO_HUP | G_IO_NVAL) ) {
-        keep_going = FALSE;
-        goto cleanup;
-    }
-
-    /* Accept client connection */
-    if( (fd = accept(g_io_channel_unix_get_fd(src), 0, 0)) == -1 )
-        goto cleanup;
+    dsmesock_connection_t *conn   = 0;
+    dsmesock_client_t     *client = 0;
+    GIOChannel            *chn    = 0;
 
     if( !(conn = dsmesock_init(fd)) )
         goto cleanup;
@@ -194,31 +350,86 @@ accept_client(GIOChannel *src, GIOCondition cnd, gpointer aptr)
         conn->ucred.gid = -1;
     }
 
+    if( !(client = calloc(1, sizeof *client)) )
+        goto cleanup;
+
+    client->conn = conn, conn = 0;
+
     /* Attach iowatch to handle client input */
-    if( !(chn = g_io_channel_unix_new(conn->fd)) )
+    if( !(chn = g_io_channel_unix_new(client->conn->fd)) )
         goto cleanup;
 
-    guint wid = g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-                               handle_client, conn);
+    guint wid = dsme_main_loop_add_watch("dsmesock:client", chn,
+                                         G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                         handle_client, client);
 
     if( wid == 0 )
         goto cleanup;
 
-    set_watch_id(conn, wid);
+    client->watch_id      = wid;
+    client->tx_tail       = &client->tx_head;
+    client->last_activity = dsmesock_clock_ms();
 
-    /* Transfer the conn ownership to the client list */
-    add_client(conn), conn = 0;
+    /* Transfer the client ownership to the client table */
+    add_client(client), client = 0;
 
 cleanup:
     if( chn )
         g_io_channel_unref(chn);
 
+    if( client )
+        close_client(client);
+
     if( conn )
-        close_client(conn);
+        dsmesock_close(conn);
 
     if( fd != -1 )
         close(fd);
+}
+
+static gboolean
+accept_client(GIOChannel *src, GIOCondition cnd, gpointer aptr)
+{
+    (void)aptr;
+
+    gboolean keep_going = TRUE;
+    unsigned count      = 0;
 
+    /* Remove watch on error conditions */
+    if( cnd & (G_IO_ERR | G_IO_HUP | G_IO_NVAL) ) {
+        keep_going = FALSE;
+        goto cleanup;
+    }
+
+    /* Accept all pending client connections, so that clients
+     * connecting simultaneously at boot do not need to wait
+     * for further main loop iterations */
+    for( ;; ) {
+        int fd = accept4(g_io_channel_unix_get_fd(src), 0, 0,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if( fd == -1 ) {
+            if( errno == EINTR || errno == ECONNABORTED )
+                continue;
+
+            if( errno != EAGAIN && errno != EWOULDBLOCK ) {
+                /* E.g. EMFILE - leave the rest pending for now */
+                dsme_log(LOG_WARNING, "accept: %m");
+                ++accept_stats.failures;
+            }
+            break;
+        }
+
+        setup_client(fd);
+        ++count;
+    }
+
+    ++accept_stats.wakeups;
+    accept_stats.accepted += count;
+    if( accept_stats.max_per_wakeup < count )
+        accept_stats.max_per_wakeup = count;
+
+cleanup:
     if( !keep_going ) {
         dsme_log(LOG_CRIT, "disabling client connect watcher");
         listen_id = 0;
@@ -227,60 +438,723 @@ cleanup:
     return keep_going;
 }
 
+/** Receive data to client buffer without blocking
+ *
+ * @param client  client connection
+ * @param buff    buffer to read to
+ * @param size    number of bytes wanted
+ *
+ * @return number of bytes received, 0 if no data is available,
+ *         or -1 on eof / error
+ */
+static ssize_t
+receive_nonblocking(dsmesock_client_t* client, void* buff, size_t size)
+{
+    for( ;; ) {
+        ssize_t rc = recv(client->conn->fd, buff, size, MSG_DONTWAIT);
+
+        if( rc > 0 ) {
+            client->bytes_in += rc;
+            return rc;
+        }
+
+        if( rc == 0 )
+            return -1;
+
+        if( errno == EINTR )
+            continue;
+
+        if( errno == EAGAIN || errno == EWOULDBLOCK )
+            return 0;
+
+        dsme_log(LOG_WARNING, "pid %d: recv: %m",
+                 (int)client->conn->ucred.pid);
+        return -1;
+    }
+}
+
+/** Receive a message from client socket
+ *
+ * Whatever data is available is consumed without blocking. Partially
+ * received messages are retained in the client state until the rest
+ * arrives. Once the header is complete, the rest of the message is
+ * received directly into a message queue buffer so that it can be
+ * queued without further allocations or copying.
+ *
+ * @param client  client connection
+ * @param pmsg    where to store completed message buffer that
+ *                was allocated via modulebase_alloc_message()
+ *
+ * @return 1 when message was received, 0 if more data is needed,
+ *         or -1 on eof / error
+ */
+static int
+receive_message(dsmesock_client_t* client, dsmemsg_generic_t** pmsg)
+{
+    const size_t head_size = sizeof client->rx_head;
+    ssize_t      rc;
+
+    while( !client->rx_msg ) {
+        char *pos = (char *)&client->rx_head + client->rx_done;
+
+        if( (rc = receive_nonblocking(client, pos,
+                                      head_size - client->rx_done)) <= 0 )
+            return (int)rc;
+
+        if( (client->rx_done += rc) < head_size )
+            continue;
+
+        size_t size = client->rx_head.line_size_;
+
+        if( size < head_size || size > DSMESOCK_MESSAGE_SIZE_MAX ) {
+            dsme_log(LOG_WARNING, "pid %d: invalid message size %u",
+                     (int)client->conn->ucred.pid, (unsigned)size);
+            return -1;
+        }
+
+        if( !(client->rx_msg = modulebase_alloc_message(size)) )
+            return -1;
+
+        *client->rx_msg = client->rx_head;
+    }
+
+    size_t size = client->rx_msg->line_size_;
+
+    while( client->rx_done < size ) {
+        char *pos = (char *)client->rx_msg + client->rx_done;
+
+        if( (rc = receive_nonblocking(client, pos,
+                                      size - client->rx_done)) <= 0 )
+            return (int)rc;
+
+        client->rx_done += rc;
+    }
+
+    *pmsg = client->rx_msg;
+    client->rx_msg  = 0;
+    client->rx_done = 0;
+
+    return 1;
+}
+
 static gboolean
 handle_client(GIOChannel* src, GIOCondition cnd, gpointer aptr)
 {
-    dsmesock_connection_t *conn = aptr;
+    dsmesock_client_t *client = aptr;
 
     bool keep_connection = true;
+    bool close_queued    = false;
 
     if( cnd & G_IO_IN ) {
-        if( !read_and_queue_f )
-            keep_connection = false;
-        else if( !read_and_queue_f(conn) )
-            keep_connection = false;
+        unsigned count = 0;
+
+        /* Handle all complete messages that are available, but leave
+         * the rest for the next round once receive budget runs out */
+        while( keep_connection ) {
+            if( count == DSMESOCK_RECEIVE_BUDGET ) {
+                ++receive_stats.budget_exhausted;
+                break;
+            }
+
+            dsmemsg_generic_t *msg = 0;
+            int                rc  = receive_message(client, &msg);
+
+            if( rc == 0 )
+                break;
+
+            if( rc < 0 ) {
+                keep_connection = false;
+                break;
+            }
+
+            ++count;
+
+            if( !read_and_queue_f )
+                modulebase_free_message(msg), keep_connection = false;
+            else if( !read_and_queue_f(client->conn, msg) )
+                keep_connection = false, close_queued = true;
+        }
+
+        if( count > 0 ) {
+            client->messages_in  += count;
+            client->last_activity = dsmesock_clock_ms();
+        }
+
+        ++receive_stats.wakeups;
+        receive_stats.messages += count;
+        if( receive_stats.max_per_wakeup < count )
+            receive_stats.max_per_wakeup = count;
+        if( count == 0 && client->rx_done > 0 )
+            ++receive_stats.partial;
     }
 
     if( cnd & (G_IO_ERR | G_IO_HUP | G_IO_NVAL) )
         keep_connection = false;
 
     if( !keep_connection ) {
-        set_watch_id(conn, 0);
-        close_client(conn);
+        /* Modules tracking the client expect to see a close message
+         * also when the connection was not closed in orderly manner */
+        if( !close_queued )
+            queue_close_message(client);
+
+        client->watch_id = 0;
+        close_client_later(client);
     }
 
     return keep_connection;
 }
 
+/** Queue close message on behalf of a disconnected client
+ *
+ * @param client  client connection
+ */
+static void
+queue_close_message(dsmesock_client_t* client)
+{
+    DSM_MSGTYPE_CLOSE  close = DSME_MSG_INIT(DSM_MSGTYPE_CLOSE);
+    dsmemsg_generic_t *msg   = modulebase_alloc_message(sizeof close);
+
+    if( !msg )
+        return;
+
+    memcpy(msg, &close, sizeof close);
+
+    /* Message buffer ownership is transferred to the queue */
+    modulebase_queue_message_from_socket(msg, client->conn);
+}
+
+static gboolean
+close_client_cb(gpointer aptr)
+{
+    dsmesock_client_t *client = aptr;
+
+    client->close_id = 0;
+    close_client(client);
+
+    return FALSE;
+}
+
+/** Release a disconnected client after queued messages are handled
+ *
+ * Messages received from the client refer to its connection object
+ * until they have been dispatched. The message queue is drained before
+ * each main loop iteration, so releasing the client from an idle
+ * callback added while dispatching input keeps the connection valid
+ * for the queued messages.
+ *
+ * Meanwhile the client stays in the client table so that endpoint
+ * lookups keep working, but input is no longer processed and
+ * anything sent to it is ignored.
+ *
+ * @param client  client connection
+ */
+static void
+close_client_later(dsmesock_client_t* client)
+{
+    if( client->close_id )
+        return;
+
+    if( client->watch_id ) {
+        g_source_remove(client->watch_id);
+        client->watch_id = 0;
+    }
+
+    if( client->tx_watch_id ) {
+        g_source_remove(client->tx_watch_id);
+        client->tx_watch_id = 0;
+    }
+
+    client->tx_failed = true;
+    clear_send_queue(client);
+
+    client->close_id = g_idle_add_full(G_PRIORITY_LOW, close_client_cb,
+                                       client, 0);
+    if( !client->close_id )
+        close_client(client);
+}
+
 static void
-close_client(dsmesock_connection_t* conn)
+close_client(dsmesock_client_t* client)
 {
-  if (conn) {
-      remove_client(conn);
+  if (client) {
+      remove_client(client);
 
-      guint wid = get_watch_id(conn);
-      if( wid ) {
-          g_source_remove(wid);
-          set_watch_id(conn, 0);
+      if( client->close_id ) {
+          g_source_remove(client->close_id);
+          client->close_id = 0;
       }
 
-      dsmesock_close(conn);
+      if( client->watch_id ) {
+          g_source_remove(client->watch_id);
+          client->watch_id = 0;
+      }
+
+      if( client->tx_watch_id ) {
+          g_source_remove(client->tx_watch_id);
+          client->tx_watch_id = 0;
+      }
+
+      clear_send_queue(client);
+
+      if( client->rx_msg )
+          modulebase_free_message(client->rx_msg);
+
+      dsmesock_close(client->conn);
+      free(client);
   }
 }
 
 static void
-add_client(dsmesock_connection_t* conn)
+add_client(dsmesock_client_t* client)
 {
-    clients = g_slist_prepend(clients, conn);
+    size_t fd = (size_t)client->conn->fd;
+
+    if( fd >= client_table_size ) {
+        size_t size = client_table_size ? client_table_size : 16;
+
+        while( size <= fd )
+            size *= 2;
+
+        client_table = g_realloc(client_table, size * sizeof *client_table);
+        memset(client_table + client_table_size, 0,
+               (size - client_table_size) * sizeof *client_table);
+        client_table_size = size;
+    }
+
+    client_table[fd] = client;
+    ++client_count;
 }
 
 static void
-remove_client(dsmesock_connection_t* conn)
+remove_client(dsmesock_client_t* client)
 {
-    GSList* node = g_slist_find(clients, conn);
+    size_t fd = (size_t)client->conn->fd;
 
-    if (node) {
-        clients = g_slist_delete_link(clients, node);
+    if( fd < client_table_size && client_table[fd] == client ) {
+        client_table[fd] = 0;
+        --client_count;
+    }
+}
+
+static dsmesock_client_t*
+lookup_client(const dsmesock_connection_t* conn)
+{
+    dsmesock_client_t *client = 0;
+
+    if( conn && conn->fd >= 0 && (size_t)conn->fd < client_table_size ) {
+        client = client_table[conn->fd];
+
+        if( client && client->conn != conn )
+            client = 0;
+    }
+
+    return client;
+}
+
+/** Discard all data queued for sending to a client
+ *
+ * @param client  client connection
+ */
+static void
+clear_send_queue(dsmesock_client_t* client)
+{
+    dsmesock_txbuf_t *buf;
+
+    while( (buf = client->tx_head) ) {
+        client->tx_head = buf->next;
+        free(buf);
+    }
+
+    client->tx_tail   = &client->tx_head;
+    client->tx_offset = 0;
+    client->tx_bytes  = 0;
+    client->tx_count  = 0;
+}
+
+/** Stop sending to a client and make it get disconnected
+ *
+ * The socket is shut down rather than closed so that the client is
+ * released via the normal input eof handling, i.e. not while some
+ * broadcast loop or message handler is still referring to it.
+ *
+ * @param client  client connection
+ */
+static void
+fail_client(dsmesock_client_t* client)
+{
+    if( client->tx_failed )
+        return;
+
+    client->tx_failed = true;
+    clear_send_queue(client);
+
+    if( shutdown(client->conn->fd, SHUT_RDWR) == -1 )
+        dsme_log(LOG_WARNING, "pid %d: shutdown: %m",
+                 (int)client->conn->ucred.pid);
+}
+
+/** Send data to client socket without blocking
+ *
+ * @param client  client connection
+ * @param iov     data to send
+ * @param iovcnt  number of elements in iov
+ *
+ * @return number of bytes sent, or -1 on error
+ */
+static ssize_t
+send_nonblocking(dsmesock_client_t* client, struct iovec* iov, size_t iovcnt)
+{
+    struct msghdr mh = {
+        .msg_iov    = iov,
+        .msg_iovlen = iovcnt,
+    };
+
+    for( ;; ) {
+        ssize_t rc = sendmsg(client->conn->fd, &mh,
+                             MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if( rc >= 0 )
+            return rc;
+
+        if( errno == EINTR )
+            continue;
+
+        if( errno == EAGAIN || errno == EWOULDBLOCK )
+            return 0;
+
+        dsme_log(LOG_WARNING, "pid %d: send: %m",
+                 (int)client->conn->ucred.pid);
+        return -1;
+    }
+}
+
+/** Send as much of the queued data to client as possible
+ *
+ * @param client  client connection
+ *
+ * @return true if there is data left to send, false otherwise
+ */
+static bool
+flush_send_queue(dsmesock_client_t* client)
+{
+    while( client->tx_head ) {
+        struct iovec      iov[DSMESOCK_SEND_BATCH];
+        size_t            cnt = 0;
+        size_t            off = client->tx_offset;
+
+        for( dsmesock_txbuf_t *buf = client->tx_head;
+             buf && cnt < DSMESOCK_SEND_BATCH; buf = buf->next ) {
+            iov[cnt].iov_base = buf->data + off;
+            iov[cnt].iov_len  = buf->size - off;
+            ++cnt, off = 0;
+        }
+
+        ssize_t rc = send_nonblocking(client, iov, cnt);
+
+        if( rc < 0 ) {
+            fail_client(client);
+            break;
+        }
+
+        if( rc == 0 )
+            break;
+
+        ++send_stats.flushes;
+        client->tx_bytes -= rc;
+
+        /* Release chunks that were sent in full */
+        size_t done = client->tx_offset + rc;
+
+        while( client->tx_head && done >= client->tx_head->size ) {
+            dsmesock_txbuf_t *buf = client->tx_head;
+
+            done -= buf->size;
+            if( !(client->tx_head = buf->next) )
+                client->tx_tail = &client->tx_head;
+            free(buf);
+
+            --client->tx_count;
+            ++send_stats.flushed;
+        }
+
+        client->tx_offset = done;
+    }
+
+    return client->tx_head != 0;
+}
+
+static gboolean
+handle_client_output(GIOChannel* src, GIOCondition cnd, gpointer aptr)
+{
+    dsmesock_client_t *client = aptr;
+
+    bool keep_going = false;
+
+    if( cnd & (G_IO_ERR | G_IO_HUP | G_IO_NVAL) )
+        fail_client(client);
+    else if( cnd & G_IO_OUT )
+        keep_going = flush_send_queue(client);
+
+    if( !keep_going )
+        client->tx_watch_id = 0;
+
+    return keep_going;
+}
+
+/** Append data to client send queue
+ *
+ * The iov array is expected to describe a single message, of
+ * which the first skip bytes have already been sent.
+ *
+ * @param client  client connection
+ * @param iov     message data
+ * @param iovcnt  number of elements in iov
+ * @param skip    number of bytes to skip from the start
+ */
+static void
+queue_to_client(dsmesock_client_t* client,
+                const struct iovec* iov, size_t iovcnt, size_t skip)
+{
+    size_t size = 0;
+
+    for( size_t i = 0; i < iovcnt; ++i )
+        size += iov[i].iov_len;
+    size -= skip;
+
+    if( client->tx_bytes + size > send_queue_limit ) {
+        dsme_log(LOG_WARNING, "pid %d: send queue limit exceeded;"
+                 " disconnecting client",
+                 (int)client->conn->ucred.pid);
+        ++send_stats.overflows;
+        fail_client(client);
+        return;
+    }
+
+    dsmesock_txbuf_t *buf = malloc(sizeof *buf + size);
+
+    if( !buf ) {
+        fail_client(client);
+        return;
+    }
+
+    buf->next = 0;
+    buf->size = size;
+
+    char *pos = buf->data;
+    for( size_t i = 0; i < iovcnt; ++i ) {
+        const char *base = iov[i].iov_base;
+        size_t      len  = iov[i].iov_len;
+
+        if( skip >= len ) {
+            skip -= len;
+            continue;
+        }
+
+        memcpy(pos, base + skip, len - skip);
+        pos += len - skip;
+        skip = 0;
+    }
+
+    *client->tx_tail  = buf;
+    client->tx_tail   = &buf->next;
+    client->tx_bytes += size;
+    client->tx_count += 1;
+
+    if( send_stats.peak_bytes < client->tx_bytes )
+        send_stats.peak_bytes = client->tx_bytes;
+
+    if( !client->tx_watch_id ) {
+        GIOChannel *chn = g_io_channel_unix_new(client->conn->fd);
+
+        if( chn ) {
+            client->tx_watch_id =
+                dsme_main_loop_add_watch("dsmesock:send", chn,
+                                         G_IO_OUT | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                         handle_client_output, client);
+            g_io_channel_unref(chn);
+        }
+
+        if( !client->tx_watch_id )
+            fail_client(client);
+    }
+}
+
+/** Send a message to a client
+ *
+ * If nothing is queued, the message is sent directly. Whatever can't
+ * be sent without blocking is queued and sent when the socket becomes
+ * writable again.
+ *
+ * @param client      client connection
+ * @param msg         message to send
+ * @param extra_size  size of extra data
+ * @param extra       extra data, or NULL
+ */
+static void
+send_to_client(dsmesock_client_t* client,
+               const void*        msg,
+               size_t             extra_size,
+               const void*        extra)
+{
+    const dsmemsg_generic_t *head = msg;
+
+    if( client->tx_failed || !client->conn->is_open )
+        return;
+
+    if( head->line_size_ < sizeof *head )
+        return;
+
+    /* Line size on the wire includes the extra data */
+    dsmemsg_generic_t wire = *head;
+    wire.line_size_ += extra_size;
+
+    struct iovec iov[3] = {
+        { &wire,                    sizeof wire                      },
+        { (char *)msg + sizeof wire, head->line_size_ - sizeof wire  },
+        { (void *)extra,             extra ? extra_size : 0          },
+    };
+
+    ssize_t done = 0;
+
+    if( !client->tx_head ) {
+        if( (done = send_nonblocking(client, iov, 3)) < 0 ) {
+            fail_client(client);
+            return;
+        }
+    }
+
+    if( (size_t)done == wire.line_size_ )
+        ++send_stats.direct;
+    else
+        ++send_stats.queued, queue_to_client(client, iov, 3, done);
+
+    client->messages_out  += 1;
+    client->bytes_out     += wire.line_size_;
+    client->last_activity  = dsmesock_clock_ms();
+}
+
+void
+dsmesock_set_listen_backlog(int backlog)
+{
+    listen_backlog = backlog;
+}
+
+void
+dsmesock_set_send_queue_limit(size_t bytes)
+{
+    send_queue_limit = bytes;
+}
+
+void
+dsmesock_client_send_with_extra(dsmesock_connection_t* conn,
+                                const void*            msg,
+                                size_t                 extra_size,
+                                const void*            extra)
+{
+    dsmesock_client_t *client = lookup_client(conn);
+
+    if( client )
+        send_to_client(client, msg, extra_size, extra);
+    else
+        dsmesock_send_with_extra(conn, msg, extra_size, extra);
+}
+
+void
+dsmesock_client_broadcast_with_extra(const void* msg,
+                                     size_t      extra_size,
+                                     const void* extra)
+{
+    for( size_t fd = 0; fd < client_table_size; ++fd ) {
+        dsmesock_client_t *client = client_table[fd];
+
+        if( client && client->conn->is_open )
+            send_to_client(client, msg, extra_size, extra);
+    }
+}
+
+/*
+ * Report client input / output statistics
+ */
+void
+dsmesock_report_stats(modulebase_stats_fn_t* report, void* aptr)
+{
+    char row[256];
+
+    snprintf(row, sizeof row,
+             "dsmesock: clients=%u wakeups=%llu messages=%llu"
+             " avg/wakeup=%.2f max/wakeup=%u budget_exhausted=%llu"
+             " partial=%llu",
+             client_count,
+             (unsigned long long)receive_stats.wakeups,
+             (unsigned long long)receive_stats.messages,
+             receive_stats.wakeups
+               ? (double)receive_stats.messages / receive_stats.wakeups
+               : 0.0,
+             receive_stats.max_per_wakeup,
+             (unsigned long long)receive_stats.budget_exhausted,
+             (unsigned long long)receive_stats.partial);
+    report(aptr, row);
+
+    snprintf(row, sizeof row,
+             "dsmesock: connect: wakeups=%llu accepted=%llu"
+             " max/wakeup=%u failures=%llu backlog=%d",
+             (unsigned long long)accept_stats.wakeups,
+             (unsigned long long)accept_stats.accepted,
+             accept_stats.max_per_wakeup,
+             (unsigned long long)accept_stats.failures,
+             listen_backlog);
+    report(aptr, row);
+
+    snprintf(row, sizeof row,
+             "dsmesock: sent: direct=%llu queued=%llu"
+             " flush: calls=%llu chunks=%llu peak=%zu limit=%zu"
+             " overflows=%llu",
+             (unsigned long long)send_stats.direct,
+             (unsigned long long)send_stats.queued,
+             (unsigned long long)send_stats.flushes,
+             (unsigned long long)send_stats.flushed,
+             send_stats.peak_bytes,
+             send_queue_limit,
+             (unsigned long long)send_stats.overflows);
+    report(aptr, row);
+}
+
+/*
+ * Report per client statistics
+ */
+void
+dsmesock_report_clients(modulebase_stats_fn_t* report, void* aptr)
+{
+    int64_t now = dsmesock_clock_ms();
+    char    row[256];
+
+    for( size_t fd = 0; fd < client_table_size; ++fd ) {
+        const dsmesock_client_t *client = client_table[fd];
+
+        if( !client )
+            continue;
+
+        /* Data written to socket, but not yet read by the client */
+        int sockq = 0;
+        if( ioctl(client->conn->fd, SIOCOUTQ, &sockq) == -1 )
+            sockq = -1;
+
+        snprintf(row, sizeof row,
+                 "client fd=%d pid=%d uid=%d"
+                 " in: messages=%llu bytes=%llu"
+                 " out: messages=%llu bytes=%llu"
+                 " idle=%lld ms sendq=%zu/%u sockq=%d",
+                 client->conn->fd,
+                 (int)client->conn->ucred.pid,
+                 (int)client->conn->ucred.uid,
+                 (unsigned long long)client->messages_in,
+                 (unsigned long long)client->bytes_in,
+                 (unsigned long long)client->messages_out,
+                 (unsigned long long)client->bytes_out,
+                 (long long)(now - client->last_activity),
+                 client->tx_bytes, client->tx_count,
+                 sockq);
+        report(aptr, row);
     }
 }
 
@@ -295,7 +1169,11 @@ dsmesock_shutdown(void)
         g_source_remove(listen_id), listen_id = 0;
     }
 
-    while( clients ) {
-        close_client(clients->data);
+    for( size_t fd = 0; fd < client_table_size; ++fd ) {
+        if( client_table[fd] )
+            close_client(client_table[fd]);
     }
+
+    g_free(client_table), client_table = 0;
+    client_table_size = 0;
 }
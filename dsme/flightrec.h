@@ -0,0 +1,65 @@
+/**
+   @file flightrec.h
+
+   DSME internal definitions for the log flight recorder.
+   <p>
+   The flight recorder is a memory mapped file under /run that
+   dsme-server appends log lines to, and dsme-wdd copies to
+   persistent storage when dsme-server hangs or exits abnormally.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DSME_FLIGHTREC_H
+#define DSME_FLIGHTREC_H
+
+#include <stdint.h>
+
+/** Flight recorder file written by dsme-server */
+#define DSME_FLIGHTREC_PATH          "/run/dsme.flightrec"
+
+/** Where dsme-wdd saves flight recorder content */
+#define DSME_FLIGHTREC_SNAPSHOT_PATH "/var/lib/dsme/flightrec.log"
+
+/** Flight recorder file identification */
+#define DSME_FLIGHTREC_MAGIC         0x44464c52 /* "DFLR" */
+#define DSME_FLIGHTREC_VERSION       1
+
+/** Default / min / max size of flight recorder data area [bytes] */
+#define DSME_FLIGHTREC_SIZE_DEFAULT  (128 * 1024)
+#define DSME_FLIGHTREC_SIZE_MIN      (4 * 1024)
+#define DSME_FLIGHTREC_SIZE_MAX      (4 * 1024 * 1024)
+
+/** Flight recorder file header
+ *
+ * The header is followed by size bytes of data area that is used
+ * as a ring buffer holding newline terminated text lines. The head
+ * offset is free running, data is written at (head % size).
+ *
+ * The head is updated only after a complete line has been written,
+ * so the data area holds min(head, size) bytes of valid text, of
+ * which the first line is partial if the ring has wrapped.
+ */
+typedef struct
+{
+    uint32_t          magic;   /**< DSME_FLIGHTREC_MAGIC */
+    uint32_t          version; /**< DSME_FLIGHTREC_VERSION */
+    uint32_t          size;    /**< Data area size, power of two */
+    volatile uint32_t head;    /**< Free running write offset */
+} dsme_flightrec_t;
+
+#endif /* DSME_FLIGHTREC_H */
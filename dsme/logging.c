@@ -29,8 +29,13 @@
 */
 
 #include "../include/dsme/logging.h"
+#include "flightrec.h"
 
 #include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
 
 #include <unistd.h>
 #include <stdio.h>
@@ -46,6 +51,8 @@
 
 #include <pthread.h>
 #include <fnmatch.h>
+#include <poll.h>
+#include <time.h>
 
 #include <glib.h>
 
@@ -57,24 +64,317 @@
  * log_entry_t
  * ------------------------------------------------------------------------- */
 
-/** Length of the logging ring buffer */
-# define DSME_LOG_ENTRY_COUNT 128 /* must be a power of 2! */
+/** Log message as passed to logging backends */
+typedef struct log_entry_t
+{
+    int         prio;   /**< LOG_EMERG ... LOG_DEBUG */
+    const char *file;   /**< Source code path */
+    const char *func;   /**< Calling function */
+    const char *text;   /**< Message text */
+} log_entry_t;
+
+/* ------------------------------------------------------------------------- *
+ * log_file_t
+ * ------------------------------------------------------------------------- */
+
+/** Maximum number of lines to pass in one writev() call */
+# define DSME_LOG_FILE_LINES_MAX 256
 
-/** Size of one entry in the logging ring buffer */
-# define DSME_LOG_ENTRY_SIZE  128
+/** Size of the buffer holding text of lines waiting to be written */
+# define DSME_LOG_FILE_BUFFER (32 * 1024)
 
-/** Entry in logging ringbuffer */
-typedef union  log_entry_t
+/** Maximum length of "<prefix> <prio>: " line header */
+# define DSME_LOG_FILE_HEADER 64
+
+/** State of the file logging backend
+ *
+ * Lines are collected while the logger thread drains the ring buffer
+ * and written out in one writev() call when the drain is done, or
+ * immediately after a line with high enough priority.
+ */
+typedef struct
 {
-    struct
-    {
-        int         prio;   /**< LOG_EMERG ... LOG_DEBUG */
-        const char *file;   /**< Source code path */
-        const char *func;   /**< Calling function */
-        char        text[]; /**< Message + context, see log_entry_vformat() */
-    };
-    char data[DSME_LOG_ENTRY_SIZE];
-} log_entry_t;
+    /** Log file descriptor, or -1 */
+    int           fd;
+
+    /** Log file path */
+    gchar        *path;
+
+    /** Size of the current log file [bytes] */
+    off_t         size;
+
+    /** Line headers for each priority */
+    char          header[LOG_DEBUG + 1][DSME_LOG_FILE_HEADER];
+    size_t        header_len[LOG_DEBUG + 1];
+
+    /** Text of lines waiting to be written */
+    char          text[DSME_LOG_FILE_BUFFER];
+    size_t        text_used;
+
+    /** Header + text vectors for lines waiting to be written */
+    struct iovec  iov[2 * DSME_LOG_FILE_LINES_MAX];
+    int           iov_used;
+
+    /** Number of bytes waiting to be written */
+    size_t        pending;
+
+    /** Data has been written after the last fdatasync() */
+    bool          unsynced;
+
+    /** Monotonic time of the last fdatasync() [ms] */
+    int64_t       sync_time;
+
+    /** Statistics */
+    guint64       lines;
+    guint64       writes;
+    guint         syncs;
+    guint         rotations;
+    guint         errors;
+} log_file_t;
+
+/* ------------------------------------------------------------------------- *
+ * log_syslog_t
+ * ------------------------------------------------------------------------- */
+
+/** Maximum number of messages to pass in one sendmmsg() call */
+# define DSME_LOG_SYSLOG_BATCH 64
+
+/** Size of the buffer holding messages waiting to be sent */
+# define DSME_LOG_SYSLOG_BUFFER (32 * 1024)
+
+/** Maximum length of syslog message header */
+# define DSME_LOG_SYSLOG_HEADER 96
+
+/** Default syslog socket path */
+# ifndef _PATH_LOG
+#  define _PATH_LOG "/dev/log"
+# endif
+
+/** State of the syslog backend
+ *
+ * Messages are formatted as RFC 3164 datagrams - the format syslogd
+ * and journald expect on the local socket - and collected while the
+ * logger thread drains the ring buffer. When the drain is done, all
+ * of them are sent with one sendmmsg() call.
+ */
+typedef struct
+{
+    /** Datagram socket connected to syslog, or -1 */
+    int            fd;
+
+    /** Syslog socket path */
+    gchar         *path;
+
+    /** Syslog facility */
+    int            facility;
+
+    /** Ident string, including pid if requested */
+    char           ident[64];
+
+    /** Time stamp string and the time it was made for */
+    char           stamp[32];
+    time_t         stamp_time;
+
+    /** Messages waiting to be sent */
+    char           text[DSME_LOG_SYSLOG_BUFFER];
+    size_t         text_used;
+    struct iovec   iov[DSME_LOG_SYSLOG_BATCH];
+    struct mmsghdr msg[DSME_LOG_SYSLOG_BATCH];
+    int            count;
+
+    /** Statistics */
+    guint64        sent;
+    guint64        batches;
+    guint          dropped;
+    guint          reconnects;
+} log_syslog_t;
+
+/* ------------------------------------------------------------------------- *
+ * log_record_t
+ * ------------------------------------------------------------------------- */
+
+/** Default size of the logging ring buffer [bytes] */
+# define DSME_LOG_RING_SIZE_DEFAULT (64 * 1024)
+
+/** Minimum size of the logging ring buffer [bytes] */
+# define DSME_LOG_RING_SIZE_MIN     (4 * 1024)
+
+/** Maximum size of the logging ring buffer [bytes] */
+# define DSME_LOG_RING_SIZE_MAX     (16 * 1024 * 1024)
+
+/** Alignment of records in the logging ring buffer */
+# define DSME_LOG_RECORD_ALIGN      8
+
+/** Flag bit in log_record_t::commit for padding records
+ *
+ * Padding is used to skip the tail end of the ring buffer when
+ * a record would not fit there in one piece.
+ */
+# define DSME_LOG_RECORD_PAD        0x40000000
+
+/** Size of stack buffer used for formatting messages
+ *
+ * Longer messages are formatted directly to the ring buffer.
+ */
+# define DSME_LOG_TEXT_BUFFER       256
+
+/** Log record content types */
+typedef enum
+{
+    LOG_RECORD_TEXT,   /**< Formatted message */
+    LOG_RECORD_BINARY, /**< log_binary_t for deferred formatting */
+} log_record_type_t;
+
+/** Variable length record in logging ring buffer */
+typedef struct log_record_t
+{
+    /** Record size when complete, or zero while still being written */
+    volatile gint commit;
+
+    /** LOG_EMERG ... LOG_DEBUG */
+    gint16        prio;
+
+    /** log_record_type_t */
+    gint16        type;
+
+    /** For text records: message, source path and function as
+     *  consecutive C strings.
+     *
+     *  For binary records: log_binary_t with interned format and
+     *  file/func strings.
+     *
+     * Note: Even though the file/func strings are constants resulting
+     * from use of __FILE__ and __FUNCTION__ macros, they can't be used
+     * as is because they still become invalid if pointing to modules
+     * that have already been unloaded (for example during dsme exit).
+     */
+    char          data[];
+} log_record_t;
+
+/* ------------------------------------------------------------------------- *
+ * log_format_t
+ * ------------------------------------------------------------------------- */
+
+/** Maximum number of arguments a format can have for deferred formatting */
+# define DSME_LOG_ARGS_MAX          16
+
+/** Size of buffer used for deferred formatting on logger thread */
+# define DSME_LOG_FORMAT_BUFFER     1024
+
+/** Maximum length of a string argument copied for deferred formatting
+ *
+ * Messages with longer string arguments are formatted immediately.
+ */
+# define DSME_LOG_STRING_MAX        256
+
+/** Upper bound for length of a converted numeric value, excluding
+ *  field width and precision */
+# define DSME_LOG_NUMBER_MAX        32
+
+/** Upper bound for length of a converted double value that might
+ *  not be representable with DSME_LOG_NUMBER_MAX characters */
+# define DSME_LOG_DOUBLE_MAX        320
+
+/** Upper bound for length of %m expansion */
+# define DSME_LOG_ERROR_MAX         64
+
+/** Type of value consumed by a printf conversion */
+typedef enum
+{
+    LOG_ARG_NONE,     /**< Literal text / %m / %% */
+    LOG_ARG_INT,      /**< int, and anything promoted to int */
+    LOG_ARG_LONG,     /**< long */
+    LOG_ARG_LLONG,    /**< long long */
+    LOG_ARG_INTMAX,   /**< intmax_t */
+    LOG_ARG_SIZE,     /**< size_t */
+    LOG_ARG_PTRDIFF,  /**< ptrdiff_t */
+    LOG_ARG_DOUBLE,   /**< double */
+    LOG_ARG_STRING,   /**< const char *, copied to the record */
+    LOG_ARG_POINTER,  /**< const void * */
+} log_arg_type_t;
+
+/** log_chunk_t flag: field width is given as an argument */
+# define LOG_CHUNK_WIDTH_ARG        0x01
+
+/** log_chunk_t flag: precision is given as an argument */
+# define LOG_CHUNK_PREC_ARG         0x02
+
+/** Format string chunk containing at most one conversion */
+typedef struct
+{
+    guint16         end;    /**< Offset of chunk end in format string */
+    guint16         width;  /**< Literal field width, or zero */
+    gint16          prec;   /**< Literal precision, or -1 if none */
+    guint8          stars;  /**< Number of '*' width / precision args */
+    guint8          type;   /**< log_arg_type_t of the converted value */
+    guint8          flags;  /**< LOG_CHUNK_WIDTH_ARG | LOG_CHUNK_PREC_ARG */
+} log_chunk_t;
+
+/** Interned format string, parsed for deferred formatting */
+typedef struct log_format_t
+{
+    char           *text;   /**< Copy of the format string */
+    guint           fixed;  /**< Output length not depending on
+                             *   arguments: literal text and %m */
+    bool            defer;  /**< Can be formatted on logger thread */
+    guint           argc;   /**< Number of arguments consumed */
+    guint           chunks; /**< Number of chunks */
+    log_chunk_t     chunk[DSME_LOG_ARGS_MAX]; /**< Format chunks */
+} log_format_t;
+
+/** Argument value captured for deferred formatting */
+typedef union
+{
+    int             i;
+    long            l;
+    long long       ll;
+    intmax_t        j;
+    size_t          z;
+    ptrdiff_t       t;
+    double          d;
+    const void     *p;
+    guint           s;      /**< String offset from record start */
+} log_arg_t;
+
+/** Payload of a binary log record */
+typedef struct
+{
+    const log_format_t *format; /**< Interned format */
+    const char         *file;   /**< Interned source path */
+    const char         *func;   /**< Interned function name */
+    int                 error;  /**< errno value for %m */
+    guint               argc;   /**< Number of captured arguments */
+    log_arg_t           args[]; /**< Captured arguments, then strings */
+} log_binary_t;
+
+/** Interned data cached in dsme_log() call site descriptor */
+typedef struct
+{
+    const log_format_t *format; /**< Interned deferrable format, or NULL */
+    const char         *file;   /**< Interned source path */
+    const char         *func;   /**< Interned function name */
+} log_site_intern_t;
+
+/** Logging core data for one dsme_log() call site
+ *
+ * Plugins see only a pointer to this, see dsme_log_site_data().
+ */
+typedef struct log_site_data_t
+{
+    /* Deferred formatting data, see dsme_log_intern_lookup() */
+    const log_site_intern_t * volatile intern;
+    volatile unsigned                  intern_gen;
+
+    /* Rate limiting, protected by dsme_log_limit_lock */
+    unsigned                stamp;      /**< Time of the last message [ms] */
+    unsigned                tokens;     /**< Messages allowed now, x1000 */
+    unsigned                suppressed; /**< Messages dropped since summary */
+    int                     level;      /**< Level of suppressed messages */
+    int                     line;       /**< Call site source line */
+    gchar                  *file;       /**< Copy of call site source file */
+    gchar                  *func;       /**< Copy of call site function */
+    struct log_site_data_t *next;       /**< Sites with suppressed messages */
+} log_site_data_t;
 
 /* ------------------------------------------------------------------------- *
  * log_state_t
@@ -104,11 +404,36 @@ typedef struct
  * ========================================================================= */
 
 /* ------------------------------------------------------------------------- *
- * log_entry_t
+ * log_record_t
+ * ------------------------------------------------------------------------- */
+
+static void        log_record_to_entry        (const log_record_t *self, log_entry_t *entry, char *buf, size_t size);
+
+/* ------------------------------------------------------------------------- *
+ * log_format_t
+ * ------------------------------------------------------------------------- */
+
+static int         log_format_number          (const char **ppos);
+static log_format_t *log_format_create        (const char *fmt);
+static void        log_format_delete          (log_format_t *self);
+static void        log_format_delete_cb       (gpointer self);
+static size_t      log_format_chunk           (const log_format_t *self, guint index, char *buf, size_t size, const log_arg_t *args, const log_record_t *record);
+static void        log_format_render          (const log_record_t *record, char *buf, size_t size);
+
+/* ------------------------------------------------------------------------- *
+ * Call Site Data
+ * ------------------------------------------------------------------------- */
+
+static log_site_data_t *dsme_log_site_data    (dsme_log_site_t *site);
+
+/* ------------------------------------------------------------------------- *
+ * Interned Strings
  * ------------------------------------------------------------------------- */
 
-static void        log_entry_vformat          (log_entry_t *self, int prio, const char *file, const char *func, const char *fmt, va_list va);
-static void        log_entry_format           (log_entry_t *self, int prio, const char *file, const char *func, const char *fmt, ...) __attribute__((format(printf,5,6)));;
+static const char *dsme_log_intern_string     (const char *str);
+static const log_format_t *dsme_log_intern_format(const char *fmt);
+static const log_format_t *dsme_log_intern_lookup(log_site_data_t *data, const char *fmt, const char **file, const char **func);
+static void        dsme_log_intern_quit       (void);
 
 /* ------------------------------------------------------------------------- *
  * log_state_t
@@ -131,6 +456,41 @@ static void        log_to_null                (const log_entry_t *entry);
 static void        log_to_stderr              (const log_entry_t *entry);
 static void        log_to_syslog              (const log_entry_t *entry);
 static void        log_to_file                (const log_entry_t *entry);
+static void        log_commit_null            (void);
+
+/* ------------------------------------------------------------------------- *
+ * File Logging
+ * ------------------------------------------------------------------------- */
+
+static int64_t     log_monotonic_ms           (void);
+static bool        log_file_reopen            (void);
+static bool        log_file_open              (const char *path);
+static void        log_file_close             (void);
+static void        log_file_rotate            (void);
+static void        log_file_flush             (void);
+static void        log_file_commit            (void);
+static int         log_file_sync_timeout      (void);
+
+/* ------------------------------------------------------------------------- *
+ * Syslog Logging
+ * ------------------------------------------------------------------------- */
+
+static bool        log_syslog_connect         (void);
+static void        log_syslog_open            (const char *ident, int option, int facility);
+static void        log_syslog_close           (void);
+static void        log_syslog_flush           (void);
+static void        log_syslog_commit          (void);
+
+/* ------------------------------------------------------------------------- *
+ * Flight Recorder
+ * ------------------------------------------------------------------------- */
+
+static uint32_t    log_flightrec_write        (uint32_t pos, const char *data, size_t size);
+static void        log_flightrec_printf       (const char *fmt, ...) __attribute__((format(printf,1,2)));
+static void        log_to_flightrec           (const log_entry_t *entry);
+static void        log_record_to_flightrec    (const log_record_t *record);
+static bool        log_flightrec_open         (void);
+static void        log_flightrec_close        (void);
 
 /* ------------------------------------------------------------------------- *
  * log_rule_t
@@ -149,14 +509,45 @@ static void        dsme_log_add_rule          (const char *pattern, log_state_t
 void               dsme_log_include           (const char *pattern);
 void               dsme_log_exclude           (const char *pattern);
 static log_state_t dsme_log_evaluate          (const char *file, const char *func);
+static void        dsme_log_bump_generation   (void);
 void               dsme_log_set_verbosity     (int verbosity);
+static bool        dsme_log_decide            (int prio, const char *file, const char *func);
 bool               dsme_log_p_                (int prio, const char *file, const char *func);
+unsigned           dsme_log_site_evaluate_    (dsme_log_site_t *site, int prio, const char *file, const char *func);
+
+/* ------------------------------------------------------------------------- *
+ * Rate Limiting
+ * ------------------------------------------------------------------------- */
+
+bool               dsme_log_site_allow_       (dsme_log_site_t *site, int prio, const char *file, const char *func, int line);
+static void        dsme_log_limit_summary     (log_site_data_t *data, unsigned count);
+static void        dsme_log_limit_sweep       (void);
+static int         dsme_log_limit_timeout     (void);
+void               dsme_log_set_rate_limit    (int prio, unsigned rate, unsigned burst);
 
 /* ------------------------------------------------------------------------- *
  * Logging Queue
  * ------------------------------------------------------------------------- */
 
+static log_record_t *dsme_log_ring_at        (guint pos);
+static bool        dsme_log_ring_alloc        (size_t size);
+static log_record_t *dsme_log_ring_reserve    (guint size);
+static void        dsme_log_ring_commit       (log_record_t *record, guint size);
+static bool        dsme_log_ring_drain        (void);
+static void        dsme_log_notify_worker     (void);
+static bool        dsme_log_vqueue            (int prio, const char *file, const char *func, const char *fmt, va_list va);
+static int         dsme_log_bqueue            (int prio, const char *file, const char *func, const log_format_t *format, int error, va_list va);
+static bool        dsme_log_fqueue            (int prio, const char *file, const char *func, const char *fmt, ...) __attribute__((format(printf,4,5)));
+static void        dsme_log_site_vqueue       (dsme_log_site_t *site, int prio, const char *file, const char *func, int error, const char *fmt, va_list va);
 void               dsme_log_queue             (int prio, const char *file, const char *func, const char *fmt, ...);
+void               dsme_log_site_queue_       (dsme_log_site_t *site, int prio, const char *file, const char *func, const char *fmt, ...);
+bool               dsme_log_set_ring_size     (size_t size);
+void               dsme_log_set_deferred      (bool enabled);
+void               dsme_log_set_file_flush    (int level, unsigned interval);
+void               dsme_log_set_file_rotation (size_t size, unsigned count);
+bool               dsme_log_set_flight_recorder(size_t size);
+void               dsme_log_set_syslog_socket (const char *path);
+void               dsme_log_report_stats      (void (*report)(void *aptr, const char *row), void *aptr);
 static void       *dsme_log_thread            (void *param);
 
 /* ------------------------------------------------------------------------- *
@@ -177,166 +568,719 @@ static struct
     int         verbosity; /* Verbosity level (corresponding to LOG_*) */
     int         usetime;   /* Timestamps on/off */
     const char* prefix;    /* Message prefix */
-    FILE*       filep;     /* Log file stream */
+    int         flush_level;   /* Write file immediately at this level */
+    unsigned    sync_interval; /* Max time between file syncs [ms] */
+    size_t      rotate_size;   /* Rotate log file at this size [bytes] */
+    unsigned    rotate_count;  /* Number of rotated log files to keep */
 } logopt =
 {
-    .method    = LOG_METHOD_STDERR,
-    .verbosity = LOG_NOTICE,
-    .usetime   = 0,
-    .prefix    = "DSME",
-    .filep     = 0,
+    .method        = LOG_METHOD_STDERR,
+    .verbosity     = LOG_NOTICE,
+    .usetime       = 0,
+    .prefix        = "DSME",
+    .flush_level   = LOG_ERR,
+    .sync_interval = 5000,
+    .rotate_size   = 1024 * 1024,
+    .rotate_count  = 2,
 };
 
-/* ========================================================================= *
- * log_entry_t
- * ========================================================================= */
-
-static void
-log_entry_vformat(log_entry_t *self, int prio, const char *file,
-                  const char *func, const char *fmt, va_list va)
+/** File logging backend state */
+static log_file_t log_file =
 {
-    /* In normal operation mode (=using syslog) the file and function
-     * data is not used. To minimize the size of the statically allocated
-     * logging ring buffer, the file:func data is added to the unused
-     * space that is left over after storing the actual log message.
-     *
-     * Note: Even though the file/func strings are constants resulting
-     * from use of __FILE__ and __FUNCTION__ macros, they can't be used
-     * as is because they still become invalid if pointing to modules that
-     * have already been unloaded (for example during dsme exit).
-     */
-
-    self->prio = log_prio_cap(prio);
-    self->file = "unknown";
-    self->func = "unknown";
+    .fd = -1,
+};
 
-    char *end = (char *)(self + 1);
-    char *pos = self->text;
+/** Syslog backend state */
+static log_syslog_t log_syslog =
+{
+    .fd = -1,
+};
 
-    vsnprintf(pos, end - pos, fmt, va);
-    pos = strchr(pos, 0) + 1;
+/** Syslog socket path to use from dsme_log_open() onwards */
+static gchar *log_syslog_path = 0;
 
-    if( file && pos < end ) {
-        self->file = pos;
-        snprintf(pos, end - pos, "%s", file);
-        pos = strchr(pos, 0) + 1;
-    }
+/** Flight recorder mapping, or NULL when not in use */
+static dsme_flightrec_t *log_flightrec = 0;
 
-    if( func && pos < end ) {
-        self->func = pos;
-        snprintf(pos, end - pos, "%s", func);
-    }
-}
+/** Lock for flight recorder writes, used from all logging threads */
+static pthread_mutex_t log_flightrec_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static void
-log_entry_format(log_entry_t *self, int prio, const char *file,
-                 const char *func, const char *fmt, ...)
-{
-    va_list va;
-    va_start(va, fmt);
-    log_entry_vformat(self, prio, file, func, fmt, va);
-    va_end(va);
-}
+/** Flight recorder size to use from dsme_log_open() onwards, or zero */
+static size_t log_flightrec_size = 0;
 
 /* ========================================================================= *
- * log_state_t
+ * log_record_t
  * ========================================================================= */
 
-static const char *
-log_state_repr(log_state_t state)
+/** Make log entry from data stored in a log record
+ *
+ * @param self   log record
+ * @param entry  log entry to fill in
+ * @param buf    buffer for formatting binary records
+ * @param size   size of buf
+ */
+static void
+log_record_to_entry(const log_record_t *self, log_entry_t *entry,
+                    char *buf, size_t size)
 {
-    const char *repr = "LOG_STATE_INVALID";
+    entry->prio = log_prio_cap(self->prio);
 
-    switch( state ) {
-    case LOG_STATE_UNKNOWN:  repr = "LOG_STATE_UNKNOWN";  break;
-    case LOG_STATE_INCLUDED: repr = "LOG_STATE_INCLUDED"; break;
-    case LOG_STATE_EXCLUDED: repr = "LOG_STATE_EXCLUDED"; break;
-    case LOG_STATE_DEFAULT:  repr = "LOG_STATE_DEFAULT";  break;
-    default: break;
-    }
+    if( self->type == LOG_RECORD_BINARY ) {
+        const log_binary_t *bin = (const log_binary_t *)self->data;
 
-    return repr;
+        log_format_render(self, buf, size);
+        entry->text = buf;
+        entry->file = bin->file;
+        entry->func = bin->func;
+    }
+    else {
+        entry->text = self->data;
+        entry->file = strchr(entry->text, 0) + 1;
+        entry->func = strchr(entry->file, 0) + 1;
+    }
 }
 
 /* ========================================================================= *
- * Logging Priorities
+ * log_format_t
  * ========================================================================= */
 
-/** Normalize priority to LOG_EMERG ... LOG_DEBUG range
+/** Parse literal field width / precision from format string
+ *
+ * @param ppos  pointer to parse position, updated past the digits
+ *
+ * @return parsed value, clamped to DSME_LOG_FORMAT_BUFFER
  */
-static int log_prio_cap(int prio)
+static int
+log_format_number(const char **ppos)
 {
-    if( prio < LOG_EMERG )
-        return LOG_EMERG;
+    const char *pos = *ppos;
+    int         val = 0;
 
-    if( prio > LOG_DEBUG )
-        return LOG_DEBUG;
+    for( ; *pos >= '0' && *pos <= '9'; ++pos ) {
+        if( val < DSME_LOG_FORMAT_BUFFER )
+            val = val * 10 + (*pos - '0');
+    }
 
-    return prio;
+    *ppos = pos;
+    return val < DSME_LOG_FORMAT_BUFFER ? val : DSME_LOG_FORMAT_BUFFER;
 }
 
-/** Map logging priority to human readable string
+/** Parse format string for deferred formatting
+ *
+ * The format is split into chunks that each contain at most one
+ * conversion, so that formatting can be done on the logger thread
+ * one captured argument at a time.
+ *
+ * Formats using features that are not supported - such as positional
+ * arguments, long doubles or %n - and formats that do not fit in the
+ * logger thread formatting buffer are marked as not deferrable.
+ *
+ * @param fmt  printf style format string
+ *
+ * @return parsed format
  */
-static const char* log_prio_str(int prio)
+static log_format_t *
+log_format_create(const char *fmt)
 {
-    switch( prio ) {
-    case LOG_DEBUG:     return "debug";
-    case LOG_INFO:      return "info";
-    case LOG_NOTICE:    return "notice";
-    case LOG_WARNING:   return "warning";
-    case LOG_ERR:       return "error";
-    case LOG_CRIT:      return "critical";
-    case LOG_ALERT:     return "alert";
-    case LOG_EMERG:     return "emergency";
-    default:            return "log";
+    log_format_t *self = g_malloc0(sizeof *self);
+
+    self->text = g_strdup(fmt);
+
+    const char *pos = self->text;
+
+    while( (pos = strchr(pos, '%')) ) {
+        if( pos[1] == '%' ) {
+            pos += 2;
+            continue;
+        }
+
+        guint          stars = 0;
+        guint          flags = 0;
+        int            width = 0;
+        int            prec  = -1;
+        log_arg_type_t type  = LOG_ARG_NONE;
+        const char    *len   = 0;
+
+        /* Flags, field width and precision */
+        pos += 1;
+        pos += strspn(pos, "-+ #0'I");
+
+        if( *pos == '*' )
+            ++stars, ++pos, flags |= LOG_CHUNK_WIDTH_ARG;
+        else
+            width = log_format_number(&pos);
+
+        if( *pos == '.' ) {
+            if( *++pos == '*' )
+                ++stars, ++pos, flags |= LOG_CHUNK_PREC_ARG;
+            else
+                prec = log_format_number(&pos);
+        }
+
+        /* Length modifier */
+        len = pos;
+        pos += strspn(pos, "hlLqjzt");
+
+        size_t n = pos - len;
+
+        /* Conversion */
+        switch( *pos++ ) {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+            if( n == 0 || !strncmp(len, "h", n) || !strncmp(len, "hh", n) )
+                type = LOG_ARG_INT;
+            else if( !strncmp(len, "l", n) )
+                type = LOG_ARG_LONG;
+            else if( !strncmp(len, "ll", n) || !strncmp(len, "q", n) )
+                type = LOG_ARG_LLONG;
+            else if( !strncmp(len, "j", n) )
+                type = LOG_ARG_INTMAX;
+            else if( !strncmp(len, "z", n) )
+                type = LOG_ARG_SIZE;
+            else if( !strncmp(len, "t", n) )
+                type = LOG_ARG_PTRDIFF;
+            else
+                goto EXIT;
+            break;
+
+        case 'c':
+            if( n != 0 )
+                goto EXIT;
+            type = LOG_ARG_INT;
+            break;
+
+        case 'e': case 'E': case 'f': case 'F':
+        case 'g': case 'G': case 'a': case 'A':
+            if( n != 0 && strncmp(len, "l", n) )
+                goto EXIT;
+            type = LOG_ARG_DOUBLE;
+            break;
+
+        case 's':
+            if( n != 0 )
+                goto EXIT;
+            type = LOG_ARG_STRING;
+            break;
+
+        case 'p':
+            if( n != 0 )
+                goto EXIT;
+            type = LOG_ARG_POINTER;
+            break;
+
+        case 'm':
+            if( n != 0 )
+                goto EXIT;
+            type = LOG_ARG_NONE;
+            self->fixed += DSME_LOG_ERROR_MAX;
+            break;
+
+        default:
+            goto EXIT;
+        }
+
+        if( self->chunks == DSME_LOG_ARGS_MAX ||
+            pos - self->text > G_MAXUINT16 )
+            goto EXIT;
+
+        log_chunk_t *chunk = &self->chunk[self->chunks++];
+        chunk->end   = pos - self->text;
+        chunk->width = width;
+        chunk->prec  = prec;
+        chunk->stars = stars;
+        chunk->type  = type;
+        chunk->flags = flags;
+
+        self->argc += stars + (type != LOG_ARG_NONE);
     }
-}
 
-/* ========================================================================= *
- * log_rule_t
- * ========================================================================= */
+    /* Literal text after the last conversion */
+    size_t tail = self->chunks ? self->chunk[self->chunks - 1].end : 0;
+    size_t size = strlen(self->text);
 
-static log_rule_t *
-log_rule_create(const char *pattern, log_state_t state)
-{
-    log_rule_t *self = g_malloc0(sizeof *self);
+    if( size >= DSME_LOG_FORMAT_BUFFER )
+        goto EXIT;
 
-    self->pattern = g_strdup(pattern);
-    self->state   = state;
+    self->fixed += size;
+
+    if( size > tail ) {
+        if( self->chunks == DSME_LOG_ARGS_MAX )
+            goto EXIT;
+
+        log_chunk_t *chunk = &self->chunk[self->chunks++];
+        chunk->end   = size;
+        chunk->width = 0;
+        chunk->prec  = -1;
+        chunk->stars = 0;
+        chunk->type  = LOG_ARG_NONE;
+        chunk->flags = 0;
+    }
+
+    self->defer = true;
 
+EXIT:
     return self;
 }
 
 static void
-log_rule_delete(log_rule_t *self)
+log_format_delete(log_format_t *self)
 {
     if( self != 0 ) {
-        g_free(self->pattern);
+        g_free(self->text);
         g_free(self);
     }
 }
 
 static void
-log_rule_delete_cb(gpointer self)
+log_format_delete_cb(gpointer self)
 {
-    return log_rule_delete(self);
+    log_format_delete(self);
 }
 
-/* ========================================================================= *
- * Logging Backends
- * ========================================================================= */
-
-/*
- * Empty routine for suppressing all log messages
+/** Format one chunk of a binary log record
+ *
+ * @param self    parsed format
+ * @param index   chunk index
+ * @param buf     output buffer
+ * @param size    output buffer size
+ * @param args    captured arguments for the chunk
+ * @param record  record holding string arguments
+ *
+ * @return number of characters written to buf
  */
-static void log_to_null(const log_entry_t *entry)
+static size_t
+log_format_chunk(const log_format_t *self, guint index, char *buf,
+                 size_t size, const log_arg_t *args,
+                 const log_record_t *record)
 {
-    (void)entry;
-}
+    const log_chunk_t *chunk = &self->chunk[index];
+    size_t             beg   = index ? self->chunk[index - 1].end : 0;
+    char               seg[DSME_LOG_FORMAT_BUFFER];
+    int                star[2] = { 0, 0 };
+    int                rc    = 0;
+
+    size_t len = chunk->end - beg;
+    if( len >= sizeof seg )
+        len = sizeof seg - 1;
+    memcpy(seg, self->text + beg, len);
+    seg[len] = 0;
+
+    for( guint i = 0; i < chunk->stars; ++i )
+        star[i] = args++->i;
+
+#define LOG_CHUNK_PRINTF(VAL_) \
+    switch( chunk->stars ) {\
+    case 0:  rc = snprintf(buf, size, seg, VAL_); break;\
+    case 1:  rc = snprintf(buf, size, seg, star[0], VAL_); break;\
+    default: rc = snprintf(buf, size, seg, star[0], star[1], VAL_); break;\
+    }
 
-/*
- * This routine is used when stderr logging method is set
- */
+    switch( chunk->type ) {
+    case LOG_ARG_INT:     LOG_CHUNK_PRINTF(args->i);  break;
+    case LOG_ARG_LONG:    LOG_CHUNK_PRINTF(args->l);  break;
+    case LOG_ARG_LLONG:   LOG_CHUNK_PRINTF(args->ll); break;
+    case LOG_ARG_INTMAX:  LOG_CHUNK_PRINTF(args->j);  break;
+    case LOG_ARG_SIZE:    LOG_CHUNK_PRINTF(args->z);  break;
+    case LOG_ARG_PTRDIFF: LOG_CHUNK_PRINTF(args->t);  break;
+    case LOG_ARG_DOUBLE:  LOG_CHUNK_PRINTF(args->d);  break;
+    case LOG_ARG_POINTER: LOG_CHUNK_PRINTF(args->p);  break;
+    case LOG_ARG_STRING:
+        LOG_CHUNK_PRINTF((const char *)record + args->s);
+        break;
+    default:
+        /* No value to convert, excess argument is ignored */
+        LOG_CHUNK_PRINTF(0);
+        break;
+    }
+
+#undef LOG_CHUNK_PRINTF
+
+    if( rc < 0 )
+        rc = 0;
+    else if( (size_t)rc >= size )
+        rc = size - 1;
+
+    return rc;
+}
+
+/** Format message from binary log record
+ *
+ * @param record  binary log record
+ * @param buf     output buffer
+ * @param size    output buffer size
+ */
+static void
+log_format_render(const log_record_t *record, char *buf, size_t size)
+{
+    const log_binary_t *bin    = (const log_binary_t *)record->data;
+    const log_format_t *format = bin->format;
+    const log_arg_t    *args   = bin->args;
+    size_t              len    = 0;
+
+    *buf = 0;
+
+    /* For %m conversions */
+    errno = bin->error;
+
+    for( guint i = 0; i < format->chunks && len + 1 < size; ++i ) {
+        const log_chunk_t *chunk = &format->chunk[i];
+
+        len  += log_format_chunk(format, i, buf + len, size - len,
+                                 args, record);
+        args += chunk->stars + (chunk->type != LOG_ARG_NONE);
+    }
+}
+
+/* ========================================================================= *
+ * Call Site Data
+ * ========================================================================= */
+
+/** Lock for creating call site data */
+static pthread_mutex_t dsme_log_site_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Call site data, keyed by call site descriptor address */
+static GHashTable *dsme_log_site_table = 0;
+
+/** Get logging core data for a call site
+ *
+ * The data is allocated on first use and never released. It can be
+ * referred from logging core lists after the plugin containing the
+ * call site has been unloaded. If a plugin is loaded again and
+ * the call site ends up at the same address, the data is reused.
+ *
+ * @param site  call site descriptor
+ *
+ * @return call site data
+ */
+static log_site_data_t *
+dsme_log_site_data(dsme_log_site_t *site)
+{
+    log_site_data_t *data = __atomic_load_n(&site->priv, __ATOMIC_ACQUIRE);
+
+    if( data )
+        goto EXIT;
+
+    pthread_mutex_lock(&dsme_log_site_lock);
+
+    if( !(data = site->priv) ) {
+        if( !dsme_log_site_table )
+            dsme_log_site_table = g_hash_table_new(g_direct_hash,
+                                                   g_direct_equal);
+
+        data = g_hash_table_lookup(dsme_log_site_table, site);
+
+        if( data ) {
+            /* Cached pointers might refer to the unloaded plugin */
+            data->intern_gen = 0;
+        }
+        else {
+            data = g_malloc0(sizeof *data);
+            g_hash_table_insert(dsme_log_site_table, site, data);
+        }
+
+        __atomic_store_n(&site->priv, data, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&dsme_log_site_lock);
+
+EXIT:
+    return data;
+}
+
+/* ========================================================================= *
+ * Interned Strings
+ * ========================================================================= */
+
+/** Lock for interned string tables, used from all logging threads */
+static pthread_mutex_t dsme_log_intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Source path / function name copies, keyed by original pointer */
+static GHashTable *dsme_log_intern_strings = 0;
+
+/** Parsed formats, keyed by original pointer */
+static GHashTable *dsme_log_intern_formats = 0;
+
+/** Replaced string copies that might still be referred from ring buffer */
+static GSList     *dsme_log_intern_retired_strings = 0;
+
+/** Replaced formats that might still be referred from ring buffer */
+static GSList     *dsme_log_intern_retired_formats = 0;
+
+/** Interned data cached for call sites */
+static GSList     *dsme_log_intern_sites = 0;
+
+/** Generation of interned data, changes when interned data is released
+ *
+ * Cached call site data is valid only if it is from the current
+ * generation. Never zero, so that statically zeroed call sites
+ * get evaluated on first use.
+ */
+static volatile unsigned dsme_log_intern_generation = 1;
+
+/** Get copy of a string that stays valid until logging is closed
+ *
+ * Constant strings from plugins become invalid when the plugin is
+ * unloaded, but binary log records can refer to interned copies
+ * until they have been formatted.
+ *
+ * Caller must hold dsme_log_intern_lock.
+ *
+ * @param str  string to intern
+ *
+ * @return interned copy of the string
+ */
+static const char *
+dsme_log_intern_string(const char *str)
+{
+    if( !dsme_log_intern_strings )
+        dsme_log_intern_strings = g_hash_table_new_full(g_direct_hash,
+                                                        g_direct_equal,
+                                                        0, g_free);
+
+    char *copy = g_hash_table_lookup(dsme_log_intern_strings, str);
+
+    /* The address might have been reused after plugin unload */
+    if( copy && strcmp(copy, str) ) {
+        g_hash_table_steal(dsme_log_intern_strings, str);
+        dsme_log_intern_retired_strings =
+            g_slist_prepend(dsme_log_intern_retired_strings, copy);
+        copy = 0;
+    }
+
+    if( !copy ) {
+        copy = g_strdup(str);
+        g_hash_table_replace(dsme_log_intern_strings, (gpointer)str, copy);
+    }
+
+    return copy;
+}
+
+/** Get parsed format that stays valid until logging is closed
+ *
+ * Caller must hold dsme_log_intern_lock.
+ *
+ * @param fmt  printf style format string
+ *
+ * @return interned parsed format
+ */
+static const log_format_t *
+dsme_log_intern_format(const char *fmt)
+{
+    if( !dsme_log_intern_formats )
+        dsme_log_intern_formats = g_hash_table_new_full(g_direct_hash,
+                                                        g_direct_equal,
+                                                        0,
+                                                        log_format_delete_cb);
+
+    log_format_t *format = g_hash_table_lookup(dsme_log_intern_formats, fmt);
+
+    /* The address might have been reused after plugin unload */
+    if( format && strcmp(format->text, fmt) ) {
+        g_hash_table_steal(dsme_log_intern_formats, fmt);
+        dsme_log_intern_retired_formats =
+            g_slist_prepend(dsme_log_intern_retired_formats, format);
+        format = 0;
+    }
+
+    if( !format ) {
+        format = log_format_create(fmt);
+        g_hash_table_replace(dsme_log_intern_formats, (gpointer)fmt, format);
+    }
+
+    return format;
+}
+
+/** Get interned format, source path and function name for a message
+ *
+ * To avoid taking dsme_log_intern_lock on every call, the result is
+ * cached in the call site data.
+ *
+ * @param data  call site data, or NULL if not available
+ * @param fmt   printf style format string
+ * @param file  source code file path, replaced with interned copy
+ * @param func  calling function, replaced with interned copy
+ *
+ * @return interned format, or NULL if it is not deferrable
+ */
+static const log_format_t *
+dsme_log_intern_lookup(log_site_data_t *data, const char *fmt,
+                       const char **file, const char **func)
+{
+    log_site_intern_t        temp  = { 0, 0, 0 };
+    const log_site_intern_t *cache = 0;
+
+    if( data && (__atomic_load_n(&data->intern_gen, __ATOMIC_ACQUIRE) ==
+                 __atomic_load_n(&dsme_log_intern_generation,
+                                 __ATOMIC_RELAXED)) )
+        cache = data->intern;
+
+    if( !cache ) {
+        pthread_mutex_lock(&dsme_log_intern_lock);
+
+        temp.format = dsme_log_intern_format(fmt);
+        if( temp.format->defer ) {
+            temp.file = dsme_log_intern_string(*file ?: "unknown");
+            temp.func = dsme_log_intern_string(*func ?: "unknown");
+        }
+        else {
+            temp.format = 0;
+        }
+
+        if( data && data->intern_gen != dsme_log_intern_generation ) {
+            log_site_intern_t *entry = g_malloc(sizeof *entry);
+            *entry = temp;
+            dsme_log_intern_sites =
+                g_slist_prepend(dsme_log_intern_sites, entry);
+
+            /* Publish data before generation, see above */
+            data->intern = entry;
+            __atomic_store_n(&data->intern_gen, dsme_log_intern_generation,
+                             __ATOMIC_RELEASE);
+        }
+
+        pthread_mutex_unlock(&dsme_log_intern_lock);
+
+        cache = &temp;
+    }
+
+    if( cache->format ) {
+        *file = cache->file;
+        *func = cache->func;
+    }
+
+    return cache->format;
+}
+
+/** Release all interned data
+ *
+ * Must not be called while binary records might still exist.
+ */
+static void
+dsme_log_intern_quit(void)
+{
+    pthread_mutex_lock(&dsme_log_intern_lock);
+
+    if( dsme_log_intern_strings )
+        g_hash_table_unref(dsme_log_intern_strings),
+            dsme_log_intern_strings = 0;
+
+    if( dsme_log_intern_formats )
+        g_hash_table_unref(dsme_log_intern_formats),
+            dsme_log_intern_formats = 0;
+
+    g_slist_free_full(dsme_log_intern_retired_strings, g_free),
+        dsme_log_intern_retired_strings = 0;
+
+    g_slist_free_full(dsme_log_intern_retired_formats, log_format_delete_cb),
+        dsme_log_intern_retired_formats = 0;
+
+    /* Invalidate data cached in call sites before releasing it */
+    dsme_log_intern_generation = (dsme_log_intern_generation + 1) ?: 1;
+
+    g_slist_free_full(dsme_log_intern_sites, g_free),
+        dsme_log_intern_sites = 0;
+
+    pthread_mutex_unlock(&dsme_log_intern_lock);
+}
+
+/* ========================================================================= *
+ * log_state_t
+ * ========================================================================= */
+
+static const char *
+log_state_repr(log_state_t state)
+{
+    const char *repr = "LOG_STATE_INVALID";
+
+    switch( state ) {
+    case LOG_STATE_UNKNOWN:  repr = "LOG_STATE_UNKNOWN";  break;
+    case LOG_STATE_INCLUDED: repr = "LOG_STATE_INCLUDED"; break;
+    case LOG_STATE_EXCLUDED: repr = "LOG_STATE_EXCLUDED"; break;
+    case LOG_STATE_DEFAULT:  repr = "LOG_STATE_DEFAULT";  break;
+    default: break;
+    }
+
+    return repr;
+}
+
+/* ========================================================================= *
+ * Logging Priorities
+ * ========================================================================= */
+
+/** Normalize priority to LOG_EMERG ... LOG_DEBUG range
+ */
+static int log_prio_cap(int prio)
+{
+    if( prio < LOG_EMERG )
+        return LOG_EMERG;
+
+    if( prio > LOG_DEBUG )
+        return LOG_DEBUG;
+
+    return prio;
+}
+
+/** Map logging priority to human readable string
+ */
+static const char* log_prio_str(int prio)
+{
+    switch( prio ) {
+    case LOG_DEBUG:     return "debug";
+    case LOG_INFO:      return "info";
+    case LOG_NOTICE:    return "notice";
+    case LOG_WARNING:   return "warning";
+    case LOG_ERR:       return "error";
+    case LOG_CRIT:      return "critical";
+    case LOG_ALERT:     return "alert";
+    case LOG_EMERG:     return "emergency";
+    default:            return "log";
+    }
+}
+
+/* ========================================================================= *
+ * log_rule_t
+ * ========================================================================= */
+
+static log_rule_t *
+log_rule_create(const char *pattern, log_state_t state)
+{
+    log_rule_t *self = g_malloc0(sizeof *self);
+
+    self->pattern = g_strdup(pattern);
+    self->state   = state;
+
+    return self;
+}
+
+static void
+log_rule_delete(log_rule_t *self)
+{
+    if( self != 0 ) {
+        g_free(self->pattern);
+        g_free(self);
+    }
+}
+
+static void
+log_rule_delete_cb(gpointer self)
+{
+    return log_rule_delete(self);
+}
+
+/* ========================================================================= *
+ * Logging Backends
+ * ========================================================================= */
+
+/*
+ * Empty routine for suppressing all log messages
+ */
+static void log_to_null(const log_entry_t *entry)
+{
+    (void)entry;
+}
+
+/*
+ * This routine is used when stderr logging method is set
+ */
 static void log_to_stderr(const log_entry_t *entry)
 {
     fprintf(stderr, "%s %s: %s: %s(): %s\n",
@@ -353,7 +1297,50 @@ static void log_to_stderr(const log_entry_t *entry)
  */
 static void log_to_syslog(const log_entry_t *entry)
 {
-    syslog(entry->prio, "%s", entry->text);
+    static const char month[12][4] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+    };
+
+    /* Make room for the message */
+    if( log_syslog.count == DSME_LOG_SYSLOG_BATCH ||
+        log_syslog.text_used + DSME_LOG_SYSLOG_HEADER +
+        DSME_LOG_FORMAT_BUFFER > sizeof log_syslog.text )
+        log_syslog_flush();
+
+    /* Time stamp changes at most once per second */
+    time_t now = time(0);
+    if( log_syslog.stamp_time != now ) {
+        struct tm tm;
+        log_syslog.stamp_time = now;
+        localtime_r(&now, &tm);
+        snprintf(log_syslog.stamp, sizeof log_syslog.stamp,
+                 "%s %2d %02d:%02d:%02d", month[tm.tm_mon % 12],
+                 tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    }
+
+    /* "<PRI>Mmm dd hh:mm:ss ident: text" */
+    char  *text = log_syslog.text + log_syslog.text_used;
+    size_t room = DSME_LOG_SYSLOG_HEADER + DSME_LOG_FORMAT_BUFFER;
+    int    len  = snprintf(text, room, "<%d>%s %s: %s",
+                           log_syslog.facility | entry->prio,
+                           log_syslog.stamp, log_syslog.ident, entry->text);
+    if( len < 0 )
+        return;
+    if( (size_t)len >= room )
+        len = room - 1;
+
+    struct iovec   *iov = &log_syslog.iov[log_syslog.count];
+    struct mmsghdr *msg = &log_syslog.msg[log_syslog.count];
+
+    iov->iov_base = text;
+    iov->iov_len  = len;
+    memset(msg, 0, sizeof *msg);
+    msg->msg_hdr.msg_iov    = iov;
+    msg->msg_hdr.msg_iovlen = 1;
+
+    log_syslog.text_used += len;
+    log_syslog.count     += 1;
 }
 
 /*
@@ -361,44 +1348,689 @@ static void log_to_syslog(const log_entry_t *entry)
  */
 static void log_to_file(const log_entry_t *entry)
 {
-    fprintf(logopt.filep, "%s %s: %s\n",
-            logopt.prefix,
-            log_prio_str(entry->prio),
-            entry->text);
-    fflush(logopt.filep);
+    size_t hlen = log_file.header_len[entry->prio];
+    size_t tlen = strlen(entry->text);
+
+    if( tlen >= sizeof log_file.text )
+        tlen = sizeof log_file.text - 1;
+
+    /* Make room for the line */
+    if( log_file.iov_used + 2 > (int)G_N_ELEMENTS(log_file.iov) ||
+        log_file.text_used + tlen + 1 > sizeof log_file.text )
+        log_file_flush();
+
+    /* Rotate before the file would grow over the limit */
+    if( logopt.rotate_size > 0 && log_file.size > 0 &&
+        log_file.size + log_file.pending + hlen + tlen + 1 > logopt.rotate_size ) {
+        log_file_flush();
+        log_file_rotate();
+    }
+
+    char *text = log_file.text + log_file.text_used;
+    memcpy(text, entry->text, tlen);
+    text[tlen++] = '\n';
+    log_file.text_used += tlen;
+
+    struct iovec *iov = log_file.iov + log_file.iov_used;
+    iov[0].iov_base = log_file.header[entry->prio];
+    iov[0].iov_len  = hlen;
+    iov[1].iov_base = text;
+    iov[1].iov_len  = tlen;
+    log_file.iov_used += 2;
+
+    log_file.pending += hlen + tlen;
+    log_file.lines   += 1;
+
+    /* Important messages are not left waiting in the buffer */
+    if( entry->prio <= logopt.flush_level )
+        log_file_flush();
+}
+
+/*
+ * Empty routine for backends that do not buffer messages
+ */
+static void log_commit_null(void)
+{
 }
 
 /* ========================================================================= *
- * Logging Queue
+ * File Logging
  * ========================================================================= */
 
-/* This variable holds the address of the logging functions */
-static void (*dsme_log_routine)(const log_entry_t *entry) = log_to_stderr;
+/** Get monotonic time stamp for sync and rate limit bookkeeping [ms] */
+static int64_t
+log_monotonic_ms(void)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000) + ts.tv_nsec / 1000000;
+}
+
+/** Open log file at the current path
+ *
+ * @return true on success, or false on failure
+ */
+static bool
+log_file_reopen(void)
+{
+    struct stat st;
 
-/** Ring buffer for queueing logging messages */
-static log_entry_t ring_buffer[DSME_LOG_ENTRY_COUNT];
+    if( log_file.fd != -1 )
+        close(log_file.fd), log_file.fd = -1;
 
-/** Eventfd for waking up the logger thread */
-static volatile int ring_buffer_event_fd = -1;
+    log_file.fd = open(log_file.path,
+                       O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if( log_file.fd == -1 ) {
+        ++log_file.errors;
+        return false;
+    }
 
-/** Worker thread id */
-static pthread_t worker_tid = 0;
+    log_file.size = (fstat(log_file.fd, &st) == 0) ? st.st_size : 0;
+    return true;
+}
 
-/** Ring buffer write position
+/** Start logging to a file
  *
- * This is modified from main thread only.
+ * @param path  log file path
  *
- * Access only via read_count_get() / read_count_inc() functions.
+ * @return true on success, or false on failure
  */
-static volatile guint write_count_pvt = 0;
+static bool
+log_file_open(const char *path)
+{
+    log_file_close();
+
+    for( int prio = LOG_EMERG; prio <= LOG_DEBUG; ++prio ) {
+        int len = snprintf(log_file.header[prio], DSME_LOG_FILE_HEADER,
+                           "%s %s: ", logopt.prefix, log_prio_str(prio));
+        if( len < 0 )
+            len = 0;
+        else if( len >= DSME_LOG_FILE_HEADER )
+            len = DSME_LOG_FILE_HEADER - 1;
+        log_file.header_len[prio] = len;
+    }
 
-/** Ring buffer read position
+    log_file.path      = g_strdup(path);
+    log_file.sync_time = log_monotonic_ms();
+    log_file.unsynced  = false;
+
+    return log_file_reopen();
+}
+
+/** Write out pending lines, sync and close the log file
+ */
+static void
+log_file_close(void)
+{
+    log_file_flush();
+
+    if( log_file.fd != -1 ) {
+        if( log_file.unsynced )
+            fdatasync(log_file.fd);
+        close(log_file.fd), log_file.fd = -1;
+    }
+
+    g_free(log_file.path), log_file.path = 0;
+}
+
+/** Rename current log file aside and start a new one
  *
- * This is modified from logger thread only.
+ * The current file is renamed to "<path>.1", earlier "<path>.1"
+ * to "<path>.2" and so on. Up to logopt.rotate_count old files are
+ * kept, with zero count the log file is just truncated.
+ */
+static void
+log_file_rotate(void)
+{
+    if( !log_file.path )
+        goto EXIT;
+
+    ++log_file.rotations;
+
+    if( logopt.rotate_count == 0 ) {
+        if( ftruncate(log_file.fd, 0) == 0 )
+            log_file.size = 0;
+        else
+            ++log_file.errors;
+        goto EXIT;
+    }
+
+    if( log_file.fd != -1 ) {
+        if( log_file.unsynced )
+            fdatasync(log_file.fd), log_file.unsynced = false;
+        close(log_file.fd), log_file.fd = -1;
+    }
+
+    for( unsigned i = logopt.rotate_count; i > 0; --i ) {
+        gchar *src = ((i > 1) ? g_strdup_printf("%s.%u", log_file.path, i - 1)
+                      : g_strdup(log_file.path));
+        gchar *dst = g_strdup_printf("%s.%u", log_file.path, i);
+
+        if( rename(src, dst) == -1 && errno != ENOENT )
+            ++log_file.errors;
+
+        g_free(dst);
+        g_free(src);
+    }
+
+    log_file_reopen();
+
+EXIT:
+    return;
+}
+
+/** Write out all pending lines with one writev() call
+ *
+ * If the log file can't be written to, the lines are dropped.
+ */
+static void
+log_file_flush(void)
+{
+    struct iovec *iov = log_file.iov;
+    int           cnt = log_file.iov_used;
+
+    if( log_file.fd == -1 )
+        cnt = 0;
+
+    while( cnt > 0 ) {
+        ssize_t rc = writev(log_file.fd, iov, cnt);
+
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            ++log_file.errors;
+            break;
+        }
+
+        ++log_file.writes;
+        log_file.size    += rc;
+        log_file.unsynced = true;
+
+        /* Skip what got written and retry the rest */
+        while( cnt > 0 && (size_t)rc >= iov->iov_len )
+            rc -= iov->iov_len, ++iov, --cnt;
+
+        if( cnt > 0 ) {
+            iov->iov_base  = (char *)iov->iov_base + rc;
+            iov->iov_len  -= rc;
+        }
+    }
+
+    log_file.iov_used  = 0;
+    log_file.text_used = 0;
+    log_file.pending   = 0;
+}
+
+/** Write out pending lines after processing a batch of messages
+ *
+ * Also syncs the log file if there are unsynced writes older
+ * than logopt.sync_interval.
+ */
+static void
+log_file_commit(void)
+{
+    if( log_file.iov_used > 0 )
+        log_file_flush();
+
+    if( log_file.unsynced && logopt.sync_interval > 0 ) {
+        int64_t now = log_monotonic_ms();
+
+        if( now - log_file.sync_time >= logopt.sync_interval ) {
+            if( fdatasync(log_file.fd) == -1 )
+                ++log_file.errors;
+            ++log_file.syncs;
+            log_file.unsynced  = false;
+            log_file.sync_time = now;
+        }
+    }
+}
+
+/** Get time until the next log file sync is due
+ *
+ * @return poll() timeout [ms], or -1 if no sync is needed
+ */
+static int
+log_file_sync_timeout(void)
+{
+    if( !log_file.unsynced || logopt.sync_interval == 0 )
+        return -1;
+
+    int64_t left = log_file.sync_time + logopt.sync_interval - log_monotonic_ms();
+
+    return (left > 0) ? (int)left : 0;
+}
+
+/* ========================================================================= *
+ * Syslog Logging
+ * ========================================================================= */
+
+/** (Re)connect to syslog socket
+ *
+ * @return true on success, or false on failure
+ */
+static bool
+log_syslog_connect(void)
+{
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+
+    if( log_syslog.fd != -1 )
+        close(log_syslog.fd), log_syslog.fd = -1;
+
+    if( !log_syslog.path )
+        goto EXIT;
+
+    snprintf(sa.sun_path, sizeof sa.sun_path, "%s", log_syslog.path);
+
+    log_syslog.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if( log_syslog.fd == -1 )
+        goto EXIT;
+
+    if( connect(log_syslog.fd, (struct sockaddr *)&sa, sizeof sa) == -1 )
+        close(log_syslog.fd), log_syslog.fd = -1;
+
+EXIT:
+    return log_syslog.fd != -1;
+}
+
+/** Start logging to syslog socket
+ *
+ * Connecting is retried on each batch of messages, so
+ * syslog does not need to be available yet.
+ *
+ * @param ident     text to prefix messages with
+ * @param option    LOG_PID or zero, other openlog() options are ignored
+ * @param facility  syslog facility, zero for LOG_USER
+ */
+static void
+log_syslog_open(const char *ident, int option, int facility)
+{
+    log_syslog_close();
+
+    if( option & LOG_PID )
+        snprintf(log_syslog.ident, sizeof log_syslog.ident, "%s[%d]",
+                 ident, (int)getpid());
+    else
+        snprintf(log_syslog.ident, sizeof log_syslog.ident, "%s", ident);
+
+    log_syslog.facility   = (facility & LOG_FACMASK) ?: LOG_USER;
+    log_syslog.stamp_time = 0;
+    log_syslog.path       = g_strdup(log_syslog_path ?: _PATH_LOG);
+
+    log_syslog_connect();
+}
+
+/** Send pending messages and close syslog socket
+ */
+static void
+log_syslog_close(void)
+{
+    log_syslog_flush();
+
+    if( log_syslog.fd != -1 )
+        close(log_syslog.fd), log_syslog.fd = -1;
+
+    g_free(log_syslog.path), log_syslog.path = 0;
+}
+
+/** Send all pending messages with sendmmsg()
+ *
+ * If syslog has gone away - e.g. journald was restarted - the
+ * socket is reconnected once. Messages that can't be sent are
+ * dropped and counted.
+ */
+static void
+log_syslog_flush(void)
+{
+    struct mmsghdr *msg   = log_syslog.msg;
+    int             todo  = log_syslog.count;
+    bool            retry = true;
+
+    if( todo > 0 )
+        ++log_syslog.batches;
+
+    if( log_syslog.fd == -1 && todo > 0 ) {
+        ++log_syslog.reconnects;
+        retry = false, log_syslog_connect();
+    }
+
+    while( todo > 0 && log_syslog.fd != -1 ) {
+        int rc = sendmmsg(log_syslog.fd, msg, todo, MSG_NOSIGNAL);
+
+        if( rc > 0 ) {
+            log_syslog.sent += rc;
+            msg += rc, todo -= rc;
+            continue;
+        }
+
+        if( rc == -1 && errno == EINTR )
+            continue;
+
+        if( rc == -1 && errno == EMSGSIZE ) {
+            /* Skip the message that can't be sent at all */
+            ++log_syslog.dropped;
+            ++msg, --todo;
+            continue;
+        }
+
+        if( !retry )
+            break;
+
+        ++log_syslog.reconnects;
+        retry = false;
+
+        if( !log_syslog_connect() )
+            break;
+    }
+
+    log_syslog.dropped   += todo;
+    log_syslog.count      = 0;
+    log_syslog.text_used  = 0;
+}
+
+/** Send pending messages after processing a batch of messages
+ */
+static void
+log_syslog_commit(void)
+{
+    if( log_syslog.count > 0 )
+        log_syslog_flush();
+}
+
+/* ========================================================================= *
+ * Flight Recorder
+ * ========================================================================= */
+
+/** Copy data to flight recorder data area
+ *
+ * The head offset is not updated, see log_to_flightrec().
+ *
+ * Caller must hold log_flightrec_lock.
+ *
+ * @param pos   free running offset to write at
+ * @param data  data to write
+ * @param size  number of bytes to write
+ *
+ * @return offset after written data
+ */
+static uint32_t
+log_flightrec_write(uint32_t pos, const char *data, size_t size)
+{
+    char     *base = (char *)(log_flightrec + 1);
+    uint32_t  mask = log_flightrec->size - 1;
+
+    while( size > 0 ) {
+        size_t offs = pos & mask;
+        size_t todo = log_flightrec->size - offs;
+
+        if( todo > size )
+            todo = size;
+
+        memcpy(base + offs, data, todo);
+        data += todo, size -= todo, pos += todo;
+    }
+
+    return pos;
+}
+
+/** Append a formatted line to flight recorder
+ */
+static void
+log_flightrec_printf(const char *fmt, ...)
+{
+    char    text[DSME_LOG_TEXT_BUFFER];
+    va_list va;
+
+    va_start(va, fmt);
+    int len = vsnprintf(text, sizeof text, fmt, va);
+    va_end(va);
+
+    if( len < 0 )
+        return;
+
+    if( (size_t)len >= sizeof text )
+        len = sizeof text - 1;
+
+    pthread_mutex_lock(&log_flightrec_lock);
+
+    if( log_flightrec ) {
+        uint32_t pos = log_flightrec->head;
+        pos = log_flightrec_write(pos, text, len);
+        pos = log_flightrec_write(pos, "\n", 1);
+        __atomic_store_n(&log_flightrec->head, pos, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&log_flightrec_lock);
+}
+
+/** Append log message to flight recorder
+ *
+ * Plain memory copy - the kernel takes care of the data ending up
+ * in the file even if dsme-server crashes right after.
+ *
+ * Can be used from any thread.
+ */
+static void
+log_to_flightrec(const log_entry_t *entry)
+{
+    struct timespec ts = { 0, 0 };
+    char            hdr[64];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    int hlen = snprintf(hdr, sizeof hdr, "[%5ld.%03ld] %s: ",
+                        (long)ts.tv_sec, (long)(ts.tv_nsec / 1000000),
+                        log_prio_str(entry->prio));
+    if( hlen < 0 )
+        hlen = 0;
+    else if( (size_t)hlen >= sizeof hdr )
+        hlen = sizeof hdr - 1;
+
+    size_t tlen = strlen(entry->text);
+
+    pthread_mutex_lock(&log_flightrec_lock);
+
+    if( log_flightrec ) {
+        if( tlen >= log_flightrec->size / 2 )
+            tlen = log_flightrec->size / 2;
+
+        uint32_t pos = log_flightrec->head;
+        pos = log_flightrec_write(pos, hdr, hlen);
+        pos = log_flightrec_write(pos, entry->text, tlen);
+        pos = log_flightrec_write(pos, "\n", 1);
+
+        /* Make the line visible only after it is complete */
+        __atomic_store_n(&log_flightrec->head, pos, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&log_flightrec_lock);
+}
+
+/** Append queued log message to flight recorder
+ *
+ * Called by the producer when the record is committed to the ring
+ * buffer, so that the message is recorded even if dsme-server dies
+ * before the logger thread gets to process it.
+ *
+ * @param record  complete ring buffer record
+ */
+static void
+log_record_to_flightrec(const log_record_t *record)
+{
+    char        text[DSME_LOG_FORMAT_BUFFER];
+    log_entry_t entry;
+
+    log_record_to_entry(record, &entry, text, sizeof text);
+    log_to_flightrec(&entry);
+}
+
+/** Map flight recorder file
+ *
+ * Content left by earlier dsme-server instances is retained if the
+ * file is compatible, so that dsme-wdd can save it later on.
+ *
+ * @return true on success, or false on failure
+ */
+static bool
+log_flightrec_open(void)
+{
+    bool   res  = false;
+    int    fd   = -1;
+    void  *map  = MAP_FAILED;
+    size_t size = sizeof *log_flightrec + log_flightrec_size;
+
+    if( log_flightrec || !log_flightrec_size )
+        goto EXIT;
+
+    fd = open(DSME_FLIGHTREC_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if( fd == -1 )
+        goto EXIT;
+
+    struct stat st;
+    if( fstat(fd, &st) == -1 )
+        goto EXIT;
+
+    if( (size_t)st.st_size != size && ftruncate(fd, size) == -1 )
+        goto EXIT;
+
+    map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if( map == MAP_FAILED )
+        goto EXIT;
+
+    dsme_flightrec_t *rec = map;
+
+    if( rec->magic   != DSME_FLIGHTREC_MAGIC   ||
+        rec->version != DSME_FLIGHTREC_VERSION ||
+        rec->size    != log_flightrec_size ) {
+        memset(rec, 0, sizeof *rec);
+        rec->magic   = DSME_FLIGHTREC_MAGIC;
+        rec->version = DSME_FLIGHTREC_VERSION;
+        rec->size    = log_flightrec_size;
+    }
+
+    pthread_mutex_lock(&log_flightrec_lock);
+    __atomic_store_n(&log_flightrec, rec, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&log_flightrec_lock);
+    map = MAP_FAILED;
+
+    log_flightrec_printf("--- %s started, pid %d ---",
+                         logopt.prefix, (int)getpid());
+
+    res = true;
+
+EXIT:
+    if( map != MAP_FAILED )
+        munmap(map, size);
+
+    if( fd != -1 )
+        close(fd);
+
+    return res;
+}
+
+/** Unmap flight recorder file
+ *
+ * The file itself is left in place.
+ */
+static void
+log_flightrec_close(void)
+{
+    if( log_flightrec ) {
+        log_flightrec_printf("--- %s stopped ---", logopt.prefix);
+
+        pthread_mutex_lock(&log_flightrec_lock);
+        dsme_flightrec_t *rec = log_flightrec;
+        __atomic_store_n(&log_flightrec, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&log_flightrec_lock);
+
+        munmap(rec, sizeof *rec + rec->size);
+    }
+}
+
+/* ========================================================================= *
+ * Logging Queue
+ * ========================================================================= */
+
+/* This variable holds the address of the logging functions */
+static void (*dsme_log_routine)(const log_entry_t *entry) = log_to_stderr;
+
+/* Called after a batch of messages has been passed to dsme_log_routine */
+static void (*dsme_log_commit_routine)(void) = log_commit_null;
+
+/** Ring buffer for queueing logging messages
+ *
+ * Holds variable length log_record_t entries. Any thread can add
+ * records, they are removed only by the logger thread - or the
+ * thread holding ring_buffer_drain_lock if the logger thread is
+ * not available.
+ *
+ * Unused space must be kept zero filled so that partially written
+ * records can be distinguished from completed ones.
+ */
+static char *ring_buffer = 0;
+
+/** Size of the ring buffer, a power of two */
+static guint ring_buffer_size = 0;
+
+/** Ring buffer size to use from dsme_log_open() onwards */
+static guint ring_buffer_size_wanted = DSME_LOG_RING_SIZE_DEFAULT;
+
+/** Eventfd for waking up the logger thread */
+static volatile int ring_buffer_event_fd = -1;
+
+/** Lock for serializing ring buffer draining
+ *
+ * Normally only the logger thread drains the ring buffer and
+ * the lock is uncontested. But logging from other threads might
+ * need to take over if the logger thread is disabled.
+ */
+static pthread_mutex_t ring_buffer_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Worker thread id */
+static pthread_t worker_tid = 0;
+
+/** Ring buffer reserve position
+ *
+ * Advanced by producers when reserving space for records. Both
+ * reserve and read positions are free running byte counters that
+ * are mapped to ring buffer offsets via dsme_log_ring_at().
+ */
+static volatile gint ring_reserve_pos = 0;
+
+/** Ring buffer read position
+ *
+ * This is advanced only while holding ring_buffer_drain_lock.
+ */
+static volatile gint ring_read_pos = 0;
+
+/** Number of messages dropped due to ring buffer overflow, per priority */
+static volatile gint ring_dropped[LOG_DEBUG + 1];
+
+/** Number of dropped messages not yet reported in the log */
+static volatile gint ring_dropped_pending = 0;
+
+/** Number of records processed */
+static guint64 ring_records = 0;
+
+/** Number of binary records processed */
+static guint64 ring_binary_records = 0;
+
+/** Buffer for formatting binary records
  *
- * Access only via write_count_get() / write_count_inc() functions.
+ * Used only while holding ring_buffer_drain_lock.
  */
-static volatile guint read_count_pvt  = 0;
+static char ring_format_buffer[DSME_LOG_FORMAT_BUFFER];
+
+/** Flag for: format messages on logger thread when possible */
+static volatile gint deferred_enabled = 1;
+
+/** Highest ring buffer fill level seen by the consumer [bytes] */
+static guint ring_peak = 0;
+
+/** Number of times call site logging decisions have been re-evaluated */
+static gint site_evaluations = 0;
+
+/** Total number of messages suppressed by rate limiting */
+static guint64 dsme_log_limit_suppressed = 0;
 
 /** Flag for: logger thread enabled
  *
@@ -414,202 +2046,737 @@ static volatile int thread_enabled = 1;
  */
 static volatile int thread_running = 0;
 
-/** Atomic access to logging ring buffer read count
+/** Map free running ring buffer position to record pointer
+ *
+ * @param pos  ring buffer position
+ *
+ * @return pointer to record at given position
+ */
+static inline log_record_t *
+dsme_log_ring_at(guint pos)
+{
+    return (log_record_t *)(ring_buffer + (pos & (ring_buffer_size - 1)));
+}
+
+/** Allocate ring buffer
  *
- * If glib atomic helpers can be assumed provide
- * atomic access and use of hw-only memory barrier,
- * they are used.
+ * Must not be called while other threads might be using the ring buffer.
  *
- * Otherwise we prefer hitting issues arising from
- * non-atomic access etc over chances of hitting
- * priority inversions due the use of mutexes.
+ * @param size  ring buffer size, must be a power of two
  *
- * @return number of messages written to logging ring buffer.
+ * @return true on success, or false on failure
  */
-static inline guint read_count_get(void)
+static bool
+dsme_log_ring_alloc(size_t size)
 {
-# ifdef G_ATOMIC_LOCK_FREE
-    return g_atomic_int_get(&read_count_pvt);
-# else
-    return read_count_pvt;
-# endif
+    char *buffer = calloc(1, size);
+
+    if( !buffer ) {
+        fprintf(stderr, "logging ring buffer: %s\n", strerror(errno));
+        return false;
+    }
+
+    free(ring_buffer);
+    ring_buffer      = buffer;
+    ring_buffer_size = size;
+    ring_reserve_pos = 0;
+    ring_read_pos    = 0;
+
+    return true;
+}
+
+/** Reserve space for a record from the ring buffer
+ *
+ * Safe to use from any thread.
+ *
+ * @param size  record size, including header and alignment padding
+ *
+ * @return record pointer, or NULL if there is not enough space
+ */
+static log_record_t *
+dsme_log_ring_reserve(guint size)
+{
+    for( ;; ) {
+        guint head = (guint)g_atomic_int_get(&ring_reserve_pos);
+        guint tail = (guint)g_atomic_int_get(&ring_read_pos);
+        guint offs = head & (ring_buffer_size - 1);
+        guint skip = 0;
+
+        /* Records are not split at ring buffer end */
+        if( offs + size > ring_buffer_size )
+            skip = ring_buffer_size - offs;
+
+        if( (head - tail) + skip + size > ring_buffer_size )
+            return 0;
+
+        if( !g_atomic_int_compare_and_exchange(&ring_reserve_pos,
+                                               (gint)head,
+                                               (gint)(head + skip + size)) )
+            continue;
+
+        if( skip ) {
+            log_record_t *pad = dsme_log_ring_at(head);
+            g_atomic_int_set(&pad->commit, (gint)(skip | DSME_LOG_RECORD_PAD));
+        }
+
+        return dsme_log_ring_at(head + skip);
+    }
+}
+
+/** Mark record as complete
+ *
+ * The message is also appended to the flight recorder at this point.
+ * Records still in the ring buffer are lost if dsme-server dies.
+ *
+ * @param record  record from dsme_log_ring_reserve()
+ * @param size    size that was reserved for the record
+ */
+static void
+dsme_log_ring_commit(log_record_t *record, guint size)
+{
+    if( __atomic_load_n(&log_flightrec, __ATOMIC_RELAXED) )
+        log_record_to_flightrec(record);
+
+    g_atomic_int_set(&record->commit, (gint)size);
+}
+
+/** Pass completed records from ring buffer to logging backend
+ *
+ * Processing stops at the first record that is still being
+ * written - the producer will notify when it is done.
+ *
+ * Caller must hold ring_buffer_drain_lock.
+ *
+ * @return true on success, or false if ring buffer is out of sync
+ */
+static bool
+dsme_log_ring_drain(void)
+{
+    guint tail = (guint)g_atomic_int_get(&ring_read_pos);
+    guint used = (guint)g_atomic_int_get(&ring_reserve_pos) - tail;
+
+    if( ring_peak < used )
+        ring_peak = used;
+
+    while( tail != (guint)g_atomic_int_get(&ring_reserve_pos) ) {
+        log_record_t *record = dsme_log_ring_at(tail);
+        guint         commit = (guint)g_atomic_int_get(&record->commit);
+        guint         size   = commit & ~DSME_LOG_RECORD_PAD;
+
+        if( commit == 0 )
+            break;
+
+        /* While it should not be possible; if it looks like ring buffer
+         * bookkeeping is out of sync, make some noise and bail out.
+         */
+        if( size < sizeof *record || size > ring_buffer_size ||
+            size % DSME_LOG_RECORD_ALIGN ) {
+            static const char m[] = "*** DSME LOGGER OUT OF SYNC\n";
+            if( write(STDERR_FILENO, m, sizeof m - 1) == -1 ) {
+                // dontcare
+            }
+            return false;
+        }
+
+        if( !(commit & DSME_LOG_RECORD_PAD) ) {
+            log_entry_t entry;
+            log_record_to_entry(record, &entry, ring_format_buffer,
+                                sizeof ring_format_buffer);
+            dsme_log_routine(&entry);
+            ++ring_records;
+            if( record->type == LOG_RECORD_BINARY )
+                ++ring_binary_records;
+        }
+
+        /* Release the space back to producers */
+        memset(record, 0, size);
+        tail += size;
+        g_atomic_int_set(&ring_read_pos, (gint)tail);
+    }
+
+    dsme_log_commit_routine();
+
+    return true;
+}
+
+/** Notify logger thread about new record in ring buffer
+ *
+ * If the logger thread is not available, the ring buffer
+ * is drained from the calling thread.
+ */
+static void
+dsme_log_notify_worker(void)
+{
+    const uint64_t one = 1;
+    bool           ack = false;
+
+    if( thread_enabled ) {
+        if( ring_buffer_event_fd == -1 ) {
+            /* Logging functionality was used before dsme_log_init().
+             *
+             * Mostly harmless, but make some noise anyway.
+             */
+            static bool reported = false;
+            if( !reported ) {
+                reported = true;
+                fprintf(stderr, "*** DSME LOGGER USED BEFORE INIT\n");
+                fflush(stderr);
+            }
+        }
+        else if( write(ring_buffer_event_fd, &one, sizeof one) == -1 ) {
+            /* Disable logging thread - this and all future logging
+             * will be handled from the threads doing the logging.
+             *
+             * As this makes dsme server process suspectible to get
+             * frozen / blocked by problems syslogd/journald might
+             * be having - which in turn can lead to dsme wdd process
+             * to stop feeding the watchdog devices - which can lead
+             * to wd reboot -> make some noise about this.
+             */
+            thread_enabled = 0;
+            fprintf(stderr, "*** DSME LOGGER THREAD DISABLED\n");
+            fflush(stderr);
+        }
+        else {
+            ack = true;
+        }
+    }
+
+    if( !ack ) {
+        /* Handle from calling thread */
+        pthread_mutex_lock(&ring_buffer_drain_lock);
+        dsme_log_ring_drain();
+        pthread_mutex_unlock(&ring_buffer_drain_lock);
+    }
+}
+
+/** Add a logging message to logging ring buffer
+ *
+ * @param prio  syslog compatible LOG_EMERG ... LOG_DEBUG value
+ * @param file  source code file path
+ * @param func  calling function
+ * @param fmt   printf style format string
+ * @param va    arguments needed for the format string
+ *
+ * @return true if message was queued, or false if it was dropped
+ */
+static bool
+dsme_log_vqueue(int prio, const char *file, const char *func,
+                const char *fmt, va_list va)
+{
+    char    text[DSME_LOG_TEXT_BUFFER];
+    va_list va2;
+
+    prio = log_prio_cap(prio);
+
+    if( !file )
+        file = "unknown";
+    if( !func )
+        func = "unknown";
+
+    /* Format to stack buffer first to find out the size needed */
+    va_copy(va2, va);
+    int len = vsnprintf(text, sizeof text, fmt, va);
+    if( len < 0 )
+        len = 0, *text = 0;
+
+    /* No single record may take more than quarter of the ring */
+    size_t text_size = (size_t)len + 1;
+    size_t file_size = strlen(file) + 1;
+    size_t func_size = strlen(func) + 1;
+    size_t limit     = ring_buffer_size / 4 - sizeof(log_record_t);
+
+    if( file_size + func_size > limit / 2 )
+        file = func = "", file_size = func_size = 1;
+    if( text_size > limit - file_size - func_size )
+        text_size = limit - file_size - func_size;
+
+    guint size = sizeof(log_record_t) + text_size + file_size + func_size;
+    size = (size + DSME_LOG_RECORD_ALIGN - 1) & ~(DSME_LOG_RECORD_ALIGN - 1);
+
+    log_record_t *record = dsme_log_ring_reserve(size);
+
+    if( !record ) {
+        va_end(va2);
+        return false;
+    }
+
+    char *pos = record->data;
+
+    if( (size_t)len < sizeof text ) {
+        memcpy(pos, text, text_size);
+    }
+    else {
+        vsnprintf(pos, text_size, fmt, va2);
+        pos[text_size - 1] = 0;
+    }
+    pos += text_size;
+
+    memcpy(pos, file, file_size), pos += file_size;
+    memcpy(pos, func, func_size);
+
+    record->prio = prio;
+    record->type = LOG_RECORD_TEXT;
+    dsme_log_ring_commit(record, size);
+
+    va_end(va2);
+    return true;
+}
+
+/** Add a logging message to logging ring buffer for deferred formatting
+ *
+ * Instead of formatting the message, the arguments are captured
+ * to a binary record and formatting is left to the logger thread.
+ * String arguments are copied, honoring the precision if given.
+ *
+ * If a string argument is longer than DSME_LOG_STRING_MAX, or the
+ * formatted message might not fit in DSME_LOG_FORMAT_BUFFER, nothing
+ * is queued and the caller is expected to format the message as text
+ * using a copy of the argument list.
+ *
+ * @param prio    syslog compatible LOG_EMERG ... LOG_DEBUG value
+ * @param file    interned source code file path
+ * @param func    interned calling function
+ * @param format  interned deferrable format
+ * @param error   errno value to use for %m
+ * @param va      arguments needed for the format string
+ *
+ * @return 1 if message was queued, 0 if it was dropped, or
+ *         -1 if it can't be formatted on logger thread
+ */
+static int
+dsme_log_bqueue(int prio, const char *file, const char *func,
+                const log_format_t *format, int error, va_list va)
+{
+    log_arg_t   args[DSME_LOG_ARGS_MAX * 3];
+    const char *strs[DSME_LOG_ARGS_MAX];
+    size_t      lens[DSME_LOG_ARGS_MAX];
+    guint       sidx[DSME_LOG_ARGS_MAX];
+    guint       argc = 0;
+    guint       strc = 0;
+    size_t      data = 0;
+
+    /* Upper bound for formatted message length */
+    size_t      need = format->fixed;
+
+    /* Capture arguments */
+    for( guint i = 0; i < format->chunks; ++i ) {
+        const log_chunk_t *chunk = &format->chunk[i];
+        size_t             width = chunk->width;
+        int                prec  = chunk->prec;
+        size_t             conv  = DSME_LOG_NUMBER_MAX;
+
+        if( chunk->flags & LOG_CHUNK_WIDTH_ARG ) {
+            int val = args[argc++].i = va_arg(va, int);
+            width = (val < 0) ? -(long long)val : val;
+        }
+
+        if( chunk->flags & LOG_CHUNK_PREC_ARG )
+            prec = args[argc++].i = va_arg(va, int);
+
+        switch( chunk->type ) {
+        case LOG_ARG_INT:     args[argc++].i  = va_arg(va, int);       break;
+        case LOG_ARG_LONG:    args[argc++].l  = va_arg(va, long);      break;
+        case LOG_ARG_LLONG:   args[argc++].ll = va_arg(va, long long); break;
+        case LOG_ARG_INTMAX:  args[argc++].j  = va_arg(va, intmax_t);  break;
+        case LOG_ARG_SIZE:    args[argc++].z  = va_arg(va, size_t);    break;
+        case LOG_ARG_PTRDIFF: args[argc++].t  = va_arg(va, ptrdiff_t); break;
+        case LOG_ARG_POINTER: args[argc++].p  = va_arg(va, void *);    break;
+        case LOG_ARG_DOUBLE:
+            {
+                double val = args[argc++].d = va_arg(va, double);
+                /* %f of a large value, or nan */
+                if( !(val > -1e16 && val < 1e16) )
+                    conv = DSME_LOG_DOUBLE_MAX;
+                if( prec < 0 )
+                    prec = 6;
+            }
+            break;
+        case LOG_ARG_STRING:
+            {
+                const char *str = va_arg(va, const char *);
+                size_t      max = DSME_LOG_STRING_MAX;
+
+                if( !str )
+                    str = "(null)";
+
+                /* Do not read past what the precision allows */
+                if( prec >= 0 && prec < DSME_LOG_STRING_MAX )
+                    max = prec;
+
+                conv = strnlen(str, max), prec = 0;
+                if( conv == DSME_LOG_STRING_MAX )
+                    return -1;
+
+                strs[strc] = str;
+                lens[strc] = conv;
+                sidx[strc] = argc++;
+                data += lens[strc++] + 1;
+            }
+            break;
+        default:
+            conv = 0, prec = 0;
+            break;
+        }
+
+        if( prec > DSME_LOG_FORMAT_BUFFER )
+            prec = DSME_LOG_FORMAT_BUFFER;
+        if( prec > 0 )
+            conv += prec;
+        if( width > DSME_LOG_FORMAT_BUFFER )
+            width = DSME_LOG_FORMAT_BUFFER;
+
+        need += (conv > width) ? conv : width;
+    }
+
+    if( need >= DSME_LOG_FORMAT_BUFFER )
+        return -1;
+
+    guint size = (sizeof(log_record_t) + sizeof(log_binary_t) +
+                  argc * sizeof(log_arg_t) + data);
+    size = (size + DSME_LOG_RECORD_ALIGN - 1) & ~(DSME_LOG_RECORD_ALIGN - 1);
+
+    if( size > ring_buffer_size / 4 )
+        return 0;
+
+    log_record_t *record = dsme_log_ring_reserve(size);
+
+    if( !record )
+        return 0;
+
+    log_binary_t *bin = (log_binary_t *)record->data;
+
+    bin->format = format;
+    bin->file   = file;
+    bin->func   = func;
+    bin->error  = error;
+    bin->argc   = argc;
+    memcpy(bin->args, args, argc * sizeof *args);
+
+    /* Append string arguments after the argument array */
+    char *pos = (char *)(bin->args + argc);
+
+    for( guint i = 0; i < strc; ++i ) {
+        bin->args[sidx[i]].s = pos - (char *)record;
+        memcpy(pos, strs[i], lens[i]);
+        pos[lens[i]] = 0;
+        pos += lens[i] + 1;
+    }
+
+    record->prio = log_prio_cap(prio);
+    record->type = LOG_RECORD_BINARY;
+    dsme_log_ring_commit(record, size);
+
+    return 1;
+}
+
+/** Add a logging message to logging ring buffer
+ *
+ * @sa #dsme_log_vqueue()
+ */
+static bool
+dsme_log_fqueue(int prio, const char *file, const char *func,
+                const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    bool queued = dsme_log_vqueue(prio, file, func, fmt, va);
+    va_end(va);
+    return queued;
+}
+
+/** Queue a logging message to logging ringbuffer
+ *
+ * Can be used from any thread: space for the message is reserved
+ * from the ring buffer atomically and the logger thread picks up
+ * messages in the order the reservations were made.
+ *
+ * @param site   call site descriptor, or NULL if not available
+ * @param prio   syslog compatible LOG_EMERG ... LOG_DEBUG value
+ * @param file   source code file path
+ * @param func   calling function
+ * @param error  errno value to use for %m
+ * @param fmt    printf style format string
+ * @param va     arguments needed for the format string
+ */
+static void
+dsme_log_site_vqueue(dsme_log_site_t *site, int prio, const char *file,
+                     const char *func, int error, const char *fmt,
+                     va_list va)
+{
+    if( !ring_buffer ) {
+        /* Used before dsme_log_init() - output directly */
+        char        text[DSME_LOG_TEXT_BUFFER];
+        log_entry_t entry = {
+            .prio = log_prio_cap(prio),
+            .file = file ?: "unknown",
+            .func = func ?: "unknown",
+            .text = text,
+        };
+
+        errno = error;
+        vsnprintf(text, sizeof text, fmt, va);
+
+        dsme_log_routine(&entry);
+        dsme_log_commit_routine();
+        goto EXIT;
+    }
+
+    bool notify = false;
+    bool queued = false;
+
+    /* Add log entry about earlier ring buffer overflow */
+    gint skipped = g_atomic_int_get(&ring_dropped_pending);
+
+    if( skipped > 0 &&
+        g_atomic_int_compare_and_exchange(&ring_dropped_pending, skipped, 0) ) {
+        if( dsme_log_fqueue(LOG_ERR, __FILE__, __FUNCTION__,
+                            "logging ringbuffer overflow; %d messages lost",
+                            skipped) )
+            notify = true;
+        else
+            g_atomic_int_add(&ring_dropped_pending, skipped);
+    }
+
+    /* Use deferred formatting if possible */
+    const log_format_t *format = 0;
+
+    if( g_atomic_int_get(&deferred_enabled) )
+        format = dsme_log_intern_lookup(site ? dsme_log_site_data(site) : 0,
+                                        fmt, &file, &func);
+
+    /* Add log entry to the ring buffer */
+    int deferred = -1;
+
+    if( format ) {
+        /* Argument list is needed as is if formatting can't be deferred */
+        va_list va2;
+        va_copy(va2, va);
+        deferred = dsme_log_bqueue(prio, file, func, format, error, va2);
+        va_end(va2);
+    }
+
+    if( deferred < 0 ) {
+        /* For %m conversions */
+        errno = error;
+        queued = dsme_log_vqueue(prio, file, func, fmt, va);
+    }
+    else {
+        queued = deferred > 0;
+    }
+
+    if( !queued ) {
+        g_atomic_int_inc(&ring_dropped[log_prio_cap(prio)]);
+        g_atomic_int_inc(&ring_dropped_pending);
+    }
+
+    if( notify || queued )
+        dsme_log_notify_worker();
+
+EXIT:
+    return;
+}
+
+/** Queue a logging message to logging ringbuffer
+ *
+ * @param prio  syslog compatible LOG_EMERG ... LOG_DEBUG value
+ * @param file  source code file path
+ * @param func  calling function
+ * @param fmt   printf style format string
+ * @param ...   arguments needed for the format string
+ */
+void
+dsme_log_queue(int prio, const char *file, const char *func, const char* fmt, ...)
+{
+    int     error = errno;
+    va_list va;
+
+    va_start(va, fmt);
+    dsme_log_site_vqueue(0, prio, file, func, error, fmt, va);
+    va_end(va);
+}
+
+/** Queue a logging message from a call site to logging ringbuffer
+ *
+ * Normally this function is used from dsme_log() macro.
+ *
+ * Data needed for deferred formatting is cached in the call site
+ * data, see dsme_log_intern_lookup().
+ *
+ * @param site  call site descriptor
+ * @param prio  syslog compatible LOG_EMERG ... LOG_DEBUG value
+ * @param file  source code file path
+ * @param func  calling function
+ * @param fmt   printf style format string
+ * @param ...   arguments needed for the format string
+ */
+void
+dsme_log_site_queue_(dsme_log_site_t *site, int prio, const char *file,
+                     const char *func, const char *fmt, ...)
+{
+    int     error = errno;
+    va_list va;
+
+    va_start(va, fmt);
+    dsme_log_site_vqueue(site, prio, file, func, error, fmt, va);
+    va_end(va);
+}
+
+/** Set logging ring buffer size
+ *
+ * The size is rounded up to the next power of two and clamped
+ * to supported range. It takes effect at dsme_log_open().
+ *
+ * @param size  ring buffer size in bytes
+ *
+ * @return true if size was acceptable as is, false if adjusted
+ */
+bool
+dsme_log_set_ring_size(size_t size)
+{
+    size_t wanted = DSME_LOG_RING_SIZE_MIN;
+
+    while( wanted < size && wanted < DSME_LOG_RING_SIZE_MAX )
+        wanted <<= 1;
+
+    ring_buffer_size_wanted = wanted;
+
+    return wanted == size;
 }
 
-/** Atomic increase of logging ring buffer read count
+/** Enable / disable deferred formatting of log messages
+ *
+ * When enabled, messages are queued as binary records holding the
+ * format arguments and formatting is done on the logger thread.
  *
- * @sa #read_count_get()
+ * @param enabled  true to format on logger thread, false to format
+ *                 in the thread doing the logging
  */
-static inline void read_count_inc(void)
+void
+dsme_log_set_deferred(bool enabled)
 {
-# ifdef G_ATOMIC_LOCK_FREE
-    g_atomic_int_inc(&read_count_pvt);
-# else
-    ++read_count_pvt;
-# endif
+    g_atomic_int_set(&deferred_enabled, enabled ? 1 : 0);
 }
 
-/** Atomic access to logging ring buffer write count
+/** Set file logging flush policy
  *
- * @sa #read_count_get()
+ * Messages are written to the log file in batches once per logger
+ * thread wakeup, except messages at or above the given level that
+ * are written immediately.
  *
- * @return number of messages read from logging ring buffer.
+ * @param level     immediate write level, LOG_EMERG ... LOG_DEBUG
+ * @param interval  max time written data is left unsynced [ms], or
+ *                  zero to leave syncing to the kernel
  */
-static inline guint write_count_get(void)
+void
+dsme_log_set_file_flush(int level, unsigned interval)
 {
-# ifdef G_ATOMIC_LOCK_FREE
-    return g_atomic_int_get(&write_count_pvt);
-# else
-    return write_count_pvt;
-# endif
+    logopt.flush_level   = log_prio_cap(level);
+    logopt.sync_interval = interval;
 }
 
-/** Atomic increase of logging ring buffer write count
+/** Set file logging rotation policy
  *
- * @sa #read_count_get()
+ * @param size   rotate when log file would grow over size [bytes],
+ *               or zero to disable rotation
+ * @param count  number of rotated files to keep
  */
-static inline void write_count_inc(void)
+void
+dsme_log_set_file_rotation(size_t size, unsigned count)
 {
-# ifdef G_ATOMIC_LOCK_FREE
-    g_atomic_int_inc(&write_count_pvt);
-# else
-    ++write_count_pvt;
-# endif
+    logopt.rotate_size  = size;
+    logopt.rotate_count = count;
 }
 
-/** Number of messages currently stored in logging ring buffer
+/** Set syslog socket path
  *
- * @return number of messages available for reading in logging ring buffer.
+ * Takes effect at dsme_log_open().
+ *
+ * @param path  socket path, or NULL for the default /dev/log
  */
-static inline guint buffered_count(void)
+void
+dsme_log_set_syslog_socket(const char *path)
 {
-    return write_count_get() - read_count_get();
+    g_free(log_syslog_path), log_syslog_path = g_strdup(path);
 }
 
-/** Notify logger thread about new entry in ring buffer
+/** Set flight recorder size
  *
- * @param entry  logging entry pointer
+ * The size is rounded up to the next power of two and clamped
+ * to supported range. It takes effect at dsme_log_open().
  *
- * Expected usage:
+ * @param size  flight recorder data size in bytes, or zero to disable
  *
- * @li Entry is "allocated" at slot read_count_get()
- * @li Entry data is filled in via log_entry_format()
- * @li Buffered count is updated via Write_count_inc()
- * @li Then this function is called
- *
- * Assumptions built in:
- *
- * @li All logging occurs only from one (= the main) thread
- *
- * @note The entry pointer itself is not used except in situations where
- *       the worker thread is not available for one or another reason.
+ * @return true if size was acceptable as is, false if adjusted
  */
-static void
-dsme_log_notify_worker(log_entry_t *entry)
+bool
+dsme_log_set_flight_recorder(size_t size)
 {
-    const uint64_t one = 1;
-    bool           ack = false;
+    size_t wanted = 0;
 
-    if( thread_enabled ) {
-        if( ring_buffer_event_fd == -1 ) {
-            /* Logging functionality was used before dsme_log_init().
-             *
-             * Mostly harmless, but make some noise anyway.
-             */
-            static bool reported = false;
-            if( !reported ) {
-                reported = true;
-                fprintf(stderr, "*** DSME LOGGER USED BEFORE INIT\n");
-                fflush(stderr);
-            }
-        }
-        else if( write(ring_buffer_event_fd, &one, sizeof one) == -1 ) {
-            /* Disable logging thread - this and all future logging
-             * will be handled from main thread.
-             *
-             * As this makes dsme server process suspectible to get
-             * frozen / blocked by problems syslogd/journald might
-             * be having - which in turn can lead to dsme wdd process
-             * to stop feeding the watchdog devices - which can lead
-             * to wd reboot -> make some noise about this.
-             */
-            thread_enabled = 0;
-            fprintf(stderr, "*** DSME LOGGER THREAD DISABLED\n");
-            fflush(stderr);
-        }
-        else {
-            ack = true;
-        }
+    if( size > 0 ) {
+        wanted = DSME_FLIGHTREC_SIZE_MIN;
+        while( wanted < size && wanted < DSME_FLIGHTREC_SIZE_MAX )
+            wanted <<= 1;
     }
 
-    if( !ack ) {
-        /* Handle from main thread */
-        dsme_log_routine(entry);
-    }
+    log_flightrec_size = wanted;
+
+    return wanted == size;
 }
 
-/** Queue a logging message to logging ringbuffer
+/** Report logging ring buffer statistics
  *
- * Normally this function is used from dsme_log() macro.
- *
- * No locking is done under assumption that mainthread controls
- * the "tail" of ring buffer and worker thread "head" of the
- * ring buffer and additions & offset increments are done in
- * sane order and atomically enough.
- *
- * @param prio  syslog compatible LOG_EMERG ... LOG_DEBUG value
- * @param file  source code file path
- * @param func  calling function
- * @param fmt   printf style format string
- * @param ...   arguments needed for the format string
+ * @param report  function to call with a line of text
+ * @param aptr    context pointer to pass to the report function
  */
 void
-dsme_log_queue(int prio, const char *file, const char *func, const char* fmt, ...)
+dsme_log_report_stats(void (*report)(void *aptr, const char *row), void *aptr)
 {
-    static bool     overflow = false;
-    static unsigned skipped  = 0;
-
-    log_entry_t *entry;
-
-    /* Handle ring buffer overflows */
-    unsigned buffered = buffered_count();
-
-    if( buffered >= DSME_LOG_ENTRY_COUNT ) {
-        overflow = true;
-        ++skipped;
-        goto EXIT;
+    char row[256];
+    int  len;
+
+    guint used = ((guint)g_atomic_int_get(&ring_reserve_pos) -
+                  (guint)g_atomic_int_get(&ring_read_pos));
+
+    len = snprintf(row, sizeof row,
+                   "logging: ring=%u used=%u peak=%u records=%llu"
+                   " deferred=%llu evaluated=%u suppressed=%llu dropped:",
+                   ring_buffer_size, used, ring_peak,
+                   (unsigned long long)ring_records,
+                   (unsigned long long)ring_binary_records,
+                   (guint)g_atomic_int_get(&site_evaluations),
+                   (unsigned long long)dsme_log_limit_suppressed);
+
+    for( int prio = LOG_EMERG; prio <= LOG_DEBUG; ++prio ) {
+        if( len < 0 || (size_t)len >= sizeof row )
+            break;
+        len += snprintf(row + len, sizeof row - len, " %s=%d",
+                        log_prio_str(prio),
+                        g_atomic_int_get(&ring_dropped[prio]));
     }
 
-    if( overflow ) {
-        /* must go down enough before overflow is cleared */
-        if( buffered >= DSME_LOG_ENTRY_COUNT * 7 / 8 ) {
-            ++skipped;
-            goto EXIT;
-        }
-
-        /* Add log entry about the overflow itself */
-        entry = &ring_buffer[write_count_get() % DSME_LOG_ENTRY_COUNT];
-        log_entry_format(entry, LOG_ERR, __FILE__, __FUNCTION__,
-                         "logging ringbuffer overflow; %u messages lost", skipped);
-        write_count_inc();
-        dsme_log_notify_worker(entry);
-
-        overflow = false;
-        skipped = 0;
+    report(aptr, row);
+
+    if( logopt.method == LOG_METHOD_FILE ) {
+        snprintf(row, sizeof row,
+                 "logging: file size=%lld lines=%llu writes=%llu"
+                 " syncs=%u rotations=%u errors=%u",
+                 (long long)log_file.size,
+                 (unsigned long long)log_file.lines,
+                 (unsigned long long)log_file.writes,
+                 log_file.syncs, log_file.rotations, log_file.errors);
+        report(aptr, row);
+    }
+    else if( logopt.method == LOG_METHOD_SYSLOG ) {
+        snprintf(row, sizeof row,
+                 "logging: syslog sent=%llu batches=%llu dropped=%u"
+                 " reconnects=%u",
+                 (unsigned long long)log_syslog.sent,
+                 (unsigned long long)log_syslog.batches,
+                 log_syslog.dropped, log_syslog.reconnects);
+        report(aptr, row);
     }
-
-    /* Add log entry to the ring buffer */
-    entry = &ring_buffer[write_count_get() % DSME_LOG_ENTRY_COUNT];
-
-    va_list va;
-    va_start(va, fmt);
-    log_entry_vformat(entry, prio, file, func, fmt, va);
-    va_end(va);
-
-    write_count_inc();
-    dsme_log_notify_worker(entry);
-
-EXIT:
-    return;
 }
 
 /** Thread function for dequeueing messages from logging ringbuffer
@@ -629,17 +2796,37 @@ dsme_log_thread(void* param)
     pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, 0);
 
     for( ;; ) {
-        uint64_t cnt = 0;
-
-        /* Arrange a cancelation point at eventfd read() */
+        uint64_t      cnt = 0;
+        ssize_t       rc  = 0;
+        struct pollfd pfd = {
+            .fd     = ring_buffer_event_fd,
+            .events = POLLIN,
+        };
+
+        /* Wake up for pending log file sync, if any */
+        pthread_mutex_lock(&ring_buffer_drain_lock);
+        int timeout = ((logopt.method == LOG_METHOD_FILE) ?
+                       log_file_sync_timeout() : -1);
+        pthread_mutex_unlock(&ring_buffer_drain_lock);
+
+        /* ... and for reporting rate limited call sites */
+        int limit_timeout = dsme_log_limit_timeout();
+        if( timeout < 0 || (limit_timeout >= 0 && limit_timeout < timeout) )
+            timeout = limit_timeout;
+
+        /* Arrange a cancelation point at eventfd poll() / read() */
         pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
-        ssize_t rc = read(ring_buffer_event_fd, &cnt, sizeof cnt);
+        if( (rc = poll(&pfd, 1, timeout)) > 0 )
+            rc = read(ring_buffer_event_fd, &cnt, sizeof cnt);
         pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
 
         /* Ignore i/o error if we have been asked to exit */
         if( !thread_enabled )
             goto EXIT;
 
+        if( rc == -1 && errno == EINTR )
+            continue;
+
         /* Make noise if exiting due to i/o error */
         if( rc == -1 ) {
             static const char m[] = "*** DSME LOGGER READ ERROR\n";
@@ -649,28 +2836,19 @@ dsme_log_thread(void* param)
             goto EXIT;
         }
 
-        for( ; cnt; --cnt ) {
-            /* While it should not be possible; if it looks like ring buffer
-             * bookkeeping is out of sync, make some noise, exit logger
-             * thread, and switch to log-from-main-thread logic.
-             */
-            if( buffered_count() == 0 ) {
-                static const char m[] = "*** DSME LOGGER OUT OF SYNC\n";
-                if( write(STDERR_FILENO, m, sizeof m - 1) == -1 ) {
-                    // dontcare
-                }
-                goto EXIT;
-            }
+        /* Queue summaries for call sites that have gone quiet */
+        dsme_log_limit_sweep();
 
-            /* Pop entry from ring buffer and process it */
-            log_entry_t *entry = &ring_buffer[read_count_get() % DSME_LOG_ENTRY_COUNT];
-            dsme_log_routine(entry);
-            read_count_inc();
+        /* Process all completed records */
+        pthread_mutex_lock(&ring_buffer_drain_lock);
+        bool in_sync = dsme_log_ring_drain();
+        pthread_mutex_unlock(&ring_buffer_drain_lock);
 
-            /* Stop processing if we have been asked to exit */
-            if( !thread_enabled )
-                goto EXIT;
-        }
+        /* If ring buffer bookkeeping is out of sync, exit logger
+         * thread, and switch to log-from-calling-thread logic.
+         */
+        if( !in_sync )
+            goto EXIT;
     }
 
 EXIT:
@@ -689,6 +2867,29 @@ EXIT:
 static GSList     *dsme_log_rule_list  = 0;
 static GHashTable *dsme_log_rule_cache = 0;
 
+/** Lock for rule data, which is evaluated from all logging threads */
+static pthread_mutex_t dsme_log_rule_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Generation of verbosity and rule settings
+ *
+ * Call sites cache logging decisions tagged with this value, see
+ * dsme_log_site_p_(). Must be changed with dsme_log_rule_lock held.
+ */
+volatile unsigned dsme_log_generation_ = 1;
+
+/** Invalidate all cached call site logging decisions
+ *
+ * Note: Caller must hold dsme_log_rule_lock.
+ */
+static void
+dsme_log_bump_generation(void)
+{
+    /* Leave room for level and enabled bits, skip zero */
+    unsigned generation = (dsme_log_generation_ + 1) & (~0u >> 4);
+
+    dsme_log_generation_ = generation ?: 1;
+}
+
 /** Remove all include/exclude rules
  */
 void
@@ -696,6 +2897,8 @@ dsme_log_clear_rules(void)
 {
     dsme_log_queue(LOG_DEBUG, __FILE__, __FUNCTION__, "log rules cleared");
 
+    pthread_mutex_lock(&dsme_log_rule_lock);
+
     if( dsme_log_rule_list ) {
         g_slist_free_full(dsme_log_rule_list, log_rule_delete_cb),
             dsme_log_rule_list = 0;
@@ -705,6 +2908,10 @@ dsme_log_clear_rules(void)
         g_hash_table_unref(dsme_log_rule_cache),
             dsme_log_rule_cache = 0;
     }
+
+    dsme_log_bump_generation();
+
+    pthread_mutex_unlock(&dsme_log_rule_lock);
 }
 
 /** Add an include/exclude rule
@@ -718,6 +2925,8 @@ dsme_log_add_rule(const char *pattern, log_state_t state)
     dsme_log_queue(LOG_DEBUG, __FILE__, __FUNCTION__, "log rule '%s' -> %s",
                    pattern, log_state_repr(state));
 
+    pthread_mutex_lock(&dsme_log_rule_lock);
+
     if( dsme_log_rule_cache )
         g_hash_table_remove_all(dsme_log_rule_cache);
     else
@@ -731,6 +2940,10 @@ dsme_log_add_rule(const char *pattern, log_state_t state)
      */
     dsme_log_rule_list = g_slist_prepend(dsme_log_rule_list,
                                          log_rule_create(pattern, state));
+
+    dsme_log_bump_generation();
+
+    pthread_mutex_unlock(&dsme_log_rule_lock);
 }
 
 /** Add include rule
@@ -806,16 +3019,17 @@ dsme_log_set_verbosity(int verbosity)
         dsme_log_queue(LOG_DEBUG, __FILE__, __FUNCTION__, "verbosity: %s -> %s",
                        log_prio_str(logopt.verbosity),
                        log_prio_str(verbosity));
+
+        pthread_mutex_lock(&dsme_log_rule_lock);
         logopt.verbosity = verbosity;
+        dsme_log_bump_generation();
+        pthread_mutex_unlock(&dsme_log_rule_lock);
     }
 }
 
-/** Log level testing predicate
- *
- * Normally this function is used from dsme_log() macro.
+/** Evaluate whether logging is allowed
  *
- * For testing whether given level of logging is allowed
- * before spending cpu time for gathering parameters etc
+ * Note: Caller must hold dsme_log_rule_lock.
  *
  * @param prio  level of logging to perform
  * @param file  path to module containing the calling function
@@ -823,8 +3037,8 @@ dsme_log_set_verbosity(int verbosity)
  *
  * @return true if logging is allowed, false if not
  */
-bool
-dsme_log_p_(int prio, const char *file, const char *func)
+static bool
+dsme_log_decide(int prio, const char *file, const char *func)
 {
     /* Check file/function inclusion/exclusion rules 1st */
     if( dsme_log_rule_cache && file && func ) {
@@ -842,6 +3056,303 @@ dsme_log_p_(int prio, const char *file, const char *func)
     return prio <= logopt.verbosity;
 }
 
+/** Log level testing predicate
+ *
+ * Normally this function is used from dsme_log() macro.
+ *
+ * For testing whether given level of logging is allowed
+ * before spending cpu time for gathering parameters etc
+ *
+ * @param prio  level of logging to perform
+ * @param file  path to module containing the calling function
+ * @param func  name of the function name
+ *
+ * @return true if logging is allowed, false if not
+ */
+bool
+dsme_log_p_(int prio, const char *file, const char *func)
+{
+    /* Without rules there is no need to take the lock */
+    if( !dsme_log_rule_cache )
+        return prio <= logopt.verbosity;
+
+    pthread_mutex_lock(&dsme_log_rule_lock);
+    bool enabled = dsme_log_decide(prio, file, func);
+    pthread_mutex_unlock(&dsme_log_rule_lock);
+
+    return enabled;
+}
+
+/** Re-evaluate cached call site logging decision
+ *
+ * Called from dsme_log_site_p_() when verbosity or rules have
+ * changed since the call site was last evaluated. The decision
+ * is cached only for syslog priorities, anything else is
+ * evaluated on every call.
+ *
+ * @param site  call site descriptor
+ * @param prio  level of logging to perform
+ * @param file  path to module containing the calling function
+ * @param func  name of the function name
+ *
+ * @return call site state, with logging allowed flag in bit zero
+ */
+unsigned
+dsme_log_site_evaluate_(dsme_log_site_t *site, int prio,
+                        const char *file, const char *func)
+{
+    pthread_mutex_lock(&dsme_log_rule_lock);
+
+    unsigned generation = dsme_log_generation_;
+    bool     enabled    = dsme_log_decide(prio, file, func);
+
+    pthread_mutex_unlock(&dsme_log_rule_lock);
+
+    unsigned state = (generation << 3 | (unsigned)prio) << 1 | enabled;
+
+    if( prio >= LOG_EMERG && prio <= LOG_DEBUG )
+        site->state = state;
+
+    g_atomic_int_inc(&site_evaluations);
+
+    return state;
+}
+
+/* ========================================================================= *
+ * Rate Limiting
+ * ========================================================================= */
+
+/** Time without messages after which a call site burst is over [ms] */
+# define DSME_LOG_LIMIT_IDLE 1000
+
+/** Token bucket parameters for one priority level */
+typedef struct
+{
+    unsigned rate;  /**< Messages per second, or zero for no limit */
+    unsigned burst; /**< Bucket size [messages] */
+} log_limit_t;
+
+/** Per priority rate limits, all disabled by default */
+static log_limit_t dsme_log_limit[LOG_DEBUG + 1];
+
+/** Call sites with suppressed messages not reported yet */
+static log_site_data_t *dsme_log_limit_list = 0;
+
+/** Lock for rate limiting data */
+static pthread_mutex_t dsme_log_limit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Apply rate limit to a message from a call site
+ *
+ * Each call site has a token bucket that is filled at the configured
+ * rate for the message priority. When the bucket is empty, messages
+ * are suppressed. Once messages are allowed again, or the call site
+ * has been quiet for a while, a summary of suppressed messages is
+ * logged instead.
+ *
+ * Normally this function is used from dsme_log() macro.
+ *
+ * @param site  call site descriptor
+ * @param prio  level of logging to perform
+ * @param file  path to module containing the calling function
+ * @param func  name of the function name
+ * @param line  source line of the call site
+ *
+ * @return true if the message should be logged, false if not
+ */
+bool
+dsme_log_site_allow_(dsme_log_site_t *site, int prio,
+                     const char *file, const char *func, int line)
+{
+    bool     allow   = true;
+    unsigned summary = 0;
+
+    prio = log_prio_cap(prio);
+
+    /* No limit and nothing to report -> skip locking and clock reads */
+    log_site_data_t *data = __atomic_load_n(&site->priv, __ATOMIC_ACQUIRE);
+
+    if( __atomic_load_n(&dsme_log_limit[prio].rate, __ATOMIC_RELAXED) == 0 &&
+        (!data || __atomic_load_n(&data->suppressed, __ATOMIC_RELAXED) == 0) )
+        goto EXIT;
+
+    if( !data )
+        data = dsme_log_site_data(site);
+
+    pthread_mutex_lock(&dsme_log_limit_lock);
+
+    const log_limit_t *limit = &dsme_log_limit[prio];
+
+    if( limit->rate == 0 && data->suppressed == 0 )
+        goto UNLOCK;
+
+    unsigned now  = (unsigned)log_monotonic_ms();
+    unsigned full = limit->burst * 1000;
+
+    if( data->stamp == 0 || limit->rate == 0 ) {
+        data->tokens = full;
+    }
+    else {
+        /* Tokens are scaled by 1000 -> rate per ms */
+        unsigned elapsed = now - data->stamp;
+        if( elapsed > full / limit->rate )
+            elapsed = full / limit->rate + 1;
+        data->tokens += elapsed * limit->rate;
+    }
+    data->stamp = now ?: 1;
+
+    if( data->tokens > full )
+        data->tokens = full;
+
+    if( limit->rate == 0 || data->tokens >= 1000 ) {
+        if( limit->rate != 0 )
+            data->tokens -= 1000;
+
+        /* Burst is over, report what was left out */
+        summary = data->suppressed;
+        __atomic_store_n(&data->suppressed, 0, __ATOMIC_RELAXED);
+        goto UNLOCK;
+    }
+
+    allow = false;
+    ++dsme_log_limit_suppressed;
+
+    __atomic_store_n(&data->suppressed, data->suppressed + 1,
+                     __ATOMIC_RELAXED);
+
+    if( data->suppressed == 1 ) {
+        data->level = prio;
+        data->line  = line;
+
+        /* The summary can be logged after the plugin is unloaded */
+        if( !data->file || strcmp(data->file, file ?: "unknown") )
+            g_free(data->file), data->file = g_strdup(file ?: "unknown");
+        if( !data->func || strcmp(data->func, func ?: "unknown") )
+            g_free(data->func), data->func = g_strdup(func ?: "unknown");
+
+        /* Let logger thread report if there are no more messages */
+        data->next = dsme_log_limit_list;
+        dsme_log_limit_list = data;
+        dsme_log_notify_worker();
+    }
+
+UNLOCK:
+    pthread_mutex_unlock(&dsme_log_limit_lock);
+
+    if( summary )
+        dsme_log_limit_summary(data, summary);
+
+EXIT:
+    return allow;
+}
+
+/** Log summary about suppressed messages from a call site
+ *
+ * @param data   call site data
+ * @param count  number of suppressed messages
+ */
+static void
+dsme_log_limit_summary(log_site_data_t *data, unsigned count)
+{
+    dsme_log_queue(data->level, data->file, data->func,
+                   "%s:%d: suppressed %u similar messages",
+                   data->file, data->line, count);
+}
+
+/** Report suppressed messages from call sites that have gone quiet
+ *
+ * Called from the logger thread.
+ */
+static void
+dsme_log_limit_sweep(void)
+{
+    unsigned now = (unsigned)log_monotonic_ms();
+
+    pthread_mutex_lock(&dsme_log_limit_lock);
+
+    for( log_site_data_t **prev = &dsme_log_limit_list, *data; (data = *prev); ) {
+        /* Summary already logged from the call site */
+        if( data->suppressed == 0 ) {
+            *prev = data->next, data->next = 0;
+            continue;
+        }
+
+        if( now - data->stamp >= DSME_LOG_LIMIT_IDLE ) {
+            dsme_log_limit_summary(data, data->suppressed);
+            __atomic_store_n(&data->suppressed, 0, __ATOMIC_RELAXED);
+            *prev = data->next, data->next = 0;
+            continue;
+        }
+
+        prev = &data->next;
+    }
+
+    pthread_mutex_unlock(&dsme_log_limit_lock);
+}
+
+/** Get time until the next rate limit sweep is due
+ *
+ * @return poll() timeout [ms], or -1 if no sweep is needed
+ */
+static int
+dsme_log_limit_timeout(void)
+{
+    int timeout = -1;
+
+    pthread_mutex_lock(&dsme_log_limit_lock);
+
+    if( dsme_log_limit_list ) {
+        unsigned now = (unsigned)log_monotonic_ms();
+        timeout = DSME_LOG_LIMIT_IDLE;
+
+        for( log_site_data_t *data = dsme_log_limit_list; data; data = data->next ) {
+            unsigned idle = now - data->stamp;
+            int      left = (idle < DSME_LOG_LIMIT_IDLE) ? (int)(DSME_LOG_LIMIT_IDLE - idle) : 0;
+            if( timeout > left )
+                timeout = left;
+        }
+    }
+
+    pthread_mutex_unlock(&dsme_log_limit_lock);
+
+    return timeout;
+}
+
+/** Set per call site rate limit for messages
+ *
+ * @param prio   LOG_EMERG ... LOG_DEBUG, or negative for all levels
+ * @param rate   messages per second, or zero to disable limiting
+ * @param burst  number of messages allowed in a burst
+ */
+void
+dsme_log_set_rate_limit(int prio, unsigned rate, unsigned burst)
+{
+    /* Keep token arithmetics within 32 bits */
+    if( burst < 1 )
+        burst = 1;
+    else if( burst > 100000 )
+        burst = 100000;
+
+    if( rate > 10000 )
+        rate = 10000;
+
+    dsme_log_queue(LOG_DEBUG, __FILE__, __FUNCTION__,
+                   "rate limit: %s -> %u/s burst %u",
+                   (prio < 0) ? "all" : log_prio_str(log_prio_cap(prio)),
+                   rate, burst);
+
+    pthread_mutex_lock(&dsme_log_limit_lock);
+
+    for( int i = LOG_EMERG; i <= LOG_DEBUG; ++i ) {
+        if( prio < 0 || i == log_prio_cap(prio) ) {
+            /* Rate is also checked without the lock */
+            dsme_log_limit[i].burst = burst;
+            __atomic_store_n(&dsme_log_limit[i].rate, rate, __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_mutex_unlock(&dsme_log_limit_lock);
+}
+
 /* ========================================================================= *
  * Logging Start/Stop
  * ========================================================================= */
@@ -861,6 +3372,9 @@ dsme_log_init(void)
 {
     bool ack = false;
 
+    if( !dsme_log_ring_alloc(ring_buffer_size_wanted) )
+        goto EXIT;
+
     if( (ring_buffer_event_fd = eventfd(0, EFD_CLOEXEC)) == -1 ) {
         fprintf(stderr, "eventfd: %s\n", strerror(errno));
         goto EXIT;
@@ -882,8 +3396,8 @@ EXIT:
  * @param method    logging method
  * @param usetime   if nonzero, each message will pe prepended with a timestamp
  * @param prefix    the text that will be printed before each message
- * @param facility  the facility for openlog() (only for syslog method)
- * @param option    option for openlog() (only for syslog method)
+ * @param facility  syslog facility (only for syslog method)
+ * @param option    LOG_PID or zero (only for syslog method)
  * @param filename  log file name (only for file method)
  *
  * @return true upon successfull initialization, falseotherwise.
@@ -898,7 +3412,10 @@ dsme_log_open(log_method  method,
               const char* filename)
 {
     logopt.method    = method;
+    pthread_mutex_lock(&dsme_log_rule_lock);
     logopt.verbosity = log_prio_cap(verbosity);
+    dsme_log_bump_generation();
+    pthread_mutex_unlock(&dsme_log_rule_lock);
     logopt.usetime   = usetime;
     logopt.prefix    = prefix;
 
@@ -912,12 +3429,13 @@ dsme_log_open(log_method  method,
         break;
 
     case LOG_METHOD_SYSLOG:
-        openlog(prefix, option, facility);
+        log_syslog_open(prefix, option, facility);
         dsme_log_routine = log_to_syslog;
+        dsme_log_commit_routine = log_syslog_commit;
         break;
 
     case LOG_METHOD_FILE:
-        if( !(logopt.filep = fopen(filename, "a")) ) {
+        if( !log_file_open(filename) ) {
             fprintf(stderr,
                     "Can't create log file %s (%s)\n",
                     filename,
@@ -925,12 +3443,28 @@ dsme_log_open(log_method  method,
             return false;
         }
         dsme_log_routine = log_to_file;
+        dsme_log_commit_routine = log_file_commit;
         break;
 
     default:
         return false;
     }
 
+    /* Apply ring buffer size given after dsme_log_init(). The logger
+     * thread is not running yet, so whatever has been queued so far
+     * can be flushed from here. */
+    if( ring_buffer && ring_buffer_size != ring_buffer_size_wanted ) {
+        pthread_mutex_lock(&ring_buffer_drain_lock);
+        dsme_log_ring_drain();
+        dsme_log_ring_alloc(ring_buffer_size_wanted);
+        pthread_mutex_unlock(&ring_buffer_drain_lock);
+    }
+
+    /* Flight recorder is optional, just make some noise on failure */
+    if( log_flightrec_size > 0 && !log_flightrec_open() )
+        fprintf(stderr, "Can't map flight recorder %s (%s)\n",
+                DSME_FLIGHTREC_PATH, strerror(errno));
+
     /* create the logging thread */
     pthread_attr_t     tattr;
     pthread_t          tid;
@@ -978,11 +3512,20 @@ dsme_log_close(void)
     dsme_log_stop();
 
     // Flush remaining messages from main thread
-    for( guint at = read_count_get(); at != write_count_get(); ++at ) {
-        log_entry_t *entry = &ring_buffer[at % DSME_LOG_ENTRY_COUNT];
-        dsme_log_routine(entry);
+    dsme_log_set_deferred(false);
+
+    if( ring_buffer ) {
+        pthread_mutex_lock(&ring_buffer_drain_lock);
+        dsme_log_ring_drain();
+        pthread_mutex_unlock(&ring_buffer_drain_lock);
     }
 
+    // Release interned strings used by binary records
+    dsme_log_intern_quit();
+
+    // Leave flight recorder file for dsme-wdd to pick up
+    log_flightrec_close();
+
     // Cleanup
     switch (logopt.method) {
     case LOG_METHOD_STDERR:
@@ -990,12 +3533,11 @@ dsme_log_close(void)
         break;
 
     case LOG_METHOD_SYSLOG:
-        closelog();
+        log_syslog_close();
         break;
 
     case LOG_METHOD_FILE:
-        if( logopt.filep )
-            fclose(logopt.filep), logopt.filep = 0;
+        log_file_close();
         break;
 
     default:
@@ -25,28 +25,511 @@
    License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "../include/dsme/mainloop.h"
+#include "../include/dsme/modulebase.h"
+#include "../include/dsme/timers.h"
 #include "../include/dsme/logging.h"
 
 #include <stdbool.h>
 #include <glib.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
-#include <fcntl.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
 typedef enum { NOT_STARTED, RUNNING, STOPPED } main_loop_state_t;
 
 static volatile main_loop_state_t state    = NOT_STARTED;
 static GMainLoop*                 the_loop = 0;
 
-static int                        mainloop_wakeup_fd[2] = { -1, -1 };
+static int                        mainloop_wakeup_fd    = -1;
 static guint                      mainloop_wakeup_id    = 0;
 static int                        mainloop_exit_code    = EXIT_SUCCESS;
 
+/* ========================================================================= *
+ * Cross-thread task posting
+ * ========================================================================= */
+
+typedef struct mainloop_task_t mainloop_task_t;
+
+struct mainloop_task_t
+{
+    mainloop_task_t       *next;
+    dsme_main_loop_task_t  fn;
+    void                  *data;
+};
+
+/** Posted tasks waiting for execution, most recently posted first
+ *
+ * Any thread can push tasks with compare-and-swap; the main thread
+ * takes the whole list at once with an atomic exchange.
+ */
+static mainloop_task_t *mainloop_post_head = 0;
+
+/** Task posting statistics; posted is updated from any thread */
+static struct
+{
+    uint64_t posted;
+    uint64_t executed;
+    uint64_t batches;
+    uint64_t max_batch;
+} mainloop_post_stats;
+
+/* ========================================================================= *
+ * Wakeup accounting
+ * ========================================================================= */
+
+/** Max number of sources listed in the periodic summary */
+#define MAINLOOP_SUMMARY_TOP 5
+
+struct dsme_main_loop_account_t
+{
+    /** Source name */
+    gchar                    *source;
+
+    /** Name of the owning module */
+    gchar                    *module;
+
+    /** Number of times the main loop was woken up by this source */
+    uint64_t                  wakeups;
+
+    /** Number of dispatches */
+    uint64_t                  dispatches;
+
+    /** Time spent in dispatching, excluding nested dispatches [ns] */
+    int64_t                   time_ns;
+    int64_t                   cpu_ns;
+    int64_t                   max_ns;
+
+    /** Wakeups at the time of the last periodic summary */
+    uint64_t                  summary_wakeups;
+
+    dsme_main_loop_account_t *next;
+};
+
+/** All accounting records */
+static dsme_main_loop_account_t  *mainloop_account_list     = 0;
+static unsigned                   mainloop_account_count    = 0;
+
+/** Innermost dispatch that is being accounted */
+static dsme_main_loop_dispatch_t *mainloop_dispatch_current = 0;
+
+/** Flag for: main loop has returned from a blocking poll() */
+static bool                       mainloop_wakeup_pending   = false;
+
+/** Main loop level wakeup statistics */
+static struct
+{
+    uint64_t polls;
+    uint64_t wakeups;
+    uint64_t unattributed;
+    int64_t  sleep_ns;
+    uint64_t summary_wakeups;
+    uint64_t summary_unattributed;
+} mainloop_stats;
+
+/** Periodic summary logging */
+static unsigned     mainloop_summary_interval = 0;
+static dsme_timer_t mainloop_summary_id       = 0;
+
+static int64_t
+mainloop_clock_ns(clockid_t id)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(id, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+dsme_main_loop_account_t *
+dsme_main_loop_account(const char *source, const module_t *module)
+{
+    const char *name = module_name(module) ?: "core";
+
+    dsme_main_loop_account_t *acc;
+
+    for( acc = mainloop_account_list; acc; acc = acc->next ) {
+        if( !strcmp(acc->source, source) && !strcmp(acc->module, name) )
+            goto EXIT;
+    }
+
+    acc = g_malloc0(sizeof *acc);
+    acc->source = g_strdup(source);
+    acc->module = g_strdup(name);
+    acc->next   = mainloop_account_list;
+    mainloop_account_list = acc;
+    ++mainloop_account_count;
+
+EXIT:
+    return acc;
+}
+
+void
+dsme_main_loop_dispatch_begin(dsme_main_loop_dispatch_t *ctx,
+                              dsme_main_loop_account_t  *account)
+{
+    ctx->account      = account;
+    ctx->parent       = mainloop_dispatch_current;
+    ctx->start_ns     = mainloop_clock_ns(CLOCK_MONOTONIC);
+    ctx->start_cpu_ns = mainloop_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    ctx->child_ns     = 0;
+    ctx->child_cpu_ns = 0;
+
+    mainloop_dispatch_current = ctx;
+}
+
+void
+dsme_main_loop_dispatch_end(dsme_main_loop_dispatch_t *ctx)
+{
+    dsme_main_loop_account_t *acc = ctx->account;
+
+    int64_t elapsed = mainloop_clock_ns(CLOCK_MONOTONIC) - ctx->start_ns;
+    int64_t cpu     = (mainloop_clock_ns(CLOCK_THREAD_CPUTIME_ID) -
+                       ctx->start_cpu_ns);
+
+    if( mainloop_dispatch_current != ctx )
+        dsme_log(LOG_ERR, "unbalanced dispatch accounting for %s@%s",
+                 acc->source, acc->module);
+
+    acc->dispatches += 1;
+    acc->time_ns    += elapsed - ctx->child_ns;
+    acc->cpu_ns     += cpu - ctx->child_cpu_ns;
+
+    if( acc->max_ns < elapsed - ctx->child_ns )
+        acc->max_ns = elapsed - ctx->child_ns;
+
+    /* First dispatch to finish gets the blame for waking up */
+    if( mainloop_wakeup_pending ) {
+        mainloop_wakeup_pending = false;
+        mainloop_stats.wakeups += 1;
+        acc->wakeups += 1;
+    }
+
+    if( (mainloop_dispatch_current = ctx->parent) ) {
+        ctx->parent->child_ns     += elapsed;
+        ctx->parent->child_cpu_ns += cpu;
+    }
+}
+
+/** Book keeping for accounted I/O watch */
+typedef struct
+{
+    GIOFunc                   func;
+    gpointer                  data;
+    dsme_main_loop_account_t *account;
+} mainloop_watch_t;
+
+static gboolean
+mainloop_watch_cb(GIOChannel *chn, GIOCondition cnd, gpointer aptr)
+{
+    mainloop_watch_t          *self = aptr;
+    dsme_main_loop_dispatch_t  ctx;
+
+    dsme_main_loop_dispatch_begin(&ctx, self->account);
+    gboolean keep = self->func(chn, cnd, self->data);
+    dsme_main_loop_dispatch_end(&ctx);
+
+    return keep;
+}
+
+static void
+mainloop_watch_delete_cb(gpointer aptr)
+{
+    g_slice_free1(sizeof(mainloop_watch_t), aptr);
+}
+
+guint
+dsme_main_loop_add_watch(const char   *source,
+                         GIOChannel   *chn,
+                         GIOCondition  cnd,
+                         GIOFunc       func,
+                         gpointer      data)
+{
+    mainloop_watch_t *self = g_slice_alloc0(sizeof *self);
+
+    self->func    = func;
+    self->data    = data;
+    self->account = dsme_main_loop_account(source,
+                                           modulebase_current_module());
+
+    guint id = g_io_add_watch_full(chn, G_PRIORITY_DEFAULT, cnd,
+                                   mainloop_watch_cb, self,
+                                   mainloop_watch_delete_cb);
+    if( !id )
+        mainloop_watch_delete_cb(self);
+
+    return id;
+}
+
+/** Poll function that detects when the main loop wakes up from sleep */
+static gint
+mainloop_poll_cb(GPollFD *fds, guint nfds, gint timeout)
+{
+    int64_t started = mainloop_clock_ns(CLOCK_MONOTONIC);
+    gint    rc      = g_poll(fds, nfds, timeout);
+
+    mainloop_stats.polls += 1;
+
+    if( timeout != 0 ) {
+        mainloop_stats.sleep_ns += mainloop_clock_ns(CLOCK_MONOTONIC) - started;
+        mainloop_wakeup_pending = true;
+    }
+
+    return rc;
+}
+
+static int
+mainloop_account_compare(const void *a, const void *b)
+{
+    const dsme_main_loop_account_t *x = *(dsme_main_loop_account_t * const *)a;
+    const dsme_main_loop_account_t *y = *(dsme_main_loop_account_t * const *)b;
+
+    if( x->wakeups != y->wakeups )
+        return (x->wakeups < y->wakeups) ? 1 : -1;
+
+    return (x->time_ns < y->time_ns) - (x->time_ns > y->time_ns);
+}
+
+/** Get accounting records ordered by number of wakeups
+ *
+ * @return array to be released with g_free()
+ */
+static dsme_main_loop_account_t **
+mainloop_account_sorted(void)
+{
+    dsme_main_loop_account_t **vec =
+        g_new0(dsme_main_loop_account_t *, mainloop_account_count + 1);
+    unsigned n = 0;
+
+    for( dsme_main_loop_account_t *acc = mainloop_account_list; acc;
+         acc = acc->next )
+        vec[n++] = acc;
+
+    qsort(vec, n, sizeof *vec, mainloop_account_compare);
+
+    return vec;
+}
+
+void
+dsme_main_loop_report_wakeups(void (*report)(void *aptr, const char *row),
+                              void *aptr)
+{
+    char row[256];
+
+    snprintf(row, sizeof row,
+             "mainloop: polls=%llu wakeups=%llu unattributed=%llu"
+             " sleep=%.1fs",
+             (unsigned long long)mainloop_stats.polls,
+             (unsigned long long)mainloop_stats.wakeups,
+             (unsigned long long)mainloop_stats.unattributed,
+             mainloop_stats.sleep_ns / 1e9);
+    report(aptr, row);
+
+    snprintf(row, sizeof row,
+             "mainloop: posted=%llu executed=%llu batches=%llu"
+             " max_batch=%llu",
+             (unsigned long long)__atomic_load_n(&mainloop_post_stats.posted,
+                                                 __ATOMIC_RELAXED),
+             (unsigned long long)mainloop_post_stats.executed,
+             (unsigned long long)mainloop_post_stats.batches,
+             (unsigned long long)mainloop_post_stats.max_batch);
+    report(aptr, row);
+
+    dsme_main_loop_account_t **vec = mainloop_account_sorted();
+
+    for( size_t i = 0; vec[i]; ++i ) {
+        const dsme_main_loop_account_t *acc = vec[i];
+
+        snprintf(row, sizeof row,
+                 "mainloop: %s@%s wakeups=%llu dispatches=%llu"
+                 " time=%.3fms cpu=%.3fms max=%.3fms",
+                 acc->source, acc->module,
+                 (unsigned long long)acc->wakeups,
+                 (unsigned long long)acc->dispatches,
+                 acc->time_ns / 1e6, acc->cpu_ns / 1e6, acc->max_ns / 1e6);
+        report(aptr, row);
+    }
+
+    g_free(vec);
+}
+
+/** Log wakeups since the previous summary, most active sources first */
+static int
+mainloop_summary_cb(void *aptr)
+{
+    (void)aptr;
+
+    char    text[256];
+    size_t  used = 0;
+
+    uint64_t wakeups = (mainloop_stats.wakeups -
+                        mainloop_stats.summary_wakeups);
+    uint64_t unattributed = (mainloop_stats.unattributed -
+                             mainloop_stats.summary_unattributed);
+
+    mainloop_stats.summary_wakeups      = mainloop_stats.wakeups;
+    mainloop_stats.summary_unattributed = mainloop_stats.unattributed;
+
+    dsme_main_loop_account_t **vec = mainloop_account_sorted();
+
+    *text = 0;
+    for( size_t i = 0, shown = 0; vec[i]; ++i ) {
+        dsme_main_loop_account_t *acc = vec[i];
+        uint64_t count = acc->wakeups - acc->summary_wakeups;
+
+        acc->summary_wakeups = acc->wakeups;
+
+        if( count == 0 || shown >= MAINLOOP_SUMMARY_TOP || used >= sizeof text )
+            continue;
+
+        /* Sorted by total wakeups, which is close enough */
+        used += snprintf(text + used, sizeof text - used, " %s@%s=%llu",
+                         acc->source, acc->module, (unsigned long long)count);
+        ++shown;
+    }
+
+    g_free(vec);
+
+    dsme_log(LOG_INFO, "wakeups in %us: %llu, unattributed %llu; top:%s",
+             mainloop_summary_interval, (unsigned long long)wakeups,
+             (unsigned long long)unattributed, *text ? text : " none");
+
+    return 1;
+}
+
+void
+dsme_main_loop_set_summary_interval(unsigned seconds)
+{
+    if( mainloop_summary_id )
+        dsme_destroy_timer(mainloop_summary_id), mainloop_summary_id = 0;
+
+    if( (mainloop_summary_interval = seconds) )
+        mainloop_summary_id = dsme_create_timer_seconds(seconds,
+                                                        mainloop_summary_cb,
+                                                        0);
+}
+
+/* ========================================================================= *
+ * Main loop
+ * ========================================================================= */
+
+/** Wake up the main loop; must remain Async-signal-safe
+ *
+ * @return false if the wake up eventfd could not be written
+ */
+static bool
+mainloop_wakeup_notify(void)
+{
+    static const uint64_t one = 1;
+
+    int fd = mainloop_wakeup_fd;
+
+    if( fd == -1 )
+        return false;
+
+    while( write(fd, &one, sizeof one) == -1 ) {
+        if( errno == EINTR )
+            continue;
+
+        /* Counter saturated - main loop wakes up anyway */
+        if( errno == EAGAIN )
+            break;
+
+        return false;
+    }
+
+    return true;
+}
+
+/** Execute all posted tasks in posting order */
+static void
+mainloop_post_dispatch(void)
+{
+    mainloop_task_t *todo = __atomic_exchange_n(&mainloop_post_head, 0,
+                                                __ATOMIC_ACQUIRE);
+    mainloop_task_t *fifo  = 0;
+    uint64_t         count = 0;
+
+    while( todo ) {
+        mainloop_task_t *task = todo;
+        todo = task->next;
+        task->next = fifo, fifo = task;
+        ++count;
+    }
+
+    if( !count )
+        return;
+
+    mainloop_post_stats.executed += count;
+    mainloop_post_stats.batches  += 1;
+
+    if( mainloop_post_stats.max_batch < count )
+        mainloop_post_stats.max_batch = count;
+
+    while( fifo ) {
+        mainloop_task_t *task = fifo;
+        fifo = task->next;
+        task->fn(task->data);
+        free(task);
+    }
+}
+
+bool
+dsme_main_loop_post(dsme_main_loop_task_t fn, void *data)
+{
+    mainloop_task_t *task = malloc(sizeof *task);
+
+    if( !task )
+        return false;
+
+    task->fn   = fn;
+    task->data = data;
+
+    __atomic_add_fetch(&mainloop_post_stats.posted, 1, __ATOMIC_RELAXED);
+
+    mainloop_task_t *head = __atomic_load_n(&mainloop_post_head,
+                                            __ATOMIC_RELAXED);
+    do {
+        task->next = head;
+    } while( !__atomic_compare_exchange_n(&mainloop_post_head, &head, task,
+                                          true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED) );
+
+    /* Only the first task of a batch needs to wake up the main loop.
+     * Note that the task can already be executed and freed here. */
+    if( !head )
+        mainloop_wakeup_notify();
+
+    return true;
+}
+
 static gboolean
 mainloop_wakeup_cb(GIOChannel* src, GIOCondition cnd, gpointer dta)
 {
+    uint64_t count = 0;
+
+    if( cnd & ~G_IO_IN ) {
+        dsme_log(LOG_CRIT, "wake up eventfd error condition");
+        goto fail;
+    }
+
+    /* Reset the counter before taking the tasks, so that tasks
+     * posted after this will cause a new wakeup */
+    if( read(mainloop_wakeup_fd, &count, sizeof count) == -1 &&
+        errno != EAGAIN && errno != EINTR ) {
+        dsme_log(LOG_CRIT, "error reading wake up eventfd: %m");
+        goto fail;
+    }
+
+    mainloop_post_dispatch();
+
+    if( state != RUNNING )
+        g_main_loop_quit(the_loop);
+
+    return TRUE;
+
+fail:
     g_main_loop_quit(the_loop);
 
     mainloop_wakeup_id = 0;
@@ -60,13 +543,8 @@ mainloop_wakeup_quit(void)
         g_source_remove(mainloop_wakeup_id), mainloop_wakeup_id = 0;
     }
 
-    if( mainloop_wakeup_fd[0] != -1 ) {
-        close(mainloop_wakeup_fd[0]), mainloop_wakeup_fd[0] = -1;
-    }
-
-    if( mainloop_wakeup_fd[1] != -1 ) {
-        close(mainloop_wakeup_fd[1]), mainloop_wakeup_fd[1] = -1;
-    }
+    /* The eventfd is left open: other threads might still be posting
+     * and closing it could make them write to a reused descriptor. */
 }
 
 static bool
@@ -77,33 +555,26 @@ mainloop_wakeup_init(void)
     if( mainloop_wakeup_id )
         goto cleanup;
 
-    /* create a pipe for waking up the main thread */
-    if( pipe(mainloop_wakeup_fd) == - 1) {
-        dsme_log(LOG_CRIT, "error creating wake up pipe: %m");
+    /* create an eventfd for waking up the main thread */
+    mainloop_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if( mainloop_wakeup_fd == -1 ) {
+        dsme_log(LOG_CRIT, "error creating wake up eventfd: %m");
         goto cleanup;
     }
 
-    /* set writing end of the pipe to non-blocking mode */
-    errno = 0;
-    int flags = fcntl(mainloop_wakeup_fd[1], F_GETFL);
-    if( flags == -1 && errno != 0 ) {
-        dsme_log(LOG_CRIT, "error getting flags for wake up pipe: %m");
+    /* set up an I/O watch for the wake up eventfd */
+    if( !(chn = g_io_channel_unix_new(mainloop_wakeup_fd)) ) {
         goto cleanup;
     }
 
-    if( fcntl(mainloop_wakeup_fd[1], F_SETFL, flags | O_NONBLOCK) == -1 ) {
-        dsme_log(LOG_CRIT, "error setting wake up pipe to non-blocking: %m");
-        goto cleanup;
-    }
-
-    /* set up an I/O watch for the wake up pipe */
-    if( !(chn = g_io_channel_unix_new(mainloop_wakeup_fd[0])) ) {
-        goto cleanup;
-    }
+    mainloop_wakeup_id = dsme_main_loop_add_watch("mainloop:post", chn,
+                                                  G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                                  mainloop_wakeup_cb, 0);
 
-    mainloop_wakeup_id = g_io_add_watch(chn,
-                                        G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-                                        mainloop_wakeup_cb, 0);
+    /* tasks posted before the main loop was started */
+    if( mainloop_wakeup_id && __atomic_load_n(&mainloop_post_head,
+                                              __ATOMIC_RELAXED) )
+        mainloop_wakeup_notify();
 
 cleanup:
     if( chn )
@@ -130,15 +601,27 @@ dsme_main_loop_run(void (*iteration)(void))
 
         GMainContext* ctx = g_main_loop_get_context(the_loop);
 
+        g_main_context_set_poll_func(ctx, mainloop_poll_cb);
+
         while (state == RUNNING) {
             if (iteration) {
                 iteration();
             }
             if (state == RUNNING) {
                 (void)g_main_context_iteration(ctx, TRUE);
+
+                /* Woken up by a source that is not accounted */
+                if (mainloop_wakeup_pending) {
+                    mainloop_wakeup_pending = false;
+                    mainloop_stats.wakeups      += 1;
+                    mainloop_stats.unattributed += 1;
+                }
             }
         }
 
+        /* Do not leave posted tasks - and their data - behind */
+        mainloop_post_dispatch();
+
         mainloop_wakeup_quit();
 
         g_main_loop_unref(the_loop), the_loop = 0;
@@ -158,11 +641,8 @@ dsme_main_loop_quit(int exit_code)
             mainloop_exit_code = exit_code;
         }
 
-        while( write(mainloop_wakeup_fd[1], "*", 1) == -1) {
-            if( errno == EINTR )
-                continue;
+        if( !mainloop_wakeup_notify() )
             _exit(EXIT_FAILURE);
-        }
     }
 }
 
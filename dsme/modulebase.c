@@ -32,6 +32,7 @@
 #include <dsme/protocol.h>
 #include "../include/dsme/logging.h"
 #include "../include/dsme/mainloop.h"
+#include "../include/dsme/dsmesock.h"
 #include "dsme-server.h"
 #include "utility.h"
 
@@ -42,6 +43,9 @@
 #include <dlfcn.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <stddef.h>
 
 /**
    Loaded module information.
@@ -52,6 +56,32 @@ struct module_t {
     void* handle;
 };
 
+/** Number of buckets in dispatch latency histograms
+ *
+ * Bucket 0 holds values below 1 us, bucket N values in
+ * [2^(N-1), 2^N) us range, and the last bucket everything
+ * that does not fit in the others.
+ */
+#define DISPATCH_HIST_BUCKETS 24
+
+/**
+   Latency statistics.
+*/
+typedef struct {
+    uint64_t total_us;
+    uint32_t max_us;
+    uint32_t hist[DISPATCH_HIST_BUCKETS];
+} dispatch_latency_t;
+
+/**
+   Dispatch statistics for message type + module pair.
+*/
+typedef struct {
+    uint32_t           calls;
+    dispatch_latency_t exec;  // time spent in handler callback
+    dispatch_latency_t wait;  // time from queuing to handler callback
+} dispatch_stats_t;
+
 /**
    Registered handler information.
 */
@@ -60,6 +90,7 @@ typedef struct {
     size_t          msg_size;
     const module_t* owner;
     handler_fn_t*   callback;
+    dispatch_stats_t stats;    // updated on every handler call
 } msg_handler_info_t;
 
 /**
@@ -73,12 +104,45 @@ struct endpoint_t {
 
 /**
    Queued message.
+
+   Queued messages form an intrusive singly linked FIFO. The message
+   data is normally stored in the payload area allocated together with
+   the queue entry; entries with standard payload sizes are recycled via
+   per size class free lists instead of being released back to libc.
 */
-typedef struct {
+typedef struct queued_msg_t queued_msg_t;
+
+struct queued_msg_t {
+    queued_msg_t*      next;
+    int                size_class; // index to msgqueue_size_class[] or -1
     endpoint_t         from;
     const module_t*    to;
+    int64_t            queued_at;  // monotonic time stamp [ns]
     dsmemsg_generic_t* data;
-} queued_msg_t;
+    uint64_t           payload[];
+};
+
+/** Payload sizes for which queue entries are recycled
+ *
+ * Most messages are just a few words, the larger classes are
+ * there mainly for messages that have string extras attached.
+ */
+static const size_t msgqueue_size_class[] = { 64, 256, 1024 };
+
+#define MSGQUEUE_CLASS_COUNT G_N_ELEMENTS(msgqueue_size_class)
+
+/** Maximum number of unused entries to retain per size class
+ *
+ * Enough to cover startup/shutdown bursts without permanently
+ * holding on to excessive amounts of memory.
+ */
+#define MSGQUEUE_CACHE_MAX 128
+
+static queued_msg_t* msgqueue_alloc(size_t size);
+static void          msgqueue_release(queued_msg_t* msg);
+static void          msgqueue_push(queued_msg_t* msg);
+static queued_msg_t* msgqueue_pop(void);
+static void          msgqueue_quit(void);
 
 /**
    Adds a message to list of handlers
@@ -97,25 +161,14 @@ static int add_msghandlers(module_t* module);
 
 static void remove_msghandlers(module_t* module);
 
-/**
-   Comparison function; matches messages with handlers by message type.
-
-   This is callback function of GCompareFunc type.
-
-   @param a  Handler to be compared
-   @param b  Message type to be compared. Internally cast to integer.
-
-   @return negative/zero/positive if a is smaller/equal/larger than b.
-*/
-static gint msg_comparator(gconstpointer a, gconstpointer b);
-
 /**
    Comparison function; used to sort message handlers.
 
    This is callback function of GCompareFunc type.
 
-   Message handlers are sorted primarily by message type in descending order.
-   Handlers for same message type are sorted by priority in descending order.
+   Message handlers are sorted primarily by message type in ascending order.
+   Handlers for same message type are sorted by priority in ascending order,
+   and handlers with equal priority are kept in module load order.
 
    @param a   New handler to be added to the list of handlers.
    @param b   Existing handler in list of handlers.
@@ -144,9 +197,75 @@ static int handle_message(endpoint_t*              from,
                           const module_t*          to,
                           const dsmemsg_generic_t* msg);
 
+/**
+   Passes a message to all matching message handlers and updates
+   dispatch statistics.
+
+   @param from       Sender of the message
+   @param to         Recipient module, or NULL for broadcast
+   @param msg        Message to be handled
+   @param queued_at  Time when the message was queued, or zero
+*/
+static void dispatch_message(endpoint_t*              from,
+                             const module_t*          to,
+                             const dsmemsg_generic_t* msg,
+                             int64_t                  queued_at);
+
+/**
+   Looks up handlers registered for a message type.
+
+   @param msg_type  Message type
+   @return Array of msg_handler_info_t pointers in dispatch order,
+           or NULL if no handlers have been registered for the message type.
+*/
+static GPtrArray* dispatch_index_lookup(uint32_t msg_type);
+
+static void dispatch_index_insert(msg_handler_info_t* handler);
+static void dispatch_index_remove_owner(const module_t* owner);
+static void dispatch_index_report(modulebase_stats_fn_t* report, void* aptr);
+static void dispatch_index_quit(void);
+
 static GSList*     modules       = 0;
-static GSList*     callbacks     = 0;
-static GSList*     message_queue = 0;
+
+/** Head of the queued message FIFO */
+static queued_msg_t*  message_queue      = 0;
+
+/** Link pointer where the next queued message is to be stored */
+static queued_msg_t** message_queue_tail = &message_queue;
+
+/** Number of messages in the queue */
+static unsigned       message_queue_len  = 0;
+
+/** Highest number of messages in the queue */
+static unsigned       message_queue_peak = 0;
+
+/** Number of messages passed through the queue */
+static uint64_t       message_queue_total = 0;
+
+/** Number of IDLE messages dispatched */
+static uint64_t       idle_emitted       = 0;
+
+/** Number of main loop iterations that did not warrant IDLE message */
+static uint64_t       idle_skipped       = 0;
+
+/** Recycled queue entries, per payload size class */
+static queued_msg_t*  msgqueue_cache[MSGQUEUE_CLASS_COUNT];
+
+/** Number of entries in msgqueue_cache[] lists */
+static unsigned       msgqueue_cache_len[MSGQUEUE_CLASS_COUNT];
+
+/** Message type -> handler array lookup table
+ *
+ * Key is message type, value is GPtrArray of msg_handler_info_t pointers
+ * sorted with sort_comparator() i.e. in the order the handlers must be
+ * called. Arrays are updated incrementally as modules are loaded and
+ * unloaded.
+ *
+ * Arrays that become empty are retained until modulebase_shutdown() so
+ * that handle_message() never ends up holding a stale array pointer
+ * when handlers load/unload modules.
+ */
+static GHashTable* dispatch_index = 0;
 
 static const struct ucred bogus_ucred = {
     .pid =  0,
@@ -154,14 +273,6 @@ static const struct ucred bogus_ucred = {
     .gid = -1
 };
 
-static int msg_comparator(gconstpointer a, gconstpointer b)
-{
-  const msg_handler_info_t* handler  = (msg_handler_info_t*)a;
-  uint32_t                 msg_type = GPOINTER_TO_UINT(b);
-
-  return compare(handler->msg_type, msg_type);
-}
-
 static gint sort_comparator(gconstpointer a, gconstpointer b)
 {
     const msg_handler_info_t *add = a;
@@ -175,6 +286,179 @@ static gint sort_comparator(gconstpointer a, gconstpointer b)
            compare(add->owner->priority, old->owner->priority) ?: 1;
 }
 
+static int64_t dispatch_clock_ns(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        return 0;
+
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void dispatch_latency_update(dispatch_latency_t* self, int64_t ns)
+{
+    uint32_t us     = (ns <= 0) ? 0 : (ns >= INT64_C(1000) * UINT32_MAX)
+                    ? UINT32_MAX : (uint32_t)(ns / 1000);
+    unsigned bucket = us ? 32 - __builtin_clz(us) : 0;
+
+    if (bucket >= DISPATCH_HIST_BUCKETS)
+        bucket = DISPATCH_HIST_BUCKETS - 1;
+
+    self->hist[bucket] += 1;
+    self->total_us     += us;
+    if (self->max_us < us)
+        self->max_us = us;
+}
+
+static void dispatch_stats_update(dispatch_stats_t* self,
+                                  int64_t wait_ns, int64_t exec_ns)
+{
+    self->calls += 1;
+    dispatch_latency_update(&self->wait, wait_ns);
+    dispatch_latency_update(&self->exec, exec_ns);
+}
+
+static void dispatch_latency_repr(const dispatch_latency_t* self,
+                                  uint32_t calls, char* buff, size_t size)
+{
+    int n = snprintf(buff, size, "avg=%" PRIu64 " max=%" PRIu32 " us hist:",
+                     calls ? self->total_us / calls : 0, self->max_us);
+
+    for (unsigned i = 0; i < DISPATCH_HIST_BUCKETS; ++i) {
+        if (n < 0 || (size_t)n >= size)
+            break;
+        if (!self->hist[i])
+            continue;
+        if (i + 1 < DISPATCH_HIST_BUCKETS)
+            n += snprintf(buff + n, size - n, " <%u=%" PRIu32,
+                          1u << i, self->hist[i]);
+        else
+            n += snprintf(buff + n, size - n, " >=%u=%" PRIu32,
+                          1u << (i - 1), self->hist[i]);
+    }
+}
+
+static void dispatch_index_delete_cb(gpointer data)
+{
+    GPtrArray* handlers = data;
+
+    for (guint i = 0; i < handlers->len; ++i) {
+        free(g_ptr_array_index(handlers, i));
+    }
+    g_ptr_array_unref(handlers);
+}
+
+static GPtrArray* dispatch_index_lookup(uint32_t msg_type)
+{
+    GPtrArray* handlers = 0;
+
+    if (dispatch_index) {
+        handlers = g_hash_table_lookup(dispatch_index,
+                                       GUINT_TO_POINTER(msg_type));
+    }
+
+    return handlers;
+}
+
+static void dispatch_index_insert(msg_handler_info_t* handler)
+{
+    GPtrArray* handlers;
+    guint      pos;
+
+    if (!dispatch_index) {
+        dispatch_index = g_hash_table_new_full(g_direct_hash,
+                                               g_direct_equal,
+                                               0,
+                                               dispatch_index_delete_cb);
+    }
+
+    if (!(handlers = dispatch_index_lookup(handler->msg_type))) {
+        handlers = g_ptr_array_new();
+        g_hash_table_insert(dispatch_index,
+                            GUINT_TO_POINTER(handler->msg_type),
+                            handlers);
+    }
+
+    /* Same placement rule as g_slist_insert_sorted() would use, i.e.
+     * before the first handler that does not compare smaller. */
+    for (pos = 0; pos < handlers->len; ++pos) {
+        if (sort_comparator(handler, g_ptr_array_index(handlers, pos)) <= 0)
+            break;
+    }
+
+    g_ptr_array_insert(handlers, pos, handler);
+}
+
+static void dispatch_index_remove_owner(const module_t* owner)
+{
+    GHashTableIter iter;
+    gpointer       value;
+
+    if (!dispatch_index)
+        return;
+
+    g_hash_table_iter_init(&iter, dispatch_index);
+    while (g_hash_table_iter_next(&iter, 0, &value)) {
+        GPtrArray* handlers = value;
+
+        for (guint i = 0; i < handlers->len; ) {
+            msg_handler_info_t* handler = g_ptr_array_index(handlers, i);
+
+            if (handler->owner == owner) {
+                /* Note: Must retain order of remaining handlers */
+                g_ptr_array_remove_index(handlers, i);
+                free(handler);
+            }
+            else {
+                ++i;
+            }
+        }
+    }
+}
+
+static void dispatch_index_report(modulebase_stats_fn_t* report, void* aptr)
+{
+    GHashTableIter iter;
+    gpointer       value;
+    char           exec[256];
+    char           wait[256];
+    char           row[768];
+
+    if (!dispatch_index)
+        return;
+
+    g_hash_table_iter_init(&iter, dispatch_index);
+    while (g_hash_table_iter_next(&iter, 0, &value)) {
+        GPtrArray* handlers = value;
+
+        for (guint i = 0; i < handlers->len; ++i) {
+            const msg_handler_info_t* handler = g_ptr_array_index(handlers, i);
+
+            if (!handler->stats.calls)
+                continue;
+
+            dispatch_latency_repr(&handler->stats.exec, handler->stats.calls,
+                                  exec, sizeof exec);
+            dispatch_latency_repr(&handler->stats.wait, handler->stats.calls,
+                                  wait, sizeof wait);
+            snprintf(row, sizeof row, "dispatch %s@%s: calls=%" PRIu32
+                     " exec: %s; wait: %s",
+                     dsmemsg_id_name(handler->msg_type),
+                     handler->owner->name, handler->stats.calls,
+                     exec, wait);
+            report(aptr, row);
+        }
+    }
+}
+
+static void dispatch_index_quit(void)
+{
+    if (dispatch_index) {
+        g_hash_table_unref(dispatch_index), dispatch_index = 0;
+    }
+}
+
 #ifdef OBSOLETE
 /**
    Comparison function; match module by name
@@ -205,11 +489,10 @@ static int modulebase_add_single_handler(uint32_t        msg_type,
     handler->msg_size = msg_size;
     handler->callback = callback;
     handler->owner    = owner;
+    memset(&handler->stats, 0, sizeof handler->stats);
 
-    /* Insert into sorted list. */
-    callbacks = g_slist_insert_sorted(callbacks,
-				      handler,
-				      sort_comparator);
+    /* Insert into sorted per message type handler array. */
+    dispatch_index_insert(handler);
 
     return 0;
 }
@@ -252,20 +535,7 @@ static int add_msghandlers(module_t* module)
 */
 static void remove_msghandlers(module_t* module)
 {
-    GSList* node;
-    GSList* next;
-
-    for (node = callbacks; node != 0; node = next) {
-        next = g_slist_next(node);
-        if (node->data &&
-            ((msg_handler_info_t *)(node->data))->owner == module)
-        {
-            free(node->data);
-            node->data = NULL;
-
-            callbacks = g_slist_delete_link(callbacks, node);
-        }
-    }
+    dispatch_index_remove_owner(module);
 }
 
 static const module_t* currently_handling_module = 0;
@@ -282,7 +552,174 @@ const module_t* modulebase_enter_module(const module_t* module)
     return previous;
 }
 
-// TODO: all these returns and mallocs are a mess
+/**
+   Gets a queue entry with room for given amount of message data.
+
+   Recycled entries are used when available.
+
+   @param size  Required payload size
+   @return Queue entry, or NULL on allocation failure
+*/
+static queued_msg_t* msgqueue_alloc(size_t size)
+{
+    queued_msg_t* msg        = 0;
+    int           size_class = -1;
+
+    for (size_t i = 0; i < MSGQUEUE_CLASS_COUNT; ++i) {
+        if (size <= msgqueue_size_class[i]) {
+            size_class = i;
+            size = msgqueue_size_class[i];
+            break;
+        }
+    }
+
+    if (size_class != -1 && (msg = msgqueue_cache[size_class])) {
+        msgqueue_cache[size_class] = msg->next;
+        --msgqueue_cache_len[size_class];
+    }
+    else if (!(msg = malloc(sizeof *msg + size))) {
+        goto EXIT;
+    }
+
+    msg->next       = 0;
+    msg->size_class = size_class;
+    msg->to         = 0;
+    msg->data       = (dsmemsg_generic_t*)msg->payload;
+
+EXIT:
+    return msg;
+}
+
+/**
+   Releases a queue entry obtained via msgqueue_alloc().
+
+   @param msg  Queue entry
+*/
+static void msgqueue_release(queued_msg_t* msg)
+{
+    if (!msg)
+        goto EXIT;
+
+    int size_class = msg->size_class;
+
+    if (size_class != -1 &&
+        msgqueue_cache_len[size_class] < MSGQUEUE_CACHE_MAX) {
+        msg->next = msgqueue_cache[size_class];
+        msgqueue_cache[size_class] = msg;
+        ++msgqueue_cache_len[size_class];
+    }
+    else {
+        free(msg);
+    }
+
+EXIT:
+    return;
+}
+
+/**
+   Appends a queue entry to the tail of the message queue.
+
+   @param msg  Queue entry
+*/
+static void msgqueue_push(queued_msg_t* msg)
+{
+    msg->next = 0;
+    *message_queue_tail = msg;
+    message_queue_tail = &msg->next;
+    ++message_queue_total;
+    if (++message_queue_len > message_queue_peak)
+        message_queue_peak = message_queue_len;
+}
+
+/**
+   Detaches queue entry from the head of the message queue.
+
+   @return Queue entry, or NULL if the queue is empty
+*/
+static queued_msg_t* msgqueue_pop(void)
+{
+    queued_msg_t* msg = message_queue;
+
+    if (msg) {
+        if (!(message_queue = msg->next))
+            message_queue_tail = &message_queue;
+        msg->next = 0;
+        --message_queue_len;
+    }
+
+    return msg;
+}
+
+/**
+   Releases recycled queue entries.
+*/
+static void msgqueue_quit(void)
+{
+    for (size_t i = 0; i < MSGQUEUE_CLASS_COUNT; ++i) {
+        queued_msg_t* msg;
+        while ((msg = msgqueue_cache[i])) {
+            msgqueue_cache[i] = msg->next;
+            free(msg);
+        }
+        msgqueue_cache_len[i] = 0;
+    }
+}
+
+/**
+   Maps message data pointer back to the queue entry it is stored in.
+
+   @param data  Message pointer obtained via modulebase_alloc_message()
+   @return Queue entry
+*/
+static queued_msg_t* msgqueue_from_data(dsmemsg_generic_t* data)
+{
+    return (queued_msg_t*)((char*)data - offsetof(queued_msg_t, payload));
+}
+
+dsmemsg_generic_t* modulebase_alloc_message(size_t size)
+{
+    queued_msg_t* msg;
+
+    if (size < sizeof(dsmemsg_generic_t))
+        return 0;
+
+    if (!(msg = msgqueue_alloc(size)))
+        return 0;
+
+    return msg->data;
+}
+
+void modulebase_free_message(dsmemsg_generic_t* msg)
+{
+    if (msg)
+        msgqueue_release(msgqueue_from_data(msg));
+}
+
+void modulebase_queue_message_from_socket(dsmemsg_generic_t*     msg,
+                                          dsmesock_connection_t* conn)
+{
+    queued_msg_t*       newmsg;
+    const struct ucred* ucred;
+
+    if (!msg)
+        return;
+
+    newmsg = msgqueue_from_data(msg);
+
+    newmsg->from.module = 0;
+    newmsg->from.conn   = conn;
+    if ((ucred = dsmesock_getucred(conn)))
+        newmsg->from.ucred = *ucred;
+    else
+        newmsg->from.ucred = bogus_ucred;
+
+    /* use 0 as recipient for broadcasting */
+    newmsg->to        = 0;
+    newmsg->queued_at = dispatch_clock_ns();
+
+    msgqueue_push(newmsg);
+}
+
 static void queue_message(const endpoint_t* from,
                           const module_t*   to,
                           const void*       msg,
@@ -295,25 +732,17 @@ static void queue_message(const endpoint_t* from,
   if (!msg) return;
   if (genmsg->line_size_ < sizeof(dsmemsg_generic_t)) return;
 
-  newmsg = (queued_msg_t*)malloc(sizeof(queued_msg_t));
-  if (!newmsg) return;
+  if (!(newmsg = msgqueue_alloc(genmsg->line_size_ + extra_size))) return;
 
-  newmsg->data = (dsmemsg_generic_t*)malloc(genmsg->line_size_ + extra_size);
-  if (newmsg->data) {
-      memcpy(newmsg->data, genmsg, genmsg->line_size_);
-      memcpy(((char*)newmsg->data)+genmsg->line_size_, extra, extra_size);
-      newmsg->data->line_size_ += extra_size;
+  memcpy(newmsg->data, genmsg, genmsg->line_size_);
+  memcpy(((char*)newmsg->data)+genmsg->line_size_, extra, extra_size);
+  newmsg->data->line_size_ += extra_size;
 
-      newmsg->from = *from;
-      newmsg->to   = to;
+  newmsg->from      = *from;
+  newmsg->to        = to;
+  newmsg->queued_at = dispatch_clock_ns();
 
-      // TODO: perhaps use GQueue for faster appending?
-      message_queue = g_slist_append(message_queue, newmsg);
-      return;
-  }
-
-  free(newmsg);
-  newmsg = NULL;
+  msgqueue_push(newmsg);
 }
 
 void modules_broadcast_internally_with_extra(const void* msg,
@@ -363,7 +792,7 @@ void modules_broadcast_with_extra(const void* msg, size_t extra_size, const void
   };
 
   queue_message(&from, 0, msg, extra_size, extra);
-  dsmesock_broadcast_with_extra(msg, extra_size, extra);
+  dsmesock_client_broadcast_with_extra(msg, extra_size, extra);
 }
 
 void modules_broadcast(const void* msg)
@@ -394,7 +823,7 @@ void endpoint_send_with_extra(endpoint_t* recipient,
     if (recipient->module) {
       queue_for_module_with_extra(recipient->module, msg, extra_size, extra);
     } else if (recipient->conn) {
-      dsmesock_send_with_extra(recipient->conn,   msg, extra_size, extra);
+      dsmesock_client_send_with_extra(recipient->conn, msg, extra_size, extra);
     } else {
       dsme_log(LOG_DEBUG, "endpoint_send(): no endpoint");
     }
@@ -539,17 +968,27 @@ void endpoint_free(endpoint_t* endpoint)
 
 void modulebase_process_message_queue(void)
 {
-    while (message_queue) {
-        queued_msg_t* front = (queued_msg_t*)message_queue->data;
+    queued_msg_t* front;
+    bool          drained = false;
+    GPtrArray*    handlers;
+
+    while ((front = msgqueue_pop())) {
+        dispatch_message(&front->from, front->to, front->data,
+                         front->queued_at);
+        msgqueue_release(front);
+        drained = true;
+    }
 
-        message_queue = g_slist_delete_link(message_queue,
-                                            message_queue);
-        handle_message(&front->from, front->to, front->data);
-        free(front->data);
-        free(front);
+    // send an IDLE message to indicate that the message queue got emptied,
+    // but skip it if there was nothing to process or nobody is listening
+    handlers = dispatch_index_lookup(DSME_MSG_ID_(DSM_MSGTYPE_IDLE));
+    if (!drained || !handlers || handlers->len == 0) {
+        ++idle_skipped;
+        return;
     }
 
-    // send an IDLE message to indicate that the message queue is empty
+    ++idle_emitted;
+
     endpoint_t from = {
         .module = 0,
         .conn   = 0,
@@ -563,15 +1002,26 @@ static int handle_message(endpoint_t*              from,
                           const module_t*          to,
                           const dsmemsg_generic_t* msg)
 {
-  GSList*                   node;
-  const msg_handler_info_t* handler;
+  dispatch_message(from, to, msg, 0);
+
+  return 0;
+}
+
+static void dispatch_message(endpoint_t*              from,
+                             const module_t*          to,
+                             const dsmemsg_generic_t* msg,
+                             int64_t                  queued_at)
+{
+  GPtrArray*          handlers;
+  msg_handler_info_t* handler;
+
+  if (!(handlers = dispatch_index_lookup(dsmemsg_id(msg))))
+      return;
 
-  node = callbacks;
-  while ((node = g_slist_find_custom(node,
-                                     GUINT_TO_POINTER(dsmemsg_id(msg)),
-                                     msg_comparator)))
-  {
-      handler = (msg_handler_info_t*)(node->data);
+  /* Note: The array can change if a handler loads/unloads modules,
+   *       so the length must be re-evaluated on every round. */
+  for (guint i = 0; i < handlers->len; ++i) {
+      handler = g_ptr_array_index(handlers, i);
       if (handler && handler->callback) {
           if (!to || to == handler->owner) {
               if (msg->line_size_ >= handler->msg_size &&
@@ -581,16 +1031,26 @@ static int handle_message(endpoint_t*              from,
                            dsmemsg_id_name(msg->type_),
                            handler->owner->name);
 
+                  int64_t t1 = dispatch_clock_ns();
+
                   currently_handling_module = handler->owner;
                   handler->callback(from, msg);
                   currently_handling_module = 0;
+
+                  int64_t t2 = dispatch_clock_ns();
+
+                  /* Note: Handler might have been removed by
+                   *       the callback -> re-check before use */
+                  if (i < handlers->len &&
+                      g_ptr_array_index(handlers, i) == handler) {
+                      dispatch_stats_update(&handler->stats,
+                                            queued_at ? t1 - queued_at : 0,
+                                            t2 - t1);
+                  }
               }
           }
       }
-      node = g_slist_next(node);
   }
-
-  return 0;
 }
 
 bool modulebase_unload_module(module_t* module)
@@ -732,6 +1192,24 @@ bool modulebase_init(const struct _GSList* module_names)
     return true;
 }
 
+void modulebase_report_stats(modulebase_stats_fn_t* report, void* aptr)
+{
+    char row[256];
+
+    if (!report)
+        return;
+
+    snprintf(row, sizeof row, "queue: length=%u peak=%u total=%" PRIu64,
+             message_queue_len, message_queue_peak, message_queue_total);
+    report(aptr, row);
+
+    snprintf(row, sizeof row, "idle: emitted=%" PRIu64 " skipped=%" PRIu64,
+             idle_emitted, idle_skipped);
+    report(aptr, row);
+
+    dispatch_index_report(report, aptr);
+}
+
 const char* module_name(const module_t* module)
 {
     return module ? module->name : 0;
@@ -749,5 +1227,8 @@ int modulebase_shutdown(void)
 
 	modulebase_process_message_queue();
 
+	dispatch_index_quit();
+	msgqueue_quit();
+
 	return 0;
 }
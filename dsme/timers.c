@@ -3,6 +3,18 @@
 
    Implementation of DSME timers.
    <p>
+   All timers with non-zero interval are kept in a hierarchical timer
+   wheel that is driven by a single timerfd. Each timer has a slack
+   window during which it is allowed to fire, and the wheel wakes up
+   at the earliest end of any window, firing all timers whose window
+   has opened by then - so timers with overlapping windows are handled
+   in the same wakeup.
+   <p>
+   There is a separate wheel for each supported clock: CLOCK_MONOTONIC
+   for normal timers, CLOCK_BOOTTIME for timers that should take time
+   spent in suspend into account, and CLOCK_BOOTTIME_ALARM for timers
+   that should also wake the device up from suspend.
+   <p>
    Copyright (C) 2004-2010 Nokia Corporation.
    Copyright (C) 2015-2017 Jolla Ltd.
 
@@ -28,17 +40,660 @@
 
 #include "../include/dsme/timers.h"
 #include "../include/dsme/modulebase.h"
+#include "../include/dsme/mainloop.h"
 #include "../include/dsme/logging.h"
 
 #include <glib.h>
 
-typedef struct
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Number of levels in the timer wheel */
+#define TIMERWHEEL_LEVELS      8
+
+/** Number of slots in each level */
+#define TIMERWHEEL_SLOTS       64
+
+/** Each level is 2^TIMERWHEEL_LEVEL_SHIFT times coarser than the previous
+ *
+ * With 1 ms base resolution the levels cover ranges from 64 ms
+ * to about 37 hours. Timers further away are parked in the last
+ * slot of the top level and requeued when that is reached.
+ */
+#define TIMERWHEEL_LEVEL_SHIFT 3
+
+/** Default slack: fraction of the interval, capped [ms] */
+#define TIMERGATE_SLACK_DIVISOR 16
+#define TIMERGATE_SLACK_MAX     1000
+
+typedef struct timergate_t  timergate_t;
+typedef struct timerwheel_t timerwheel_t;
+
+/** Book keeping data for one DSME timer */
+struct timergate_t
 {
+    dsme_timer_t           tg_id;
+    timerwheel_t          *tg_wheel;
     const module_t        *tg_module;
+    dsme_main_loop_account_t *tg_account;
     guint                  tg_interval;
+    guint                  tg_slack;
     dsme_timer_callback_t  tg_callback;
     void                  *tg_data;
-} timergate_t;
+
+    /** Glib idle source, used for zero interval timers */
+    guint                  tg_idle_id;
+
+    /** Start of the window in which the timer may fire [ms] */
+    int64_t                tg_expire;
+
+    /** End of the window in which the timer may fire [ms] */
+    int64_t                tg_deadline;
+
+    /** Set if dsme_destroy_timer() is called during dispatch */
+    bool                   tg_destroyed;
+
+    /** Wheel slot or expired list linkage */
+    timergate_t           *tg_next;
+    timergate_t          **tg_pprev;
+};
+
+/** Timer wheel driven by a timerfd */
+struct timerwheel_t
+{
+    /** Clock used for timer expiry */
+    clockid_t     tw_clockid;
+
+    /** Clock name for diagnostics */
+    const char   *tw_name;
+
+    /** Flag for: timerfd can't be created for the clock */
+    bool          tw_unavailable;
+
+    /** Time up to which the wheel has been processed [ms] */
+    int64_t       tw_clk;
+
+    /** Timer lists for each level and slot */
+    timergate_t  *tw_slot[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+
+    /** Bitmap of non-empty slots for each level */
+    uint64_t      tw_occupied[TIMERWHEEL_LEVELS];
+
+    /** Timers taken out of the wheel and waiting for dispatch */
+    timergate_t  *tw_expired;
+
+    /** Timer whose callback is being executed */
+    timergate_t  *tw_current;
+
+    /** Number of timers in the wheel */
+    unsigned      tw_count;
+
+    /** Largest slack of timers in the wheel [ms] */
+    guint         tw_max_slack;
+
+    /** Timerfd and glib io watch for it */
+    int           tw_fd;
+    guint         tw_watch_id;
+
+    /** Absolute wakeup time the timerfd is armed for, or -1 [ms] */
+    int64_t       tw_armed;
+
+    /** Coalescing statistics */
+    struct {
+        unsigned  peak;
+        uint64_t  created;
+        uint64_t  wakeups;
+        uint64_t  spurious;
+        uint64_t  fired;
+        uint64_t  early;
+        uint64_t  requeued;
+        unsigned  max_per_wakeup;
+        int64_t   max_late;
+    } tw_stats;
+};
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * TIMERWHEEL
+ * ------------------------------------------------------------------------- */
+
+static int64_t      timerwheel_now           (const timerwheel_t *self);
+static int64_t      timerwheel_slot_start    (const timerwheel_t *self, int lvl, unsigned off);
+static unsigned     timerwheel_slot_offset   (const timerwheel_t *self, int lvl, unsigned off);
+static int          timerwheel_first_offset  (const timerwheel_t *self, int lvl, uint64_t bits);
+static void         timerwheel_link          (timergate_t **head, timergate_t *timer);
+static void         timerwheel_unlink        (timergate_t *timer);
+static void         timerwheel_insert        (timerwheel_t *self, timergate_t *timer);
+static void         timerwheel_detach        (timerwheel_t *self, timergate_t *timer);
+static void         timerwheel_remove        (timerwheel_t *self, timergate_t *timer);
+static void         timerwheel_take_slot     (timerwheel_t *self, int lvl, unsigned idx, int64_t now);
+static unsigned     timerwheel_take_early    (timerwheel_t *self, int64_t now);
+static unsigned     timerwheel_advance       (timerwheel_t *self, int64_t now);
+static int64_t      timerwheel_next_wakeup   (const timerwheel_t *self);
+static void         timerwheel_rethink       (timerwheel_t *self);
+static void         timerwheel_dispatch      (timerwheel_t *self, int64_t now);
+static gboolean     timerwheel_iowatch_cb    (GIOChannel *chn, GIOCondition cnd, gpointer aptr);
+static bool         timerwheel_init          (timerwheel_t *self);
+
+/* ------------------------------------------------------------------------- *
+ * TIMERGATE
+ * ------------------------------------------------------------------------- */
+
+static dsme_timer_t timergate_add_id         (timergate_t *self);
+static void         timergate_delete         (timergate_t *self);
+static void         timergate_delete_cb      (gpointer aptr);
+static int          timergate_call           (timergate_t *self);
+static gboolean     timergate_idle_cb        (gpointer aptr);
+static void         timergate_schedule       (timergate_t *self, int64_t now);
+static dsme_timer_t timergate_create         (timerwheel_t *wheel, gint priority, guint interval, guint slack, dsme_timer_callback_t callback, void *data);
+static unsigned     timergate_default_slack  (unsigned interval);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Wheel for timers using CLOCK_MONOTONIC */
+static timerwheel_t timerwheel_monotonic =
+{
+    .tw_clockid = CLOCK_MONOTONIC,
+    .tw_name    = "monotonic",
+    .tw_fd      = -1,
+    .tw_armed   = -1,
+};
+
+/** Wheel for timers using CLOCK_BOOTTIME */
+static timerwheel_t timerwheel_boottime =
+{
+    .tw_clockid = CLOCK_BOOTTIME,
+    .tw_name    = "boottime",
+    .tw_fd      = -1,
+    .tw_armed   = -1,
+};
+
+/** Wheel for timers using CLOCK_BOOTTIME_ALARM */
+static timerwheel_t timerwheel_alarm =
+{
+    .tw_clockid = CLOCK_BOOTTIME_ALARM,
+    .tw_name    = "alarm",
+    .tw_fd      = -1,
+    .tw_armed   = -1,
+};
+
+/** All timer wheels, for reporting */
+static timerwheel_t * const timerwheel_lut[] =
+{
+    &timerwheel_monotonic,
+    &timerwheel_boottime,
+    &timerwheel_alarm,
+};
+
+/** Lookup table for timer id -> timergate_t */
+static GHashTable *timergate_lut = 0;
+
+/** Last timer id that was handed out */
+static dsme_timer_t timergate_last_id = 0;
+
+/* ========================================================================= *
+ * TIMERWHEEL
+ * ========================================================================= */
+
+static int64_t
+timerwheel_now(const timerwheel_t *self)
+{
+    struct timespec ts = { 0, 0 };
+
+    /* Alarm timers run on boottime, which can be read also
+     * when there is no rtc device to back CLOCK_BOOTTIME_ALARM */
+    if( self->tw_clockid == CLOCK_BOOTTIME_ALARM )
+        clock_gettime(CLOCK_BOOTTIME, &ts);
+    else
+        clock_gettime(self->tw_clockid, &ts);
+    return ts.tv_sec * INT64_C(1000) + ts.tv_nsec / 1000000;
+}
+
+/** Start time of slot that is given offset after current wheel position */
+static int64_t
+timerwheel_slot_start(const timerwheel_t *self, int lvl, unsigned off)
+{
+    int shift = lvl * TIMERWHEEL_LEVEL_SHIFT;
+    return ((self->tw_clk >> shift) + off) << shift;
+}
+
+/** Slot index for given offset after current wheel position */
+static unsigned
+timerwheel_slot_offset(const timerwheel_t *self, int lvl, unsigned off)
+{
+    int shift = lvl * TIMERWHEEL_LEVEL_SHIFT;
+    return ((self->tw_clk >> shift) + off) % TIMERWHEEL_SLOTS;
+}
+
+/** Offset from current wheel position to the first non-empty slot
+ *
+ * @param self  timer wheel
+ * @param lvl   wheel level
+ * @param bits  slot occupation bitmap, normally tw_occupied[lvl]
+ *
+ * @return 0 ... TIMERWHEEL_SLOTS-1, or -1 if there are no slots left
+ */
+static int
+timerwheel_first_offset(const timerwheel_t *self, int lvl, uint64_t bits)
+{
+    if( !bits )
+        return -1;
+
+    unsigned cur = timerwheel_slot_offset(self, lvl, 0);
+    uint64_t rot = cur ? (bits >> cur) | (bits << (64 - cur)) : bits;
+
+    return __builtin_ctzll(rot);
+}
+
+static void
+timerwheel_link(timergate_t **head, timergate_t *timer)
+{
+    if( (timer->tg_next = *head) )
+        timer->tg_next->tg_pprev = &timer->tg_next;
+    timer->tg_pprev = head;
+    *head = timer;
+}
+
+static void
+timerwheel_unlink(timergate_t *timer)
+{
+    if( timer->tg_pprev ) {
+        if( (*timer->tg_pprev = timer->tg_next) )
+            timer->tg_next->tg_pprev = timer->tg_pprev;
+        timer->tg_next  = 0;
+        timer->tg_pprev = 0;
+    }
+}
+
+/** Add timer to the wheel slot matching its deadline
+ *
+ * The timer is placed at the finest level that can hold its
+ * deadline. On coarser levels the slot is reached before the
+ * deadline, at which point the timer is requeued on a finer level.
+ */
+static void
+timerwheel_insert(timerwheel_t *self, timergate_t *timer)
+{
+    int      lvl = 0;
+    unsigned off = 0;
+
+    for( ;; ++lvl ) {
+        int shift = lvl * TIMERWHEEL_LEVEL_SHIFT;
+        int64_t diff = (timer->tg_deadline >> shift) - (self->tw_clk >> shift);
+
+        if( diff < TIMERWHEEL_SLOTS ) {
+            off = (unsigned)diff;
+            break;
+        }
+
+        if( lvl == TIMERWHEEL_LEVELS - 1 ) {
+            off = TIMERWHEEL_SLOTS - 1;
+            break;
+        }
+    }
+
+    unsigned idx = timerwheel_slot_offset(self, lvl, off);
+
+    timerwheel_link(&self->tw_slot[lvl][idx], timer);
+    self->tw_occupied[lvl] |= UINT64_C(1) << idx;
+
+    if( self->tw_max_slack < timer->tg_slack )
+        self->tw_max_slack = timer->tg_slack;
+}
+
+/** Remove timer from a wheel slot or the expired list */
+static void
+timerwheel_detach(timerwheel_t *self, timergate_t *timer)
+{
+    timergate_t **head = timer->tg_pprev;
+
+    timerwheel_unlink(timer);
+
+    /* Update occupied bitmap if a slot became empty */
+    if( head && !*head ) {
+        for( int lvl = 0; lvl < TIMERWHEEL_LEVELS; ++lvl ) {
+            timergate_t **base = self->tw_slot[lvl];
+            if( head >= base && head < base + TIMERWHEEL_SLOTS ) {
+                self->tw_occupied[lvl] &= ~(UINT64_C(1) << (head - base));
+                break;
+            }
+        }
+    }
+}
+
+/** Remove timer from the wheel for good */
+static void
+timerwheel_remove(timerwheel_t *self, timergate_t *timer)
+{
+    timerwheel_detach(self, timer);
+
+    if( self->tw_count > 0 && --self->tw_count == 0 )
+        self->tw_max_slack = 0;
+}
+
+/** Move timers in a slot to the expired list, or requeue them */
+static void
+timerwheel_take_slot(timerwheel_t *self, int lvl, unsigned idx, int64_t now)
+{
+    timergate_t *list = self->tw_slot[lvl][idx];
+
+    self->tw_slot[lvl][idx] = 0;
+    self->tw_occupied[lvl] &= ~(UINT64_C(1) << idx);
+
+    if( list )
+        list->tg_pprev = &list;
+
+    while( list ) {
+        timergate_t *timer = list;
+        timerwheel_unlink(timer);
+
+        if( timer->tg_deadline <= now ) {
+            timerwheel_link(&self->tw_expired, timer);
+        }
+        else {
+            timerwheel_insert(self, timer);
+            self->tw_stats.requeued += 1;
+        }
+    }
+}
+
+/** Move timers whose slack window is already open to the expired list
+ *
+ * Only slots that can contain deadlines within the largest slack
+ * from now need to be checked.
+ *
+ * @return number of timers taken
+ */
+static unsigned
+timerwheel_take_early(timerwheel_t *self, int64_t now)
+{
+    unsigned taken = 0;
+    int64_t  limit = now + self->tw_max_slack;
+
+    if( self->tw_max_slack == 0 )
+        goto EXIT;
+
+    for( int lvl = 0; lvl < TIMERWHEEL_LEVELS; ++lvl ) {
+        uint64_t bits = self->tw_occupied[lvl];
+
+        for( unsigned off = 0; off < TIMERWHEEL_SLOTS && bits; ++off ) {
+            if( timerwheel_slot_start(self, lvl, off) > limit )
+                break;
+
+            unsigned idx = timerwheel_slot_offset(self, lvl, off);
+            if( !(bits & (UINT64_C(1) << idx)) )
+                continue;
+            bits &= ~(UINT64_C(1) << idx);
+
+            timergate_t *timer = self->tw_slot[lvl][idx];
+            while( timer ) {
+                timergate_t *next = timer->tg_next;
+                if( timer->tg_expire <= now ) {
+                    timerwheel_detach(self, timer);
+                    timerwheel_link(&self->tw_expired, timer);
+                    ++taken;
+                }
+                timer = next;
+            }
+        }
+    }
+
+EXIT:
+    return taken;
+}
+
+/** Process all wheel slots that have been reached
+ *
+ * @return number of timers that expired
+ */
+static unsigned
+timerwheel_advance(timerwheel_t *self, int64_t now)
+{
+    unsigned expired = 0;
+
+    for( ;; ) {
+        int      lvl   = -1;
+        int64_t  start = 0;
+        unsigned idx   = 0;
+
+        for( int i = 0; i < TIMERWHEEL_LEVELS; ++i ) {
+            int off = timerwheel_first_offset(self, i, self->tw_occupied[i]);
+            if( off < 0 )
+                continue;
+
+            int64_t t = timerwheel_slot_start(self, i, off);
+            if( lvl < 0 || t < start ) {
+                lvl   = i;
+                start = t;
+                idx   = timerwheel_slot_offset(self, i, off);
+            }
+        }
+
+        if( lvl < 0 || start > now )
+            break;
+
+        if( self->tw_clk < start )
+            self->tw_clk = start;
+
+        timerwheel_take_slot(self, lvl, idx, now);
+    }
+
+    self->tw_clk = now;
+
+    for( timergate_t *timer = self->tw_expired; timer; timer = timer->tg_next )
+        ++expired;
+
+    return expired;
+}
+
+/** Earliest deadline of timers in the wheel
+ *
+ * @return absolute time [ms], or -1 if there are no timers
+ */
+static int64_t
+timerwheel_next_wakeup(const timerwheel_t *self)
+{
+    int64_t wakeup = -1;
+
+    /* The first occupied slot on each level holds the earliest
+     * deadlines of that level - except on the top level, where
+     * the parking slot for far away timers can be anywhere */
+    for( int lvl = 0; lvl < TIMERWHEEL_LEVELS; ++lvl ) {
+        uint64_t bits = self->tw_occupied[lvl];
+
+        for( int off; (off = timerwheel_first_offset(self, lvl, bits)) >= 0; ) {
+            unsigned idx = timerwheel_slot_offset(self, lvl, off);
+
+            for( timergate_t *timer = self->tw_slot[lvl][idx]; timer;
+                 timer = timer->tg_next ) {
+                if( wakeup < 0 || wakeup > timer->tg_deadline )
+                    wakeup = timer->tg_deadline;
+            }
+
+            if( lvl < TIMERWHEEL_LEVELS - 1 )
+                break;
+
+            bits &= ~(UINT64_C(1) << idx);
+        }
+    }
+
+    return wakeup;
+}
+
+/** Arm the timerfd for the earliest deadline in the wheel */
+static void
+timerwheel_rethink(timerwheel_t *self)
+{
+    int64_t wakeup = timerwheel_next_wakeup(self);
+
+    if( self->tw_armed == wakeup || self->tw_fd == -1 )
+        goto EXIT;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof its);
+
+    if( wakeup >= 0 ) {
+        its.it_value.tv_sec  = wakeup / 1000;
+        its.it_value.tv_nsec = wakeup % 1000 * 1000000;
+
+        /* Zero would disarm the timer */
+        if( !its.it_value.tv_sec && !its.it_value.tv_nsec )
+            its.it_value.tv_nsec = 1;
+    }
+
+    if( timerfd_settime(self->tw_fd, TFD_TIMER_ABSTIME, &its, 0) == -1 ) {
+        dsme_log(LOG_ERR, "timerfd_settime: %m");
+        wakeup = -1;
+    }
+
+    self->tw_armed = wakeup;
+
+EXIT:
+    return;
+}
+
+/** Execute callbacks of expired timers */
+static void
+timerwheel_dispatch(timerwheel_t *self, int64_t now)
+{
+    timergate_t *timer;
+
+    while( (timer = self->tw_expired) ) {
+        timerwheel_remove(self, timer);
+
+        if( self->tw_stats.max_late < now - timer->tg_deadline )
+            self->tw_stats.max_late = now - timer->tg_deadline;
+
+        self->tw_stats.fired += 1;
+
+        self->tw_current = timer;
+        int rc = timergate_call(timer);
+        self->tw_current = 0;
+
+        if( !rc || timer->tg_destroyed )
+            timergate_delete(timer);
+        else
+            timergate_schedule(timer, now);
+    }
+}
+
+static gboolean
+timerwheel_iowatch_cb(GIOChannel *chn, GIOCondition cnd, gpointer aptr)
+{
+    (void)chn;
+
+    timerwheel_t *self = aptr;
+    uint64_t      cnt  = 0;
+
+    if( cnd & ~G_IO_IN ) {
+        dsme_log(LOG_CRIT, "timerfd error condition; timers disabled");
+        self->tw_watch_id = 0;
+        return FALSE;
+    }
+
+    if( read(self->tw_fd, &cnt, sizeof cnt) == -1 &&
+        errno != EAGAIN && errno != EINTR )
+        dsme_log(LOG_ERR, "timerfd read: %m");
+
+    self->tw_armed = -1;
+
+    int64_t  now   = timerwheel_now(self);
+    unsigned count = timerwheel_advance(self, now);
+    unsigned early = timerwheel_take_early(self, now);
+
+    self->tw_stats.wakeups += 1;
+    self->tw_stats.early   += early;
+
+    if( count == 0 )
+        self->tw_stats.spurious += 1;
+
+    if( self->tw_stats.max_per_wakeup < count + early )
+        self->tw_stats.max_per_wakeup = count + early;
+
+    timerwheel_dispatch(self, now);
+    timerwheel_rethink(self);
+
+    return TRUE;
+}
+
+static bool
+timerwheel_init(timerwheel_t *self)
+{
+    GIOChannel *chn = 0;
+
+    if( self->tw_watch_id || self->tw_unavailable )
+        goto EXIT;
+
+    if( self->tw_fd == -1 ) {
+        self->tw_fd = timerfd_create(self->tw_clockid,
+                                     TFD_NONBLOCK | TFD_CLOEXEC);
+        if( self->tw_fd == -1 ) {
+            /* Alarm clocks need CAP_WAKE_ALARM and kernel support */
+            if( errno == EPERM || errno == EINVAL ) {
+                dsme_log(LOG_WARNING, "%s timers not available: %m",
+                         self->tw_name);
+                self->tw_unavailable = true;
+            }
+            else {
+                dsme_log(LOG_CRIT, "%s timerfd_create: %m", self->tw_name);
+            }
+            goto EXIT;
+        }
+    }
+
+    if( !(chn = g_io_channel_unix_new(self->tw_fd)) )
+        goto EXIT;
+
+    self->tw_watch_id = dsme_main_loop_add_watch("timerwheel", chn,
+                                                 G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                                 timerwheel_iowatch_cb, self);
+    self->tw_clk   = timerwheel_now(self);
+    self->tw_armed = -1;
+
+EXIT:
+    if( chn )
+        g_io_channel_unref(chn);
+
+    return self->tw_watch_id != 0;
+}
+
+/* ========================================================================= *
+ * TIMERGATE
+ * ========================================================================= */
+
+/** Assign unique timer id and add timer to lookup table */
+static dsme_timer_t
+timergate_add_id(timergate_t *self)
+{
+    if( !timergate_lut )
+        timergate_lut = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    do {
+        if( ++timergate_last_id == 0 )
+            timergate_last_id = 1;
+    } while( g_hash_table_lookup(timergate_lut,
+                                 GUINT_TO_POINTER(timergate_last_id)) );
+
+    self->tg_id = timergate_last_id;
+    g_hash_table_insert(timergate_lut, GUINT_TO_POINTER(self->tg_id), self);
+
+    return self->tg_id;
+}
 
 static void
 timergate_delete(timergate_t *self)
@@ -48,6 +703,10 @@ timergate_delete(timergate_t *self)
 
     dsme_log(LOG_DEBUG, "delete %ums timer from module: %s",
              self->tg_interval, module_name(self->tg_module) ?: "unknown");
+
+    if( self->tg_id && timergate_lut )
+        g_hash_table_remove(timergate_lut, GUINT_TO_POINTER(self->tg_id));
+
     g_slice_free1(sizeof *self, self);
 
 EXIT:
@@ -60,64 +719,131 @@ timergate_delete_cb(gpointer aptr)
     timergate_delete(aptr);
 }
 
-static gboolean
-timergate_timeout_cb(gpointer aptr)
+static int
+timergate_call(timergate_t *self)
 {
-    timergate_t *self = aptr;
-
     dsme_log(LOG_DEBUG, "dispatch %ums timer at module: %s",
              self->tg_interval, module_name(self->tg_module) ?: "unknown");
 
+    dsme_main_loop_dispatch_t ctx;
+    dsme_main_loop_dispatch_begin(&ctx, self->tg_account);
+
     const module_t *cur = modulebase_enter_module(self->tg_module);
     int rc = self->tg_callback(self->tg_data);
     modulebase_enter_module(cur);
 
-    return rc != 0;
+    dsme_main_loop_dispatch_end(&ctx);
+
+    return rc;
+}
+
+static gboolean
+timergate_idle_cb(gpointer aptr)
+{
+    timergate_t *self = aptr;
+
+    if( !timergate_call(self) ) {
+        self->tg_idle_id = 0;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/** Add timer to the wheel to expire after interval from now */
+static void
+timergate_schedule(timergate_t *self, int64_t now)
+{
+    timerwheel_t *wheel = self->tg_wheel;
+
+    if( wheel->tw_count++ == 0 )
+        wheel->tw_clk = now;
+
+    if( wheel->tw_stats.peak < wheel->tw_count )
+        wheel->tw_stats.peak = wheel->tw_count;
+
+    self->tg_expire   = now + self->tg_interval;
+    self->tg_deadline = self->tg_expire + self->tg_slack;
+
+    timerwheel_insert(wheel, self);
 }
 
 static dsme_timer_t
-timergate_create(gint priority,
+timergate_create(timerwheel_t *wheel,
+                 gint priority,
                  guint interval,
+                 guint slack,
                  dsme_timer_callback_t callback,
                  void *data)
 {
-    guint id = 0;
+    dsme_timer_t id = 0;
+
+    /* Without wakeup alarm support, fall back to boottime */
+    if( wheel == &timerwheel_alarm && interval > 0 &&
+        !timerwheel_init(wheel) )
+        wheel = &timerwheel_boottime;
+
+    if( interval > 0 && !timerwheel_init(wheel) )
+        goto EXIT;
 
     timergate_t *self = g_slice_alloc0(sizeof *self);
 
+    self->tg_wheel    = wheel;
     self->tg_module   = modulebase_current_module();
+    self->tg_account  = dsme_main_loop_account("timer", self->tg_module);
     self->tg_interval = interval;
+    self->tg_slack    = slack;
     self->tg_callback = callback;
     self->tg_data     = data;
 
-    dsme_log(LOG_DEBUG, "create %ums timer from module: %s",
-             self->tg_interval, module_name(self->tg_module) ?: "unknown");
+    dsme_log(LOG_DEBUG, "create %ums %s timer from module: %s",
+             self->tg_interval, wheel->tw_name,
+             module_name(self->tg_module) ?: "unknown");
 
     if( interval > 0 ) {
-        id = g_timeout_add_full(priority, interval,
-                                timergate_timeout_cb,
-                                self, timergate_delete_cb);
+        timergate_schedule(self, timerwheel_now(wheel));
+        wheel->tw_stats.created += 1;
+
+        /* Wakeup is moved only if the new timer is due earlier;
+         * when dispatching, rethink is done after the callbacks */
+        if( !wheel->tw_current &&
+            (wheel->tw_armed < 0 || wheel->tw_armed > self->tg_deadline) )
+            timerwheel_rethink(wheel);
     }
     else {
-        id = g_idle_add_full(priority,
-                             timergate_timeout_cb,
-                             self, timergate_delete_cb);
+        self->tg_idle_id = g_idle_add_full(priority,
+                                           timergate_idle_cb,
+                                           self, timergate_delete_cb);
+        if( !self->tg_idle_id ) {
+            timergate_delete(self);
+            goto EXIT;
+        }
     }
 
-    if( !id )
-        timergate_delete(self);
+    id = timergate_add_id(self);
 
+EXIT:
     return id;
 }
 
+/** Slack used when not explicitly specified [ms] */
+static unsigned
+timergate_default_slack(unsigned interval)
+{
+    unsigned slack = interval / TIMERGATE_SLACK_DIVISOR;
+
+    if( slack > TIMERGATE_SLACK_MAX )
+        slack = TIMERGATE_SLACK_MAX;
+
+    return slack;
+}
+
 dsme_timer_t
 dsme_create_timer_seconds(unsigned              seconds,
                           dsme_timer_callback_t callback,
                           void*                 data)
 {
-    return timergate_create(G_PRIORITY_DEFAULT,
-                            seconds * 1000,
-                            callback, data);
+    return dsme_create_timer(seconds * 1000, callback, data);
 }
 
 dsme_timer_t
@@ -125,14 +851,118 @@ dsme_create_timer(unsigned              milliseconds,
                   dsme_timer_callback_t callback,
                   void*                 data)
 {
-    return timergate_create(G_PRIORITY_DEFAULT,
+    return timergate_create(&timerwheel_monotonic, G_PRIORITY_DEFAULT,
                             milliseconds,
+                            timergate_default_slack(milliseconds),
+                            callback, data);
+}
+
+dsme_timer_t
+dsme_create_timer_slack(unsigned              milliseconds,
+                        unsigned              slack,
+                        dsme_timer_callback_t callback,
+                        void*                 data)
+{
+    return timergate_create(&timerwheel_monotonic, G_PRIORITY_DEFAULT,
+                            milliseconds, slack,
+                            callback, data);
+}
+
+dsme_timer_t
+dsme_create_timer_boottime(unsigned              milliseconds,
+                           dsme_timer_callback_t callback,
+                           void*                 data)
+{
+    return timergate_create(&timerwheel_boottime, G_PRIORITY_DEFAULT,
+                            milliseconds,
+                            timergate_default_slack(milliseconds),
+                            callback, data);
+}
+
+dsme_timer_t
+dsme_create_timer_alarm(unsigned              milliseconds,
+                        dsme_timer_callback_t callback,
+                        void*                 data)
+{
+    return timergate_create(&timerwheel_alarm, G_PRIORITY_DEFAULT,
+                            milliseconds,
+                            timergate_default_slack(milliseconds),
                             callback, data);
 }
 
 void
 dsme_destroy_timer(dsme_timer_t timer)
 {
-    if( timer )
-        g_source_remove(timer);
+    timerwheel_t *wheel = 0;
+    timergate_t  *self  = 0;
+
+    if( !timer )
+        goto EXIT;
+
+    if( timergate_lut )
+        self = g_hash_table_lookup(timergate_lut, GUINT_TO_POINTER(timer));
+
+    if( !self ) {
+        dsme_log(LOG_WARNING, "timer %u does not exist", timer);
+        goto EXIT;
+    }
+
+    wheel = self->tg_wheel;
+
+    if( self->tg_idle_id ) {
+        /* Timer is released via glib destroy notification */
+        g_source_remove(self->tg_idle_id);
+    }
+    else if( self == wheel->tw_current ) {
+        /* Timer is released after the callback returns */
+        g_hash_table_remove(timergate_lut, GUINT_TO_POINTER(self->tg_id));
+        self->tg_id = 0;
+        self->tg_destroyed = true;
+    }
+    else {
+        timerwheel_remove(wheel, self);
+        timergate_delete(self);
+
+        if( wheel->tw_count == 0 && !wheel->tw_current )
+            timerwheel_rethink(wheel);
+    }
+
+EXIT:
+    return;
+}
+
+void
+dsme_timers_report_stats(void (*report)(void *aptr, const char *row),
+                         void *aptr)
+{
+    char row[256];
+
+    for( size_t i = 0; i < G_N_ELEMENTS(timerwheel_lut); ++i ) {
+        const timerwheel_t *wheel = timerwheel_lut[i];
+
+        /* Skip clocks that have not been used */
+        if( wheel != &timerwheel_monotonic && !wheel->tw_stats.created )
+            continue;
+
+        uint64_t fired   = wheel->tw_stats.fired;
+        uint64_t wakeups = wheel->tw_stats.wakeups;
+
+        snprintf(row, sizeof row,
+                 "timers: %s: active=%u peak=%u created=%llu wakeups=%llu"
+                 " fired=%llu avg/wakeup=%.2f max/wakeup=%u early=%llu"
+                 " requeued=%llu spurious=%llu max_late=%lldms",
+                 wheel->tw_name,
+                 wheel->tw_count,
+                 wheel->tw_stats.peak,
+                 (unsigned long long)wheel->tw_stats.created,
+                 (unsigned long long)wakeups,
+                 (unsigned long long)fired,
+                 wakeups ? (double)fired / wakeups : 0.0,
+                 wheel->tw_stats.max_per_wakeup,
+                 (unsigned long long)wheel->tw_stats.early,
+                 (unsigned long long)wheel->tw_stats.requeued,
+                 (unsigned long long)wheel->tw_stats.spurious,
+                 (long long)wheel->tw_stats.max_late);
+        report(aptr, row);
+    }
 }
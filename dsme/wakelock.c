@@ -0,0 +1,448 @@
+/**
+   @file wakelock.c
+
+   Sysfs wakelock manipulation shared by dsme and dsme-server.
+   <p>
+   The /sys/power/wake_lock and /sys/power/wake_unlock files are
+   opened on first use and kept open. The kernel does not use the
+   file position for these attributes, so each write on the same
+   file descriptor is handled as a separate lock / unlock request.
+   <p>
+   Known wakelocks are tracked in a small fixed size table. Signal
+   handlers in dsme bypass the table and write preformatted requests
+   to the already open control file.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "wakelock.h"
+
+#include "../include/dsme/logging.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Sysfs entry for acquiring wakelocks */
+#define WAKELOCK_LOCK_PATH   "/sys/power/wake_lock"
+
+/** Sysfs entry for releasing wakelocks */
+#define WAKELOCK_UNLOCK_PATH "/sys/power/wake_unlock"
+
+/** Maximum number of tracked wakelocks */
+#define WAKELOCK_MAX         16
+
+/** Maximum length of tracked wakelock name, including terminator */
+#define WAKELOCK_NAME_MAX    48
+
+/** State of the sysfs control files */
+typedef enum {
+    WAKELOCK_SYSFS_CLOSED,
+    WAKELOCK_SYSFS_OPEN,
+    WAKELOCK_SYSFS_UNSUPPORTED,
+} wakelock_sysfs_t;
+
+/** Tracking data for one wakelock */
+typedef struct {
+    char     name[WAKELOCK_NAME_MAX];
+    int      refs;       /**< Lock calls without matching unlock */
+    bool     held;       /**< Kernel side lock is active */
+    bool     pending;    /**< Kernel side unlock has been deferred */
+    int64_t  since;      /**< When kernel side lock was taken [ms] */
+    int64_t  expires;    /**< Kernel side lock timeout, or zero [ms] */
+    uint64_t calls;      /**< Number of lock calls */
+    uint64_t locks;      /**< Number of kernel side locks */
+    uint64_t unlocks;    /**< Number of kernel side unlocks */
+    int64_t  held_total; /**< Total kernel side hold time [ms] */
+    int64_t  held_max;   /**< Longest kernel side hold time [ms] */
+} wakelock_t;
+
+static wakelock_t       wakelock_lut[WAKELOCK_MAX];
+static int              wakelock_count     = 0;
+static unsigned         wakelock_pending   = 0;
+static wakelock_sysfs_t wakelock_sysfs     = WAKELOCK_SYSFS_CLOSED;
+static int              wakelock_lock_fd   = -1;
+static int              wakelock_unlock_fd = -1;
+
+static struct {
+    uint64_t writes;   /**< sysfs writes made */
+    uint64_t failed;   /**< sysfs writes that failed */
+    uint64_t skipped;  /**< lock / unlock calls that needed no write */
+    uint64_t deferred; /**< kernel side unlocks deferred */
+} wakelock_stats;
+
+/** Get monotonic time stamp in milliseconds
+ */
+static int64_t wakelock_now(void)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000) + ts.tv_nsec / 1000000;
+}
+
+/** Open the sysfs control files if not already done
+ *
+ * @return true if the files are open, false otherwise
+ */
+static bool wakelock_open(void)
+{
+    if( wakelock_sysfs == WAKELOCK_SYSFS_CLOSED ) {
+        wakelock_lock_fd   = open(WAKELOCK_LOCK_PATH, O_WRONLY | O_CLOEXEC);
+        wakelock_unlock_fd = open(WAKELOCK_UNLOCK_PATH, O_WRONLY | O_CLOEXEC);
+
+        if( wakelock_lock_fd != -1 && wakelock_unlock_fd != -1 ) {
+            wakelock_sysfs = WAKELOCK_SYSFS_OPEN;
+        }
+        else {
+            dsme_log(LOG_DEBUG, "wakelocks are not supported");
+            wakelock_sysfs = WAKELOCK_SYSFS_UNSUPPORTED;
+            dsme_wakelock_quit();
+        }
+    }
+
+    return wakelock_sysfs == WAKELOCK_SYSFS_OPEN;
+}
+
+/** Write lock / unlock request to sysfs
+ *
+ * @param lock    true to lock, false to unlock
+ * @param name    name of the wakelock
+ * @param ms      timeout in milliseconds, or negative for none
+ */
+static void wakelock_write(bool lock, const char *name, int ms)
+{
+    char tmp[256];
+    int  len;
+
+    if( lock && ms >= 0 )
+        len = snprintf(tmp, sizeof tmp, "%s %lld\n", name, ms * 1000000LL);
+    else
+        len = snprintf(tmp, sizeof tmp, "%s\n", name);
+
+    if( len <= 0 || len >= (int)sizeof tmp )
+        return;
+
+    int fd = lock ? wakelock_lock_fd : wakelock_unlock_fd;
+
+    wakelock_stats.writes += 1;
+    errno = 0;
+    if( TEMP_FAILURE_RETRY(write(fd, tmp, len)) != len ) {
+        /* assume EINVAL on unlock == the wakelock did not exist */
+        if( lock || errno != EINVAL ) {
+            wakelock_stats.failed += 1;
+            dsme_log(LOG_WARNING, "%s: write: %m",
+                     lock ? WAKELOCK_LOCK_PATH : WAKELOCK_UNLOCK_PATH);
+        }
+    }
+}
+
+/** Find tracking data for a wakelock
+ *
+ * @param name    name of the wakelock
+ * @param create  add tracking data if not found
+ *
+ * @return tracking data, or NULL if not tracked
+ */
+static wakelock_t *wakelock_find(const char *name, bool create)
+{
+    for( int i = 0; i < wakelock_count; ++i ) {
+        if( !strcmp(wakelock_lut[i].name, name) )
+            return &wakelock_lut[i];
+    }
+
+    if( !create || strlen(name) >= WAKELOCK_NAME_MAX )
+        return 0;
+
+    if( wakelock_count >= WAKELOCK_MAX ) {
+        dsme_log(LOG_WARNING, "%s: too many wakelocks to track", name);
+        return 0;
+    }
+
+    wakelock_t *wl = &wakelock_lut[wakelock_count++];
+    strcpy(wl->name, name);
+    return wl;
+}
+
+/** Update statistics when kernel side lock ends
+ *
+ * @param wl   wakelock tracking data
+ * @param now  current time [ms]
+ */
+static void wakelock_held_end(wakelock_t *wl, int64_t now)
+{
+    if( wl->expires && wl->expires < now )
+        now = wl->expires;
+
+    int64_t held = now - wl->since;
+
+    wl->held_total += held;
+    if( wl->held_max < held )
+        wl->held_max = held;
+
+    wl->held    = false;
+    wl->expires = 0;
+}
+
+/** Notice kernel side locks that have timed out
+ *
+ * @param wl   wakelock tracking data
+ * @param now  current time [ms]
+ */
+static void wakelock_check_expired(wakelock_t *wl, int64_t now)
+{
+    if( wl->held && wl->expires && wl->expires <= now )
+        wakelock_held_end(wl, now);
+}
+
+/** Cancel deferred kernel side unlock
+ *
+ * @param wl   wakelock tracking data
+ */
+static void wakelock_cancel_pending(wakelock_t *wl)
+{
+    if( wl->pending ) {
+        wl->pending = false;
+        wakelock_pending -= 1;
+    }
+}
+
+/** Release kernel side lock
+ *
+ * @param wl   wakelock tracking data
+ * @param now  current time [ms]
+ */
+static void wakelock_release_now(wakelock_t *wl, int64_t now)
+{
+    wakelock_cancel_pending(wl);
+
+    if( wl->held ) {
+        wakelock_write(false, wl->name, -1);
+        wl->unlocks += 1;
+        wakelock_held_end(wl, now);
+    }
+}
+
+/** Drop one reference to a wakelock
+ *
+ * @param name   name of the wakelock
+ * @param defer  true to defer kernel side unlock
+ *
+ * @return true if kernel side unlock was deferred, false otherwise
+ */
+static bool wakelock_unref(const char *name, bool defer)
+{
+    if( !wakelock_open() )
+        return false;
+
+    wakelock_t *wl = wakelock_find(name, false);
+
+    if( !wl ) {
+        /* Not tracked, pass through as is */
+        wakelock_write(false, name, -1);
+        return false;
+    }
+
+    int64_t now = wakelock_now();
+    wakelock_check_expired(wl, now);
+
+    if( wl->expires ) {
+        /* Locks with timeout are not reference counted */
+        wakelock_release_now(wl, now);
+    }
+    else if( wl->refs <= 0 || --wl->refs > 0 || !wl->held ) {
+        wakelock_stats.skipped += 1;
+    }
+    else if( defer ) {
+        if( !wl->pending ) {
+            wl->pending = true;
+            wakelock_pending += 1;
+            wakelock_stats.deferred += 1;
+        }
+    }
+    else {
+        wakelock_release_now(wl, now);
+    }
+
+    return wl->pending;
+}
+
+bool dsme_wakelock_supported(void)
+{
+    return wakelock_open();
+}
+
+void dsme_wakelock_lock(const char *name, int ms)
+{
+    if( !wakelock_open() )
+        return;
+
+    wakelock_t *wl = wakelock_find(name, true);
+
+    if( !wl ) {
+        /* Not tracked, pass through as is */
+        wakelock_write(true, name, ms);
+        return;
+    }
+
+    int64_t now = wakelock_now();
+    wakelock_check_expired(wl, now);
+    wl->calls += 1;
+
+    if( ms >= 0 ) {
+        /* Always rearm the kernel side timeout */
+        wakelock_write(true, wl->name, ms);
+        if( !wl->held ) {
+            wl->held  = true;
+            wl->since = now;
+        }
+        wl->locks  += 1;
+        wl->expires = now + ms;
+        return;
+    }
+
+    wakelock_cancel_pending(wl);
+
+    if( wl->refs++ > 0 || (wl->held && !wl->expires) ) {
+        wakelock_stats.skipped += 1;
+        return;
+    }
+
+    wakelock_write(true, wl->name, -1);
+    if( !wl->held ) {
+        wl->held  = true;
+        wl->since = now;
+    }
+    wl->locks  += 1;
+    wl->expires = 0;
+}
+
+void dsme_wakelock_write_lock(const char *text, size_t size)
+{
+    // NOTE: called from signal handler - must stay async-signal-safe
+
+    int saved = errno;
+
+    if( wakelock_lock_fd != -1 ) {
+        if( write(wakelock_lock_fd, text, size) == -1 ) {
+            /* dontcare, but need to keep the compiler happy */
+        }
+    }
+
+    errno = saved;
+}
+
+void dsme_wakelock_unlock(const char *name)
+{
+    wakelock_unref(name, false);
+}
+
+bool dsme_wakelock_release(const char *name)
+{
+    return wakelock_unref(name, true);
+}
+
+void dsme_wakelock_flush(void)
+{
+    if( !wakelock_pending )
+        return;
+
+    int64_t now = wakelock_now();
+
+    for( int i = 0; i < wakelock_count; ++i ) {
+        if( wakelock_lut[i].pending )
+            wakelock_release_now(&wakelock_lut[i], now);
+    }
+}
+
+void dsme_wakelock_clear(const char *name)
+{
+    if( !wakelock_open() )
+        return;
+
+    wakelock_t *wl = wakelock_find(name, false);
+
+    if( wl ) {
+        wakelock_cancel_pending(wl);
+        wl->refs = 0;
+        if( wl->held ) {
+            wl->unlocks += 1;
+            wakelock_held_end(wl, wakelock_now());
+        }
+    }
+
+    wakelock_write(false, name, -1);
+}
+
+void dsme_wakelock_quit(void)
+{
+    if( wakelock_sysfs == WAKELOCK_SYSFS_OPEN ) {
+        dsme_wakelock_flush();
+        wakelock_sysfs = WAKELOCK_SYSFS_CLOSED;
+    }
+
+    if( wakelock_lock_fd != -1 )
+        close(wakelock_lock_fd), wakelock_lock_fd = -1;
+
+    if( wakelock_unlock_fd != -1 )
+        close(wakelock_unlock_fd), wakelock_unlock_fd = -1;
+}
+
+void dsme_wakelock_report_stats(void (*report)(void *aptr, const char *row),
+                                void *aptr)
+{
+    static const char * const sysfs_repr[] = {
+        [WAKELOCK_SYSFS_CLOSED]      = "closed",
+        [WAKELOCK_SYSFS_OPEN]        = "open",
+        [WAKELOCK_SYSFS_UNSUPPORTED] = "unsupported",
+    };
+
+    char    row[256];
+    int64_t now = wakelock_now();
+
+    snprintf(row, sizeof row,
+             "wakelock: sysfs=%s writes=%llu failed=%llu skipped=%llu"
+             " deferred=%llu",
+             sysfs_repr[wakelock_sysfs],
+             (unsigned long long)wakelock_stats.writes,
+             (unsigned long long)wakelock_stats.failed,
+             (unsigned long long)wakelock_stats.skipped,
+             (unsigned long long)wakelock_stats.deferred);
+    report(aptr, row);
+
+    for( int i = 0; i < wakelock_count; ++i ) {
+        wakelock_t *wl = &wakelock_lut[i];
+
+        wakelock_check_expired(wl, now);
+
+        snprintf(row, sizeof row,
+                 "wakelock: %.*s: held=%lldms refs=%d calls=%llu locks=%llu"
+                 " unlocks=%llu held_total=%lldms held_max=%lldms",
+                 WAKELOCK_NAME_MAX, wl->name,
+                 wl->held ? (long long)(now - wl->since) : -1LL,
+                 wl->refs,
+                 (unsigned long long)wl->calls,
+                 (unsigned long long)wl->locks,
+                 (unsigned long long)wl->unlocks,
+                 (long long)wl->held_total,
+                 (long long)wl->held_max);
+        report(aptr, row);
+    }
+}
@@ -0,0 +1,130 @@
+/**
+   @file wakelock.h
+
+   DSME internal interface for sysfs wakelock manipulation.
+   <p>
+   The wakelock control files are opened once and kept open. Locks
+   taken without timeout are reference counted, so that nested and
+   repeated lock/unlock pairs do not cause sysfs writes, and the kernel
+   side unlock can be deferred until the caller gets idle.
+   <p>
+   A lock name should be used either with or without timeout, not both.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DSME_WAKELOCK_H
+#define DSME_WAKELOCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+   Check whether the sysfs wakelock interface is available
+
+   @return true if wakelocks are supported, false otherwise
+*/
+bool dsme_wakelock_supported(void);
+
+/**
+   Obtain a wakelock
+
+   Without timeout the lock is reference counted and the kernel side
+   lock is taken only when the count goes up from zero.
+
+   With timeout the kernel side lock is always (re)armed.
+
+   @param name  Name of the wakelock
+   @param ms    Timeout in milliseconds, or negative value for no timeout
+*/
+void dsme_wakelock_lock(const char *name, int ms);
+
+/**
+   Write a preformatted lock request to sysfs
+
+   Async-signal-safe: no formatting, logging or bookkeeping is done,
+   and nothing is written unless the control files have already been
+   opened, e.g. via dsme_wakelock_supported().
+
+   @param text  Lock request, i.e. name, optional timeout in
+                nanoseconds and a terminating newline
+   @param size  Length of the request
+*/
+void dsme_wakelock_write_lock(const char *text, size_t size);
+
+/**
+   Release a wakelock
+
+   The kernel side lock is released when the reference count drops
+   to zero, or immediately for locks taken with timeout.
+
+   @param name  Name of the wakelock
+*/
+void dsme_wakelock_unlock(const char *name);
+
+/**
+   Release a wakelock, but defer the kernel side unlock
+
+   If the lock is obtained again before dsme_wakelock_flush() is
+   called, both the kernel side unlock and lock are skipped.
+
+   @param name  Name of the wakelock
+
+   @return true if a kernel side unlock is pending, false otherwise
+*/
+bool dsme_wakelock_release(const char *name);
+
+/**
+   Execute kernel side unlocks deferred by dsme_wakelock_release()
+*/
+void dsme_wakelock_flush(void);
+
+/**
+   Release a wakelock regardless of reference count
+
+   Used for clearing wakelocks that might have been left behind
+   by an earlier dsme instance.
+
+   @param name  Name of the wakelock
+*/
+void dsme_wakelock_clear(const char *name);
+
+/**
+   Close the sysfs control files
+
+   Closing does not affect wakelocks held in the kernel.
+*/
+void dsme_wakelock_quit(void);
+
+/**
+   Report wakelock statistics
+
+   @param report  Function to call for each row of statistics
+   @param aptr    Context pointer to pass to the report function
+*/
+void dsme_wakelock_report_stats(void (*report)(void *aptr, const char *row),
+                                void *aptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DSME_WAKELOCK_H */
@@ -26,6 +26,10 @@
 #ifndef DSMESOCK_H
 #define DSMESOCK_H
 
+#include "modulebase.h"
+
+#include <dsme/messages.h>
+
 #include <sys/select.h>
 #include <stdbool.h>
 
@@ -47,12 +51,17 @@ struct dsmesock_connection_t;
    */
 
 /**
-   A callback for client sockets ready to be read.
+   A callback for messages received from client sockets.
 
-   @param conn   a ready socket
+   The message buffer has been allocated via modulebase_alloc_message()
+   and the callback takes ownership of it.
+
+   @param conn   client connection the message was received from
+   @param msg    received message
    @return false if the socket should be closed; true otherwise
 */
-typedef bool dsmesock_callback(struct dsmesock_connection_t* conn);
+typedef bool dsmesock_callback(struct dsmesock_connection_t* conn,
+                               dsmemsg_generic_t*            msg);
 
 /**
    Initialize listening socket and static variables
@@ -69,6 +78,80 @@ int dsmesock_listen(dsmesock_callback* read_and_queue);
 */
 void dsmesock_shutdown(void);
 
+/**
+   Set listen backlog for the connect socket
+
+   Must be called before dsmesock_listen() to take effect.
+
+   @param backlog  maximum number of pending connections
+*/
+void dsmesock_set_listen_backlog(int backlog);
+
+/**
+   Set upper limit for data queued for sending to a single client
+
+   @param bytes  maximum send queue size
+*/
+void dsmesock_set_send_queue_limit(size_t bytes);
+
+/**
+   Report client input / output statistics
+
+   Produces rows with the number of client wakeups, received
+   messages, how many messages were handled per wakeup, and
+   how often sending had to be deferred to the send queues.
+
+   @param report  callback for passing the text row
+   @param aptr    context pointer passed to the callback
+*/
+void dsmesock_report_stats(modulebase_stats_fn_t* report, void* aptr);
+
+/**
+   Report per client statistics
+
+   Produces one row per connected client with peer credentials,
+   message and byte counts in both directions, time since last
+   activity, size of the send queue and amount of data pending
+   in the socket send buffer.
+
+   @param report  callback for passing the text rows
+   @param aptr    context pointer passed to the callback
+*/
+void dsmesock_report_clients(modulebase_stats_fn_t* report, void* aptr);
+
+/**
+   Send a message to a client connection
+
+   Like dsmesock_send_with_extra(), but never blocks. Data that
+   can't be sent immediately is queued and sent when the client
+   socket becomes writable. Clients whose send queue grows beyond
+   the limit set via dsmesock_set_send_queue_limit() get
+   disconnected.
+
+   @param conn        client connection
+   @param msg         message to send
+   @param extra_size  size of extra data
+   @param extra       extra data, or NULL
+*/
+void dsmesock_client_send_with_extra(struct dsmesock_connection_t* conn,
+                                     const void*                   msg,
+                                     size_t                        extra_size,
+                                     const void*                   extra);
+
+/**
+   Send a message to all connected clients
+
+   Like dsmesock_broadcast_with_extra(), but uses the non-blocking
+   send path of dsmesock_client_send_with_extra().
+
+   @param msg         message to send
+   @param extra_size  size of extra data
+   @param extra       extra data, or NULL
+*/
+void dsmesock_client_broadcast_with_extra(const void* msg,
+                                          size_t      extra_size,
+                                          const void* extra);
+
   /**
    * @}
    * @}
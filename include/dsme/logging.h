@@ -52,6 +52,16 @@ typedef struct
     int verbosity;
 } DSM_MSGTYPE_SET_LOGGING_VERBOSITY;
 
+/* Set rate limit for messages at given level, or all levels if
+ * level is negative. Zero rate disables limiting. */
+typedef struct
+{
+    DSMEMSG_PRIVATE_FIELDS
+    int level;
+    int rate;  /* messages per second per call site */
+    int burst; /* messages allowed in a burst per call site */
+} DSM_MSGTYPE_SET_LOGGING_RATELIMIT;
+
 typedef dsmemsg_generic_t DSM_MSGTYPE_ADD_LOGGING_INCLUDE;
 typedef dsmemsg_generic_t DSM_MSGTYPE_ADD_LOGGING_EXCLUDE;
 typedef dsmemsg_generic_t DSM_MSGTYPE_USE_LOGGING_DEFAULTS;
@@ -74,6 +84,7 @@ enum
     DSME_MSG_ENUM(DSM_MSGTYPE_ADD_LOGGING_INCLUDE,   0x00001104),
     DSME_MSG_ENUM(DSM_MSGTYPE_ADD_LOGGING_EXCLUDE,   0x00001105),
     DSME_MSG_ENUM(DSM_MSGTYPE_USE_LOGGING_DEFAULTS,  0x00001106),
+    DSME_MSG_ENUM(DSM_MSGTYPE_SET_LOGGING_RATELIMIT, 0x00001107),
 };
 
 /* Logging functionality */
@@ -87,15 +98,64 @@ void dsme_log_set_verbosity(int verbosity);
 void dsme_log_include(const char *pat);
 void dsme_log_exclude(const char *pat);
 void dsme_log_clear_rules(void);
+bool dsme_log_set_ring_size(size_t size);
+void dsme_log_set_deferred(bool enabled);
+void dsme_log_set_file_flush(int level, unsigned interval);
+void dsme_log_set_file_rotation(size_t size, unsigned count);
+bool dsme_log_set_flight_recorder(size_t size);
+void dsme_log_set_syslog_socket(const char *path);
+void dsme_log_set_rate_limit(int level, unsigned rate, unsigned burst);
+void dsme_log_report_stats(void (*report)(void *aptr, const char *row), void *aptr);
 bool dsme_log_p_ (int level, const char *file, const char *func);
 void dsme_log_queue(int level, const char *file, const char *func, const char *fmt, ...) __attribute__((format(printf,4,5)));
 
+/** Cached logging decision for one dsme_log() call site
+ *
+ * The state holds (generation << 4 | level << 1 | enabled), where
+ * generation is the value dsme_log_generation_ had when the decision
+ * was made. The generation changes whenever verbosity or include /
+ * exclude rules change, and is never zero - so statically zeroed
+ * call sites get evaluated on first use.
+ *
+ * Everything else the logging core keeps about the call site lives
+ * in core owned memory, so that its layout is not part of the plugin
+ * interface and it stays valid after the plugin has been unloaded.
+ */
+typedef struct dsme_log_site_t
+{
+    volatile unsigned        state;
+    void * volatile          priv;       /* Owned by the logging core */
+} dsme_log_site_t;
+
+extern volatile unsigned dsme_log_generation_;
+
+unsigned dsme_log_site_evaluate_(dsme_log_site_t *site, int level, const char *file, const char *func);
+bool dsme_log_site_allow_(dsme_log_site_t *site, int level, const char *file, const char *func, int line);
+void dsme_log_site_queue_(dsme_log_site_t *site, int level, const char *file, const char *func, const char *fmt, ...) __attribute__((format(printf,5,6)));
+
+/** Log level testing predicate using cached per call site decision
+ *
+ * Normally this function is used from dsme_log() macro.
+ */
+static inline bool
+dsme_log_site_p_(dsme_log_site_t *site, int level, const char *file, const char *func)
+{
+    unsigned state = site->state;
+
+    if( (state >> 1) != (dsme_log_generation_ << 3 | (unsigned)level) )
+        state = dsme_log_site_evaluate_(site, level, file, func);
+
+    return state & 1;
+}
+
 # define dsme_log_p(LEV_) dsme_log_p_(LEV_, __FILE__, __FUNCTION__)
 
 # define dsme_log(LEV_, FMT_, ARGS_...) \
      do {\
-         if( dsme_log_p_(LEV_, __FILE__, __FUNCTION__) ) {\
-             dsme_log_queue(LEV_, __FILE__, __FUNCTION__, FMT_, ## ARGS_);\
+         static dsme_log_site_t dsme_log_site_;\
+         if( dsme_log_site_p_(&dsme_log_site_, LEV_, __FILE__, __FUNCTION__) &&\
+             dsme_log_site_allow_(&dsme_log_site_, LEV_, __FILE__, __FUNCTION__, __LINE__) ) {\
+             dsme_log_site_queue_(&dsme_log_site_, LEV_, __FILE__, __FUNCTION__, FMT_, ## ARGS_);\
          }\
      } while( 0 )
 
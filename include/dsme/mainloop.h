@@ -25,10 +25,123 @@
 #ifndef DSME_MAINLOOP_H
 #define DSME_MAINLOOP_H
 
+#include "modules.h"
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 void dsme_main_loop_run(void (*iteration)(void));
 
 void dsme_main_loop_quit(int exit_code);
 
 int dsme_main_loop_exit_code(void);
 
+/** Function to execute in the main thread */
+typedef void (*dsme_main_loop_task_t)(void *data);
+
+/**
+   Post a task to be executed in the main thread
+
+   Can be called from any thread. Tasks are executed in the order they
+   were posted. All tasks that are queued when the main loop wakes up
+   are executed in one batch. Tasks that are still queued when the main
+   loop is stopped are executed before dsme_main_loop_run() returns.
+
+   @param fn    Function to call
+   @param data  Data to pass to the function
+   @return true if the task was queued, or false on allocation failure
+*/
+bool dsme_main_loop_post(dsme_main_loop_task_t fn, void *data);
+
+/** Accounting record for wakeups and dispatch time
+ *
+ * One record exists for each source name + module pair. Records
+ * are never freed, so pointers to them can be cached.
+ */
+typedef struct dsme_main_loop_account_t dsme_main_loop_account_t;
+
+/** Book keeping for one accounted dispatch, allocated by the caller */
+typedef struct dsme_main_loop_dispatch_t
+{
+    dsme_main_loop_account_t         *account;
+    struct dsme_main_loop_dispatch_t *parent;
+    int64_t                           start_ns;
+    int64_t                           start_cpu_ns;
+    int64_t                           child_ns;
+    int64_t                           child_cpu_ns;
+} dsme_main_loop_dispatch_t;
+
+/**
+   Get accounting record for a main loop source
+
+   @param source  Source name
+   @param module  Module that owns the source, or NULL for core
+   @return accounting record
+*/
+dsme_main_loop_account_t *dsme_main_loop_account(const char     *source,
+                                                 const module_t *module);
+
+/**
+   Start accounting a dispatch
+
+   Dispatches can be nested; time spent in nested dispatches is
+   accounted only to the innermost one. The main loop wakeup is
+   attributed to the first dispatch that finishes after the main
+   loop has returned from poll().
+
+   @param ctx      Dispatch book keeping, typically on stack
+   @param account  Accounting record to use
+*/
+void dsme_main_loop_dispatch_begin(dsme_main_loop_dispatch_t *ctx,
+                                   dsme_main_loop_account_t  *account);
+
+/**
+   Finish accounting a dispatch started with dsme_main_loop_dispatch_begin()
+
+   @param ctx  Dispatch book keeping
+*/
+void dsme_main_loop_dispatch_end(dsme_main_loop_dispatch_t *ctx);
+
+/**
+   Add accounted I/O watch to the main loop
+
+   Works like g_io_add_watch(), but dispatches are accounted to the
+   given source name and the module that is active when the watch
+   is added.
+
+   @param source  Source name
+   @param chn     I/O channel to watch
+   @param cnd     Conditions to watch for
+   @param func    Callback function
+   @param data    Data to pass to callback function
+   @return glib source id, or 0 on failure
+*/
+guint dsme_main_loop_add_watch(const char   *source,
+                               GIOChannel   *chn,
+                               GIOCondition  cnd,
+                               GIOFunc       func,
+                               gpointer      data);
+
+/**
+   Report main loop wakeup statistics
+
+   Produces summary rows for polling and posted tasks, followed by
+   one row per accounting record
+   with wakeup and dispatch counts, wall clock and cpu time spent in
+   dispatching, ordered by the number of wakeups.
+
+   @param report  Function to call for each row of statistics
+   @param aptr    Context pointer to pass to the report function
+*/
+void dsme_main_loop_report_wakeups(void (*report)(void *aptr, const char *row),
+                                   void *aptr);
+
+/**
+   Set interval for logging a summary of main loop wakeups
+
+   @param seconds  Summary interval, or 0 to disable
+*/
+void dsme_main_loop_set_summary_interval(unsigned seconds);
+
 #endif
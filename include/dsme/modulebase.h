@@ -80,12 +80,66 @@ bool modulebase_unload_module(module_t* module);
 
 /**
    Passes messages in queue to message handlers.
+
+   If at least one message was processed and some module has a handler
+   for DSM_MSGTYPE_IDLE, an IDLE message is dispatched after the queue
+   has been emptied.
 */
 void modulebase_process_message_queue(void);
 
 const module_t* modulebase_current_module(void);
 const module_t* modulebase_enter_module(const module_t* module);
 
+/**
+   Allocates a message buffer from the message queue.
+
+   Used for receiving messages from dsmesock clients directly into
+   storage that can then be queued without copying.
+
+   @param size  Size of the message, including extra data
+   @return Message buffer, or NULL on allocation failure
+*/
+dsmemsg_generic_t* modulebase_alloc_message(size_t size);
+
+/**
+   Releases a message buffer obtained via modulebase_alloc_message().
+
+   @param msg  Message buffer that was not passed to the queue
+*/
+void modulebase_free_message(dsmemsg_generic_t* msg);
+
+/**
+   Queues a message received from a dsmesock client for handling.
+
+   The ownership of the message buffer, which must have been obtained
+   via modulebase_alloc_message(), is transferred to the queue.
+
+   @param msg   Message buffer
+   @param conn  Client connection the message was received from
+*/
+void modulebase_queue_message_from_socket(dsmemsg_generic_t*            msg,
+                                          struct dsmesock_connection_t* conn);
+
+/**
+   Callback for passing statistics rows to a reporter.
+
+   @param aptr  Context pointer given by the reporter
+   @param row   Human readable single line of statistics
+*/
+typedef void (modulebase_stats_fn_t)(void* aptr, const char* row);
+
+/**
+   Reports message queue and per handler dispatch statistics.
+
+   For each message type + module pair the number of handler calls,
+   handler execution time and time the message spent in the queue
+   are reported as fixed bucket histograms.
+
+   @param report  Function to call for each row of statistics
+   @param aptr    Context pointer to pass to the report function
+*/
+void modulebase_report_stats(modulebase_stats_fn_t* report, void* aptr);
+
 enum {
     /* NOTE: dsme message types are defined in:
      * - libdsme
@@ -99,11 +153,45 @@ enum {
      *    must be made aware of the new message type
      */
 
-    DSME_MSG_ENUM(DSM_MSGTYPE_IDLE, 0x00001337),
+    DSME_MSG_ENUM(DSM_MSGTYPE_IDLE,             0x00001337),
+    DSME_MSG_ENUM(DSM_MSGTYPE_GET_SERVER_STATS, 0x00001338),
+    DSME_MSG_ENUM(DSM_MSGTYPE_SERVER_STATS,     0x00001339),
+    DSME_MSG_ENUM(DSM_MSGTYPE_GET_CLIENT_STATS, 0x0000133a),
+    DSME_MSG_ENUM(DSM_MSGTYPE_GET_WAKEUP_STATS, 0x0000133b),
+    DSME_MSG_ENUM(DSM_MSGTYPE_GET_IPHB_STATS,   0x0000133c),
 };
 
 typedef dsmemsg_generic_t DSM_MSGTYPE_IDLE;
 
+/* Server statistics query from dsmesock client
+ *
+ * Replied with a sequence of DSM_MSGTYPE_SERVER_STATS messages, each
+ * carrying one line of text as extra data. The end of the sequence is
+ * signaled with a DSM_MSGTYPE_SERVER_STATS without extra data.
+ */
+typedef dsmemsg_generic_t DSM_MSGTYPE_GET_SERVER_STATS;
+typedef dsmemsg_generic_t DSM_MSGTYPE_SERVER_STATS;
+
+/* Connected clients query from dsmesock client
+ *
+ * Replied in the same manner as DSM_MSGTYPE_GET_SERVER_STATS,
+ * with one row per connected client.
+ */
+typedef dsmemsg_generic_t DSM_MSGTYPE_GET_CLIENT_STATS;
+
+/* Main loop wakeup statistics query from dsmesock client
+ *
+ * Replied in the same manner as DSM_MSGTYPE_GET_SERVER_STATS,
+ * with one row per main loop wakeup source.
+ */
+typedef dsmemsg_generic_t DSM_MSGTYPE_GET_WAKEUP_STATS;
+
+/* IPHB client wakeup batching statistics query from dsmesock client
+ *
+ * Replied in the same manner as DSM_MSGTYPE_GET_SERVER_STATS.
+ */
+typedef dsmemsg_generic_t DSM_MSGTYPE_GET_IPHB_STATS;
+
 #ifdef __cplusplus
 }
 #endif
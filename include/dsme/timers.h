@@ -59,6 +59,61 @@ dsme_timer_t dsme_create_timer(unsigned              milliseconds,
                                dsme_timer_callback_t callback,
                                void*                 data);
 
+/** Creates a new DSME timer with explicit slack
+
+   The timer fires at the earliest after the given interval and at the
+   latest slack milliseconds later. Timers whose slack windows overlap
+   are dispatched during the same wakeup. Timers created with
+   dsme_create_timer() and dsme_create_timer_seconds() get slack of
+   1/16 of the interval, but at most one second.
+
+   @param milliseconds  Timer expiry in milliseconds from current time
+   @param slack         Allowed delay after expiry in milliseconds
+   @param callback      Function to be called when the timer expires
+   @param data          Passed to callback function as an argument.
+   @return !0 on success; 0 on failure
+*/
+dsme_timer_t dsme_create_timer_slack(unsigned              milliseconds,
+                                     unsigned              slack,
+                                     dsme_timer_callback_t callback,
+                                     void*                 data);
+
+/** Creates a new DSME timer that counts also time spent in suspend
+
+   The timer uses CLOCK_BOOTTIME, so it expires after the given
+   amount of elapsed time even if the device was suspended in
+   between. It does not wake the device up; if the expiry time is
+   reached during suspend, the timer fires right after resume.
+
+   @param milliseconds  Timer expiry in milliseconds from current time
+   @param callback      Function to be called when the timer expires
+   @param data          Passed to callback function as an argument.
+   @return !0 on success; 0 on failure
+*/
+dsme_timer_t dsme_create_timer_boottime(unsigned              milliseconds,
+                                        dsme_timer_callback_t callback,
+                                        void*                 data);
+
+/** Creates a new DSME timer that wakes the device up from suspend
+
+   Like dsme_create_timer_boottime(), but uses CLOCK_BOOTTIME_ALARM
+   so that the device is resumed when the timer expires. Callbacks
+   that need to do something lengthy before the device is allowed
+   to suspend again must hold a wakelock.
+
+   If wakeup alarms are not available (missing CAP_WAKE_ALARM or
+   kernel support), a dsme_create_timer_boottime() timer is created
+   instead.
+
+   @param milliseconds  Timer expiry in milliseconds from current time
+   @param callback      Function to be called when the timer expires
+   @param data          Passed to callback function as an argument.
+   @return !0 on success; 0 on failure
+*/
+dsme_timer_t dsme_create_timer_alarm(unsigned              milliseconds,
+                                     dsme_timer_callback_t callback,
+                                     void*                 data);
+
 /**
    Deactivates and destroys an existing timer.
 
@@ -66,6 +121,15 @@ dsme_timer_t dsme_create_timer(unsigned              milliseconds,
 */
 void dsme_destroy_timer(dsme_timer_t timer);
 
+/**
+   Report timer wakeup coalescing statistics
+
+   @param report  Function to call for each row of statistics
+   @param aptr    Context pointer to pass to the report function
+*/
+void dsme_timers_report_stats(void (*report)(void *aptr, const char *row),
+                              void *aptr);
+
 #ifdef __cplusplus
 }
 #endif
@@ -44,6 +44,7 @@
 #include "../include/dsme/timers.h"
 #include "../include/dsme/modules.h"
 #include "../include/dsme/logging.h"
+#include "../include/dsme/dsmesock.h"
 #include "../dsme/utility.h"
 
 #include <dsme/state.h>
@@ -366,7 +367,7 @@ alarmtracker_alarmstate_broadcast(void)
         modules_broadcast_internally(&msg);
 
         /* inform clients about the change in upcoming alarms */
-        dsmesock_broadcast(&msg);
+        dsmesock_client_broadcast_with_extra(&msg, 0, 0);
     }
 
     return;
@@ -380,11 +381,16 @@ static void
 alarmtracker_alarmstate_schedule_evaluate(int delay)
 {
     if( !alarmtracker_alarmstate_evaluate_id ) {
-        /* TODO: does this work with suspend? */
+        /* Alarms can be far away -> clamp to what the timer can take */
+        unsigned secs = (delay < 1) ? 1u : (unsigned)delay;
+        if( secs > UINT_MAX / 1000u )
+            secs = UINT_MAX / 1000u;
+
+        /* Alarm times are wall clock based -> count time in suspend */
         alarmtracker_alarmstate_evaluate_id =
-            dsme_create_timer_seconds(delay,
-                                      alarmtracker_alarmstate_evaluate_cb, 0);
-        dsme_log(LOG_DEBUG, PFIX "evaluate again in %d s", delay);
+            dsme_create_timer_boottime(secs * 1000u,
+                                       alarmtracker_alarmstate_evaluate_cb, 0);
+        dsme_log(LOG_DEBUG, PFIX "evaluate again in %u s", secs);
     }
 }
 
@@ -29,6 +29,7 @@
 #include "../include/dsme/modulebase.h"
 #include "../include/dsme/modules.h"
 #include "../include/dsme/logging.h"
+#include "../include/dsme/mainloop.h"
 #include "../include/dsme/timers.h"
 
 #include <dsme/protocol.h>
@@ -277,9 +278,9 @@ systembus_watcher_start(void)
         goto cleanup;
     }
 
-    systembus_watcher_id = g_io_add_watch(chn,
-                                          G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-                                          systembus_watcher_cb, 0);
+    systembus_watcher_id = dsme_main_loop_add_watch("dbusautoconnector:inotify", chn,
+                                                    G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                                    systembus_watcher_cb, 0);
     if( !systembus_watcher_id )
         dsme_log(LOG_ERR, PFIX "SystemBus watch: adding io watch failed");
 
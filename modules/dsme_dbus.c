@@ -39,6 +39,7 @@
 #include "../include/dsme/logging.h"
 #include "../include/dsme/modules.h"
 #include "../include/dsme/modulebase.h"
+#include "../include/dsme/mainloop.h"
 #include "../dsme/dsme-server.h"
 #include "../dsme/utility.h"
 #include <dsme/state.h>
@@ -175,6 +176,8 @@ static DBusHandlerResult manager_message_filter_cb    (DBusConnection *con, DBus
 static gchar            *manager_generate_rule        (const dsme_dbus_signal_binding_t *binding);
 static void              manager_set_module           (DsmeDbusManager *self, const void *context, const module_t *module);
 static module_t         *manager_get_module           (DsmeDbusManager *self, const void *context);
+static void              manager_set_account          (DsmeDbusManager *self, const void *context, const char *source, const module_t *module);
+static dsme_main_loop_account_t *manager_get_account  (DsmeDbusManager *self, const void *context);
 static DsmeDbusManager  *manager_create               (void);
 static void              manager_delete               (DsmeDbusManager *self);
 #ifdef DEAD_CODE
@@ -1098,6 +1101,7 @@ struct DsmeDbusManager
     GSList         *mr_handlers;  // iterm->data -> dsme_dbus_signal_binding_t array
     GHashTable     *mr_matches;   // [DsmeDbusService *] -> match string
     GHashTable     *mr_modules;   // void * -> module_t
+    GHashTable     *mr_accounts;  // void * -> dsme_main_loop_account_t
 };
 
 /** Format string for Introspect XML prologue */
@@ -1221,6 +1225,13 @@ manager_message_filter_cb(DBusConnection *con, DBusMessage *msg, void *aptr)
 {
     DsmeDbusManager *self = aptr;
 
+    static dsme_main_loop_account_t *account = 0;
+    if( !account )
+        account = dsme_main_loop_account("dbus", 0);
+
+    dsme_main_loop_dispatch_t ctx;
+    dsme_main_loop_dispatch_begin(&ctx, account);
+
     /* Dispatching context can/should be defined in methdo call and
      * signal handler configuration. If not, make sure we default to
      * "core" module context. */
@@ -1283,6 +1294,8 @@ manager_message_filter_cb(DBusConnection *con, DBusMessage *msg, void *aptr)
     }
 
     modulebase_enter_module(caller);
+
+    dsme_main_loop_dispatch_end(&ctx);
     return result;;
 }
 
@@ -1322,6 +1335,27 @@ manager_get_module(DsmeDbusManager *self, const void *context)
     return g_hash_table_lookup(self->mr_modules, context);
 }
 
+static void
+manager_set_account(DsmeDbusManager *self, const void *context,
+                    const char *source, const module_t *module)
+{
+    /* Accounting records are never freed -> pointers can be cached */
+    if( source )
+        g_hash_table_replace(self->mr_accounts, (void *)context,
+                             dsme_main_loop_account(source, module));
+    else
+        g_hash_table_remove(self->mr_accounts, context);
+}
+
+static dsme_main_loop_account_t *
+manager_get_account(DsmeDbusManager *self, const void *context)
+{
+    dsme_main_loop_account_t *account =
+        g_hash_table_lookup(self->mr_accounts, context);
+
+    return account ?: dsme_main_loop_account("dbus", 0);
+}
+
 static DsmeDbusManager *
 manager_create(void)
 {
@@ -1337,6 +1371,9 @@ manager_create(void)
     self->mr_modules = g_hash_table_new_full(g_direct_hash, g_direct_equal,
                                              0, 0);
 
+    self->mr_accounts = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                              0, 0);
+
     return self;
 }
 
@@ -1357,6 +1394,9 @@ manager_delete(DsmeDbusManager *self)
         g_hash_table_unref(self->mr_modules),
             self->mr_modules = 0;
 
+        g_hash_table_unref(self->mr_accounts),
+            self->mr_accounts = 0;
+
         g_free(self);
     }
 }
@@ -1734,6 +1774,7 @@ manager_handle_method(DsmeDbusManager *self, DBusMessage *req)
         goto EXIT;
 
     module_t *module = manager_get_module(self, bindings);
+    dsme_main_loop_account_t *account = manager_get_account(self, bindings);
 
     for( ; bindings->name; ++bindings ) {
         if( !bindings->method )
@@ -1761,10 +1802,13 @@ manager_handle_method(DsmeDbusManager *self, DBusMessage *req)
                                           "sender is not privileged");
         }
         else {
+            dsme_main_loop_dispatch_t ctx;
+            dsme_main_loop_dispatch_begin(&ctx, account);
             if( module )
                 modulebase_enter_module(module);
             bindings->method(&message, &reply);
             modulebase_enter_module(restore);
+            dsme_main_loop_dispatch_end(&ctx);
         }
 
         if( !dbus_message_get_no_reply(req) ) {
@@ -1838,6 +1882,7 @@ manager_handle_signal(DsmeDbusManager *self, DBusMessage *sig)
             continue;
 
         module_t *module = manager_get_module(self, bindings);
+        dsme_main_loop_account_t *account = manager_get_account(self, bindings);
 
         for( ; bindings->name; ++bindings ) {
             if( strcmp(bindings->name, member) )
@@ -1855,10 +1900,13 @@ manager_handle_signal(DsmeDbusManager *self, DBusMessage *sig)
                      interface, member,
                      module ? module_name(module) : "(current");
 
+            dsme_main_loop_dispatch_t ctx;
+            dsme_main_loop_dispatch_begin(&ctx, account);
             if( module )
                 modulebase_enter_module(module);
             bindings->handler(&message);
             modulebase_enter_module(restore);
+            dsme_main_loop_dispatch_end(&ctx);
 
             message_dtor(&message);
         }
@@ -2471,6 +2519,8 @@ dsme_dbus_bind_methods(bool                      *bound,
     /* Bind methods to interface
      */
     manager_set_module(the_manager, bindings, modulebase_current_module());
+    manager_set_account(the_manager, bindings, "dbus:method",
+                        modulebase_current_module());
     interface_set_members(interface, bindings);
 
 EXIT:
@@ -2521,6 +2571,7 @@ dsme_dbus_unbind_methods(bool                      *bound,
      */
 
     manager_set_module(the_manager, bindings, 0);
+    manager_set_account(the_manager, bindings, 0, 0);
 
     if( !object_rem_interface(object, interface_name) )
         goto EXIT;
@@ -2568,6 +2619,8 @@ dsme_dbus_bind_signals(bool                             *bound,
     dsme_log(LOG_DEBUG, PFIX "binding handlers for interface:  %s", bindings->interface);
 
     manager_set_module(the_manager, bindings, modulebase_current_module());
+    manager_set_account(the_manager, bindings, "dbus:signal",
+                        modulebase_current_module());
     manager_add_handlers_array(the_manager, bindings);
 
 EXIT:
@@ -2595,6 +2648,7 @@ dsme_dbus_unbind_signals(bool                             *bound,
     dsme_log(LOG_DEBUG, PFIX "unbinding handlers for interface: %s", bindings->interface);
 
     manager_set_module(the_manager, bindings, 0);
+    manager_set_account(the_manager, bindings, 0, 0);
     manager_rem_handlers_array(the_manager, bindings);
 
 EXIT:
@@ -108,10 +108,10 @@ static bool start_heartbeat(void)
     if( !(chn = g_io_channel_unix_new(STDIN_FILENO)) )
         goto cleanup;
 
-    watch_id = g_io_add_watch(chn,
-                              G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-                              emit_heartbeat_message,
-                              0);
+    watch_id = dsme_main_loop_add_watch("heartbeat", chn,
+                                        G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                        emit_heartbeat_message,
+                                        0);
 
 cleanup:
     if( chn )
@@ -44,13 +44,17 @@
 #include "../include/dsme/modules.h"
 #include "../include/dsme/modulebase.h"
 #include "../include/dsme/logging.h"
+#include "../include/dsme/mainloop.h"
 #include "../include/dsme/timers.h"
 #include "../dsme/dsme-wdd-wd.h"
 #include "../dsme/dsme-server.h"
 #include "../dsme/utility.h"
+#include "../dsme/wakelock.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -76,9 +80,19 @@
 /** Prefix string for diagnostic messages from this module */
 #define PFIX "IPHB: "
 
-/** Maximum number of epoll events to process in one go */
+/** Minimum number of epoll events to fetch in one go */
 #define DSME_MAX_EPOLL_EVENTS   10
 
+/** Maximum time to spend draining epoll events in one dispatch [ms]
+ *
+ * Events left over are handled on the next main loop iteration, so
+ * that timers - including the watchdog heartbeat - do not get starved.
+ */
+#define DSME_EPOLL_BUDGET_MS    100
+
+/** Number of client requests to receive per client input event */
+#define DSME_RECV_REQUESTS      16
+
 /** How long it takes to power up to act dead mode to show alarms */
 #define STARTUP_TIME_ESTIMATE_SECS 60
 
@@ -94,6 +108,18 @@
 /** Maximum time to stay in suspend [seconds]; zero for no limit */
 #define RTC_MAXIMUM_WAKEUP_TIME (30*60) // 30 minutes
 
+/** How far ahead wakeups are planned [s]
+ *
+ * The device wakes up at least this often anyway, so wakeups beyond
+ * this do not need to be accounted when deciding whether to serve
+ * a client early.
+ */
+#if RTC_MAXIMUM_WAKEUP_TIME
+# define WAKEUP_PLAN_HORIZON RTC_MAXIMUM_WAKEUP_TIME
+#else
+# define WAKEUP_PLAN_HORIZON (24*60*60)
+#endif
+
 /** Image create time = mtime of os-release file/symlink */
 #define IMAGE_TIME_STAMP_FILE "/etc/os-release"
 
@@ -110,6 +136,23 @@
  * Custom types
  * ------------------------------------------------------------------------- */
 
+/** @brief  Priority queues of clients that have an active wait period
+ */
+typedef enum clientheap_id_t {
+    CLIENTHEAP_MAXTIME, /*!< all waiting clients, ordered by maxtime */
+    CLIENTHEAP_MINTIME, /*!< all waiting clients, ordered by mintime */
+    CLIENTHEAP_RESUME,  /*!< waiting clients that need resume, by maxtime */
+    CLIENTHEAP_COUNT
+} clientheap_id_t;
+
+/** @brief  Binary min-heap of clients
+ */
+typedef struct clientheap_t {
+    struct _client_t **vec;   /*!< heap ordered array of clients */
+    int                count; /*!< number of clients in the heap */
+    int                alloc; /*!< allocated size of the array */
+} clientheap_t;
+
 /** @brief  Allocated structure of one client in the linked client list in iphbd
  */
 typedef struct _client_t {
@@ -122,7 +165,11 @@ typedef struct _client_t {
     struct timeval    maxtime; /*!< max end of sleep period */
     pid_t             pid;     /*!< client process ID */
     bool              wakeup;  /*!< resume to handle */
+    int               heap_pos[CLIENTHEAP_COUNT]; /*!< index in priority queues, or -1 */
     struct _client_t *next;    /*!< pointer to the next client in the list (NULL if none) */
+    struct _client_t **pprev;  /*!< pointer to the link pointing to this client */
+    size_t            rxlen;   /*!< bytes of partial request in rxbuf */
+    char              rxbuf[sizeof(struct _iphb_req_t)]; /*!< partial request */
 } client_t;
 
 /** @brief  Reasons for keeping rtc device opened
@@ -171,6 +218,29 @@ static int epollfd  = -1;
 /** I/O watch for epollfd */
 static guint epoll_watch = 0;
 
+/** Buffer for fetching epoll events */
+static struct epoll_event *epollfd_events = 0;
+
+/** Number of events that fit in epollfd_events */
+static int epollfd_events_max = 0;
+
+/** Client request handling statistics */
+static struct {
+    uint64_t waits;     /*!< wait requests received */
+    uint64_t stats;     /*!< status requests received */
+    uint64_t coalesced; /*!< wait requests overridden by a later one */
+    uint64_t partial;   /*!< receives that left a partial request */
+} client_req_stats;
+
+/** Epoll event dispatching statistics */
+static struct {
+    uint64_t dispatches; /*!< epoll io watch dispatches */
+    uint64_t events;     /*!< epoll events handled */
+    uint64_t rounds;     /*!< epoll_wait() calls made */
+    uint64_t budget;     /*!< dispatches cut short by time budget */
+    int      max_events; /*!< most events handled in one dispatch */
+} epollfd_stats;
+
 /** IPC client listen/accept handle */
 static int listenfd = -1;
 
@@ -192,6 +262,29 @@ static guint rtc_need_ended_id = 0;
 /** Linked lits of connected clients */
 static client_t *clients = NULL;
 
+/** Link to use for appending to the list of clients */
+static client_t **clients_tail = &clients;
+
+/** Number of connected clients */
+static int clients_count = 0;
+
+/** Number of external clients with active wait period */
+static int clients_waiting_external = 0;
+
+/** Flag for: device has been woken up via rtc / alarm timer */
+static bool clients_resumed = false;
+
+/** Client wakeup batching statistics */
+static struct {
+    uint64_t rounds; /*!< wakeup rounds that woke up clients */
+    uint64_t forced; /*!< rounds needed by client deadlines */
+    uint64_t woken;  /*!< clients woken up */
+    uint64_t early;  /*!< clients served early to avoid own wakeup */
+} clients_stats;
+
+/** Priority queues of clients with active wait period */
+static clientheap_t clientheap[CLIENTHEAP_COUNT];
+
 /** Timer for serving wakeups with shorter than heartbeat range */
 static dsme_timer_t wakeup_timer = 0;
 
@@ -201,12 +294,6 @@ static DBusConnection *systembus = 0;
 /** Status of com.nokia.mce on systembus */
 static bool mce_is_running = false;
 
-/** Sysfs entry for acquiring wakelocks */
-static const char lock_path[]   = "/sys/power/wake_lock";
-
-/** Sysfs entry for releasing wakelocks */
-static const char unlock_path[] = "/sys/power/wake_unlock";
-
 /** RTC wakeup wakelock - acquired by dsme and released by mce / timeout */
 static const char rtc_wakeup[] = "mce_rtc_wakeup";
 
@@ -371,50 +458,26 @@ static void hwwd_feeder_sync(void)
  * Utilities for manipulating wakelocks
  * ------------------------------------------------------------------------- */
 
-/** Whether the wakelock sysfs paths are available
- *
- * @return true if wakelocks are supported, false otherwise
- */
-static bool wakelock_supported(void)
-{
-    static bool checked = false;
-    static bool supported = false;
-
-    if( !checked ) {
-	checked = true;
-	supported = (access(lock_path, W_OK) == 0 &&
-		     access(unlock_path, W_OK) == 0);
-    }
-
-    return supported;
-}
+/** Idle callback id for executing deferred wakelock releases */
+static guint wakelock_flush_id = 0;
 
-/** Helper for writing to sysfs files
+/** Idle callback for executing deferred wakelock releases
  *
- * @param path file to write to
- * @param data string to write
+ * @param aptr (not used)
+ *
+ * @return FALSE, to stop idle callback from repeating
  */
-static void wakelock_write(const char *path, const char *data, int ignore)
+static gboolean wakelock_flush_cb(gpointer aptr)
 {
-    int file;
+    (void)aptr;
 
-    if( (file = TEMP_FAILURE_RETRY(open(path, O_WRONLY))) == -1 ) {
-	dsme_log(LOG_WARNING, PFIX "%s: open: %m", path);
-    }
-    else {
-	int size = strlen(data);
-	errno = 0;
-	if( TEMP_FAILURE_RETRY(write(file, data, size)) != size ) {
-	    if( errno != ignore )
-		dsme_log(LOG_WARNING, PFIX "%s: write: %m", path);
-	}
-	if( TEMP_FAILURE_RETRY(close(file)) == -1 ) {
-	    dsme_log(LOG_WARNING, PFIX "%s: close: %m", path);
-	}
-    }
+    wakelock_flush_id = 0;
+    dsme_wakelock_flush();
+
+    return FALSE;
 }
 
-/** Use sysfs interface to create and enable a wakelock.
+/** Obtain a wakelock
  *
  * @param name The name of the wakelock to obtain
  * @param ms   Time in milliseconds before the wakelock gets released
@@ -423,37 +486,51 @@ static void wakelock_write(const char *path, const char *data, int ignore)
 static void wakelock_lock(const char *name, int ms)
 {
     dsme_log(LOG_DEBUG, PFIX "LOCK: %s %d", name, ms);
-    if( wakelock_supported() ) {
-	char tmp[256];
-	int rc = -1;
-	if( ms < 0 ) {
-	    rc = snprintf(tmp, sizeof tmp, "%s\n", name);
-	}
-	else {
-	    long long ns = ms * 1000000LL;
-	    rc = snprintf(tmp, sizeof tmp, "%s %lld\n", name, ns);
-	}
-	if( rc > 0 && rc < sizeof tmp )
-	    wakelock_write(lock_path, tmp, -1);
-    }
+    dsme_wakelock_lock(name, ms);
 }
 
-/** Use sysfs interface to disable a wakelock.
+/** Release a wakelock
  *
  * @param name The name of the wakelock to release
- *
- * Note: This will not delete the wakelocks.
  */
 static void wakelock_unlock(const char *name)
 {
     dsme_log(LOG_DEBUG, PFIX "UNLK: %s", name);
-    if( wakelock_supported() ) {
-	char tmp[256];
-	int rc = snprintf(tmp, sizeof tmp, "%s\n", name);
-	/* assume EINVAL == the wakelock did not exist */
-	if( rc > 0 && rc < sizeof tmp )
-	    wakelock_write(unlock_path, tmp, EINVAL);
-    }
+    dsme_wakelock_unlock(name);
+}
+
+/** Release a wakelock once dsme gets idle
+ *
+ * If the same wakelock is obtained again before that, e.g. while
+ * handling a burst of epoll events, no sysfs writes are made.
+ *
+ * @param name The name of the wakelock to release
+ */
+static void wakelock_release(const char *name)
+{
+    dsme_log(LOG_DEBUG, PFIX "RELS: %s", name);
+    if( dsme_wakelock_release(name) && !wakelock_flush_id )
+	wakelock_flush_id = g_idle_add(wakelock_flush_cb, 0);
+}
+
+/** Clear a wakelock regardless of how many times it has been obtained
+ *
+ * @param name The name of the wakelock to clear
+ */
+static void wakelock_clear(const char *name)
+{
+    dsme_log(LOG_DEBUG, PFIX "CLR: %s", name);
+    dsme_wakelock_clear(name);
+}
+
+/** Execute deferred wakelock releases now
+ */
+static void wakelock_flush(void)
+{
+    if( wakelock_flush_id )
+	g_source_remove(wakelock_flush_id), wakelock_flush_id = 0;
+
+    dsme_wakelock_flush();
 }
 
 /* ------------------------------------------------------------------------- *
@@ -1784,6 +1861,9 @@ static client_t *client_new_external(int fd)
 
     self->fd = fd;
 
+    for( int id = 0; id < CLIENTHEAP_COUNT; ++id )
+	self->heap_pos[id] = -1;
+
     /* Have something valid as description. Overrides are
      * in client_new_internal() and client_handle_wait_req() */
     self->pidtxt = strdup("unknown");
@@ -2108,17 +2188,11 @@ static void client_handle_stat_req(client_t *self)
 
     monotime_get_tv(&tv_now);
 
-    for( client_t *c = clients; c; c = c->next ) {
-        stats.clients++;
+    stats.clients = clients_count;
+    stats.waiting = clientheap[CLIENTHEAP_MAXTIME].count;
 
-	if( !client_wait_started(c) )
-	    continue;
-
-	stats.waiting++;
-
-	if( next_hb > c->maxtime.tv_sec )
-	    next_hb = c->maxtime.tv_sec;
-    }
+    if( stats.waiting )
+	next_hb = clientheap[CLIENTHEAP_MAXTIME].vec[0]->maxtime.tv_sec;
 
     if( next_hb < INT_MAX )
 	stats.next_hb = next_hb - tv_now.tv_sec;
@@ -2131,6 +2205,273 @@ static void client_handle_stat_req(client_t *self)
     }
 }
 
+/* ------------------------------------------------------------------------- *
+ * priority queues of waiting IPHB clients
+ * ------------------------------------------------------------------------- */
+
+/** Get the time value a priority queue is ordered by
+ *
+ * @param id     priority queue id
+ * @param client client object
+ *
+ * @return pointer to mintime or maxtime of the client
+ */
+static const struct timeval *clientheap_key(clientheap_id_t id,
+					    const client_t *client)
+{
+    return (id == CLIENTHEAP_MINTIME) ? &client->mintime : &client->maxtime;
+}
+
+/** Store client to a priority queue slot
+ *
+ * @param id     priority queue id
+ * @param pos    index in the heap array
+ * @param client client object
+ */
+static void clientheap_place(clientheap_id_t id, int pos, client_t *client)
+{
+    clientheap[id].vec[pos] = client;
+    client->heap_pos[id] = pos;
+}
+
+/** Move client towards the top of a priority queue as needed
+ *
+ * @param id     priority queue id
+ * @param pos    index of the client in the heap array
+ */
+static void clientheap_sift_up(clientheap_id_t id, int pos)
+{
+    clientheap_t *heap   = &clientheap[id];
+    client_t     *client = heap->vec[pos];
+
+    while( pos > 0 ) {
+	int parent = (pos - 1) / 2;
+
+	if( !tv_lt(clientheap_key(id, client),
+		   clientheap_key(id, heap->vec[parent])) )
+	    break;
+
+	clientheap_place(id, pos, heap->vec[parent]);
+	pos = parent;
+    }
+
+    clientheap_place(id, pos, client);
+}
+
+/** Move client towards the bottom of a priority queue as needed
+ *
+ * @param id     priority queue id
+ * @param pos    index of the client in the heap array
+ */
+static void clientheap_sift_down(clientheap_id_t id, int pos)
+{
+    clientheap_t *heap   = &clientheap[id];
+    client_t     *client = heap->vec[pos];
+
+    for( ;; ) {
+	int child = pos * 2 + 1;
+
+	if( child >= heap->count )
+	    break;
+
+	if( child + 1 < heap->count &&
+	    tv_lt(clientheap_key(id, heap->vec[child + 1]),
+		  clientheap_key(id, heap->vec[child])) )
+	    child += 1;
+
+	if( !tv_lt(clientheap_key(id, heap->vec[child]),
+		   clientheap_key(id, client)) )
+	    break;
+
+	clientheap_place(id, pos, heap->vec[child]);
+	pos = child;
+    }
+
+    clientheap_place(id, pos, client);
+}
+
+/** Add client to a priority queue
+ *
+ * @param id     priority queue id
+ * @param client client object
+ */
+static void clientheap_insert(clientheap_id_t id, client_t *client)
+{
+    clientheap_t *heap = &clientheap[id];
+
+    if( heap->count == heap->alloc ) {
+	int        alloc = heap->alloc ? heap->alloc * 2 : 32;
+	client_t **vec   = realloc(heap->vec, alloc * sizeof *vec);
+
+	if( !vec )
+	    abort();
+
+	heap->vec   = vec;
+	heap->alloc = alloc;
+    }
+
+    clientheap_place(id, heap->count++, client);
+    clientheap_sift_up(id, client->heap_pos[id]);
+}
+
+/** Remove client from a priority queue
+ *
+ * @param id     priority queue id
+ * @param client client object
+ */
+static void clientheap_remove(clientheap_id_t id, client_t *client)
+{
+    clientheap_t *heap = &clientheap[id];
+    int           pos  = client->heap_pos[id];
+
+    if( pos < 0 )
+	return;
+
+    client->heap_pos[id] = -1;
+
+    if( pos == --heap->count )
+	return;
+
+    /* Fill the hole with the last entry and restore heap order */
+    clientheap_place(id, pos, heap->vec[heap->count]);
+
+    if( pos > 0 &&
+	tv_lt(clientheap_key(id, heap->vec[pos]),
+	      clientheap_key(id, heap->vec[(pos - 1) / 2])) )
+	clientheap_sift_up(id, pos);
+    else
+	clientheap_sift_down(id, pos);
+}
+
+/** Release priority queue dynamic resources
+ *
+ * @param id     priority queue id
+ */
+static void clientheap_clear(clientheap_id_t id)
+{
+    clientheap_t *heap = &clientheap[id];
+
+    for( int pos = 0; pos < heap->count; ++pos )
+	heap->vec[pos]->heap_pos[id] = -1;
+
+    free(heap->vec);
+    heap->vec   = 0;
+    heap->count = 0;
+    heap->alloc = 0;
+}
+
+/** Collect clients from the top of a priority queue
+ *
+ * Adds clients whose ordering time value is before the limit, and
+ * that have reached their mintime, to the given array. Only the part
+ * of the heap that holds clients before the limit is traversed.
+ *
+ * @param id     priority queue id
+ * @param pos    index to start traversal from
+ * @param limit  time limit for ordering time value
+ * @param now    current monotonic time
+ * @param due    array to add clients to, or NULL to just check
+ *
+ * @return true if at least one client was found, false otherwise
+ */
+static bool clientheap_collect(clientheap_id_t id, int pos,
+			       const struct timeval *limit,
+			       const struct timeval *now,
+			       GPtrArray *due)
+{
+    clientheap_t *heap = &clientheap[id];
+
+    if( pos >= heap->count )
+	return false;
+
+    client_t *client = heap->vec[pos];
+
+    if( !tv_lt(clientheap_key(id, client), limit) )
+	return false;
+
+    bool found = false;
+
+    if( tv_ge(now, &client->mintime) ) {
+	if( !due )
+	    return true;
+	g_ptr_array_add(due, client);
+	found = true;
+    }
+
+    if( clientheap_collect(id, pos * 2 + 1, limit, now, due) ) {
+	if( !due )
+	    return true;
+	found = true;
+    }
+
+    if( clientheap_collect(id, pos * 2 + 2, limit, now, due) )
+	found = true;
+
+    return found;
+}
+
+/** Collect all clients from the top of a priority queue
+ *
+ * Adds clients whose ordering time value is before the limit
+ * to the given array.
+ *
+ * @param id     priority queue id
+ * @param pos    index to start traversal from
+ * @param limit  time limit for ordering time value
+ * @param out    array to add clients to
+ */
+static void clientheap_gather(clientheap_id_t id, int pos,
+			      const struct timeval *limit,
+			      GPtrArray *out)
+{
+    clientheap_t *heap = &clientheap[id];
+
+    if( pos >= heap->count )
+	return;
+
+    client_t *client = heap->vec[pos];
+
+    if( !tv_lt(clientheap_key(id, client), limit) )
+	return;
+
+    g_ptr_array_add(out, client);
+
+    clientheap_gather(id, pos * 2 + 1, limit, out);
+    clientheap_gather(id, pos * 2 + 2, limit, out);
+}
+
+/** Find the earliest maxtime that is after the given time
+ *
+ * Only the part of the heap that holds clients with maxtime
+ * not after the given time is traversed.
+ *
+ * @param id     priority queue id, ordered by maxtime
+ * @param pos    index to start traversal from
+ * @param now    current monotonic time
+ * @param best   in: latest acceptable time, out: earliest time found
+ */
+static void clientheap_next_maxtime(clientheap_id_t id, int pos,
+				    const struct timeval *now,
+				    struct timeval *best)
+{
+    clientheap_t *heap = &clientheap[id];
+
+    if( pos >= heap->count )
+	return;
+
+    const struct timeval *maxtime = &heap->vec[pos]->maxtime;
+
+    if( tv_gt(maxtime, now) ) {
+	/* Entries below this one can't be earlier */
+	if( tv_lt(maxtime, best) )
+	    *best = *maxtime;
+	return;
+    }
+
+    clientheap_next_maxtime(id, pos * 2 + 1, now, best);
+    clientheap_next_maxtime(id, pos * 2 + 2, now, best);
+}
+
 /* ------------------------------------------------------------------------- *
  * list of IPHB clients
  * ------------------------------------------------------------------------- */
@@ -2160,18 +2501,52 @@ static client_t *clientlist_find_internal_client(endpoint_t *conn, void* data)
  */
 static void clientlist_add_client(client_t *newclient)
 {
-    client_t *client;
+    /* add to end */
+    newclient->next  = 0;
+    newclient->pprev = clients_tail;
+    *clients_tail = newclient;
+    clients_tail = &newclient->next;
 
-    if( (client = clients) != 0 ) {
-	/* add to end */
-	while (client->next)
-	    client = client->next;
-	client->next = newclient;
-    }
-    else {
-	/* first one */
-	clients = newclient;
-    }
+    clients_count += 1;
+}
+
+/** Remove client from the priority queues
+ *
+ * @param client client instance to dequeue
+ */
+static void clientlist_dequeue_client(client_t *client)
+{
+    if( client->heap_pos[CLIENTHEAP_MAXTIME] < 0 )
+	return;
+
+    if( client_is_external(client) )
+	clients_waiting_external -= 1;
+
+    for( int id = 0; id < CLIENTHEAP_COUNT; ++id )
+	clientheap_remove(id, client);
+}
+
+/** Update client position in the priority queues
+ *
+ * Must be called whenever wait period of the client changes.
+ *
+ * @param client client instance to requeue
+ */
+static void clientlist_requeue_client(client_t *client)
+{
+    clientlist_dequeue_client(client);
+
+    if( !client_wait_started(client) )
+	return;
+
+    if( client_is_external(client) )
+	clients_waiting_external += 1;
+
+    clientheap_insert(CLIENTHEAP_MAXTIME, client);
+    clientheap_insert(CLIENTHEAP_MINTIME, client);
+
+    if( client_needs_resume(client) )
+	clientheap_insert(CLIENTHEAP_RESUME, client);
 }
 
 /** Remove client instance from list of clients
@@ -2180,13 +2555,20 @@ static void clientlist_add_client(client_t *newclient)
  */
 static void clientlist_remove_client(client_t *client)
 {
-    for( client_t **pos = &clients; *pos; pos = &(*pos)->next ) {
-	if( *pos == client ) {
-	    *pos = client->next;
-	    client->next = 0;
-	    break;
-	}
-    }
+    clientlist_dequeue_client(client);
+
+    if( !client->pprev )
+	return;
+
+    if( (*client->pprev = client->next) )
+	client->next->pprev = client->pprev;
+    else
+	clients_tail = client->pprev;
+
+    client->next  = 0;
+    client->pprev = 0;
+
+    clients_count -= 1;
 }
 
 /** Remove client instance from list of clients and then delete it
@@ -2208,14 +2590,22 @@ static void clientlist_delete_clients(void)
 {
     client_t *client;
 
+    for( int id = 0; id < CLIENTHEAP_COUNT; ++id )
+	clientheap_clear(id);
+    clients_waiting_external = 0;
+
     while( (client = clients) != 0 ) {
 	/* detach head from list*/
 	clients = client->next;
 	client->next = 0;
+	client->pprev = 0;
 
 	/* release dynamic resources */
 	client_close_and_free(client);
     }
+
+    clients_tail = &clients;
+    clients_count = 0;
 }
 
 /** Calculate seconds to the next alarm
@@ -2251,6 +2641,129 @@ static time_t clientlist_get_alarm_time(void)
 /** "infinity" value for struct timeval data */
 static const struct timeval tv_invalid = { INT_MAX, 0 };
 
+/** @brief  Planned wakeups for clients that need resume
+ */
+typedef struct clientplan_t {
+    struct timeval first;   /*!< first planned wakeup, or tv_invalid */
+    int            points;  /*!< number of planned wakeups */
+    int            clients; /*!< number of clients served by them */
+} clientplan_t;
+
+/** Sort callback for ordering clients by maxtime
+ */
+static gint clientplan_compare_cb(gconstpointer a, gconstpointer b)
+{
+    const client_t *c1 = *(const client_t * const *)a;
+    const client_t *c2 = *(const client_t * const *)b;
+
+    if( tv_lt(&c1->maxtime, &c2->maxtime) )
+	return -1;
+
+    return tv_gt(&c1->maxtime, &c2->maxtime);
+}
+
+/** Plan wakeups needed by clients that can't be served right now
+ *
+ * Resume clients that have not reached their mintime yet force a
+ * wakeup somewhere in their [mintime, maxtime] window. The smallest
+ * set of wakeup instants that hits every window is found with greedy
+ * interval stabbing: going through the clients in maxtime order, a
+ * new wakeup is placed at the maxtime of the first client whose window
+ * does not contain the previously placed wakeup.
+ *
+ * Only clients with maxtime less than WAKEUP_PLAN_HORIZON away are
+ * considered.
+ *
+ * @param now  current monotonic time
+ * @param plan where to store the planned wakeups
+ */
+static void clientlist_plan_wakeups(const struct timeval *now,
+				    clientplan_t *plan)
+{
+    struct timeval horizon = *now;
+    struct timeval point   = tv_invalid;
+    GPtrArray     *vec     = g_ptr_array_new();
+
+    horizon.tv_sec += WAKEUP_PLAN_HORIZON;
+
+    plan->first   = tv_invalid;
+    plan->points  = 0;
+    plan->clients = 0;
+
+    clientheap_gather(CLIENTHEAP_RESUME, 0, &horizon, vec);
+    g_ptr_array_sort(vec, clientplan_compare_cb);
+
+    for( guint i = 0; i < vec->len; ++i ) {
+	const client_t *client = g_ptr_array_index(vec, i);
+
+	/* Clients that could be served now do not force a wakeup */
+	if( !tv_gt(&client->mintime, now) )
+	    continue;
+
+	plan->clients += 1;
+
+	/* Served by the previous wakeup? */
+	if( plan->points && !tv_gt(&client->mintime, &point) )
+	    continue;
+
+	point = client->maxtime;
+	if( plan->points++ == 0 )
+	    plan->first = point;
+    }
+
+    g_ptr_array_unref(vec);
+}
+
+/** Collect clients that should be served on wakeup from suspend
+ *
+ * When the device has been woken up anyway, resume clients that have
+ * reached their mintime, but whose maxtime is before the next planned
+ * wakeup, are served right away. Otherwise they would need to wake up
+ * the device once more later on.
+ *
+ * @param now      current monotonic time
+ * @param skip     clients with maxtime before this are already due
+ * @param due      array to add clients to
+ *
+ * @return number of clients added
+ */
+static int clientlist_collect_early(const struct timeval *now,
+				    const struct timeval *skip,
+				    GPtrArray *due)
+{
+    clientplan_t  plan;
+    struct timeval limit;
+    GPtrArray    *vec   = g_ptr_array_new();
+    int           added = 0;
+
+    clientlist_plan_wakeups(now, &plan);
+
+    if( plan.points ) {
+	limit = plan.first;
+    }
+    else {
+	limit = *now;
+	limit.tv_sec += WAKEUP_PLAN_HORIZON;
+    }
+
+    clientheap_collect(CLIENTHEAP_RESUME, 0, &limit, now, vec);
+
+    for( guint i = 0; i < vec->len; ++i ) {
+	client_t *client = g_ptr_array_index(vec, i);
+
+	if( tv_lt(&client->maxtime, skip) )
+	    continue;
+
+	dsme_log(LOG_DEBUG, PFIX "client %s served early", client->pidtxt);
+	g_ptr_array_add(due, client);
+	added += 1;
+    }
+
+    g_ptr_array_unref(vec);
+
+    return added;
+}
+
 /** Reprogram the rtc wakeup alarm
  *
  * Calculate the time when the next client needs to be woken up.
@@ -2267,17 +2780,9 @@ static void clientlist_rethink_rtc_wakeup(const struct timeval *now)
     time_t         sleeptime = INT_MAX;
     time_t         alarmtime = 0;
 
-    /* scan closest external client wakeup time */
-    for( client_t *client = clients; client; client = client->next ) {
-	if( !client_needs_resume(client) )
-	    continue;
-
-	if( !client_wait_started(client) )
-	    continue;
-
-	if( tv_gt(&client->maxtime, now) && tv_gt(&wakeup, &client->maxtime) )
-	    wakeup = client->maxtime;
-    }
+    /* closest wakeup time of clients that need resume; this is
+     * also the first wakeup of the clientlist_plan_wakeups() plan */
+    clientheap_next_maxtime(CLIENTHEAP_RESUME, 0, now, &wakeup);
 
     /* convert from monotonic time stamp to delay */
     if( tv_gt(&wakeup, now) && tv_lt(&wakeup, &tv_invalid) )
@@ -2421,85 +2926,91 @@ static void clientlist_wakeup_clients_now(const struct timeval *now)
     int externals_left = 0;
 
     struct timeval tv_to_max;
-    struct timeval tv_to_min;
     char stamp[64];
 
+    /* maxtimes before this are less than heartbeat away */
+    struct timeval horizon = *now;
+    horizon.tv_sec += DSME_HEARTBEAT_INTERVAL;
+
     dsme_log(LOG_DEBUG, PFIX "check if clients need waking up");
     clientlist_wakeup_clients_cancel();
     clientlist_cancel_wakeup_timeout();
 
-    bool must_wake = false;
+    /* Are there clients that we *must* wake up: mintime passed,
+     * maxtime less than heartbeat away and resume is needed */
+    bool must_wake = clientheap_collect(CLIENTHEAP_RESUME, 0,
+					&horizon, now, 0);
+    if( must_wake )
+	dsme_log(LOG_DEBUG, PFIX "some clients must be woken up");
 
-    /* 1st pass: are there external clients that we *must* wake up */
-    for( client_t *client = clients; client; client = client->next ) {
-        if( !client_wait_started(client) )
-	    continue;
+    /* Collect clients that are due now. When waking up anyway, all
+     * clients that have reached mintime are included. Otherwise just
+     * the ones that have maxtime less than heartbeat away. */
+    GPtrArray *due = g_ptr_array_new();
 
-	if( !client_needs_resume(client) )
-	    continue;
+    int early = 0;
 
-	if( tv_lt(now, &client->mintime) )
-	    continue;
-
-	timersub(&client->maxtime, now, &tv_to_max);
-	if( tv_to_max.tv_sec >= DSME_HEARTBEAT_INTERVAL )
-	    continue;
+    if( must_wake ) {
+	struct timeval limit = { 0, 1 };
+	timeradd(now, &limit, &limit);
+	clientheap_collect(CLIENTHEAP_MINTIME, 0, &limit, now, due);
+    }
+    else {
+	clientheap_collect(CLIENTHEAP_MAXTIME, 0, &horizon, now, due);
 
-	/* mintime passed and maxtime is less than heartbeat away */
-	dsme_log(LOG_DEBUG, PFIX "client %s must be woken up", client->pidtxt);
-	must_wake = true;
-	break;
+	if( clients_resumed )
+	    early = clientlist_collect_early(now, &horizon, due);
     }
 
-    /* 2nd pass: actually wake up clients */
-    for( client_t *client = clients, *next; client; client = next ) {
-	/* get next before possible clientlist_delete_client() call */
-	next = client->next;
+    clients_resumed = false;
 
-        if( !client_wait_started(client) ) {
-            dsme_log(LOG_DEBUG, PFIX "client %s not scheduled", client->pidtxt);
-	    continue;
-        }
+    if( due->len ) {
+	clients_stats.rounds += 1;
+	clients_stats.forced += must_wake;
+	clients_stats.woken  += due->len;
+	clients_stats.early  += early;
+    }
 
-	timersub(&client->maxtime, now, &tv_to_max);
+    /* Actually wake up clients */
+    for( guint i = 0; i < due->len; ++i ) {
+	client_t *client = g_ptr_array_index(due, i);
 
-	if( tv_lt(now, &client->mintime) ) {
-	    timersub(&client->mintime, now, &tv_to_min);
-	    dsme_log(LOG_DEBUG, PFIX "client %s min wakeup %s",
-		     client->pidtxt,
-		     time_minus(&tv_to_min, stamp, sizeof stamp));
+	timersub(&client->maxtime, now, &tv_to_max);
+	dsme_log(LOG_DEBUG, PFIX "client %s due, max wakeup %s",
+		 client->pidtxt,
+		 time_minus(&tv_to_max, stamp, sizeof stamp));
 
-	    /* mintime not reached yet */
-	    if( tv_to_max.tv_sec >= DSME_HEARTBEAT_INTERVAL || !client_needs_resume(client) ) {
-		/* timer is not used for internal clients */
-	    }
-	    else {
-		/* we need timer if maxtime is before the next heartbeat */
-		if( tv_gt(&sleep_time, &tv_to_max) )
-		    sleep_time = tv_to_max;
-	    }
-	}
-	else if( !must_wake && tv_to_max.tv_sec >= DSME_HEARTBEAT_INTERVAL ) {
-	    /* maxtime is at least one heartbeat away */
-	    dsme_log(LOG_DEBUG, PFIX "client %s max wakeup %s",
-		     client->pidtxt,
-		     time_minus(&tv_to_max, stamp, sizeof stamp));
+	if( !client_wakeup(client, now) ) {
+	    dsme_log(LOG_ERR, PFIX "failed to send to client %s (%m),"
+		     " drop client", client->pidtxt);
+	    clientlist_delete_client(client);
 	}
 	else {
-	    /* due now, wakeup */
-	    if( !client_wakeup(client, now) ) {
-		dsme_log(LOG_ERR, PFIX "failed to send to client %s (%m),"
-			 " drop client", client->pidtxt);
-		clientlist_delete_client(client), client = 0;
-	    }
-	    continue;
+	    clientlist_requeue_client(client);
 	}
+    }
+
+    g_ptr_array_unref(due);
 
-	/* count active, but untriggered external clients */
-	if( client_is_external(client) )
-	    externals_left += 1;
+    dsme_log(LOG_DEBUG, PFIX "%d clients waiting",
+	     clientheap[CLIENTHEAP_MAXTIME].count);
+
+    /* We need timer if a client that needs resume has maxtime before
+     * the next heartbeat. Anything still queued has mintime ahead. */
+    if( clientheap[CLIENTHEAP_RESUME].count ) {
+	const client_t *client = clientheap[CLIENTHEAP_RESUME].vec[0];
+
+	if( tv_lt(&client->maxtime, &horizon) ) {
+	    if( tv_gt(&client->maxtime, now) )
+		timersub(&client->maxtime, now, &sleep_time);
+	    else
+		timerclear(&sleep_time);
+	}
     }
 
+    /* count active, but untriggered external clients */
+    externals_left = clients_waiting_external;
+
     if( sleep_time.tv_sec < INT_MAX ) {
 	clientlist_start_wakeup_timeout(&sleep_time);
     }
@@ -2551,7 +3062,7 @@ static gboolean clientlist_wakeup_clients_cb(gpointer aptr)
 
     /* If the timer has not been reprogrammed, release wakelock */
     if( !clientlist_wakeup_clients_id )
-	wakelock_unlock(iphb_wakeup);
+	wakelock_release(iphb_wakeup);
 
 EXIT:
     return FALSE;
@@ -2565,7 +3076,7 @@ static void clientlist_wakeup_clients_cancel(void)
 	dsme_log(LOG_DEBUG, PFIX "cancel delayed wakeup checking");
 	dsme_destroy_timer(clientlist_wakeup_clients_id),
 	    clientlist_wakeup_clients_id = 0;
-	wakelock_unlock(iphb_wakeup);
+	wakelock_release(iphb_wakeup);
     }
 }
 
@@ -2873,6 +3384,11 @@ static void epollfd_remove_fd(int fd)
 }
 
 /** Handle epoll event associated with libiphb client
+ *
+ * All requests available from the socket are received without
+ * blocking. A trailing partial request is kept buffered until the
+ * rest of it arrives. Since each wait request replaces the previous
+ * one, only the latest wait request in a batch is applied.
  *
  * @param event epoll event to handle
  * @param now   current monotonic time
@@ -2891,28 +3407,90 @@ static bool epollfd_handle_client_req(struct epoll_event* event,
         goto drop_client_and_fail;
     }
 
-    struct _iphb_req_t req = { 0 };
+    /* Room for several requests, of which the first one can be
+     * partially received already */
+    struct _iphb_req_t      reqs[DSME_RECV_REQUESTS];
+    char                   *buf       = (char *)reqs;
+    const size_t            frame     = sizeof *reqs;
+
+    /* Only the latest wait request in the batch needs to be applied */
+    struct _iphb_wait_req_t wait;
+    bool                    have_wait = false;
+
+    for( ;; ) {
+	size_t have = client->rxlen;
+	memcpy(buf, client->rxbuf, have);
+
+	ssize_t rc = recv(client->fd, buf + have, sizeof reqs - have,
+			  MSG_DONTWAIT);
+	if( rc == 0 ) {
+	    dsme_log(LOG_DEBUG, PFIX "client %s disappeared",
+		     client->pidtxt);
+	    goto drop_client_and_fail;
+	}
 
-    if( recv(client->fd, &req, sizeof req, MSG_WAITALL) <= 0 ) {
-        dsme_log(LOG_ERR, PFIX "failed to read from client %s: %m",
-                 client->pidtxt);
-        goto drop_client_and_fail;
-    }
+	if( rc == -1 ) {
+	    if( errno == EINTR )
+		continue;
+	    if( errno == EAGAIN || errno == EWOULDBLOCK )
+		break;
+	    dsme_log(LOG_ERR, PFIX "failed to read from client %s: %m",
+		     client->pidtxt);
+	    goto drop_client_and_fail;
+	}
 
-    switch (req.cmd) {
-        case IPHB_WAIT:
-            client_woken = client_handle_wait_req(client, &req.u.wait, now);
-            break;
+	size_t done = 0;
+
+	for( have += rc; have - done >= frame; done += frame ) {
+	    const struct _iphb_req_t *req = &reqs[done / frame];
+
+	    switch (req->cmd) {
+	    case IPHB_WAIT:
+		client_req_stats.waits += 1;
+		if( have_wait )
+		    client_req_stats.coalesced += 1;
+		wait      = req->u.wait;
+		have_wait = true;
+		break;
+
+	    case IPHB_STAT:
+		client_req_stats.stats += 1;
+		/* Report state as if requests were handled one by one */
+		if( have_wait ) {
+		    client_woken |= client_handle_wait_req(client, &wait, now);
+		    clientlist_requeue_client(client);
+		    have_wait = false;
+		}
+		client_handle_stat_req(client);
+		break;
+
+	    default:
+		dsme_log(LOG_ERR, PFIX "client %s gave invalid command 0x%x, drop it",
+			 client->pidtxt,
+			 (unsigned int)req->cmd);
+		goto drop_client_and_fail;
+	    }
+	}
+
+	/* Keep partial request buffered until the rest arrives */
+	client->rxlen = have - done;
+	memcpy(client->rxbuf, buf + done, client->rxlen);
 
-        case IPHB_STAT:
-            client_handle_stat_req(client);
-            break;
+	/* One buffer per event; the socket is polled level triggered,
+	 * so whatever is left gets handled on a later round and a busy
+	 * client can't hold up the others */
+	break;
+    }
 
-        default:
-            dsme_log(LOG_ERR, PFIX "client %s gave invalid command 0x%x, drop it",
-                     client->pidtxt,
-                     (unsigned int)req.cmd);
-            goto drop_client_and_fail;
+    if( client->rxlen ) {
+	dsme_log(LOG_DEBUG, PFIX "client %s: partial request, %zu bytes",
+		 client->pidtxt, client->rxlen);
+	client_req_stats.partial += 1;
+    }
+
+    if( have_wait ) {
+	client_woken |= client_handle_wait_req(client, &wait, now);
+	clientlist_requeue_client(client);
     }
 
     return client_woken;
@@ -2922,6 +3500,33 @@ drop_client_and_fail:
     return false;
 }
 
+/** Make sure the epoll event buffer can hold events from all clients
+ *
+ * The buffer grows with the number of connected clients, so that
+ * a burst of requests from all of them can be fetched at once.
+ */
+static void epollfd_reserve_events(void)
+{
+    /* listenfd, kernelfd, rtc_fd and linux_alarm_timerfd + clients */
+    int want = clients_count + 4;
+
+    if( want < DSME_MAX_EPOLL_EVENTS )
+	want = DSME_MAX_EPOLL_EVENTS;
+
+    if( want <= epollfd_events_max )
+	return;
+
+    if( want < epollfd_events_max * 2 )
+	want = epollfd_events_max * 2;
+
+    void *events = realloc(epollfd_events, want * sizeof *epollfd_events);
+    if( !events )
+	abort();
+
+    epollfd_events     = events;
+    epollfd_events_max = want;
+}
+
 /** I/O watch callback for the epoll set
  *
  * The epoll set handles
@@ -2930,6 +3535,9 @@ drop_client_and_fail:
  * - rtc wakeup alarms from /dev/rtc
  * - iphb events from kernel
  *
+ * Events are fetched until epoll_wait() does not fill the buffer
+ * anymore, or DSME_EPOLL_BUDGET_MS has been spent.
+ *
  * @param source     glib io channel associated with epollfd
  * @param condition  (unused)
  * @param data       (unused)
@@ -2945,8 +3553,10 @@ static gboolean epollfd_iowatch_cb(GIOChannel*  source,
     bool               wakeup_mce = false;
 
     struct timeval     tv_now;
-    struct epoll_event events[DSME_MAX_EPOLL_EVENTS];
+    struct timeval     tv_limit;
+    struct timeval     tv_budget  = { 0, DSME_EPOLL_BUDGET_MS * 1000 };
     int                nfds;
+    int                handled    = 0;
 
     wakelock_lock(rtc_input, -1);
 
@@ -2957,48 +3567,80 @@ static gboolean epollfd_iowatch_cb(GIOChannel*  source,
 	goto cleanup_nak;
     }
 
-    nfds = epoll_wait(epollfd, events, DSME_MAX_EPOLL_EVENTS, 0);
+    monotime_get_tv(&tv_now);
+    timeradd(&tv_now, &tv_budget, &tv_limit);
 
-    if( nfds == -1 ) {
-	if( errno == EINTR || errno == EAGAIN )
-	    goto cleanup_ack;
+    for( ;; ) {
+	epollfd_reserve_events();
 
-        dsme_log(LOG_ERR, PFIX "epoll waiting failed (%m)");
-	goto cleanup_nak;
-    }
+	nfds = epoll_wait(epollfd, epollfd_events, epollfd_events_max, 0);
 
-    monotime_get_tv(&tv_now);
+	if( nfds == -1 ) {
+	    if( errno != EINTR && errno != EAGAIN ) {
+		dsme_log(LOG_ERR, PFIX "epoll waiting failed (%m)");
+		goto cleanup_nak;
+	    }
+	    if( !handled )
+		goto cleanup_ack;
+	    break;
+	}
 
-    /* go through new events */
-    for( int i = 0; i < nfds; ++i ) {
-        if (events[i].data.ptr == &listenfd) {
-            /* accept new clients */
-	    listenfd_handle_connect();
-        }
-	else if (events[i].data.ptr == &kernelfd) {
-	    /* iphb event from kernel */
-	    kernelfd_handle_event();
-        }
-	else if (events[i].data.ptr == &rtc_fd) {
-	    /* rtc wakeup (and possibly resume from suspend) */
-	    if( !rtc_handle_input() )
-		rtc_detach();
-	    else
-		wakeup_mce = true;
-        }
-	else if (events[i].data.ptr == &linux_alarm_timerfd) {
-	    /* timerfd wakeup (and possibly resume from suspend) */
-	    if( !linux_alarm_handle_input() )
-		linux_alarm_quit();
-	    else
-		wakeup_mce = true;
-        }
-	else {
-            /* deal with old clients */
-            epollfd_handle_client_req(&events[i], &tv_now);
-        }
+	epollfd_stats.rounds += 1;
+	handled += nfds;
+
+	monotime_get_tv(&tv_now);
+
+	/* go through new events */
+	for( int i = 0; i < nfds; ++i ) {
+	    struct epoll_event *event = &epollfd_events[i];
+
+	    if (event->data.ptr == &listenfd) {
+		/* accept new clients */
+		listenfd_handle_connect();
+	    }
+	    else if (event->data.ptr == &kernelfd) {
+		/* iphb event from kernel */
+		kernelfd_handle_event();
+	    }
+	    else if (event->data.ptr == &rtc_fd) {
+		/* rtc wakeup (and possibly resume from suspend) */
+		if( !rtc_handle_input() )
+		    rtc_detach();
+		else
+		    wakeup_mce = clients_resumed = true;
+	    }
+	    else if (event->data.ptr == &linux_alarm_timerfd) {
+		/* timerfd wakeup (and possibly resume from suspend) */
+		if( !linux_alarm_handle_input() )
+		    linux_alarm_quit();
+		else
+		    wakeup_mce = clients_resumed = true;
+	    }
+	    else {
+		/* deal with old clients */
+		epollfd_handle_client_req(event, &tv_now);
+	    }
+	}
+
+	/* Buffer was not filled -> all pending events handled */
+	if( nfds < epollfd_events_max )
+	    break;
+
+	/* Leave the rest to the next main loop iteration */
+	monotime_get_tv(&tv_now);
+	if( !tv_lt(&tv_now, &tv_limit) ) {
+	    dsme_log(LOG_DEBUG, PFIX "epoll time budget exceeded after"
+		     " %d events", handled);
+	    epollfd_stats.budget += 1;
+	    break;
+	}
     }
 
+    epollfd_stats.dispatches += 1;
+    epollfd_stats.events     += handled;
+    if( epollfd_stats.max_events < handled )
+	epollfd_stats.max_events = handled;
+
     clientlist_wakeup_clients_later(&tv_now);
 
     if( wakeup_mce ) {
@@ -3021,7 +3663,7 @@ cleanup_nak:
     if( !keep_going )
 	dsme_log(LOG_CRIT, PFIX "epoll waiting disabled");
 
-    wakelock_unlock(rtc_input);
+    wakelock_release(rtc_input);
     modulebase_enter_module(caller);
 
     return keep_going;
@@ -3035,6 +3677,9 @@ static void epollfd_quit(void)
 
     if( epollfd != -1 )
 	close(epollfd), epollfd = -1;
+
+    free(epollfd_events), epollfd_events = 0;
+    epollfd_events_max = 0;
 }
 
 /** Start the epoll io watch
@@ -3055,9 +3700,9 @@ static bool epollfd_init(void)
         goto cleanup;
     }
 
-    if( !(epoll_watch = g_io_add_watch(chan,
-				       G_IO_IN|G_IO_ERR|G_IO_HUP|G_IO_NVAL,
-				       epollfd_iowatch_cb, 0)) ) {
+    if( !(epoll_watch = dsme_main_loop_add_watch("iphb:epoll", chan,
+						 G_IO_IN|G_IO_ERR|G_IO_HUP|G_IO_NVAL,
+						 epollfd_iowatch_cb, 0)) ) {
 	goto cleanup;
     }
 
@@ -3151,6 +3796,7 @@ DSME_HANDLER(DSM_MSGTYPE_WAIT, conn, msg)
     }
 
     client_handle_wait_req(client, &msg->req, &tv_now);
+    clientlist_requeue_client(client);
 
     if( client_needs_resume(client) ) {
 	/* Internal requests with wakeup flag set are handled similarly
@@ -3165,6 +3811,75 @@ DSME_HANDLER(DSM_MSGTYPE_WAIT, conn, msg)
     }
 }
 
+/** Send one row of statistics to dsmetool */
+static void iphb_report_row(endpoint_t *conn, const char *fmt, ...)
+{
+    DSM_MSGTYPE_SERVER_STATS rsp = DSME_MSG_INIT(DSM_MSGTYPE_SERVER_STATS);
+    char                     row[256];
+    va_list                  va;
+
+    va_start(va, fmt);
+    vsnprintf(row, sizeof row, fmt, va);
+    va_end(va);
+
+    endpoint_send_with_extra(conn, &rsp, strlen(row) + 1, row);
+}
+
+/** Handle client wakeup statistics query */
+DSME_HANDLER(DSM_MSGTYPE_GET_IPHB_STATS, conn, msg)
+{
+    DSM_MSGTYPE_SERVER_STATS rsp = DSME_MSG_INIT(DSM_MSGTYPE_SERVER_STATS);
+
+    struct timeval tv_now;
+    clientplan_t   plan;
+
+    monotime_get_tv(&tv_now);
+    clientlist_plan_wakeups(&tv_now, &plan);
+
+    iphb_report_row(conn, "iphb: clients=%d waiting=%d resume=%d external=%d",
+		    clients_count,
+		    clientheap[CLIENTHEAP_MAXTIME].count,
+		    clientheap[CLIENTHEAP_RESUME].count,
+		    clients_waiting_external);
+
+    iphb_report_row(conn, "iphb: rounds=%llu forced=%llu woken=%llu"
+		    " early=%llu clients/round=%.2f",
+		    (unsigned long long)clients_stats.rounds,
+		    (unsigned long long)clients_stats.forced,
+		    (unsigned long long)clients_stats.woken,
+		    (unsigned long long)clients_stats.early,
+		    clients_stats.rounds ?
+		    (double)clients_stats.woken / clients_stats.rounds : 0.0);
+
+    iphb_report_row(conn, "iphb: plan: wakeups=%d clients=%d"
+		    " clients/wakeup=%.2f next=%lds",
+		    plan.points, plan.clients,
+		    plan.points ? (double)plan.clients / plan.points : 0.0,
+		    plan.points ? (long)(plan.first.tv_sec - tv_now.tv_sec) : -1L);
+
+    iphb_report_row(conn, "iphb: requests: wait=%llu stat=%llu"
+		    " coalesced=%llu partial=%llu",
+		    (unsigned long long)client_req_stats.waits,
+		    (unsigned long long)client_req_stats.stats,
+		    (unsigned long long)client_req_stats.coalesced,
+		    (unsigned long long)client_req_stats.partial);
+
+    iphb_report_row(conn, "iphb: epoll: dispatches=%llu events=%llu"
+		    " rounds=%llu events/dispatch=%.2f max/dispatch=%d"
+		    " budget_exceeded=%llu buffer=%d",
+		    (unsigned long long)epollfd_stats.dispatches,
+		    (unsigned long long)epollfd_stats.events,
+		    (unsigned long long)epollfd_stats.rounds,
+		    epollfd_stats.dispatches ?
+		    (double)epollfd_stats.events / epollfd_stats.dispatches : 0.0,
+		    epollfd_stats.max_events,
+		    (unsigned long long)epollfd_stats.budget,
+		    epollfd_events_max);
+
+    /* Terminate the reply sequence */
+    endpoint_send(conn, &rsp);
+}
+
 /** Handle connected to system bus */
 DSME_HANDLER(DSM_MSGTYPE_DBUS_CONNECTED, client, msg)
 {
@@ -3184,6 +3899,7 @@ module_fn_info_t message_handlers[] =
 {
     DSME_HANDLER_BINDING(DSM_MSGTYPE_HEARTBEAT),
     DSME_HANDLER_BINDING(DSM_MSGTYPE_WAIT),
+    DSME_HANDLER_BINDING(DSM_MSGTYPE_GET_IPHB_STATS),
 
     DSME_HANDLER_BINDING(DSM_MSGTYPE_DBUS_CONNECTED),
     DSME_HANDLER_BINDING(DSM_MSGTYPE_DBUS_DISCONNECT),
@@ -3356,8 +4072,8 @@ void module_init(module_t *handle)
     xtimed_status_load();
 
     /* Clear stale wakelocks that we might have left due to dsme crash etc */
-    wakelock_unlock(rtc_wakeup);
-    wakelock_unlock(rtc_input);
+    wakelock_clear(rtc_wakeup);
+    wakelock_clear(rtc_input);
 
     /* Initialize epoll set before services that need it */
     if( !epollfd_init() )
@@ -3462,8 +4178,9 @@ void module_fini(void)
     systembus_disconnect();
 
     /* Release wakelocks before exiting */
-    wakelock_unlock(rtc_wakeup);
-    wakelock_unlock(rtc_input);
+    wakelock_flush();
+    wakelock_clear(rtc_wakeup);
+    wakelock_clear(rtc_input);
 
     dsme_log(LOG_INFO, PFIX "iphb.so unloaded");
 }
@@ -35,6 +35,7 @@
 #include "../include/dsme/modules.h"
 #include "../include/dsme/logging.h"
 #include "../include/dsme/modulebase.h"
+#include "../include/dsme/mainloop.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -301,9 +302,9 @@ static bool start_listening_to_validator(void)
     g_io_channel_set_buffered(chn, FALSE);
     g_io_channel_set_close_on_unref(chn, TRUE), fd = -1;
 
-    validator_id = g_io_add_watch(chn,
-                                  G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-                                  handle_validator_message, 0);
+    validator_id = dsme_main_loop_add_watch("validator", chn,
+                                            G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                            handle_validator_message, 0);
 
 cleanup:
     if( chn )
@@ -0,0 +1,257 @@
+/**
+   @file connectbench.c
+
+   Measure how quickly DSME serves a burst of connecting clients
+   <p>
+   Simulates bootup where lots of clients connect to DSME at about
+   the same time: the given number of threads are released at once to
+   connect and make a version query. Connect and reply latencies are
+   reported as percentiles.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dsme/protocol.h>
+#include <dsme/messages.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* ========================================================================= *
+ * Client threads
+ * ========================================================================= */
+
+/** Timing results from one client */
+typedef struct
+{
+    /** Time spent in connect() [us], or -1 on failure */
+    int64_t connect_us;
+
+    /** Time from connect to receiving version reply [us], or -1 */
+    int64_t reply_us;
+} client_result_t;
+
+static const char        *socket_path = 0;
+static pthread_barrier_t  start_barrier;
+
+static int64_t bench_clock_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+static void *client_thread(void *aptr)
+{
+    client_result_t       *res  = aptr;
+    dsmesock_connection_t *conn = 0;
+    int                    fd   = -1;
+
+    res->connect_us = -1;
+    res->reply_us   = -1;
+
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof sa.sun_path, "%s", socket_path);
+
+    if( (fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 )
+        goto EXIT;
+
+    /* Release all clients at once */
+    pthread_barrier_wait(&start_barrier);
+
+    int64_t t0 = bench_clock_us();
+
+    if( connect(fd, (struct sockaddr *)&sa, sizeof sa) == -1 )
+        goto EXIT;
+
+    int64_t t1 = bench_clock_us();
+    res->connect_us = t1 - t0;
+
+    if( !(conn = dsmesock_init(fd)) )
+        goto EXIT;
+
+    /* socket fd is now owned by conn */
+    fd = -1;
+
+    DSM_MSGTYPE_GET_VERSION req = DSME_MSG_INIT(DSM_MSGTYPE_GET_VERSION);
+    dsmesock_send(conn, &req);
+
+    for( ;; ) {
+        dsmemsg_generic_t *msg = dsmesock_receive(conn);
+        bool               got = false;
+
+        if( !msg )
+            break;
+
+        if( DSMEMSG_CAST(DSM_MSGTYPE_DSME_VERSION, msg) ) {
+            res->reply_us = bench_clock_us() - t1;
+            got = true;
+        }
+
+        free(msg);
+
+        if( got )
+            break;
+    }
+
+EXIT:
+    if( conn )
+        dsmesock_close(conn);
+
+    if( fd != -1 )
+        close(fd);
+
+    return 0;
+}
+
+/* ========================================================================= *
+ * Reporting
+ * ========================================================================= */
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void report_latency(const char *what, int64_t *data, size_t count,
+                           size_t total)
+{
+    static const int pct[] = { 50, 90, 99, 100 };
+
+    printf("%-8s ok=%zu/%zu", what, count, total);
+
+    if( count > 0 ) {
+        qsort(data, count, sizeof *data, cmp_int64);
+
+        for( size_t i = 0; i < sizeof pct / sizeof *pct; ++i ) {
+            size_t idx = (count * pct[i] + 99) / 100;
+            if( idx > 0 )
+                --idx;
+            printf(" p%d=%lld", pct[i], (long long)data[idx]);
+        }
+        printf(" us");
+    }
+    printf("\n");
+}
+
+/* ========================================================================= *
+ * Main
+ * ========================================================================= */
+
+static void usage(const char *name)
+{
+    printf("USAGE: %s [-n <clients>] [-s <socket path>]\n", name);
+    printf("  -n --clients <count>   Number of simultaneous clients (32)\n");
+    printf("  -s --socket <path>     DSME socket path\n");
+}
+
+int main(int argc, char **argv)
+{
+    const struct option long_options[] = {
+        { "clients", required_argument, NULL, 'n' },
+        { "socket",  required_argument, NULL, 's' },
+        { "help",    no_argument,       NULL, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    unsigned clients = 32;
+
+    if( !(socket_path = getenv("DSME_SOCKFILE")) || !*socket_path )
+        socket_path = dsmesock_default_location;
+
+    for( ;; ) {
+        int opt = getopt_long(argc, argv, "n:s:h", long_options, 0);
+
+        if( opt == -1 )
+            break;
+
+        switch( opt ) {
+        case 'n':
+            clients = strtoul(optarg, 0, 0);
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if( clients < 1 ) {
+        fprintf(stderr, "invalid number of clients\n");
+        return EXIT_FAILURE;
+    }
+
+    pthread_t       *tid = calloc(clients, sizeof *tid);
+    client_result_t *res = calloc(clients, sizeof *res);
+    int64_t         *con = calloc(clients, sizeof *con);
+    int64_t         *rep = calloc(clients, sizeof *rep);
+    size_t           con_cnt = 0;
+    size_t           rep_cnt = 0;
+
+    if( !tid || !res || !con || !rep )
+        return EXIT_FAILURE;
+
+    pthread_barrier_init(&start_barrier, 0, clients);
+
+    for( unsigned i = 0; i < clients; ++i ) {
+        if( pthread_create(&tid[i], 0, client_thread, &res[i]) != 0 ) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    for( unsigned i = 0; i < clients; ++i ) {
+        pthread_join(tid[i], 0);
+
+        if( res[i].connect_us >= 0 )
+            con[con_cnt++] = res[i].connect_us;
+        if( res[i].reply_us >= 0 )
+            rep[rep_cnt++] = res[i].reply_us;
+    }
+
+    pthread_barrier_destroy(&start_barrier);
+
+    printf("socket: %s  clients: %u\n", socket_path, clients);
+    report_latency("connect:", con, con_cnt, clients);
+    report_latency("reply:",   rep, rep_cnt, clients);
+
+    free(rep);
+    free(con);
+    free(res);
+    free(tid);
+
+    return (rep_cnt == clients) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,202 @@
+/**
+   @file dispatchbench.c
+
+   Micro-benchmark for DSME internal message dispatching
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* INTRUSIONS */
+
+#include "../dsme/modulebase.c"
+
+/* INCLUDES */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* ========================================================================= *
+ * Fake modules and handlers
+ * ========================================================================= */
+
+/** Message type used for measurements */
+#define BENCH_MSG_TYPE   0x0000b00f
+
+/** Number of different message types the fake modules handle */
+#define BENCH_TYPE_COUNT 64
+
+/** Number of dispatch rounds per measurement */
+#define BENCH_ROUNDS     200000
+
+static unsigned bench_calls = 0;
+static int      bench_prev  = -1;
+
+bool dsme_in_valgrind_mode(void)
+{
+    return false;
+}
+
+static void bench_handler_cb(endpoint_t* sender, const dsmemsg_generic_t* msg)
+{
+    (void)sender;
+    (void)msg;
+    ++bench_calls;
+}
+
+static void order_handler_cb(endpoint_t* sender, const dsmemsg_generic_t* msg)
+{
+    (void)sender;
+    (void)msg;
+
+    int prio = currently_handling_module->priority;
+
+    assert(prio >= bench_prev);
+    bench_prev = prio;
+    ++bench_calls;
+}
+
+static module_t* fake_module_create(int priority)
+{
+    module_t* module = calloc(1, sizeof *module);
+
+    module->name     = strdup("fake.so");
+    module->priority = priority;
+
+    return module;
+}
+
+static void fake_module_delete(module_t* module)
+{
+    remove_msghandlers(module);
+    free(module->name);
+    free(module);
+}
+
+static int64_t bench_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* ========================================================================= *
+ * Test cases
+ * ========================================================================= */
+
+/** Check that priority order + load order tie-break is honored */
+static void order_check(void)
+{
+    static const int prio[] = { 5, 0, 3, 0, -2, 3, 9, 0 };
+
+    module_t*         module[G_N_ELEMENTS(prio)];
+    dsmemsg_generic_t msg = {
+        .line_size_ = sizeof msg,
+        .size_      = sizeof msg,
+        .type_      = BENCH_MSG_TYPE,
+    };
+    endpoint_t        from = { 0, 0, bogus_ucred };
+
+    for (size_t i = 0; i < G_N_ELEMENTS(prio); ++i) {
+        module[i] = fake_module_create(prio[i]);
+        modulebase_add_single_handler(BENCH_MSG_TYPE, sizeof msg,
+                                      order_handler_cb, module[i]);
+    }
+
+    /* Equal priorities must be dispatched in load order */
+    GPtrArray* handlers = dispatch_index_lookup(BENCH_MSG_TYPE);
+    assert(handlers && handlers->len == G_N_ELEMENTS(prio));
+    assert(((msg_handler_info_t*)g_ptr_array_index(handlers, 1))->owner == module[1]);
+    assert(((msg_handler_info_t*)g_ptr_array_index(handlers, 2))->owner == module[3]);
+    assert(((msg_handler_info_t*)g_ptr_array_index(handlers, 3))->owner == module[7]);
+
+    bench_calls = 0;
+    bench_prev  = INT32_MIN;
+    handle_message(&from, 0, &msg);
+    assert(bench_calls == G_N_ELEMENTS(prio));
+
+    /* Removing handlers must retain the order of the rest */
+    fake_module_delete(module[3]);
+    assert(((msg_handler_info_t*)g_ptr_array_index(handlers, 1))->owner == module[1]);
+    assert(((msg_handler_info_t*)g_ptr_array_index(handlers, 2))->owner == module[7]);
+
+    for (size_t i = 0; i < G_N_ELEMENTS(prio); ++i) {
+        if (i != 3)
+            fake_module_delete(module[i]);
+    }
+    assert(handlers->len == 0);
+
+    printf("order check: ok\n");
+}
+
+/** Measure dispatch cost vs total number of registered handlers */
+static void dispatch_bench(unsigned handler_count)
+{
+    module_t*         module[handler_count + 1];
+    dsmemsg_generic_t msg = {
+        .line_size_ = sizeof msg,
+        .size_      = sizeof msg,
+        .type_      = BENCH_MSG_TYPE,
+    };
+    endpoint_t        from = { 0, 0, bogus_ucred };
+
+    /* Background handlers spread over other message types */
+    for (unsigned i = 0; i < handler_count; ++i) {
+        module[i] = fake_module_create(0);
+        modulebase_add_single_handler(BENCH_MSG_TYPE + 1 + i % BENCH_TYPE_COUNT,
+                                      sizeof msg, bench_handler_cb, module[i]);
+    }
+
+    /* The single handler that is actually called */
+    module[handler_count] = fake_module_create(0);
+    modulebase_add_single_handler(BENCH_MSG_TYPE, sizeof msg,
+                                  bench_handler_cb, module[handler_count]);
+
+    /* Logging would dominate the measurement */
+    dsme_log_set_verbosity(LOG_WARNING);
+
+    bench_calls = 0;
+    int64_t t0 = bench_clock_ns();
+    for (unsigned round = 0; round < BENCH_ROUNDS; ++round)
+        handle_message(&from, 0, &msg);
+    int64_t t1 = bench_clock_ns();
+    assert(bench_calls == BENCH_ROUNDS);
+
+    printf("handlers: %5u  dispatch: %7.1f ns/msg\n",
+           handler_count + 1, (double)(t1 - t0) / BENCH_ROUNDS);
+
+    for (unsigned i = 0; i <= handler_count; ++i)
+        fake_module_delete(module[i]);
+}
+
+int main(void)
+{
+    static const unsigned counts[] = { 0, 8, 32, 128, 512, 2048 };
+
+    dsme_log_init();
+    dsme_log_open(LOG_METHOD_STDERR, LOG_WARNING, false, "", 0, 0, "");
+
+    order_check();
+
+    for (size_t i = 0; i < G_N_ELEMENTS(counts); ++i)
+        dispatch_bench(counts[i]);
+
+    dsme_log_close();
+
+    return EXIT_SUCCESS;
+}
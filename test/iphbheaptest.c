@@ -0,0 +1,328 @@
+/**
+   @file iphbheaptest.c
+
+   Check IPHB client priority queues against brute force scans
+   <p>
+   Clients get random wait periods, and are moved in and out of the
+   priority queues the same way the iphb module does it. After each
+   batch of updates the heaps are checked for ordering and position
+   bookkeeping, and the results of the pruned heap traversals are
+   compared against what a linear scan over all clients finds.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* INTRUSIONS */
+
+#include "../dsme/modulebase.c"
+#include "../modules/iphb.c"
+
+/* INCLUDES */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* STUBS */
+
+#include "stub_dsme_dbus.h"
+
+DBusConnection *dsme_dbus_get_connection(DBusError *err)
+{
+    (void)err;
+    return 0;
+}
+
+bool dsme_in_valgrind_mode(void)
+{
+    return false;
+}
+
+/* ========================================================================= *
+ * Test clients
+ * ========================================================================= */
+
+/** Number of clients */
+#define TEST_CLIENTS  500
+
+/** Number of random wait period changes */
+#define TEST_UPDATES  200000
+
+/** Check heaps against brute force after this many changes */
+#define TEST_INTERVAL 100
+
+/** Wait periods are placed within this time range [s] */
+#define TEST_RANGE    2000
+
+static client_t *test_client[TEST_CLIENTS];
+static unsigned  test_failures = 0;
+
+static void test_fail(clientheap_id_t id, const char *what)
+{
+    if( ++test_failures <= 10 )
+        fprintf(stderr, "heap %d: %s\n", (int)id, what);
+}
+
+/** Random time value with plenty of ties */
+static struct timeval test_random_time(void)
+{
+    struct timeval tv = {
+        .tv_sec  = rand() % TEST_RANGE,
+        .tv_usec = (rand() % 4) * 250000,
+    };
+    return tv;
+}
+
+/** Start, stop or change wait period of a random client */
+static void test_update_client(void)
+{
+    client_t *client = test_client[rand() % TEST_CLIENTS];
+
+    if( rand() % 5 == 0 ) {
+        timerclear(&client->reqtime);
+    }
+    else {
+        struct timeval len = {
+            .tv_sec  = rand() % 600,
+            .tv_usec = (rand() % 4) * 250000,
+        };
+
+        client->reqtime.tv_sec = 1;
+        client->mintime = test_random_time();
+        timeradd(&client->mintime, &len, &client->maxtime);
+
+        if( !client_is_external(client) )
+            client->wakeup = (rand() % 2) != 0;
+    }
+
+    clientlist_requeue_client(client);
+}
+
+/** Test if client should be in the given priority queue */
+static bool test_in_heap(clientheap_id_t id, const client_t *client)
+{
+    if( !client_wait_started(client) )
+        return false;
+
+    if( id == CLIENTHEAP_RESUME )
+        return client_needs_resume(client);
+
+    return true;
+}
+
+static int test_compare_cb(const void *a, const void *b)
+{
+    uintptr_t pa = (uintptr_t)*(void * const *)a;
+    uintptr_t pb = (uintptr_t)*(void * const *)b;
+    return (pa > pb) - (pa < pb);
+}
+
+/** Compare traversal result against brute force result, order ignored */
+static void test_compare(clientheap_id_t id, const char *what,
+                         GPtrArray *have, GPtrArray *want)
+{
+    qsort(have->pdata, have->len, sizeof *have->pdata, test_compare_cb);
+    qsort(want->pdata, want->len, sizeof *want->pdata, test_compare_cb);
+
+    bool same = (have->len == want->len);
+
+    for( guint i = 0; same && i < have->len; ++i )
+        same = (have->pdata[i] == want->pdata[i]);
+
+    if( !same )
+        test_fail(id, what);
+}
+
+/** Check heap ordering and client position bookkeeping */
+static void test_check_structure(clientheap_id_t id)
+{
+    const clientheap_t *heap = &clientheap[id];
+    int                 size = 0;
+
+    for( int pos = 0; pos < heap->count; ++pos ) {
+        const client_t *client = heap->vec[pos];
+
+        if( client->heap_pos[id] != pos )
+            test_fail(id, "position mismatch");
+
+        if( pos > 0 &&
+            tv_lt(clientheap_key(id, client),
+                  clientheap_key(id, heap->vec[(pos - 1) / 2])) )
+            test_fail(id, "heap order violated");
+    }
+
+    for( int i = 0; i < TEST_CLIENTS; ++i ) {
+        const client_t *client = test_client[i];
+        int             pos    = client->heap_pos[id];
+
+        if( !test_in_heap(id, client) ) {
+            if( pos != -1 )
+                test_fail(id, "client queued without wait period");
+            continue;
+        }
+
+        size += 1;
+
+        if( pos < 0 || pos >= heap->count || heap->vec[pos] != client )
+            test_fail(id, "client missing from queue");
+    }
+
+    if( size != heap->count )
+        test_fail(id, "wrong number of clients");
+}
+
+/** Check pruned traversals against brute force scans */
+static void test_check_traversals(clientheap_id_t id)
+{
+    GPtrArray     *have  = g_ptr_array_new();
+    GPtrArray     *want  = g_ptr_array_new();
+    struct timeval now   = test_random_time();
+    struct timeval limit = test_random_time();
+
+    /* clientheap_collect() */
+    bool found = clientheap_collect(id, 0, &limit, &now, have);
+
+    for( int i = 0; i < TEST_CLIENTS; ++i ) {
+        client_t *client = test_client[i];
+
+        if( test_in_heap(id, client) &&
+            tv_lt(clientheap_key(id, client), &limit) &&
+            tv_ge(&now, &client->mintime) )
+            g_ptr_array_add(want, client);
+    }
+
+    if( found != (want->len > 0) )
+        test_fail(id, "collect returned wrong status");
+
+    if( clientheap_collect(id, 0, &limit, &now, 0) != (want->len > 0) )
+        test_fail(id, "collect without array returned wrong status");
+
+    test_compare(id, "collect found wrong clients", have, want);
+
+    /* clientheap_gather() */
+    g_ptr_array_set_size(have, 0);
+    g_ptr_array_set_size(want, 0);
+
+    clientheap_gather(id, 0, &limit, have);
+
+    for( int i = 0; i < TEST_CLIENTS; ++i ) {
+        client_t *client = test_client[i];
+
+        if( test_in_heap(id, client) &&
+            tv_lt(clientheap_key(id, client), &limit) )
+            g_ptr_array_add(want, client);
+    }
+
+    test_compare(id, "gather found wrong clients", have, want);
+
+    /* clientheap_next_maxtime(), for heaps ordered by maxtime */
+    if( id != CLIENTHEAP_MINTIME ) {
+        struct timeval best = { .tv_sec = TEST_RANGE + 600 };
+        struct timeval scan = best;
+
+        clientheap_next_maxtime(id, 0, &now, &best);
+
+        for( int i = 0; i < TEST_CLIENTS; ++i ) {
+            const client_t *client = test_client[i];
+
+            if( test_in_heap(id, client) &&
+                tv_gt(&client->maxtime, &now) &&
+                tv_lt(&client->maxtime, &scan) )
+                scan = client->maxtime;
+        }
+
+        if( timercmp(&best, &scan, !=) )
+            test_fail(id, "next maxtime mismatch");
+    }
+
+    g_ptr_array_unref(have);
+    g_ptr_array_unref(want);
+}
+
+static void test_check(void)
+{
+    int externals = 0;
+
+    for( int i = 0; i < TEST_CLIENTS; ++i ) {
+        if( client_wait_started(test_client[i]) &&
+            client_is_external(test_client[i]) )
+            externals += 1;
+    }
+
+    if( externals != clients_waiting_external ) {
+        if( ++test_failures <= 10 )
+            fprintf(stderr, "waiting externals: have %d, want %d\n",
+                    clients_waiting_external, externals);
+    }
+
+    for( int id = 0; id < CLIENTHEAP_COUNT; ++id ) {
+        test_check_structure(id);
+        test_check_traversals(id);
+    }
+}
+
+int main(void)
+{
+    dsme_log_init();
+    dsme_log_open(LOG_METHOD_STDERR, LOG_WARNING, false, "", 0, 0, "");
+
+    srand(1);
+
+    /* Every other client is external; those always need resume.
+     * The descriptors are never used, they just mark the clients. */
+    for( int i = 0; i < TEST_CLIENTS; ++i )
+        test_client[i] = client_new_external((i % 2) ? 1000 + i : -1);
+
+    for( int i = 1; i <= TEST_UPDATES; ++i ) {
+        test_update_client();
+
+        if( i % TEST_INTERVAL == 0 )
+            test_check();
+    }
+
+    printf("%d clients: %d waiting, %d need resume, %d external\n",
+           TEST_CLIENTS, clientheap[CLIENTHEAP_MAXTIME].count,
+           clientheap[CLIENTHEAP_RESUME].count, clients_waiting_external);
+
+    /* Emptying the queues one client at a time must keep them valid */
+    for( int i = 0; i < TEST_CLIENTS; ++i ) {
+        timerclear(&test_client[i]->reqtime);
+        clientlist_requeue_client(test_client[i]);
+
+        if( i % 50 == 0 )
+            test_check();
+    }
+
+    for( int id = 0; id < CLIENTHEAP_COUNT; ++id ) {
+        if( clientheap[id].count != 0 )
+            test_fail(id, "not empty at exit");
+        clientheap_clear(id);
+    }
+
+    for( int i = 0; i < TEST_CLIENTS; ++i ) {
+        free(test_client[i]->pidtxt);
+        free(test_client[i]);
+    }
+
+    dsme_log_close();
+
+    bool ok = !test_failures;
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,113 @@
+/**
+   @file logbench.c
+
+   Micro-benchmark for the producer side of DSME logging
+   <p>
+   Measures how long a dsme_log() call keeps the calling thread busy
+   when messages are formatted in the caller (text records) vs. when
+   only the arguments are captured and formatting is left to the
+   logger thread (deferred binary records), and what a call that
+   ends up disabled costs while include/exclude rules are active.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../include/dsme/logging.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/** Number of log calls per measurement
+ *
+ * Small enough that everything fits in the ring buffer, so that
+ * the producer never has to wait for the logger thread.
+ */
+#define BENCH_CALLS     20000
+
+/** Ring buffer size used for measurements */
+#define BENCH_RING_SIZE (16 << 20)
+
+static int64_t bench_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void log_bench(const char *title, bool deferred)
+{
+    static const char *const state_name[] = {
+        "USER", "ACTDEAD", "REBOOT", "SHUTDOWN",
+    };
+
+    dsme_log_set_deferred(deferred);
+
+    int64_t t0 = bench_clock_ns();
+    for (unsigned i = 0; i < BENCH_CALLS; ++i) {
+        dsme_log(LOG_WARNING, "state change request: %s -> %s, "
+                 "client pid=%d uid=%u, %zu bytes queued, load %.2f",
+                 state_name[i % 4], state_name[(i + 1) % 4],
+                 (int)(1000 + i), 100000u, (size_t)i * 16, i / 1000.0);
+    }
+    int64_t t1 = bench_clock_ns();
+
+    printf("%-10s %7.1f ns/call\n", title, (double)(t1 - t0) / BENCH_CALLS);
+}
+
+static void disabled_bench(const char *title)
+{
+    int64_t t0 = bench_clock_ns();
+    for (unsigned i = 0; i < BENCH_CALLS; ++i)
+        dsme_log(LOG_DEBUG, "disabled %u", i);
+    int64_t t1 = bench_clock_ns();
+
+    printf("%-10s %7.1f ns/call\n", title, (double)(t1 - t0) / BENCH_CALLS);
+}
+
+static void report_cb(void *aptr, const char *row)
+{
+    (void)aptr;
+    printf("%s\n", row);
+}
+
+int main(void)
+{
+    dsme_log_set_ring_size(BENCH_RING_SIZE);
+    dsme_log_init();
+    dsme_log_open(LOG_METHOD_NONE, LOG_WARNING, false, "", 0, 0, "");
+
+    /* Warm up interning and page in the ring buffer */
+    log_bench("warmup:", true);
+    log_bench("warmup:", false);
+
+    log_bench("text:",     false);
+    log_bench("deferred:", true);
+
+    disabled_bench("disabled:");
+    dsme_log_include("*.c:dsme_log_thread");
+    dsme_log_exclude("logbench.c:log_bench");
+    disabled_bench("w/rules:");
+    dsme_log_clear_rules();
+
+    dsme_log_close();
+    dsme_log_report_stats(report_cb, 0);
+
+    return EXIT_SUCCESS;
+}
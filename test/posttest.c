@@ -0,0 +1,140 @@
+/**
+   @file posttest.c
+
+   Check posting tasks to the DSME main loop from other threads
+   <p>
+   Worker threads post numbered tasks as fast as they can. The test
+   checks that every task gets executed in the main thread, in the
+   order it was posted, and that tasks get executed in batches rather
+   than one main loop wakeup per task.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* INTRUSIONS */
+
+#include "../dsme/modulebase.c"
+
+/* INCLUDES */
+
+#include "../include/dsme/mainloop.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/** Number of posting threads */
+#define TEST_THREADS 4
+
+/** Number of tasks each thread posts */
+#define TEST_TASKS   100000
+
+static pthread_t test_main_thread;
+static unsigned  test_next[TEST_THREADS];
+static unsigned  test_done     = 0;
+static unsigned  test_failures = 0;
+static bool      test_prestart = false;
+
+bool dsme_in_valgrind_mode(void)
+{
+    return false;
+}
+
+static void report_cb(void *aptr, const char *row)
+{
+    (void)aptr;
+    printf("%s\n", row);
+}
+
+static void prestart_task_cb(void *data)
+{
+    (void)data;
+    test_prestart = true;
+}
+
+static void test_task_cb(void *data)
+{
+    uintptr_t thread = (uintptr_t)data / TEST_TASKS;
+    unsigned  task   = (uintptr_t)data % TEST_TASKS;
+
+    if( !pthread_equal(pthread_self(), test_main_thread) ||
+        test_next[thread] != task )
+        ++test_failures;
+
+    test_next[thread] = task + 1;
+
+    if( ++test_done == TEST_THREADS * TEST_TASKS )
+        dsme_main_loop_quit(EXIT_SUCCESS);
+}
+
+static void *test_thread(void *aptr)
+{
+    uintptr_t thread = (uintptr_t)aptr;
+
+    for( unsigned task = 0; task < TEST_TASKS; ++task ) {
+        if( !dsme_main_loop_post(test_task_cb,
+                                 (void *)(thread * TEST_TASKS + task)) )
+            abort();
+
+        /* Let the main loop catch up now and then */
+        if( task % 1000 == 0 )
+            usleep(100);
+    }
+
+    return 0;
+}
+
+static void *test_watchdog(void *aptr)
+{
+    (void)aptr;
+    sleep(30);
+    fprintf(stderr, "timeout: %u tasks done\n", test_done);
+    _exit(EXIT_FAILURE);
+}
+
+int main(void)
+{
+    pthread_t threads[TEST_THREADS];
+    pthread_t watchdog;
+
+    dsme_log_init();
+    dsme_log_open(LOG_METHOD_STDERR, LOG_WARNING, false, "", 0, 0, "");
+
+    test_main_thread = pthread_self();
+    pthread_create(&watchdog, 0, test_watchdog, 0);
+
+    /* Posted before the main loop exists */
+    dsme_main_loop_post(prestart_task_cb, 0);
+
+    for( uintptr_t i = 0; i < TEST_THREADS; ++i )
+        pthread_create(&threads[i], 0, test_thread, (void *)i);
+
+    dsme_main_loop_run(0);
+
+    for( int i = 0; i < TEST_THREADS; ++i )
+        pthread_join(threads[i], 0);
+
+    dsme_main_loop_report_wakeups(report_cb, 0);
+    dsme_log_close();
+
+    bool ok = (test_prestart && !test_failures &&
+               test_done == TEST_THREADS * TEST_TASKS);
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
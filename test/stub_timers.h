@@ -30,20 +30,28 @@
 
 #include "../include/dsme/timers.h"
 
+#include <stdbool.h>
+
 typedef struct test_timer_t {
     unsigned               seconds;
     dsme_timer_callback_t  callback;
     void*                  data;
+    bool                   boottime; /* counts time spent in suspend */
+    unsigned               expiry;   /* fake_boottime at expiry [s] */
 } test_timer_t;
 
 static unsigned      timers = 0;
 static test_timer_t* timer  = 0;
 
+/* Fake CLOCK_BOOTTIME [s], advanced only by suspend_timers() */
+static unsigned      fake_boottime = 0;
+
 static void reset_timers(void)
 {
   free(timer);
   timer  = 0;
   timers = 0;
+  fake_boottime = 0;
 }
 
 static inline bool timer_exists(void)
@@ -112,11 +120,54 @@ static inline void trigger_timer(void)
   }
 }
 
+/* Simulate suspend: advance fake boottime and trigger boottime timers
+ * that expired meanwhile, earliest first. Monotonic timers do not
+ * see time spent in suspend and are left as is.
+ *
+ * Returns the number of timers triggered.
+ */
+static inline unsigned suspend_timers(unsigned seconds)
+{
+  unsigned triggered = 0;
+
+  fake_boottime += seconds;
+  fprintf(stderr, "\n[SUSPEND %u s]\n", seconds);
+
+  for (;;) {
+      int earliest = -1;
+      int i;
+
+      for (i = 0; i < timers; ++i) {
+          if (timer[i].seconds != 0 && timer[i].boottime &&
+              timer[i].expiry <= fake_boottime) {
+              if (earliest < 0 || timer[i].expiry < timer[earliest].expiry) {
+                  earliest = i;
+              }
+          }
+      }
+
+      if (earliest < 0) {
+          break;
+      }
+
+      fprintf(stderr, "\n[TRIGGER BOOTTIME TIMER %d]\n", earliest + 1);
+      ++triggered;
+      if (!timer[earliest].callback(timer[earliest].data)) {
+          timer[earliest].seconds = 0;
+      } else {
+          timer[earliest].expiry += timer[earliest].seconds;
+      }
+  }
+
+  return triggered;
+}
+
 static int dsme_create_timer_fails = 0;
 
-dsme_timer_t dsme_create_timer_seconds(unsigned               seconds,
-                                       dsme_timer_callback_t  callback,
-                                       void*                  data)
+static dsme_timer_t create_test_timer(unsigned               seconds,
+                                      bool                   boottime,
+                                      dsme_timer_callback_t  callback,
+                                      void*                  data)
 {
   if (!dsme_create_timer_fails) {
       ++timers;
@@ -124,7 +175,10 @@ dsme_timer_t dsme_create_timer_seconds(unsigned               seconds,
       timer[timers - 1].seconds  = seconds;
       timer[timers - 1].callback = callback;
       timer[timers - 1].data     = data;
-      fprintf(stderr, "[=> timer %u created for %u s]\n", timers, seconds);
+      timer[timers - 1].boottime = boottime;
+      timer[timers - 1].expiry   = fake_boottime + seconds;
+      fprintf(stderr, "[=> %stimer %u created for %u s]\n",
+              boottime ? "boottime " : "", timers, seconds);
       return timers;
   } else {
       --dsme_create_timer_fails;
@@ -132,6 +186,20 @@ dsme_timer_t dsme_create_timer_seconds(unsigned               seconds,
   }
 }
 
+dsme_timer_t dsme_create_timer_seconds(unsigned               seconds,
+                                       dsme_timer_callback_t  callback,
+                                       void*                  data)
+{
+  return create_test_timer(seconds, false, callback, data);
+}
+
+dsme_timer_t dsme_create_timer_boottime(unsigned               milliseconds,
+                                        dsme_timer_callback_t  callback,
+                                        void*                  data)
+{
+  return create_test_timer((milliseconds + 999) / 1000, true, callback, data);
+}
+
 void dsme_destroy_timer(dsme_timer_t t)
 {
   fprintf(stderr, "[=> destroying timer %u]\n", t);
@@ -0,0 +1,152 @@
+/**
+   @file syslogtest.c
+
+   Check DSME syslog logging against a stand-in syslog socket
+   <p>
+   Binds a local datagram socket, points DSME logging at it and
+   verifies that messages arrive complete and in order - also after
+   the socket has been re-created, as happens when journald or syslogd
+   restarts.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../include/dsme/logging.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/** Number of messages to log per round */
+#define TEST_MESSAGES 500
+
+/** Max time to wait for a message [ms] */
+#define TEST_TIMEOUT  2000
+
+static char socket_path[64];
+
+static int stand_in_create(void)
+{
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    int                fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+    snprintf(sa.sun_path, sizeof sa.sun_path, "%s", socket_path);
+    unlink(socket_path);
+
+    if( fd == -1 || bind(fd, (struct sockaddr *)&sa, sizeof sa) == -1 ) {
+        perror(socket_path);
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+static void stand_in_delete(int fd)
+{
+    close(fd);
+    unlink(socket_path);
+}
+
+/** Receive and check a round of messages
+ *
+ * @return number of messages received in order
+ */
+static int stand_in_receive(int fd, int round)
+{
+    char expect[128];
+    int  count = 0;
+
+    /* LOG_DAEMON | LOG_INFO, ident with pid */
+    snprintf(expect, sizeof expect, "<%d>", LOG_DAEMON | LOG_INFO);
+
+    while( count < TEST_MESSAGES ) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        char          buf[1024];
+
+        if( poll(&pfd, 1, TEST_TIMEOUT) != 1 )
+            break;
+
+        ssize_t len = recv(fd, buf, sizeof buf - 1, 0);
+        if( len <= 0 )
+            break;
+        buf[len] = 0;
+
+        /* Skip messages from logging itself */
+        if( strncmp(buf, expect, strlen(expect)) )
+            continue;
+
+        char tail[128];
+        snprintf(tail, sizeof tail, " TEST[%d]: round %d message %d",
+                 (int)getpid(), round, count);
+
+        const char *hdr = strchr(buf, ' ');
+        if( !hdr || strlen(buf) < strlen(tail) ||
+            strcmp(buf + strlen(buf) - strlen(tail), tail) ) {
+            fprintf(stderr, "unexpected: '%s' vs '...%s'\n", buf, tail);
+            break;
+        }
+        ++count;
+    }
+
+    printf("round %d: received %d/%d\n", round, count, TEST_MESSAGES);
+    return count;
+}
+
+static void report_cb(void *aptr, const char *row)
+{
+    (void)aptr;
+    printf("%s\n", row);
+}
+
+int main(void)
+{
+    bool ok = true;
+
+    snprintf(socket_path, sizeof socket_path, "/tmp/syslogtest-%d.sock",
+             (int)getpid());
+
+    int fd = stand_in_create();
+
+    dsme_log_set_syslog_socket(socket_path);
+    dsme_log_init();
+    dsme_log_open(LOG_METHOD_SYSLOG, LOG_INFO, false, "TEST",
+                  LOG_DAEMON, LOG_PID, "");
+
+    for( int round = 0; round < 2; ++round ) {
+        for( int i = 0; i < TEST_MESSAGES; ++i )
+            dsme_log(LOG_INFO, "round %d message %d", round, i);
+
+        if( stand_in_receive(fd, round) != TEST_MESSAGES )
+            ok = false;
+
+        /* Simulate syslog restart */
+        stand_in_delete(fd);
+        fd = stand_in_create();
+    }
+
+    dsme_log_report_stats(report_cb, 0);
+    dsme_log_close();
+    stand_in_delete(fd);
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
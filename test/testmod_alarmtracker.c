@@ -141,11 +141,23 @@ static inline void* queued_dsmesock_(unsigned type, const char* name)
   return msg;
 }
 
-void dsmesock_broadcast(const void* msg)
+void dsmesock_client_send_with_extra(struct dsmesock_connection_t* conn,
+                                     const void*                   msg,
+                                     size_t                        extra_size,
+                                     const void*                   extra)
+{
+  (void)conn; (void)msg; (void)extra_size; (void)extra;
+}
+
+void dsmesock_client_broadcast_with_extra(const void* msg,
+                                          size_t      extra_size,
+                                          const void* extra)
 {
   queued_msg_t*      newmsg;
   dsmemsg_generic_t* genmsg = (dsmemsg_generic_t*)msg;
 
+  (void)extra_size; (void)extra;
+
   if (!msg) return;
   if (genmsg->line_size_ < sizeof(dsmemsg_generic_t)) return;
 
@@ -369,6 +381,34 @@ static void test_init_alarm_in5min(void)
   unload_alarmtracker();
 }
 
+/* Alarm time is reached while the device is suspended */
+static void test_init_alarm_in5min_suspend(void)
+{
+  load_alarmtracker(time(0)+300);
+
+  DSM_MSGTYPE_SET_ALARM_STATE *msg;
+  assert((msg = queued_dsmesock(DSM_MSGTYPE_SET_ALARM_STATE)));
+  assert(msg->alarm_set);
+  free(msg);
+
+  /* re-evaluation timer must count time spent in suspend */
+  assert(timer_exists());
+  unsigned seconds = first_timer_seconds();
+  assert(suspend_timers(seconds - 1) == 0);
+  sumtime(seconds);
+  assert(suspend_timers(1) == 1);
+
+  assert(!message_queue_is_empty());
+  assert((msg = queued(DSM_MSGTYPE_SET_ALARM_STATE)));
+  assert(msg->alarm_set);
+  free(msg);
+  assert(g_slist_length(dsmesock_broadcasts)==0);
+
+  assert(!timer_exists());
+
+  unload_alarmtracker();
+}
+
 /* Set alarm with com.nokia.time dbus interface */
 static void test_init_set_alarm_in5min(void)
 {
@@ -457,6 +497,7 @@ int main(int argc, char** argv)
   run(test_init_activealarm);
   run(test_init_alarm_in10sec);
   run(test_init_alarm_in5min);
+  run(test_init_alarm_in5min_suspend);
   run(test_init_set_alarm_in5min);
 
   finalize();
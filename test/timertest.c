@@ -0,0 +1,313 @@
+/**
+   @file timertest.c
+
+   Check DSME timer wheel against a simulated clock
+   <p>
+   The clock and timerfd used by the timer wheel are replaced with
+   fakes, so that timers with intervals from milliseconds to days can
+   be run through in no time. Each wakeup advances the clock to the
+   time the timerfd was armed for. The test checks that every timer
+   fires once per arming, inside its slack window, that destroyed
+   timers do not fire, and that overlapping windows share wakeups.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* INCLUDES */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+/* SIMULATED CLOCK */
+
+/** Simulated time for all clocks [ms] */
+static int64_t test_now   = 1000;
+
+/** Absolute time the fake timerfd is armed for, or -1 [ms] */
+static int64_t test_armed = -1;
+
+static int test_clock_gettime(clockid_t id, struct timespec *ts);
+static int test_timerfd_create(int clockid, int flags);
+static int test_timerfd_settime(int fd, int flags,
+                                const struct itimerspec *its,
+                                struct itimerspec *old);
+
+static int test_clock_gettime(clockid_t id, struct timespec *ts)
+{
+    (void)id;
+    ts->tv_sec  = test_now / 1000;
+    ts->tv_nsec = test_now % 1000 * 1000000;
+    return 0;
+}
+
+static int test_timerfd_create(int clockid, int flags)
+{
+    (void)clockid;
+    (void)flags;
+
+    /* Something that can be watched and read without blocking */
+    return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+static int test_timerfd_settime(int fd, int flags,
+                                const struct itimerspec *its,
+                                struct itimerspec *old)
+{
+    (void)fd;
+    (void)flags;
+    (void)old;
+
+    if( its->it_value.tv_sec || its->it_value.tv_nsec )
+        test_armed = (its->it_value.tv_sec * INT64_C(1000) +
+                      its->it_value.tv_nsec / 1000000);
+    else
+        test_armed = -1;
+
+    return 0;
+}
+
+/* INTRUSIONS */
+
+#include "../dsme/modulebase.c"
+
+#define clock_gettime   test_clock_gettime
+#define timerfd_create  test_timerfd_create
+#define timerfd_settime test_timerfd_settime
+#include "../dsme/timers.c"
+#undef timerfd_settime
+#undef timerfd_create
+#undef clock_gettime
+
+/* ========================================================================= *
+ * Test timers
+ * ========================================================================= */
+
+/** Number of timers created before the first wakeup */
+#define TEST_INITIAL      2500
+
+/** Total number of timers, the rest are created between wakeups */
+#define TEST_TIMERS       3000
+
+/** Longest timer interval used [ms] */
+#define TEST_INTERVAL_MAX (60 * 60 * 60 * 1000)
+
+/** Bail out if the timers have not finished after this many wakeups */
+#define TEST_WAKEUPS_MAX  100000
+
+typedef enum
+{
+    /** Fire given number of times */
+    TEST_REPEAT,
+
+    /** Destroy itself from the first callback, but ask for repeat */
+    TEST_DESTROY_SELF,
+
+    /** Destroy some other timer from each callback */
+    TEST_DESTROY_OTHER,
+} test_action_t;
+
+typedef struct
+{
+    dsme_timer_t   id;
+    test_action_t  action;
+    unsigned       interval;
+    unsigned       slack;
+    unsigned       repeats;  /**< Times to fire before returning zero */
+    unsigned       fired;    /**< Times fired so far */
+    int64_t        armed;    /**< Time the timer was last (re)armed [ms] */
+    bool           live;     /**< Timer exists in dsme */
+    bool           killed;   /**< Destroyed from another timer callback */
+} test_timer_t;
+
+static test_timer_t test_timer[TEST_TIMERS];
+static unsigned     test_created  = 0;
+static unsigned     test_fired    = 0;
+static unsigned     test_failures = 0;
+
+bool dsme_in_valgrind_mode(void)
+{
+    return false;
+}
+
+static void report_cb(void *aptr, const char *row)
+{
+    (void)aptr;
+    printf("%s\n", row);
+}
+
+static void test_fail(const test_timer_t *t, const char *what)
+{
+    if( ++test_failures <= 10 )
+        fprintf(stderr, "timer %u (%ums+%ums): %s at %lld\n",
+                (unsigned)(t - test_timer), t->interval, t->slack, what,
+                (long long)test_now);
+}
+
+/** Interval from 1 ms to TEST_INTERVAL_MAX, short ones being more common */
+static unsigned test_random_interval(void)
+{
+    unsigned bits     = rand() % 28;
+    unsigned interval = 1 + (unsigned)rand() % (1u << bits);
+
+    return interval < TEST_INTERVAL_MAX ? interval : TEST_INTERVAL_MAX;
+}
+
+/** Destroy some other live timer, if there are any */
+static void test_destroy_other(unsigned self)
+{
+    unsigned start = (unsigned)rand() % test_created;
+
+    for( unsigned i = 0; i < test_created; ++i ) {
+        test_timer_t *t = &test_timer[(start + i) % test_created];
+
+        if( t == &test_timer[self] || !t->live )
+            continue;
+
+        dsme_destroy_timer(t->id);
+        t->live   = false;
+        t->killed = true;
+        break;
+    }
+}
+
+static int test_timer_cb(void *aptr)
+{
+    unsigned      self = (unsigned)(uintptr_t)aptr;
+    test_timer_t *t    = &test_timer[self];
+    int64_t       beg  = t->armed + t->interval;
+
+    if( !t->live )
+        test_fail(t, "fired after destroy");
+
+    if( test_now < beg || test_now > beg + t->slack )
+        test_fail(t, "fired outside window");
+
+    ++t->fired;
+    ++test_fired;
+
+    switch( t->action ) {
+    case TEST_DESTROY_SELF:
+        dsme_destroy_timer(t->id);
+        t->live = false;
+        return 1;
+
+    case TEST_DESTROY_OTHER:
+        test_destroy_other(self);
+        break;
+
+    default:
+        break;
+    }
+
+    if( t->fired >= t->repeats ) {
+        t->live = false;
+        return 0;
+    }
+
+    t->armed = test_now;
+    return 1;
+}
+
+static void test_create_timer(void)
+{
+    unsigned      self = test_created++;
+    test_timer_t *t    = &test_timer[self];
+    int           pick = rand() % 20;
+
+    t->action   = (pick == 0) ? TEST_DESTROY_SELF :
+                  (pick == 1) ? TEST_DESTROY_OTHER : TEST_REPEAT;
+    t->interval = test_random_interval();
+    t->slack    = timergate_default_slack(t->interval);
+    t->repeats  = 1 + rand() % 3;
+    t->armed    = test_now;
+    t->live     = true;
+    t->id       = dsme_create_timer(t->interval, test_timer_cb,
+                                    (void *)(uintptr_t)self);
+    if( !t->id ) {
+        test_fail(t, "create failed");
+        t->live = false;
+    }
+}
+
+int main(void)
+{
+    unsigned wakeups = 0;
+
+    dsme_log_init();
+    dsme_log_open(LOG_METHOD_STDERR, LOG_WARNING, false, "", 0, 0, "");
+
+    srand(1);
+
+    while( test_created < TEST_INITIAL )
+        test_create_timer();
+
+    while( timerwheel_monotonic.tw_count > 0 ) {
+        if( test_armed < 0 ) {
+            fprintf(stderr, "%u timers left, but no wakeup\n",
+                    timerwheel_monotonic.tw_count);
+            ++test_failures;
+            break;
+        }
+
+        if( ++wakeups > TEST_WAKEUPS_MAX ) {
+            fprintf(stderr, "too many wakeups\n");
+            ++test_failures;
+            break;
+        }
+
+        if( test_now < test_armed )
+            test_now = test_armed;
+
+        timerwheel_iowatch_cb(0, G_IO_IN, &timerwheel_monotonic);
+
+        /* Timers created while others are already waiting */
+        if( test_created < TEST_TIMERS && rand() % 2 )
+            test_create_timer();
+    }
+
+    for( unsigned i = 0; i < test_created; ++i ) {
+        const test_timer_t *t = &test_timer[i];
+        unsigned want = (t->action == TEST_DESTROY_SELF) ? 1 : t->repeats;
+
+        if( t->live )
+            test_fail(t, "still live");
+        else if( t->killed ? t->fired > want : t->fired != want )
+            test_fail(t, "wrong number of expirations");
+    }
+
+    /* Overlapping windows should have been handled together */
+    if( wakeups >= test_fired ) {
+        fprintf(stderr, "no coalescing: %u wakeups for %u expirations\n",
+                wakeups, test_fired);
+        ++test_failures;
+    }
+
+    printf("%u timers, %u expirations in %u wakeups\n",
+           test_created, test_fired, wakeups);
+    dsme_timers_report_stats(report_cb, 0);
+    dsme_log_close();
+
+    bool ok = (test_created == TEST_TIMERS && !test_failures);
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -29,10 +29,10 @@ static const char* dsme_module_path = "../modules/.libs/";
 
 static bool message_queue_is_empty(void)
 {
-  int     count = 0;
-  GSList* node;
+  int           count = 0;
+  queued_msg_t* node;
 
-  count = g_slist_length(message_queue);
+  count = message_queue_len;
 
   if (count == 1) {
       fprintf(stderr, "[=> 1 more message queued]\n");
@@ -44,7 +44,7 @@ static bool message_queue_is_empty(void)
 
   if (count != 0) {
       for (node = message_queue; node; node = node->next) {
-          fprintf(stderr, "[%x]\n", ((queued_msg_t*)(node->data))->data->type_);
+          fprintf(stderr, "[%x]\n", node->data->type_);
       }
   }
 
@@ -55,17 +55,23 @@ static bool message_queue_is_empty(void)
 static inline void* queued_(unsigned type, const char* name)
 {
   dsmemsg_generic_t* msg = 0;
-  GSList*            node;
+  queued_msg_t**     link;
   char*              other_messages = 0;
 
-  for (node = message_queue; node; node = node->next)
+  for (link = &message_queue; *link; link = &(*link)->next)
   {
-      queued_msg_t* m = node->data;
+      queued_msg_t* m = *link;
 
       if (m->data->type_ == type) {
-          msg = m->data;
-          free(m);
-          message_queue = g_slist_delete_link(message_queue, node);
+          /* Detach from queue */
+          if (!(*link = m->next))
+              message_queue_tail = link;
+          --message_queue_len;
+
+          /* Caller is expected to free() the returned message */
+          msg = malloc(m->data->line_size_);
+          memcpy(msg, m->data, m->data->line_size_);
+          msgqueue_release(m);
           break;
       } else {
           int dummy_ret;
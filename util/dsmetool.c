@@ -32,6 +32,7 @@
 #include "../modules/dbusproxy.h"
 #include "../modules/state-internal.h"
 #include "../include/dsme/logging.h"
+#include "../include/dsme/modulebase.h"
 
 #include <dsme/state.h>
 #include <dsme/protocol.h>
@@ -114,6 +115,12 @@ static void               xdsme_request_loglevel(unsigned level);
 static void               xdsme_request_log_include(const char *pattern);
 static void               xdsme_request_log_exclude(const char *pattern);
 static void               xdsme_request_log_defaults(void);
+static void               xdsme_request_log_limit(char *spec);
+static void               xdsme_query_rows(const void *req);
+static void               xdsme_query_stats(void);
+static void               xdsme_query_clients(void);
+static void               xdsme_query_wakeups(void);
+static void               xdsme_query_iphb_stats(void);
 
 /* ------------------------------------------------------------------------- *
  * RTC_OPTIONS
@@ -469,6 +476,90 @@ static void xdsme_request_log_defaults(void)
     dsmeipc_send(&req);
 }
 
+static void xdsme_request_log_limit(char *spec)
+{
+    DSM_MSGTYPE_SET_LOGGING_RATELIMIT req =
+        DSME_MSG_INIT(DSM_MSGTYPE_SET_LOGGING_RATELIMIT);
+
+    char *level = strtok(spec, ":");
+    char *rate  = strtok(0, ":");
+    char *burst = strtok(0, ":");
+
+    if( !level || !rate || strtok(0, ":") ) {
+        log_error("%s: expected <level|all>:<rate>[:<burst>]", spec);
+        exit(EXIT_FAILURE);
+    }
+
+    req.level = strcmp(level, "all") ? (int)parse_loglevel(level) : -1;
+    req.rate  = parse_unsigned(rate);
+    req.burst = burst ? parse_unsigned(burst) : 100;
+
+    dsmeipc_send(&req);
+}
+
+static void xdsme_query_rows(const void *req)
+{
+    int64_t timeout = DSMEIPC_WAIT_DEFAULT;
+
+    dsmeipc_send(req);
+
+    while( dsmeipc_wait(&timeout) ) {
+        dsmemsg_generic_t *msg = dsmeipc_read();
+        bool               eos = false;
+
+        DSM_MSGTYPE_SERVER_STATS *rsp =
+            DSMEMSG_CAST(DSM_MSGTYPE_SERVER_STATS, msg);
+
+        if( rsp ) {
+            const char *data = DSMEMSG_EXTRA(rsp);
+            size_t      size = DSMEMSG_EXTRA_SIZE(rsp);
+
+            /* Empty reply terminates the sequence */
+            if( size == 0 )
+                eos = true;
+            else
+                printf("%.*s\n", (int)size, data);
+        }
+
+        free(msg);
+
+        if( eos )
+            break;
+    }
+}
+
+static void xdsme_query_stats(void)
+{
+    DSM_MSGTYPE_GET_SERVER_STATS req =
+        DSME_MSG_INIT(DSM_MSGTYPE_GET_SERVER_STATS);
+
+    xdsme_query_rows(&req);
+}
+
+static void xdsme_query_clients(void)
+{
+    DSM_MSGTYPE_GET_CLIENT_STATS req =
+        DSME_MSG_INIT(DSM_MSGTYPE_GET_CLIENT_STATS);
+
+    xdsme_query_rows(&req);
+}
+
+static void xdsme_query_wakeups(void)
+{
+    DSM_MSGTYPE_GET_WAKEUP_STATS req =
+        DSME_MSG_INIT(DSM_MSGTYPE_GET_WAKEUP_STATS);
+
+    xdsme_query_rows(&req);
+}
+
+static void xdsme_query_iphb_stats(void)
+{
+    DSM_MSGTYPE_GET_IPHB_STATS req =
+        DSME_MSG_INIT(DSM_MSGTYPE_GET_IPHB_STATS);
+
+    xdsme_query_rows(&req);
+}
+
 static void xdsme_block_shutdown(void)
 {
     dbusipc_simple_request_bool_arg(dsme_inhibit_shutdown, true);
@@ -619,6 +710,13 @@ static void output_usage(const char *name)
 "  -i --log-include <file:func>    Include logging from matching functions\n"
 "  -e --log-exclude <file:func>    Exclude logging from matching functions\n"
 "  -L --log-defaults               Clear include/exclude patterns\n"
+"     --log-limit <level|all>:<rate>[:<burst>]\n"
+"                                  Limit messages per call site to rate/s\n"
+"                                  with given burst (100), 0 rate = no limit\n"
+"     --stats                      Print DSME message dispatch statistics\n"
+"     --clients                    Print DSME socket client statistics\n"
+"     --wakeups                    Print DSME main loop wakeup sources\n"
+"     --iphb-stats                 Print IPHB client wakeup batching\n"
 "\n"
 "  -g --get-state                  Print device state, i.e. one of\n"
 "                                   SHUTDOWN USER ACTDEAD REBOOT BOOT\n"
@@ -672,6 +770,11 @@ int main(int argc, char *argv[])
         {"block",          optional_argument, NULL, 'B'},
         {"block-shutdown", no_argument,       NULL, 900},
         {"allow-shutdown", no_argument,       NULL, 901},
+        {"stats",          no_argument,       NULL, 902},
+        {"clients",        no_argument,       NULL, 903},
+        {"log-limit",      required_argument, NULL, 904},
+        {"wakeups",        no_argument,       NULL, 905},
+        {"iphb-stats",     no_argument,       NULL, 906},
         {0, 0, 0, 0}
     };
 
@@ -758,6 +861,26 @@ int main(int argc, char *argv[])
             xdsme_allow_shutdown();
             break;
 
+        case 902:
+            xdsme_query_stats();
+            break;
+
+        case 903:
+            xdsme_query_clients();
+            break;
+
+        case 904:
+            xdsme_request_log_limit(optarg);
+            break;
+
+        case 905:
+            xdsme_query_wakeups();
+            break;
+
+        case 906:
+            xdsme_query_iphb_stats();
+            break;
+
         case 'B':
             xdsme_block(optarg);
             break;